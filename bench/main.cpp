@@ -0,0 +1,653 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+// domiplan_bench : 光線追跡まわりのマイクロベンチマーク.
+//
+//   domiplan_bench [--filter substr] [--samples N] [--min-time ms] [--json file] [--list] [--adaptive target]
+//
+// 各ベンチは1サンプルが min-time 以上になるよう反復数を合わせてから N サンプル計測し,
+// 1操作あたりの時間の平均/中央値/標準偏差と平均の95%信頼区間を出す.
+// --adaptive は参照シーンを一様/適応サンプリングで同じ誤差までレンダリングし, 光線数を比べる.
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <autofocus.hpp>
+#include <configuration.hpp>
+#include <lens.hpp>
+#include <lightfield.hpp>
+#include <parallel.hpp>
+#include <pupil.hpp>
+#include <random.hpp>
+#include <renderer.hpp>
+#include <spot.hpp>
+#include <wavefront.hpp>
+
+#ifndef DOMIPLAN_BENCH_DATA
+#define DOMIPLAN_BENCH_DATA "data"
+#endif
+
+namespace
+{
+// 結果を使ったことにして, 計算ごと消されるのを防ぐ.
+template <typename T>
+inline void doNotOptimize(const T &value)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    asm volatile(""
+                 :
+                 : "g"(&value)
+                 : "memory");
+#else
+    static volatile const void *sink;
+    sink = &value;
+#endif
+}
+
+struct Benchmark
+{
+    std::string                 name_;
+    std::string                 unit_;  // items/s の単位. 光線なら "rays".
+    double                      items_; // 1操作あたりの件数.
+    std::function<void(size_t)> run_;   // n回操作する.
+};
+
+struct Result
+{
+    std::string name_;
+    std::string unit_;
+    size_t      iterations_; // 1サンプルあたり.
+    size_t      samples_;
+    double      mean_, median_, stddev_, ci95_; // [ns/op]
+    double      itemsPerSecond_;
+};
+
+// 両側95%のt分布の臨界値.
+double tCritical(size_t dof)
+{
+    static const double table[] = {
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+    if (dof == 0)
+        return 0.;
+    return (dof <= 30) ? table[dof - 1] : 1.96;
+}
+
+double elapsedNs(const Benchmark &bench, size_t n)
+{
+    const auto begin = std::chrono::steady_clock::now();
+    bench.run_(n);
+    const auto end = std::chrono::steady_clock::now();
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+}
+
+Result measure(const Benchmark &bench, size_t samples, double minTimeMs)
+{
+    // 反復数を倍々にして1サンプルの時間を揃える. 最初の呼び出しはウォームアップも兼ねる.
+    size_t n = 1;
+    for (;;)
+    {
+        const double t = elapsedNs(bench, n);
+        if (t >= minTimeMs * 1e6 || n >= ((size_t)1 << 40))
+            break;
+        const double scale = (t > 0.) ? minTimeMs * 1e6 / t * 1.2 : 10.;
+        n = std::max(n * 2, (size_t)((double)n * std::min(scale, 100.)));
+    }
+
+    std::vector<double> ns(samples);
+    for (size_t i = 0; i < samples; i++)
+        ns[i] = elapsedNs(bench, n) / (double)n;
+
+    Result r;
+    r.name_       = bench.name_;
+    r.unit_       = bench.unit_;
+    r.iterations_ = n;
+    r.samples_    = samples;
+
+    double sum = 0.;
+    for (double v : ns)
+        sum += v;
+    r.mean_    = sum / (double)samples;
+    double sq  = 0.;
+    for (double v : ns)
+        sq += (v - r.mean_) * (v - r.mean_);
+    r.stddev_ = (samples > 1) ? sqrt(sq / (double)(samples - 1)) : 0.;
+    r.ci95_   = tCritical(samples - 1) * r.stddev_ / sqrt((double)samples);
+
+    std::sort(ns.begin(), ns.end());
+    r.median_ = (samples & 1) ? ns[samples / 2] : (ns[samples / 2 - 1] + ns[samples / 2]) * 0.5;
+
+    r.itemsPerSecond_ = (r.mean_ > 0.) ? bench.items_ * 1e9 / r.mean_ : 0.;
+    return r;
+}
+
+// 入力は事前に作った表から引き, 定数畳み込みと分岐予測の当たりすぎを避ける.
+constexpr size_t TABLE = 1024;
+
+struct Inputs
+{
+    std::vector<double>       x_, y_;
+    std::vector<Lens::Vector> dir_;
+
+    Inputs(double radius, double slope, uint64_t seed)
+    {
+        RANDOM::xoshiro256aa rng(seed);
+        for (size_t i = 0; i < TABLE; i++)
+        {
+            const Lens::Pupil::Sample p = Lens::Pupil::concentric(rng.rand01(), rng.rand01());
+            x_.push_back(p.x_ * radius);
+            y_.push_back(p.y_ * radius);
+            dir_.push_back(Lens::Vector((rng.rand01() * 2. - 1.) * slope, (rng.rand01() * 2. - 1.) * slope, 1.).normal());
+        }
+    }
+};
+
+Lens::Surface sphere(void)
+{
+    Lens::Surface s;
+    s.type_     = Lens::Surface::STANDARD;
+    s.curve_    = 1. / 50.;
+    s.radius_   = 50.;
+    s.diameter_ = 20.;
+    s.ior_      = 1.5168;
+    s.abbeVd_   = 64.17;
+    s.setup();
+    return s;
+}
+
+Lens::Surface asphere(void)
+{
+    Lens::Surface s = sphere();
+    s.type_          = Lens::Surface::EVENASPH;
+    s.conic_         = -0.6;
+    s.aspherical_[0] = 1e-4;
+    s.aspherical_[1] = -2e-6;
+    s.aspherical_[2] = 3e-9;
+    s.setup();
+    return s;
+}
+
+void addSurfaceBenchmarks(std::vector<Benchmark> &benches, const char *name, const Lens::Surface &surf)
+{
+    const std::shared_ptr<Inputs> in = std::make_shared<Inputs>(surf.diameter_ * 0.95, 0.2, 1);
+
+    benches.push_back({std::string("sag/") + name, "ops", 1., [surf, in](size_t n) {
+                           double sum = 0.;
+                           for (size_t i = 0; i < n; i++)
+                           {
+                               const size_t k = i & (TABLE - 1);
+                               Lens::Vector norm;
+                               sum += surf.sag(in->x_[k], in->y_[k], norm);
+                               doNotOptimize(norm);
+                           }
+                           doNotOptimize(sum);
+                       }});
+
+    benches.push_back({std::string("intersect/") + name, "ops", 1., [surf, in](size_t n) {
+                           size_t hits = 0;
+                           for (size_t i = 0; i < n; i++)
+                           {
+                               const size_t k = i & (TABLE - 1);
+                               double       t;
+                               Lens::Vector point, norm;
+                               hits += surf.intersect(Lens::Vector(in->x_[k], in->y_[k], 0.), in->dir_[k], t, point, norm);
+                               doNotOptimize(point);
+                           }
+                           doNotOptimize(hits);
+                       }});
+}
+
+// 同梱の参照レンズ(クックトリプレット)を瞳全面の光線束で像面まで追う.
+void addTraceBenchmarks(std::vector<Benchmark> &benches, const std::string &dataDir)
+{
+    const std::string path = dataDir + "/cooke.zmx";
+    FILE             *fp   = fopen(path.c_str(), "rb");
+    if (!fp)
+    {
+        fprintf(stderr, "warning: %s not found, skipping trace benchmarks.\n", path.c_str());
+        return;
+    }
+    fclose(fp);
+
+    const std::shared_ptr<Lens::Body> body = std::make_shared<Lens::Body>(Lens::Loader::ZEMAX::load(path.c_str()));
+
+    // .zmx の字句解析. 1本分と, 同じ記述を並べた大きな入力の読み込み速度(bytes/s).
+    const Lens::Loader::MappedFile file(path.c_str());
+    const std::string              single(file.data(), file.size());
+    std::string                    large;
+    for (int i = 0; i < 4096; i++)
+        large += single;
+    const std::pair<const char *, std::string> inputs[] = {{"zemax/cooke/parse", single}, {"zemax/cooke4096/parse", large}};
+    for (const std::pair<const char *, std::string> &input : inputs)
+    {
+        const std::shared_ptr<std::string> in = std::make_shared<std::string>(input.second);
+        benches.push_back({input.first, "bytes", (double)in->size(), [in](size_t n) {
+                               for (size_t i = 0; i < n; i++)
+                               {
+                                   const Lens::Body lens = Lens::Loader::ZEMAX::parse(in->data(), in->size());
+                                   doNotOptimize(lens.imageSurfaceZ_);
+                               }
+                           }});
+    }
+
+    constexpr size_t BUNDLE = 1024;
+    const double     fields[] = {0., 15.};
+    for (double deg : fields)
+    {
+        const Lens::Field field(0., deg);
+
+        Lens::Pupil::Entrance entrance;
+        entrance.setup(*body);
+        const Lens::Vector                     chief   = entrance.chief(*body, field);
+        const Lens::Vector                     dir     = field.direction();
+        const std::vector<Lens::Pupil::Sample> samples = Lens::Pupil::qmc(BUNDLE);
+
+        std::vector<Lens::Vector> origins;
+        for (const Lens::Pupil::Sample &s : samples)
+            origins.push_back(Lens::Vector(chief.x + s.x_ * entrance.radius_, chief.y + s.y_ * entrance.radius_, chief.z));
+        const std::shared_ptr<std::vector<Lens::Vector>> orig = std::make_shared<std::vector<Lens::Vector>>(origins);
+
+        char name[64];
+        snprintf(name, sizeof(name), "trace/cooke/%gdeg", deg);
+        benches.push_back({name, "rays", (double)BUNDLE, [body, orig, dir](size_t n) {
+                               size_t hits = 0;
+                               for (size_t i = 0; i < n; i++)
+                               {
+                                   for (const Lens::Vector &o : *orig)
+                                   {
+                                       Lens::Vector hit, hitDir;
+                                       hits += body->trace(o, dir, 587.56, hit, hitDir);
+                                       doNotOptimize(hit);
+                                   }
+                               }
+                               doNotOptimize(hits);
+                           }});
+
+        // 同じ光線束を1面ずつ.
+        snprintf(name, sizeof(name), "trace/cooke/%gdeg/wavefront", deg);
+        benches.push_back({name, "rays", (double)BUNDLE, [body, orig, dir](size_t n) {
+                               Lens::Wavefront::Batch batch;
+                               batch.reserve(orig->size());
+                               for (size_t i = 0; i < n; i++)
+                               {
+                                   batch.clear();
+                                   for (size_t r = 0; r < orig->size(); r++)
+                                       batch.push((*orig)[r], dir, (uint32_t)r);
+                                   Lens::Wavefront::trace(*body, 587.56, batch);
+                                   doNotOptimize(batch.px_.data());
+                               }
+                           }});
+    }
+
+    // スレッド分割込みのスポット評価. 3画角 x 3波長.
+    constexpr size_t SPOT = 4096;
+    benches.push_back({"spot/cooke/parallel", "rays", (double)(SPOT * 9), [body](size_t n) {
+                           Lens::SpotDiagram spot;
+                           spot.rays_ = SPOT;
+                           for (size_t i = 0; i < n; i++)
+                           {
+                               const std::vector<Lens::SpotDiagram::Result> r = spot.evaluate(*body, {Lens::Field(0., 0.), Lens::Field(0., 10.), Lens::Field(0., 15.)}, {486.13, 587.56, 656.27});
+                               doNotOptimize(r[0].rms_);
+                           }
+                       }});
+
+    // ピント送り1コマ分. 作り直す場合と, 間隔だけ動かして追従する場合.
+    const std::shared_ptr<Lens::Configurations> focus = std::make_shared<Lens::Configurations>();
+    focus->addGap(*body, body->surfaces_.size() - 1);
+    focus->capture(*body);
+    focus->capture(*body);
+    focus->values_[1][0] += 2.;
+    benches.push_back({"focus/cooke/prepare", "frames", 1., [body, focus](size_t n) {
+                           Lens::Body           moving = *body;
+                           const Lens::Renderer renderer;
+                           for (size_t i = 0; i < n; i++)
+                           {
+                               focus->apply(moving, (double)(i & 15) / 15.);
+                               const Lens::Renderer::Optics optics = renderer.prepare(moving);
+                               doNotOptimize(optics.exit_.radius_);
+                           }
+                       }});
+    benches.push_back({"focus/cooke/update", "frames", 1., [body, focus](size_t n) {
+                           Lens::Body             moving = *body;
+                           const Lens::Renderer   renderer;
+                           Lens::Renderer::Optics optics = renderer.prepare(moving);
+                           for (size_t i = 0; i < n; i++)
+                           {
+                               focus->apply(moving, (double)(i & 15) / 15.);
+                               renderer.update(optics, moving);
+                               doNotOptimize(optics.exit_.radius_);
+                           }
+                       }});
+
+    // 1コマ分のオートフォーカス. 3波長 x 64光線.
+    for (double distance : {0., 2000.})
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "autofocus/cooke/%gmm", distance);
+        benches.push_back({name, "solves", 1., [body, distance](size_t n) {
+                               Lens::Autofocus focus;
+                               focus.lambdas_ = {486.13, 587.56, 656.27};
+                               for (size_t i = 0; i < n; i++)
+                               {
+                                   const Lens::Autofocus::Result r = focus.solve(*body, distance);
+                                   doNotOptimize(r.z_);
+                               }
+                           }});
+    }
+
+    // 1パス分のレンダリング. ガラスを追う場合と LightField から引く場合.
+    // テーブルは最初の計測で作る(--list で待たせない).
+    constexpr size_t RW = 64, RH = 48;
+    std::shared_ptr<Lens::Renderer::Scene> scene = std::make_shared<Lens::Renderer::Scene>();
+    scene->background_                           = FloatCanvas::Pixel(0.1f, 0.1f, 0.1f);
+    scene->lights_.push_back(Lens::Renderer::Light(Lens::Vector(0., 0., -2000.), 20., FloatCanvas::Pixel(4.f, 2.f, 1.f)));
+    const std::shared_ptr<Lens::Renderer> renderer = std::make_shared<Lens::Renderer>();
+    renderer->samples_                             = 1;
+    renderer->threads_                             = 1;
+    const double rays                              = (double)(RW * RH * renderer->samples_ * 3);
+    benches.push_back({"render/cooke/trace", "rays", rays, [body, scene, renderer](size_t n) {
+                           const Lens::Renderer::Optics optics = renderer->prepare(*body);
+                           for (size_t i = 0; i < n; i++)
+                           {
+                               renderer->setup(RW, RH);
+                               renderer->pass(optics, *scene);
+                               doNotOptimize(renderer->sum_.pixel_[0]);
+                           }
+                       }});
+    const std::shared_ptr<Lens::Renderer::Optics> table = std::make_shared<Lens::Renderer::Optics>();
+    benches.push_back({"render/cooke/table", "rays", rays, [body, scene, renderer, table](size_t n) {
+                           if (!table->table_)
+                           {
+                               std::shared_ptr<Lens::LightField> field = std::make_shared<Lens::LightField>();
+                               field->build(*body, renderer->sensorWidth_, renderer->sensorWidth_ * RH / RW,
+                                   std::vector<double>(renderer->lambdas_, renderer->lambdas_ + 3), 24, 16, 12, 12, renderer->overscan_, 1);
+                               *table        = renderer->prepare(*body);
+                               table->table_ = field;
+                           }
+                           for (size_t i = 0; i < n; i++)
+                           {
+                               renderer->setup(RW, RH);
+                               renderer->pass(*table, *scene);
+                               doNotOptimize(renderer->sum_.pixel_[0]);
+                           }
+                       }});
+}
+
+std::vector<Benchmark> benchmarks(const std::string &dataDir)
+{
+    std::vector<Benchmark> benches;
+
+    addSurfaceBenchmarks(benches, "sphere", sphere());
+    addSurfaceBenchmarks(benches, "asphere", asphere());
+
+    {
+        const std::shared_ptr<Inputs> in = std::make_shared<Inputs>(0.5, 0.5, 2);
+        benches.push_back({"refract", "ops", 1., [in](size_t n) {
+                               size_t ok = 0;
+                               for (size_t i = 0; i < n; i++)
+                               {
+                                   const size_t k    = i & (TABLE - 1);
+                                   Lens::Vector norm = Lens::Vector(in->x_[k], in->y_[k], -1.).normal();
+                                   Lens::Vector out;
+                                   ok += Lens::refract(in->dir_[k], norm, 1. / 1.5168, out);
+                                   doNotOptimize(out);
+                               }
+                               doNotOptimize(ok);
+                           }});
+    }
+
+    // 法線の正規化と外積.
+    {
+        const std::shared_ptr<Inputs> in = std::make_shared<Inputs>(0.5, 0.5, 3);
+        benches.push_back({"vector/normal", "ops", 1., [in](size_t n) {
+                               for (size_t i = 0; i < n; i++)
+                               {
+                                   const size_t k = i & (TABLE - 1);
+                                   doNotOptimize(Lens::Vector(in->x_[k], in->y_[k], -1.).normal());
+                               }
+                           }});
+        benches.push_back({"vector/cross", "ops", 1., [in](size_t n) {
+                               for (size_t i = 0; i < n; i++)
+                               {
+                                   const size_t k = i & (TABLE - 1);
+                                   doNotOptimize(in->dir_[k].cross(in->dir_[(k + 1) & (TABLE - 1)]));
+                               }
+                           }});
+    }
+
+    // 絞り羽根の判定. 1本ずつと, 光線束まとめて.
+    {
+        const std::shared_ptr<Inputs>     in    = std::make_shared<Inputs>(1.1, 0., 4);
+        const std::shared_ptr<Lens::Iris> blade = std::make_shared<Lens::Iris>();
+        blade->blades_                          = 7;
+        blade->curvature_                       = 0.3;
+        blade->setup();
+        benches.push_back({"iris/inside", "points", (double)TABLE, [in, blade](size_t n) {
+                               size_t inside = 0;
+                               for (size_t i = 0; i < n; i++)
+                                   for (size_t k = 0; k < TABLE; k++)
+                                       inside += blade->inside(in->x_[k], in->y_[k]);
+                               doNotOptimize(inside);
+                           }});
+        benches.push_back({"iris/clip", "points", (double)TABLE, [in, blade](size_t n) {
+                               std::vector<uint8_t> alive(TABLE);
+                               for (size_t i = 0; i < n; i++)
+                               {
+                                   std::fill(alive.begin(), alive.end(), 1);
+                                   doNotOptimize(blade->clip(in->x_.data(), in->y_.data(), TABLE, 1., 1., alive.data()));
+                               }
+                           }});
+    }
+
+    benches.push_back({"xoshiro256aa/rand01", "ops", 1., [](size_t n) {
+                           RANDOM::xoshiro256aa rng(1);
+                           double               sum = 0.;
+                           for (size_t i = 0; i < n; i++)
+                               sum += rng.rand01();
+                           doNotOptimize(sum);
+                       }});
+
+    {
+        constexpr size_t                        W = 512, H = 512;
+        const std::shared_ptr<FloatCanvas::Canvas> canvas = std::make_shared<FloatCanvas::Canvas>(W, H);
+        const std::shared_ptr<Inputs>           in     = std::make_shared<Inputs>(W * 0.5, 1., 3);
+        benches.push_back({"canvas/drawLine", "lines", 1., [canvas, in](size_t n) {
+                               const FloatCanvas::Pixel color(0.1f, 0.1f, 0.1f);
+                               for (size_t i = 0; i < n; i++)
+                               {
+                                   const size_t k = i & (TABLE - 1);
+                                   const size_t j = (i + 1) & (TABLE - 1);
+                                   canvas->drawLine((float)(W * 0.5 + in->x_[k]), (float)(H * 0.5 + in->y_[k]), (float)(W * 0.5 + in->x_[j]), (float)(H * 0.5 + in->y_[j]), color, 1.f);
+                               }
+                               doNotOptimize(canvas->pixel_[0]);
+                           }});
+        benches.push_back({"canvas/getLDR8", "pixels", (double)(W * H), [canvas](size_t n) {
+                               for (size_t i = 0; i < n; i++)
+                               {
+                                   const std::vector<uint8_t> ldr = canvas->getLDR8();
+                                   doNotOptimize(ldr[0]);
+                               }
+                           }});
+    }
+
+    addTraceBenchmarks(benches, dataDir);
+    return benches;
+}
+
+struct AdaptiveReport
+{
+    double   target_;
+    uint64_t uniformRays_, adaptiveRays_;
+    size_t   uniformPasses_, adaptivePasses_;
+    double   uniformError_, adaptiveError_;
+
+    // 一様サンプリングが目標に届かなかったときは誤差 ~ 1/sqrt(光線数) で外挿した数と比べる.
+    double uniformEqual(void) const { return (double)uniformRays_ * std::max(1., (uniformError_ / target_) * (uniformError_ / target_)); }
+    double saved(void) const { return (uniformRays_ && adaptiveError_ <= target_) ? 1. - (double)adaptiveRays_ / uniformEqual() : 0.; }
+};
+
+// クックトリプレットで近距離の点光源をぼかした参照シーンを, 最悪タイル誤差がtargetに届くまで回す.
+bool adaptiveReport(const std::string &dataDir, double target, AdaptiveReport &report)
+{
+    const std::string path = dataDir + "/cooke.zmx";
+    FILE             *fp   = fopen(path.c_str(), "rb");
+    if (!fp)
+        return false;
+    fclose(fp);
+    const Lens::Body body = Lens::Loader::ZEMAX::load(path.c_str());
+
+    Lens::Renderer::Scene scene;
+    scene.background_ = FloatCanvas::Pixel(0.05f, 0.05f, 0.05f);
+    scene.lights_.push_back(Lens::Renderer::Light(Lens::Vector(0., 0., -500.), 8., FloatCanvas::Pixel(8.f, 6.f, 4.f)));
+    scene.lights_.push_back(Lens::Renderer::Light(Lens::Vector(120., 60., -500.), 8., FloatCanvas::Pixel(4.f, 6.f, 8.f)));
+    scene.lights_.push_back(Lens::Renderer::Light(Lens::Vector(-90., -70., -800.), 12., FloatCanvas::Pixel(6.f, 6.f, 6.f)));
+
+    constexpr size_t MAX_PASSES = 256;
+    Lens::Renderer   uniform;
+    uniform.tile_    = 16;
+    uniform.samples_ = 2;
+    uniform.setup(64, 48);
+    Lens::Renderer adaptive = uniform;
+
+    while (uniform.passes_ < MAX_PASSES && (uniform.passes_ == 0 || uniform.error() > target))
+        uniform.pass(body, scene);
+    adaptive.renderAdaptive(body, scene, target, MAX_PASSES);
+
+    report.target_         = target;
+    report.uniformRays_    = uniform.rays();
+    report.adaptiveRays_   = adaptive.rays();
+    report.uniformPasses_  = uniform.passes_;
+    report.adaptivePasses_ = adaptive.passes_;
+    report.uniformError_   = uniform.error();
+    report.adaptiveError_  = adaptive.error();
+    return true;
+}
+
+void writeJson(const char *filename, const std::vector<Result> &results, const AdaptiveReport *adaptive)
+{
+    FILE *fp = fopen(filename, "wb");
+    if (!fp)
+    {
+        fprintf(stderr, "error: cannot write %s\n", filename);
+        return;
+    }
+    fprintf(fp, "{\n  \"context\": {\n");
+#if defined(__clang__)
+    fprintf(fp, "    \"compiler\": \"clang %s\",\n", __clang_version__);
+#elif defined(__GNUC__)
+    fprintf(fp, "    \"compiler\": \"gcc %s\",\n", __VERSION__);
+#elif defined(_MSC_VER)
+    fprintf(fp, "    \"compiler\": \"msvc %d\",\n", _MSC_VER);
+#else
+    fprintf(fp, "    \"compiler\": \"unknown\",\n");
+#endif
+#ifdef NDEBUG
+    fprintf(fp, "    \"ndebug\": true,\n");
+#else
+    fprintf(fp, "    \"ndebug\": false,\n");
+#endif
+    fprintf(fp, "    \"threads\": %zu\n  },\n  \"benchmarks\": [\n", PARALLEL::concurrency());
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const Result &r = results[i];
+        fprintf(fp, "    {\"name\": \"%s\", \"iterations\": %zu, \"samples\": %zu, "
+                    "\"mean_ns\": %.6g, \"median_ns\": %.6g, \"stddev_ns\": %.6g, \"ci95_ns\": %.6g, "
+                    "\"unit\": \"%s\", \"items_per_second\": %.6g}%s\n",
+            r.name_.c_str(), r.iterations_, r.samples_, r.mean_, r.median_, r.stddev_, r.ci95_,
+            r.unit_.c_str(), r.itemsPerSecond_, (i + 1 < results.size()) ? "," : "");
+    }
+    fprintf(fp, "  ]");
+    if (adaptive)
+        fprintf(fp, ",\n  \"adaptive\": {\"target\": %.6g, \"uniform_rays\": %llu, \"adaptive_rays\": %llu, "
+                    "\"uniform_error\": %.6g, \"adaptive_error\": %.6g, \"uniform_equal_rays\": %.6g, \"rays_saved\": %.6g}",
+            adaptive->target_, (unsigned long long)adaptive->uniformRays_, (unsigned long long)adaptive->adaptiveRays_,
+            adaptive->uniformError_, adaptive->adaptiveError_, adaptive->uniformEqual(), adaptive->saved());
+    fprintf(fp, "\n}\n");
+    fclose(fp);
+}
+
+void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [--filter substr] [--samples N] [--min-time ms] [--json file] [--data dir] [--list] [--adaptive target]\n", argv0);
+}
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    std::string filter;
+    std::string json;
+    std::string dataDir   = DOMIPLAN_BENCH_DATA;
+    size_t      samples   = 15;
+    double      minTimeMs = 20.;
+    bool        list      = false;
+    double      target    = 0.;
+    for (int i = 1; i < argc; i++)
+    {
+        const bool hasValue = i + 1 < argc;
+        if (!strcmp(argv[i], "--filter") && hasValue)
+            filter = argv[++i];
+        else if (!strcmp(argv[i], "--json") && hasValue)
+            json = argv[++i];
+        else if (!strcmp(argv[i], "--data") && hasValue)
+            dataDir = argv[++i];
+        else if (!strcmp(argv[i], "--samples") && hasValue)
+            samples = std::max(2, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "--min-time") && hasValue)
+            minTimeMs = std::max(0.1, atof(argv[++i]));
+        else if (!strcmp(argv[i], "--adaptive") && hasValue)
+            target = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--list"))
+            list = true;
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+#ifndef NDEBUG
+    fprintf(stderr, "warning: built without NDEBUG. numbers are not representative.\n");
+#endif
+
+    std::vector<Result> results;
+    printf("%-30s %12s %12s %12s %10s %14s\n", "benchmark", "mean[ns]", "median[ns]", "stddev[ns]", "+-95%", "items/s");
+    for (const Benchmark &bench : benchmarks(dataDir))
+    {
+        if (!filter.empty() && bench.name_.find(filter) == std::string::npos)
+            continue;
+        if (list)
+        {
+            printf("%s\n", bench.name_.c_str());
+            continue;
+        }
+        const Result r = measure(bench, samples, minTimeMs);
+        printf("%-30s %12.2f %12.2f %12.2f %9.2f%% %12.4g %s/s\n", r.name_.c_str(), r.mean_, r.median_, r.stddev_,
+            (r.mean_ > 0.) ? r.ci95_ / r.mean_ * 100. : 0., r.itemsPerSecond_, r.unit_.c_str());
+        fflush(stdout);
+        results.push_back(r);
+    }
+
+    AdaptiveReport report;
+    const bool     reported = !list && target > 0. && adaptiveReport(dataDir, target, report);
+    if (reported)
+        printf("adaptive: %llu rays (%zu passes, error %.3f), uniform: %llu rays (%zu passes, error %.3f, %.4g at equal error), target %.3f, %.1f%% saved\n",
+            (unsigned long long)report.adaptiveRays_, report.adaptivePasses_, report.adaptiveError_,
+            (unsigned long long)report.uniformRays_, report.uniformPasses_, report.uniformError_, report.uniformEqual(),
+            target, report.saved() * 100.);
+
+    if (!json.empty())
+        writeJson(json.c_str(), results, reported ? &report : NULL);
+#if DOMIPLAN_TRACE_STATS
+    Lens::TraceStats::total().report(stderr);
+#endif
+    return 0;
+}
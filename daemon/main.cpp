@@ -0,0 +1,243 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+
+// レンダリングジョブを Unix ドメインソケットで受ける常駐プロセス.
+// 1行1コマンド. 応答も1行.
+//   render lens=<file> out=<file.png|file.dpck> [width= height= sensor= samples= passes= target= seed= threads= priority= background= light=...]
+//                           -> "queued <id>" / "error <reason>"
+//   status <id>             -> "queued" "running" "done" "failed" "unknown"
+//   wait <id>               -> 終わるまで待って status と同じ
+//   stats                   -> キューとキャッシュの状態
+//   flush                   -> レンズのキャッシュを捨てる (ファイルを書き換えたとき)
+//   shutdown                -> 受付を止め, 積まれたジョブを流し切って終わる
+// 例: echo "render lens=cooke.zmx out=a.png light=0,0,-2000,20,4,2,1" | socat - UNIX-CONNECT:/tmp/domiplan.sock
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb_image_write.h>
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <renderservice.hpp>
+
+namespace
+{
+std::atomic<bool> quit(false);
+int               listenFd = -1;
+
+bool endsWith(const std::string &s, const char *suffix)
+{
+    const size_t n = strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+// 仕上がった画像の書き出し. png は表示用, dpck は Renderer のチェックポイント(和とサンプル数)そのもの.
+bool writeImage(const Lens::RenderService::Job &job, const Lens::Renderer &renderer)
+{
+    if (endsWith(job.output_, ".dpck"))
+        return renderer.save(job.output_.c_str());
+    if (endsWith(job.output_, ".png"))
+    {
+        FloatCanvas::Canvas image = renderer.image();
+        return stbi_write_png(job.output_.c_str(), (int)image.width(), (int)image.height(), 3, image.getLDR8().data(), (int)image.width() * 3) != 0;
+    }
+    printf("job %llu: unknown output %s\n", (unsigned long long)job.id_, job.output_.c_str());
+    return false;
+}
+
+bool sendLine(int fd, const std::string &line)
+{
+    const std::string out  = line + "\n";
+    size_t            done = 0;
+    while (done < out.size())
+    {
+        const ssize_t n = send(fd, out.data() + done, out.size() - done, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        done += (size_t)n;
+    }
+    return true;
+}
+
+std::string command(Lens::RenderService &service, const std::string &line)
+{
+    const size_t      sp   = line.find(' ');
+    const std::string verb = line.substr(0, sp);
+    const std::string args = (sp == std::string::npos) ? std::string() : line.substr(sp + 1);
+
+    if (verb == "render")
+    {
+        Lens::RenderService::Job job;
+        std::string              error;
+        if (!Lens::RenderService::parse(args, job, error))
+            return "error " + error;
+        if (job.output_.empty())
+            return "error out= is required";
+        const uint64_t id = service.submit(job);
+        return id ? "queued " + std::to_string(id) : std::string("error shutting down");
+    }
+    if (verb == "status" || verb == "wait")
+    {
+        const uint64_t id = strtoull(args.c_str(), NULL, 10);
+        return Lens::RenderService::name(verb == "wait" ? service.wait(id) : service.state(id));
+    }
+    if (verb == "stats")
+    {
+        char buf[256];
+        snprintf(buf, sizeof(buf), "queued %zu running %zu cached %zu hits %llu misses %llu",
+            service.queued(), service.running(), service.cache().size(),
+            (unsigned long long)service.cache().hits(), (unsigned long long)service.cache().misses());
+        return buf;
+    }
+    if (verb == "flush")
+    {
+        service.cache().clear();
+        return "ok";
+    }
+    if (verb == "shutdown")
+    {
+        quit = true;
+        shutdown(listenFd, SHUT_RDWR); // acceptを起こす.
+        return "ok";
+    }
+    return "error unknown command: " + verb;
+}
+
+void serve(Lens::RenderService &service, int fd)
+{
+    std::string pending;
+    char        buf[4096];
+    for (;;)
+    {
+        const ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0)
+            break;
+        pending.append(buf, (size_t)n);
+        size_t eol;
+        while ((eol = pending.find('\n')) != std::string::npos)
+        {
+            std::string line = pending.substr(0, eol);
+            pending.erase(0, eol + 1);
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            if (!line.empty() && !sendLine(fd, command(service, line)))
+                return;
+        }
+    }
+}
+
+void onSignal(int)
+{
+    quit = true;
+    shutdown(listenFd, SHUT_RDWR);
+}
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    std::string path    = "/tmp/domiplan.sock";
+    size_t      workers = 0;
+    size_t      cache   = 8;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-workers") == 0 && i + 1 < argc)
+            workers = (size_t)atoi(argv[++i]);
+        else if (strcmp(argv[i], "-cache") == 0 && i + 1 < argc)
+            cache = (size_t)atoi(argv[++i]);
+        else if (argv[i][0] != '-')
+            path = argv[i];
+        else
+        {
+            printf("usage: %s [socket] [-workers n] [-cache n]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+    {
+        printf("socket path too long: %s\n", path.c_str());
+        return 1;
+    }
+    strcpy(addr.sun_path, path.c_str());
+
+    listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path.c_str());
+    if (listenFd < 0 || bind(listenFd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(listenFd, 16) != 0)
+    {
+        printf("socket %s open fail\n", path.c_str());
+        return 1;
+    }
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    Lens::RenderService service(cache);
+    service.sink_ = writeImage;
+    service.start(workers);
+    printf("listening on %s\n", path.c_str());
+
+    // 接続ごとのスレッドは fd ではなく通し番号で持つ. fd は閉じるとすぐ使い回される.
+    std::mutex                      mutex;
+    std::set<int>                   clients;
+    std::map<uint64_t, std::thread> threads;
+    std::vector<uint64_t>           finished; // 抜けたのでjoinできるもの.
+    uint64_t                        serial = 0;
+    while (!quit)
+    {
+        const int fd = accept(listenFd, NULL, NULL);
+
+        // 終わった接続を片付ける. joinはロックの外で.
+        std::vector<std::thread> reap;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (uint64_t key : finished)
+            {
+                reap.push_back(std::move(threads[key]));
+                threads.erase(key);
+            }
+            finished.clear();
+        }
+        for (std::thread &t : reap)
+            t.join();
+
+        if (fd < 0)
+            continue;
+        std::lock_guard<std::mutex> lock(mutex);
+        clients.insert(fd);
+        const uint64_t key = serial++;
+        threads[key]       = std::thread([&, fd, key]() {
+            serve(service, fd);
+            std::lock_guard<std::mutex> lock(mutex);
+            clients.erase(fd);
+            close(fd);
+            finished.push_back(key);
+        });
+    }
+    close(listenFd);
+    unlink(path.c_str());
+
+    // 積まれたジョブを流し切ってから, まだ繋がっている相手を切る.
+    service.shutdown();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int fd : clients)
+            shutdown(fd, SHUT_RDWR);
+    }
+    for (auto &t : threads)
+        t.second.join();
+    return 0;
+}
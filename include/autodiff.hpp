@@ -0,0 +1,39 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+#ifndef __AUTODIFF_H
+#define __AUTODIFF_H
+
+#include <dual.hpp>
+#include <lens.hpp>
+
+namespace Lens
+{
+// 光線追跡の前進モード自動微分.
+// 面パラメータをDualにしたBodyを追跡すると, 像面座標などに各レーンの偏微分が乗る.
+namespace AutoDiff
+{
+    static constexpr int LANES = 8; // 1回の追跡で求める偏微分の数.
+
+    typedef DUAL::Dual<double, LANES>   Number;
+    typedef VECTORMATH::Vector3<Number> Vec;
+    typedef BasicSurface<Number>        Surface;
+    typedef BasicBody<Number>           Body;
+
+    // 微分ゼロの定数としてBodyを持ち上げる. 変数は呼び出し側でレーンを割り当てる.
+    inline Body lift(const Lens::Body &body)
+    {
+        return Body(body);
+    }
+
+    inline Number variable(double value, int lane)
+    {
+        return Number(value, lane);
+    }
+
+    inline double derivative(const Number &v, int lane)
+    {
+        return v.d_[lane];
+    }
+} // namespace AutoDiff
+} // namespace Lens
+
+#endif
@@ -0,0 +1,184 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+#ifndef __AUTOFOCUS_H
+#define __AUTOFOCUS_H
+
+#include <math.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <lens.hpp>
+#include <parallel.hpp>
+#include <paraxial.hpp>
+#include <pupil.hpp>
+#include <wavefront.hpp>
+
+namespace Lens
+{
+// 物体距離に対してピントの合う像面位置を求める.
+// 近軸の共役距離を出してから, 軸上の物点から出るQMC光線束を最終面まで1回だけ追跡する.
+// 最終面より後ろは直進なので, 像面zでの重心まわりの二乗和はzの二次式になり, 最小は追跡し直さずに解ける.
+class Autofocus
+{
+  public:
+    struct Result
+    {
+        double paraxial_;    // 近軸の像点(ワールドz).
+        double z_;           // RMSスポット最小の像面位置(ワールドz).
+        double rms_;         // z_ での重心まわりRMS半径.
+        size_t rays_, hits_; // 追跡した光線数, 最終面を抜けた光線数.
+    };
+
+    // 最終面を抜けた光線を, 基準面 zRef_ 上の位置 + 傾き x (z - zRef_) で持つ.
+    // 像面zでの重心まわりの二乗和は sum_ から z の二次式で出る.
+    struct Bundle
+    {
+        double zRef_;
+        size_t hits_;
+        double sum_[10]; // x, y それぞれ a, b, a^2, ab, b^2.
+
+        Bundle() : zRef_(0.), hits_(0) { std::fill(sum_, sum_ + 10, 0.); }
+
+        void add(const Bundle &b)
+        {
+            hits_ += b.hits_;
+            for (int i = 0; i < 10; i++)
+                sum_[i] += b.sum_[i];
+        }
+
+        // zRef_ + t での重心まわりの二乗和 = c0 + 2 c1 t + c2 t^2.
+        void quadratic(double &c0, double &c1, double &c2) const
+        {
+            const double n = (double)std::max<size_t>(hits_, 1);
+            c0 = c1 = c2 = 0.;
+            for (int k = 0; k < 2; k++)
+            {
+                const double *s = sum_ + k * 5;
+                c0 += s[2] - s[0] * s[0] / n;
+                c1 += s[3] - s[0] * s[1] / n;
+                c2 += s[4] - s[1] * s[1] / n;
+            }
+        }
+
+        double rms(double z) const
+        {
+            if (!hits_)
+                return 0.;
+            double c0, c1, c2;
+            quadratic(c0, c1, c2);
+            const double t = z - zRef_;
+            return sqrt(std::max(0., (c0 + 2. * c1 * t + c2 * t * t) / (double)hits_));
+        }
+
+        // 最小の位置. 光線が平行なら zRef_.
+        double best(void) const
+        {
+            double c0, c1, c2;
+            quadratic(c0, c1, c2);
+            return (c2 > 0.) ? zRef_ - c1 / c2 : zRef_;
+        }
+    };
+
+    std::vector<double> lambdas_;
+    size_t              rays_;     // 1波長あたりの瞳サンプル数.
+    size_t              chunk_;    // 1ジョブあたりの光線数.
+    size_t              threads_;  // 既定は1. 光線が少ないうちはスレッドを起こす方が高くつく.
+    double              overscan_; // 入射瞳半径に対する狙う範囲. 近い物体では瞳が広がるので少し大きめ.
+
+    Autofocus() : lambdas_(1, 587.56), rays_(64), chunk_(64), threads_(1), overscan_(1.25) { ; }
+
+    // 物体は第一面頂点の手前distance[mm]の光軸上. 0以下は無限遠.
+    Bundle trace(const Body &body, double distance, double zRef) const
+    {
+        Bundle bundle;
+        bundle.zRef_ = zRef;
+        if (body.surfaces_.empty() || lambdas_.empty())
+            return bundle;
+
+        Pupil::Entrance entrance;
+        entrance.setup(body, lambdas_[lambdas_.size() / 2]);
+        const double z0     = entrance.z_;
+        const double radius = entrance.radius_ * ((distance > 0.) ? overscan_ : 1.);
+        const Vector object = Vector(0., 0., z0 - distance);
+
+        const size_t        chunks = (rays_ + chunk_ - 1) / chunk_;
+        std::vector<Bundle> parts(chunks * lambdas_.size());
+        PARALLEL::parallelFor(parts.size(), [&](size_t job) {
+            const size_t         l     = job / chunks;
+            const size_t         begin = (job % chunks) * chunk_;
+            const size_t         end   = std::min(begin + chunk_, rays_);
+            Wavefront::Batch     batch;
+            batch.reserve(end - begin);
+            for (size_t i = begin; i < end; i++)
+            {
+                const Pupil::Sample s   = Pupil::r2(i);
+                const Vector        pos = Vector(s.x_ * radius, s.y_ * radius, z0);
+                const Vector        dir = (distance > 0.) ? (pos - object).normal() : Vector(0., 0., 1.);
+                batch.push(pos, dir, (uint32_t)i);
+            }
+            Wavefront::traceSurfaces(body, lambdas_[l], batch, 0, body.surfaces_.size());
+
+            Bundle &part = parts[job];
+            for (size_t i = 0; i < batch.size(); i++)
+            {
+                if (batch.dz_[i] <= 0.)
+                    continue;
+                const double bx = batch.dx_[i] / batch.dz_[i];
+                const double by = batch.dy_[i] / batch.dz_[i];
+                const double ax = batch.px_[i] + bx * (zRef - batch.pz_[i]);
+                const double ay = batch.py_[i] + by * (zRef - batch.pz_[i]);
+                const double v[2][2] = {{ax, bx}, {ay, by}};
+                for (int k = 0; k < 2; k++)
+                {
+                    double *sum = part.sum_ + k * 5;
+                    sum[0] += v[k][0];
+                    sum[1] += v[k][1];
+                    sum[2] += v[k][0] * v[k][0];
+                    sum[3] += v[k][0] * v[k][1];
+                    sum[4] += v[k][1] * v[k][1];
+                }
+                part.hits_++;
+            }
+        },
+            threads_);
+
+        // ジョブ順に足すのでスレッド数によらず同じ値になる.
+        for (const Bundle &part : parts)
+            bundle.add(part);
+        return bundle;
+    }
+
+    Result solve(const Body &body, double distance) const
+    {
+        Paraxial::System system;
+        system.setup(body, lambdas_[lambdas_.size() / 2]);
+        return solve(body, system, distance);
+    }
+
+    // Paraxial::System を持ち回る版. 間隔を動かしながら毎コマ呼ぶときは system.update(body) してから渡す.
+    Result solve(const Body &body, const Paraxial::System &system, double distance) const
+    {
+        Result result;
+        result.paraxial_ = body.surfaces_.empty() ? body.imageSurfaceZ_ : body.surfaces_.back().vertex() + system.conjugate(distance);
+        result.rays_     = rays_ * lambdas_.size();
+
+        const Bundle bundle = trace(body, distance, result.paraxial_);
+        result.hits_        = bundle.hits_;
+        result.z_           = (bundle.hits_ >= 3) ? bundle.best() : result.paraxial_;
+        result.rms_         = bundle.rms(result.z_);
+        return result;
+    }
+
+    // 最終面の後ろの間隔を動かしてピントを合わせる. Renderer::update() などは位置だけ直せばよい.
+    Result apply(Body &body, double distance) const
+    {
+        const Result result = solve(body, distance);
+        if (!body.surfaces_.empty())
+            body.setGap(body.surfaces_.size() - 1, result.z_ - body.surfaces_.back().vertex());
+        return result;
+    }
+};
+} // namespace Lens
+
+#endif
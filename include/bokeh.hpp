@@ -0,0 +1,245 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+#ifndef __BOKEH_H
+#define __BOKEH_H
+
+#include <math.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <fft.hpp>
+#include <floatcanvas.hpp>
+#include <lens.hpp>
+#include <parallel.hpp>
+#include <paraxial.hpp>
+#include <pupil.hpp>
+
+namespace Lens
+{
+// 物点ごとのボケ形状(カーネル)を追跡で求め, RGB-D画像にタイル単位のFFT畳み込みで適用する.
+class Bokeh
+{
+  public:
+    // 画素単位のカーネル. (2r+1)^2, 中心が主光線の到達点. 合計は軸上合焦点に対する透過率.
+    struct Kernel
+    {
+        int                radius_;
+        std::vector<float> weight_;
+
+        Kernel() : radius_(0) { ; }
+        float at(int dx, int dy) const { return weight_[(dy + radius_) * (2 * radius_ + 1) + (dx + radius_)]; }
+    };
+
+    double sensorWidth_;  // 画像の幅に対応するセンサー幅[mm].
+    double lambda_;       // カーネルを求める波長.
+    size_t pupilRays_;    // カーネル1枚あたりの瞳サンプル数.
+    int    kernelRadius_; // カーネル半径の上限[px].
+    size_t layers_;       // 奥行きの分割数(1/距離で等間隔).
+    size_t zones_;        // 画面をzones_ x zones_に分けてカーネルを変える.
+    size_t tile_;         // 畳み込みタイルの大きさ[px]. 2 * kernelRadius_ 以上.
+    size_t threads_;
+
+    Bokeh() : sensorWidth_(36.), lambda_(587.56), pupilRays_(4096), kernelRadius_(32), layers_(8), zones_(4), tile_(128), threads_(0) { ; }
+
+    // 物点object(ワールド座標)のカーネル. pitchは像面での1画素[mm].
+    Kernel kernel(const Body &body, const Pupil::Entrance &entrance, const Vector &object, double pitch) const
+    {
+        Kernel k;
+        k.radius_ = kernelRadius_;
+        const int size = 2 * kernelRadius_ + 1;
+        k.weight_.assign(size * size, 0.f);
+
+        const Vector chief = entrance.chiefFrom(body, object, lambda_);
+        Vector       center, hitDir;
+        if (!body.trace(object, (chief - object).normal(), lambda_, center, hitDir))
+            return k;
+
+        // 瞳の歪みとケラレを拾うため少し広めにサンプルする.
+        const double spread = entrance.radius_ * 1.25;
+        const double weight = (1.25 * 1.25) / (double)pupilRays_;
+        for (size_t i = 0; i < pupilRays_; i++)
+        {
+            const Pupil::Sample p    = Pupil::r2(i);
+            const Vector        aim  = Vector(chief.x + p.x_ * spread, chief.y + p.y_ * spread, chief.z);
+            Vector              hit;
+            if (!body.trace(object, (aim - object).normal(), lambda_, hit, hitDir))
+                continue;
+
+            // 倒立像を正立させた画素オフセットにバイリニアで置く.
+            const double x  = -(hit.x - center.x) / pitch + kernelRadius_;
+            const double y  = -(hit.y - center.y) / pitch + kernelRadius_;
+            const int    xl = (int)floor(x);
+            const int    yl = (int)floor(y);
+            const double fx = x - xl;
+            const double fy = y - yl;
+            for (int j = 0; j < 2; j++)
+                for (int i2 = 0; i2 < 2; i2++)
+                {
+                    const int xx = xl + i2, yy = yl + j;
+                    if (xx < 0 || yy < 0 || xx >= size || yy >= size)
+                        continue;
+                    k.weight_[yy * size + xx] += (float)(weight * (i2 ? fx : 1. - fx) * (j ? fy : 1. - fy));
+                }
+        }
+        return k;
+    }
+
+    // rgbと奥行き(第一面頂点からの距離[mm])から被写界深度を付けた画像をoutに描く.
+    // 奥行き方向のレイヤーを合成するだけで, 前景による遮蔽は扱わない.
+    void render(const Body &body, const FloatCanvas::Canvas &rgb, const std::vector<float> &depth, FloatCanvas::Canvas &out) const
+    {
+        DOMIPLAN_STATS_SCOPE(BOKEH);
+        const size_t W = rgb.width_, H = rgb.height_;
+        out.setup(W, H, rgb.gamut_);
+        out.fill(FloatCanvas::Pixel(0.f, 0.f, 0.f));
+        if (W == 0 || H == 0 || depth.size() != W * H || body.surfaces_.empty())
+            return;
+
+        const double pitch  = sensorWidth_ / (double)W;
+        const double focal  = fabs(Paraxial::focalLength(body, lambda_));
+        const size_t layers = std::max<size_t>(1, layers_);
+        const size_t zones  = std::max<size_t>(1, zones_);
+        const int    K      = kernelRadius_;
+        const size_t T      = std::max<size_t>(tile_, 2 * K);
+        const size_t M      = FFT::nextPowerOf2(T + 2 * K);
+
+        Pupil::Entrance entrance;
+        entrance.setup(body, lambda_);
+
+        // 奥行きレイヤー: 1/距離で等間隔.
+        float dmin = depth[0], dmax = depth[0];
+        for (float d : depth)
+        {
+            dmin = std::min(dmin, d);
+            dmax = std::max(dmax, d);
+        }
+        const double invNear = 1. / std::max(1e-3, (double)dmin);
+        const double invFar  = 1. / std::max(1e-3, (double)dmax);
+        std::vector<double> layerDepth(layers);
+        for (size_t l = 0; l < layers; l++)
+        {
+            const double a = (layers == 1) ? 0.5 : (double)l / (double)(layers - 1);
+            layerDepth[l]  = 1. / (invNear + (invFar - invNear) * a);
+        }
+        const auto layerOf = [&](float d, size_t &l0, float &f) {
+            const double a = (layers == 1 || invNear == invFar) ? 0. : (1. / std::max(1e-3, (double)d) - invNear) / (invFar - invNear) * (layers - 1);
+            const double c = std::min(std::max(a, 0.), (double)(layers - 1));
+            l0             = std::min((size_t)c, layers - 1);
+            f              = (float)(c - l0);
+        };
+
+        // ゾーン中心 x レイヤーのカーネルを求め, FFTしておく.
+        const size_t              kernelCount = zones * zones * layers;
+        std::vector<FFT::Complex> spectra(kernelCount * M * M);
+        PARALLEL::parallelFor(kernelCount, [&](size_t index) {
+            const size_t l  = index % layers;
+            const size_t zx = (index / layers) % zones;
+            const size_t zy = index / layers / zones;
+
+            // ゾーン中心の画素に写る物点. 倒立するのでセンサー上では反対側に結像する.
+            const double ix     = ((zx + 0.5) / zones - 0.5) * W * pitch;
+            const double iy     = ((zy + 0.5) / zones - 0.5) * H * pitch;
+            const double d      = layerDepth[l];
+            const Vector object = Vector(ix / focal * d, iy / focal * d, entrance.z_ - d);
+
+            const Kernel  k   = kernel(body, entrance, object, pitch);
+            FFT::Complex *dst = &spectra[index * M * M];
+            for (int dy = -K; dy <= K; dy++)
+                for (int dx = -K; dx <= K; dx++)
+                    dst[((dy + M) % M) * M + (dx + M) % M] = k.at(dx, dy);
+            std::vector<FFT::Complex> buf(dst, dst + M * M);
+            FFT::transform2D(buf, M, M, false, 1);
+            std::copy(buf.begin(), buf.end(), dst);
+        },
+            threads_);
+
+        std::vector<float> acc(W * H * 3, 0.f);
+
+        const size_t tilesX = (W + T - 1) / T;
+        const size_t tilesY = (H + T - 1) / T;
+
+        // 隣接タイルの書き込み範囲が重なるので, 偶奇で4回に分けて並列化する.
+        for (size_t phase = 0; phase < 4; phase++)
+        {
+            std::vector<size_t> tiles;
+            for (size_t ty = phase / 2; ty < tilesY; ty += 2)
+                for (size_t tx = phase % 2; tx < tilesX; tx += 2)
+                    tiles.push_back(ty * tilesX + tx);
+
+            PARALLEL::parallelFor(tiles.size(), [&](size_t n) {
+                const size_t tx = tiles[n] % tilesX;
+                const size_t ty = tiles[n] / tilesX;
+                const size_t x0 = tx * T, y0 = ty * T;
+                const size_t x1 = std::min(W, x0 + T), y1 = std::min(H, y0 + T);
+
+                const size_t zx   = std::min(zones - 1, ((x0 + x1) / 2) * zones / W);
+                const size_t zy   = std::min(zones - 1, ((y0 + y1) / 2) * zones / H);
+                const size_t zone = (zy * zones + zx) * layers;
+
+                std::vector<FFT::Complex> rg(M * M), b(M * M);
+                for (size_t l = 0; l < layers; l++)
+                {
+                    // (R + iG), (B) の2回のFFTで3チャンネルを畳み込む.
+                    bool any = false;
+                    std::fill(rg.begin(), rg.end(), FFT::Complex(0., 0.));
+                    std::fill(b.begin(), b.end(), FFT::Complex(0., 0.));
+                    for (size_t y = y0; y < y1; y++)
+                        for (size_t x = x0; x < x1; x++)
+                        {
+                            size_t l0;
+                            float  f;
+                            layerOf(depth[y * W + x], l0, f);
+                            const float w = (l0 == l) ? 1.f - f : (l0 + 1 == l) ? f : 0.f;
+                            if (w <= 0.f)
+                                continue;
+                            const FloatCanvas::Pixel &p = rgb.pixel_[y * W + x];
+                            const size_t              k = (y - y0) * M + (x - x0);
+                            rg[k]                       = FFT::Complex(p[0] * w, p[1] * w);
+                            b[k]                        = FFT::Complex(p[2] * w, 0.);
+                            any                         = true;
+                        }
+                    if (!any)
+                        continue;
+
+                    const FFT::Complex *spec = &spectra[(zone + l) * M * M];
+                    FFT::transform2D(rg, M, M, false, 1);
+                    FFT::transform2D(b, M, M, false, 1);
+                    for (size_t k = 0; k < M * M; k++)
+                    {
+                        rg[k] *= spec[k];
+                        b[k] *= spec[k];
+                    }
+                    FFT::transform2D(rg, M, M, true, 1);
+                    FFT::transform2D(b, M, M, true, 1);
+
+                    // 巡回畳み込みの結果をタイル周囲K画素まで足し込む.
+                    for (size_t by = 0; by < M; by++)
+                    {
+                        const long oy = (by < T + K) ? (long)by : (long)by - (long)M;
+                        const long y  = (long)y0 + oy;
+                        if (oy < -K || y < 0 || y >= (long)H)
+                            continue;
+                        for (size_t bx = 0; bx < M; bx++)
+                        {
+                            const long ox = (bx < T + K) ? (long)bx : (long)bx - (long)M;
+                            const long x  = (long)x0 + ox;
+                            if (ox < -K || x < 0 || x >= (long)W)
+                                continue;
+                            float *dst = &acc[((size_t)y * W + (size_t)x) * 3];
+                            dst[0] += (float)rg[by * M + bx].real();
+                            dst[1] += (float)rg[by * M + bx].imag();
+                            dst[2] += (float)b[by * M + bx].real();
+                        }
+                    }
+                }
+            },
+                threads_);
+        }
+
+        for (size_t i = 0; i < W * H; i++)
+            out.pixel_[i] = FloatCanvas::Pixel(acc[i * 3 + 0], acc[i * 3 + 1], acc[i * 3 + 2]);
+    }
+};
+} // namespace Lens
+
+#endif
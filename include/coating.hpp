@@ -0,0 +1,185 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+#ifndef __COATING_H
+#define __COATING_H
+
+#include <math.h>
+
+#include <algorithm>
+#include <complex>
+#include <memory>
+#include <vector>
+
+namespace Lens
+{
+// 多層薄膜コーティング. 特性行列(transfer matrix)法でs/p偏光の反射率/透過率を求める.
+// 吸収は扱わない(屈折率は実数).
+class Coating
+{
+  public:
+    typedef std::complex<double> Complex;
+
+    struct Layer
+    {
+        double ior_;       // 膜の屈折率.
+        double thickness_; // 物理膜厚[nm].
+        Layer(double ior = 1.38, double thickness = 0.) : ior_(ior), thickness_(thickness) { ; }
+    };
+
+    // 強度の反射率/透過率.
+    struct Fresnel
+    {
+        double rs_, rp_;
+        double ts_, tp_;
+
+        double reflectance(void) const { return (rs_ + rp_) * 0.5; }
+        double transmittance(void) const { return (ts_ + tp_) * 0.5; }
+    };
+
+    std::vector<Layer> layers_; // 入射側から順に.
+
+    Coating() { ; }
+
+    // 設計波長での1/4波長膜. MgF2単層なら ior=1.38.
+    static Coating quarterWave(double ior, double lambda = 550.)
+    {
+        Coating c;
+        c.layers_.push_back(Layer(ior, lambda / (4. * ior)));
+        return c;
+    }
+
+    // n0側から角度(cosTheta0)で入射し基板nsへ抜けるときの値. lambda[nm].
+    Fresnel evaluate(double n0, double ns, double cosTheta0, double lambda, bool reverse = false) const
+    {
+        Fresnel f;
+        const double c0   = std::min(fabs(cosTheta0), 1.);
+        const double sin0 = n0 * sqrt(std::max(0., 1. - c0 * c0)); // n sin(theta) は各層で不変.
+        if (sin0 >= ns)
+        {
+            // 基板側で全反射.
+            f.rs_ = f.rp_ = 1.;
+            f.ts_ = f.tp_ = 0.;
+            return f;
+        }
+        const Complex cs = cosine(ns, sin0);
+        for (int pol = 0; pol < 2; pol++)
+        {
+            const Complex eta0 = admittance(n0, Complex(c0, 0.), pol);
+            const Complex etaS = admittance(ns, cs, pol);
+
+            // [B C]^T = M_1 ... M_n [1 etaS]^T
+            Complex      m00 = 1., m01 = 0., m10 = 0., m11 = 1.;
+            const size_t n   = layers_.size();
+            for (size_t k = 0; k < n; k++)
+            {
+                // 層の特性行列 [[cos d, i sin d / eta], [i eta sin d, cos d]] を右から掛ける.
+                const Layer  &l     = layers_[reverse ? n - 1 - k : k];
+                const Complex cj    = cosine(l.ior_, sin0);
+                const Complex etaJ  = admittance(l.ior_, cj, pol);
+                const Complex delta = 2. * M_PI * l.ior_ * l.thickness_ * cj / lambda;
+                const Complex cd    = std::cos(delta);
+                const Complex isd   = Complex(0., 1.) * std::sin(delta);
+                const Complex n00   = m00 * cd + m01 * isd * etaJ;
+                const Complex n01   = m00 * isd / etaJ + m01 * cd;
+                const Complex n10   = m10 * cd + m11 * isd * etaJ;
+                const Complex n11   = m10 * isd / etaJ + m11 * cd;
+                m00                 = n00;
+                m01                 = n01;
+                m10                 = n10;
+                m11                 = n11;
+            }
+            const Complex B   = m00 + m01 * etaS;
+            const Complex C   = m10 + m11 * etaS;
+            const Complex den = eta0 * B + C;
+            const double  R   = std::norm((eta0 * B - C) / den);
+            const double  T   = 4. * eta0.real() * etaS.real() / std::norm(den);
+            if (pol == 0)
+            {
+                f.rs_ = R;
+                f.ts_ = T;
+            }
+            else
+            {
+                f.rp_ = R;
+                f.tp_ = T;
+            }
+        }
+        return f;
+    }
+
+    // (入射角, 波長)の表. 面ごとに表/裏の2枚を持つ.
+    class Table
+    {
+      public:
+        static constexpr int    ANGLES  = 91; // 0..90度, 1度刻み.
+        static constexpr int    LAMBDAS = 41; // 380..780nm, 10nm刻み.
+        static constexpr double LAMBDA0 = 380.;
+        static constexpr double LAMBDA1 = 780.;
+
+        std::vector<double> key_;      // 作成条件. 同じなら作り直さない.
+        std::vector<float>  front_[2]; // s, p 反射率. 面の手前(物体側)からの入射.
+        std::vector<float>  back_[2];  // 面の奥(像側)からの入射.
+
+        // n0(lambda), ns(lambda) は手前/奥の媒質の屈折率.
+        template <typename IorBefore, typename IorAfter>
+        void build(const Coating &coating, const IorBefore &n0, const IorAfter &ns)
+        {
+            for (int pol = 0; pol < 2; pol++)
+            {
+                front_[pol].resize(ANGLES * LAMBDAS);
+                back_[pol].resize(ANGLES * LAMBDAS);
+            }
+            for (int l = 0; l < LAMBDAS; l++)
+            {
+                const double lambda = LAMBDA0 + (LAMBDA1 - LAMBDA0) * l / (LAMBDAS - 1);
+                const double a      = n0(lambda), b = ns(lambda);
+                for (int i = 0; i < ANGLES; i++)
+                {
+                    const double  c  = cos((double)i * M_PI / 180.);
+                    const Fresnel ff = coating.evaluate(a, b, c, lambda, false);
+                    const Fresnel fb = coating.evaluate(b, a, c, lambda, true);
+                    front_[0][l * ANGLES + i] = (float)ff.rs_;
+                    front_[1][l * ANGLES + i] = (float)ff.rp_;
+                    back_[0][l * ANGLES + i]  = (float)fb.rs_;
+                    back_[1][l * ANGLES + i]  = (float)fb.rp_;
+                }
+            }
+        }
+
+        // s/p反射率を双線形補間で引く. cosThetaは入射角の余弦.
+        void lookup(bool front, double cosTheta, double lambda, double &rs, double &rp) const
+        {
+            const double a  = acos(std::min(fabs(cosTheta), 1.)) * 180. / M_PI;
+            const double w  = (std::min(std::max(lambda, LAMBDA0), LAMBDA1) - LAMBDA0) / (LAMBDA1 - LAMBDA0) * (LAMBDAS - 1);
+            const int    i0 = std::min((int)a, ANGLES - 2);
+            const int    l0 = std::min((int)w, LAMBDAS - 2);
+            const double fa = a - i0, fl = w - l0;
+
+            const std::vector<float> *t = front ? front_ : back_;
+            double                    r[2];
+            for (int pol = 0; pol < 2; pol++)
+            {
+                const float *p = t[pol].data() + l0 * ANGLES + i0;
+                r[pol]         = (p[0] * (1. - fa) + p[1] * fa) * (1. - fl) + (p[ANGLES] * (1. - fa) + p[ANGLES + 1] * fa) * fl;
+            }
+            rs = r[0];
+            rp = r[1];
+        }
+    };
+
+  private:
+    // n sin(theta) = sin0 となる層内の cos(theta). 全反射ならエバネッセントで虚数.
+    static Complex cosine(double n, double sin0)
+    {
+        const double s = sin0 / n;
+        return std::sqrt(Complex(1. - s * s, 0.));
+    }
+
+    // 斜入射の光学アドミタンス. s: n cos, p: n / cos.
+    static Complex admittance(double n, const Complex &c, int pol)
+    {
+        return (pol == 0) ? n * c : n / c;
+    }
+};
+} // namespace Lens
+
+#endif
@@ -0,0 +1,101 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+#ifndef __CONFIGURATION_H
+#define __CONFIGURATION_H
+
+#include <math.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <lens.hpp>
+
+namespace Lens
+{
+// ZEMAXのマルチコンフィグのように, 可変間隔を宣言して設定(ピント位置, ズーム位置)ごとの値を持つ.
+// 切り替えは Body::setGap() で変わった間隔だけ動かすので, 面のsetup()はやり直さない.
+// Renderer::update() や Paraxial::System::update() は revision_ を見て, 位置に依るものだけ直す.
+class Configurations
+{
+  public:
+    std::vector<size_t>              gaps_;   // 可変間隔. 面indexで, その面の後ろの間隔(最終面なら像面まで).
+    std::vector<std::vector<double>> values_; // [設定][可変間隔] の間隔[mm].
+
+    size_t size(void) const { return values_.size(); }
+
+    // 面surfaceの後ろの間隔を可変にする. 既にある設定には今の値を入れる.
+    size_t addGap(const Body &body, size_t surface)
+    {
+        gaps_.push_back(surface);
+        for (std::vector<double> &v : values_)
+            v.push_back(body.gap(surface));
+        return gaps_.size() - 1;
+    }
+
+    // 今のBodyの間隔を新しい設定として覚える.
+    size_t capture(const Body &body)
+    {
+        std::vector<double> v;
+        for (size_t g : gaps_)
+            v.push_back(body.gap(g));
+        values_.push_back(v);
+        return values_.size() - 1;
+    }
+
+    // 群[begin,end)を光軸方向にdzだけ動かす. 手前の間隔を伸ばし, 後ろの間隔を縮める.
+    // 両方とも宣言されていること.
+    bool moveGroup(size_t config, size_t begin, size_t end, double dz)
+    {
+        if (begin == 0 || end <= begin)
+            return false;
+        std::vector<double>::iterator before = find(config, begin - 1), after = find(config, end - 1);
+        if (before == values_[config].end() || after == values_[config].end())
+            return false;
+        *before += dz;
+        *after -= dz;
+        return true;
+    }
+
+    // 設定configにする. 動かした間隔の数を返す. 同じ設定なら何もせず revision_ も進まない.
+    size_t apply(Body &body, size_t config) const
+    {
+        size_t moved = 0;
+        for (size_t g = 0; g < gaps_.size(); g++)
+            moved += set(body, gaps_[g], values_[config][g]);
+        return moved;
+    }
+
+    // 設定の間を線形に補間する. position は 0..size()-1 で, ピント送りやズームのアニメーションに使う.
+    size_t apply(Body &body, double position) const
+    {
+        if (values_.empty())
+            return 0;
+        const double p     = std::min(std::max(position, 0.), (double)(values_.size() - 1));
+        const size_t c0    = std::min((size_t)p, values_.size() - 1);
+        const size_t c1    = std::min(c0 + 1, values_.size() - 1);
+        const double f     = p - (double)c0;
+        size_t       moved = 0;
+        for (size_t g = 0; g < gaps_.size(); g++)
+            moved += set(body, gaps_[g], values_[c0][g] * (1. - f) + values_[c1][g] * f);
+        return moved;
+    }
+
+  private:
+    std::vector<double>::iterator find(size_t config, size_t surface)
+    {
+        std::vector<size_t>::const_iterator it = std::find(gaps_.begin(), gaps_.end(), surface);
+        return (it == gaps_.end()) ? values_[config].end() : values_[config].begin() + (it - gaps_.begin());
+    }
+
+    // 位置の引き算の丸めで動いたことにならないよう, 1nm未満の差は無視する.
+    static bool set(Body &body, size_t surface, double value)
+    {
+        if (fabs(body.gap(surface) - value) < 1e-6)
+            return false;
+        body.setGap(surface, value);
+        return true;
+    }
+};
+} // namespace Lens
+
+#endif
@@ -0,0 +1,182 @@
+/*
+ * dual
+ * forward-mode automatic differentiation with N derivative lanes.
+ * copyright(c) 2018 Hajime UCHIMURA.
+ */
+
+#ifndef __DUAL_H
+#define __DUAL_H
+
+#include <math.h>
+
+namespace DUAL
+{
+template <typename T, int N>
+class Dual
+{
+  public:
+    typedef Dual<T, N> self;
+    static constexpr int LANES = N;
+
+    T v_;    // 値.
+    T d_[N]; // 各レーンの偏微分.
+
+    Dual() { ; }
+    Dual(T v) : v_(v)
+    {
+        for (int i = 0; i < N; i++)
+            d_[i] = T(0);
+    }
+    // lane番目の変数として初期化する.
+    Dual(T v, int lane) : v_(v)
+    {
+        for (int i = 0; i < N; i++)
+            d_[i] = (i == lane) ? T(1) : T(0);
+    }
+
+    inline self operator-() const
+    {
+        self r;
+        r.v_ = -v_;
+        for (int i = 0; i < N; i++)
+            r.d_[i] = -d_[i];
+        return r;
+    }
+
+    inline self operator+(const self &b) const
+    {
+        self r;
+        r.v_ = v_ + b.v_;
+        for (int i = 0; i < N; i++)
+            r.d_[i] = d_[i] + b.d_[i];
+        return r;
+    }
+    inline self operator-(const self &b) const
+    {
+        self r;
+        r.v_ = v_ - b.v_;
+        for (int i = 0; i < N; i++)
+            r.d_[i] = d_[i] - b.d_[i];
+        return r;
+    }
+    inline self operator*(const self &b) const
+    {
+        self r;
+        r.v_ = v_ * b.v_;
+        for (int i = 0; i < N; i++)
+            r.d_[i] = d_[i] * b.v_ + v_ * b.d_[i];
+        return r;
+    }
+    inline self operator/(const self &b) const
+    {
+        const T inv = T(1) / b.v_;
+        self    r;
+        r.v_ = v_ * inv;
+        for (int i = 0; i < N; i++)
+            r.d_[i] = (d_[i] - r.v_ * b.d_[i]) * inv;
+        return r;
+    }
+
+    inline self operator+(T b) const
+    {
+        self r = *this;
+        r.v_ += b;
+        return r;
+    }
+    inline self operator-(T b) const
+    {
+        self r = *this;
+        r.v_ -= b;
+        return r;
+    }
+    inline self operator*(T b) const
+    {
+        self r;
+        r.v_ = v_ * b;
+        for (int i = 0; i < N; i++)
+            r.d_[i] = d_[i] * b;
+        return r;
+    }
+    inline self operator/(T b) const { return *this * (T(1) / b); }
+
+    inline self &operator+=(const self &b) { return *this = *this + b; }
+    inline self &operator-=(const self &b) { return *this = *this - b; }
+    inline self &operator*=(const self &b) { return *this = *this * b; }
+    inline self &operator/=(const self &b) { return *this = *this / b; }
+
+    // 比較は値のみ.
+    inline bool operator<(const self &b) const { return v_ < b.v_; }
+    inline bool operator>(const self &b) const { return v_ > b.v_; }
+    inline bool operator<=(const self &b) const { return v_ <= b.v_; }
+    inline bool operator>=(const self &b) const { return v_ >= b.v_; }
+    inline bool operator==(const self &b) const { return v_ == b.v_; }
+    inline bool operator!=(const self &b) const { return v_ != b.v_; }
+    inline bool operator<(T b) const { return v_ < b; }
+    inline bool operator>(T b) const { return v_ > b; }
+    inline bool operator<=(T b) const { return v_ <= b; }
+    inline bool operator>=(T b) const { return v_ >= b; }
+    inline bool operator==(T b) const { return v_ == b; }
+    inline bool operator!=(T b) const { return v_ != b; }
+};
+
+template <typename T, int N>
+inline Dual<T, N> operator+(T a, const Dual<T, N> &b) { return b + a; }
+template <typename T, int N>
+inline Dual<T, N> operator-(T a, const Dual<T, N> &b) { return -b + a; }
+template <typename T, int N>
+inline Dual<T, N> operator*(T a, const Dual<T, N> &b) { return b * a; }
+template <typename T, int N>
+inline Dual<T, N> operator/(T a, const Dual<T, N> &b) { return Dual<T, N>(a) / b; }
+template <typename T, int N>
+inline bool operator<(T a, const Dual<T, N> &b) { return a < b.v_; }
+template <typename T, int N>
+inline bool operator>(T a, const Dual<T, N> &b) { return a > b.v_; }
+
+// 値だけを取り出す. doubleはLens側の同名関数で受ける.
+template <typename T, int N>
+inline T primal(const Dual<T, N> &a) { return a.v_; }
+
+// f(a)の値fvと微分dfから結果を作る.
+template <typename T, int N>
+inline Dual<T, N> chain(const Dual<T, N> &a, T fv, T df)
+{
+    Dual<T, N> r;
+    r.v_ = fv;
+    for (int i = 0; i < N; i++)
+        r.d_[i] = a.d_[i] * df;
+    return r;
+}
+
+template <typename T, int N>
+inline Dual<T, N> sqrt(const Dual<T, N> &a)
+{
+    const T s = ::sqrt(a.v_);
+    return chain(a, s, (s > T(0)) ? T(0.5) / s : T(0));
+}
+template <typename T, int N>
+inline Dual<T, N> fabs(const Dual<T, N> &a) { return (a.v_ < T(0)) ? -a : a; }
+template <typename T, int N>
+inline Dual<T, N> pow(const Dual<T, N> &a, T b) { return chain(a, (T)::pow(a.v_, b), b * (T)::pow(a.v_, b - T(1))); }
+template <typename T, int N>
+inline Dual<T, N> sin(const Dual<T, N> &a) { return chain(a, (T)::sin(a.v_), (T)::cos(a.v_)); }
+template <typename T, int N>
+inline Dual<T, N> cos(const Dual<T, N> &a) { return chain(a, (T)::cos(a.v_), -(T)::sin(a.v_)); }
+template <typename T, int N>
+inline Dual<T, N> tan(const Dual<T, N> &a)
+{
+    const T t = ::tan(a.v_);
+    return chain(a, t, T(1) + t * t);
+}
+template <typename T, int N>
+inline Dual<T, N> atan(const Dual<T, N> &a) { return chain(a, (T)::atan(a.v_), T(1) / (T(1) + a.v_ * a.v_)); }
+template <typename T, int N>
+inline Dual<T, N> exp(const Dual<T, N> &a)
+{
+    const T e = ::exp(a.v_);
+    return chain(a, e, e);
+}
+template <typename T, int N>
+inline Dual<T, N> log(const Dual<T, N> &a) { return chain(a, (T)::log(a.v_), T(1) / a.v_); }
+} // namespace DUAL
+
+#endif
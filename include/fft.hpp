@@ -0,0 +1,175 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+#ifndef __FFT_H
+#define __FFT_H
+
+#include <assert.h>
+#include <math.h>
+#include <stddef.h>
+
+#include <algorithm>
+#include <complex>
+#include <vector>
+
+#include <parallel.hpp>
+
+namespace FFT
+{
+typedef std::complex<double> Complex;
+
+inline bool isPowerOf2(size_t n) { return n && !(n & (n - 1)); }
+
+inline size_t nextPowerOf2(size_t n)
+{
+    size_t p = 1;
+    while (p < n)
+        p <<= 1;
+    return p;
+}
+
+// 1D in-place FFT. bit-reverse + radix-2 stage (if log2(n) is odd) + fused radix-4 stages.
+class Plan
+{
+  public:
+    size_t               n_;
+    std::vector<size_t>  reverse_;
+    std::vector<Complex> twiddle_; // exp(-2 pi i k / n), k < n/2
+
+    Plan(size_t n = 1) { setup(n); }
+
+    void setup(size_t n)
+    {
+        assert(isPowerOf2(n));
+        n_ = n;
+
+        int bits = 0;
+        while (((size_t)1 << bits) < n)
+            bits++;
+        reverse_.resize(n);
+        for (size_t i = 0; i < n; i++)
+        {
+            size_t r = 0;
+            for (int b = 0; b < bits; b++)
+                r |= ((i >> b) & 1) << (bits - 1 - b);
+            reverse_[i] = r;
+        }
+
+        twiddle_.resize(std::max<size_t>(1, n / 2));
+        for (size_t k = 0; k < twiddle_.size(); k++)
+            twiddle_[k] = std::polar(1., -2. * M_PI * (double)k / (double)n);
+    }
+
+    void transform(Complex *a, bool inverse = false) const
+    {
+        const size_t n = n_;
+        for (size_t i = 0; i < n; i++)
+            if (i < reverse_[i])
+                std::swap(a[i], a[reverse_[i]]);
+
+        size_t h = 1;
+        int    log2n = 0;
+        while (((size_t)1 << log2n) < n)
+            log2n++;
+
+        if (log2n & 1)
+        {
+            // radix-2 (twiddle is 1).
+            for (size_t k = 0; k < n; k += 2)
+            {
+                const Complex u = a[k];
+                const Complex v = a[k + 1];
+                a[k]            = u + v;
+                a[k + 1]        = u - v;
+            }
+            h = 2;
+        }
+
+        // stage h と 2h をまとめて radix-4 で処理する.
+        const Complex rot = inverse ? Complex(0., 1.) : Complex(0., -1.);
+        for (; h * 4 <= n; h *= 4)
+        {
+            const size_t strideA = n / (2 * h);
+            const size_t strideB = n / (4 * h);
+            for (size_t k = 0; k < n; k += 4 * h)
+            {
+                for (size_t j = 0; j < h; j++)
+                {
+                    Complex wa = twiddle_[j * strideA];
+                    Complex wb = twiddle_[j * strideB];
+                    if (inverse)
+                    {
+                        wa = std::conj(wa);
+                        wb = std::conj(wb);
+                    }
+                    Complex *p  = a + k + j;
+                    const Complex a1 = wa * p[h];
+                    const Complex a3 = wa * p[3 * h];
+                    const Complex b0 = p[0] + a1;
+                    const Complex b1 = p[0] - a1;
+                    const Complex b2 = wb * (p[2 * h] + a3);
+                    const Complex b3 = wb * rot * (p[2 * h] - a3);
+                    p[0]             = b0 + b2;
+                    p[2 * h]         = b0 - b2;
+                    p[h]             = b1 + b3;
+                    p[3 * h]         = b1 - b3;
+                }
+            }
+        }
+
+        if (inverse)
+        {
+            const double s = 1. / (double)n;
+            for (size_t i = 0; i < n; i++)
+                a[i] *= s;
+        }
+    }
+};
+
+// ブロック転置. src(w x h) -> dst(h x w).
+inline void transpose(const Complex *src, Complex *dst, size_t w, size_t h, size_t threads = 0)
+{
+    constexpr size_t B      = 32;
+    const size_t     blocks = (h + B - 1) / B;
+    PARALLEL::parallelFor(blocks, [&](size_t by) {
+        const size_t y0 = by * B;
+        const size_t y1 = std::min(h, y0 + B);
+        for (size_t x0 = 0; x0 < w; x0 += B)
+        {
+            const size_t x1 = std::min(w, x0 + B);
+            for (size_t y = y0; y < y1; y++)
+                for (size_t x = x0; x < x1; x++)
+                    dst[x * h + y] = src[y * w + x];
+        }
+    },
+        threads);
+}
+
+// 2D FFT (row-major, w x h, 両方2のべき乗). 行FFT -> 転置 -> 行FFT -> 転置.
+inline void transform2D(std::vector<Complex> &data, size_t w, size_t h, bool inverse = false, size_t threads = 0)
+{
+    assert(data.size() == w * h);
+    std::vector<Complex> tmp(w * h);
+
+    const auto rows = [&](Complex *buf, size_t len, size_t count) {
+        const Plan plan(len);
+        PARALLEL::parallelFor(count, [&](size_t y) { plan.transform(buf + y * len, inverse); }, threads);
+    };
+
+    rows(data.data(), w, h);
+    transpose(data.data(), tmp.data(), w, h, threads);
+    rows(tmp.data(), h, w);
+    transpose(tmp.data(), data.data(), h, w, threads);
+}
+
+// 象限入れ替え. 直流成分を中心へ.
+template <typename T>
+void shift2D(std::vector<T> &data, size_t w, size_t h)
+{
+    std::vector<T> tmp(data.size());
+    for (size_t y = 0; y < h; y++)
+        for (size_t x = 0; x < w; x++)
+            tmp[((y + h / 2) % h) * w + (x + w / 2) % w] = data[y * w + x];
+    data.swap(tmp);
+}
+} // namespace FFT
+
+#endif
@@ -0,0 +1,193 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+#ifndef __IRIS_H
+#define __IRIS_H
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+
+namespace Lens
+{
+// 絞り羽根が作る開口. blades_ 枚の正多角形で, 羽根の縁は直線か円弧.
+// 外接円半径1の単位座標で持ち, 絞り径 x irisScale_ は点の側を割って合わせる. irisScale_ を変えても作り直しは要らない.
+// blades_ が0なら円で, 面は今までどおりの円の判定を使う.
+class Iris
+{
+  public:
+    static constexpr int MAX_BLADES = 16;
+    static constexpr int TABLE      = 64; // 曲線羽根のサンプリング表の刻み.
+
+    int    blades_;    // 羽根の枚数. 0で円, 3..MAX_BLADES.
+    double curvature_; // 羽根の縁の曲率(外接円半径で正規化). 0で直線, 1で円.
+    double rotation_;  // 向き[度]. 0で頂点が+x.
+
+    Iris() : blades_(0), curvature_(0.), rotation_(0.) { setup(); }
+
+    // 縁の式を作る. 羽根の枚数/曲率/向きを変えたら呼ぶ.
+    // 辺kの内側は quad_ (x^2+y^2) + bx_[k] x + by_[k] y + c_[k] <= 0.
+    //   直線: quad_=0, (bx, by) が外向き法線, c = -内接円半径.
+    //   円弧: quad_=1, 円の中心 q に対して (bx, by) = -2q, c = |q|^2 - R^2.
+    // 使わない辺は x^2+y^2 <= 1 (直線なら常に真) で埋め, 羽根の枚数によらず同じ長さの分岐の無いループにする.
+    void setup(void)
+    {
+        blades_ = (blades_ <= 0) ? 0 : std::min(std::max(blades_, 3), (int)MAX_BLADES);
+        const double k = std::min(std::max(curvature_, 0.), 1.);
+        quad_          = (blades_ == 0 || k > 0.) ? 1. : 0.;
+        for (int i = 0; i < MAX_BLADES; i++)
+        {
+            bx_[i] = 0.;
+            by_[i] = 0.;
+            c_[i]  = -1.;
+        }
+        const int    n = std::max(blades_, 3);
+        const double h = sin(M_PI / n); // 辺の半分.
+        apothem_       = cos(M_PI / n);
+        radius_        = (k > 0.) ? 1. / k : 0.;
+        offset_        = (k > 0.) ? apothem_ - sqrt(radius_ * radius_ - h * h) : 0.; // 円弧の中心の, 原点からの距離(内向きが負).
+        for (int i = 0; i < blades_; i++)
+        {
+            const double a  = edgeAngle(i);
+            const double nx = cos(a), ny = sin(a);
+            if (k > 0.)
+            {
+                bx_[i] = -2. * nx * offset_;
+                by_[i] = -2. * ny * offset_;
+                c_[i]  = offset_ * offset_ - radius_ * radius_;
+            }
+            else
+            {
+                bx_[i] = nx;
+                by_[i] = ny;
+                c_[i]  = -apothem_;
+            }
+        }
+
+        // 曲線羽根は, 1つの扇形(頂点0から頂点1)の中の面積の累積を角度で表にしておく.
+        area_ = (blades_ == 0) ? M_PI : 0.5 * n * sin(2. * M_PI / n);
+        if (blades_ && k > 0.)
+        {
+            const double beta = asin(h / radius_);
+            area_ += n * radius_ * radius_ * (beta - sin(beta) * cos(beta));
+
+            constexpr int SUB = 8;
+            const double  w   = 2. * M_PI / n / (TABLE * SUB);
+            cdf_[0]           = 0.;
+            for (int j = 0; j < TABLE; j++)
+            {
+                double s = 0.;
+                for (int m = 0; m < SUB; m++)
+                {
+                    const double r = boundary(((double)(j * SUB + m) + 0.5) * w);
+                    s += 0.5 * r * r * w;
+                }
+                cdf_[j + 1] = cdf_[j] + s;
+            }
+            for (int j = 1; j <= TABLE; j++)
+                cdf_[j] /= cdf_[TABLE];
+        }
+    }
+
+    // 単位座標の点(x, y)が開口の中か.
+    bool inside(double x, double y) const
+    {
+        const double q = quad_ * (x * x + y * y);
+        double       m = -INFINITY;
+        for (int i = 0; i < MAX_BLADES; i++)
+            m = std::max(m, q + bx_[i] * x + by_[i] * y + c_[i]);
+        return m <= 0.;
+    }
+
+    // 光線束の判定. 点は (x[i] * sx, y[i] * sy) を単位座標とする. alive を落とし, 落とした数を返す.
+    // 光線の方向に並べたループで, 羽根のループは固定長なのでコンパイラがベクトル化できる.
+    size_t clip(const double *x, const double *y, size_t n, double sx, double sy, uint8_t *alive) const
+    {
+        size_t clipped = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            const double px = x[i] * sx, py = y[i] * sy;
+            const double q  = quad_ * (px * px + py * py);
+            double       m  = -INFINITY;
+            for (int k = 0; k < MAX_BLADES; k++)
+                m = std::max(m, q + bx_[k] * px + by_[k] * py + c_[k]);
+            const bool in = m <= 0.;
+            clipped += (alive[i] && !in);
+            alive[i] = alive[i] && in;
+        }
+        return clipped;
+    }
+
+    // 単位座標での面積.
+    double area(void) const { return area_; }
+
+    // [0,1)^2 -> 開口内の一様な点. uで扇形を選び, 扇形の中は面積が一様になるよう写す.
+    void sample(double u, double v, double &x, double &y) const
+    {
+        if (blades_ == 0)
+        {
+            // 円は同心写像(Pupil::concentric と同じ).
+            const double a = 2. * u - 1., b = 2. * v - 1.;
+            double       r = 0., phi = 0.;
+            if (a * a > b * b)
+            {
+                r   = a;
+                phi = (M_PI / 4.) * (b / a);
+            }
+            else if (b != 0.)
+            {
+                r   = b;
+                phi = (M_PI / 2.) - (M_PI / 4.) * (a / b);
+            }
+            x = r * cos(phi);
+            y = r * sin(phi);
+            return;
+        }
+
+        const double su = u * blades_;
+        const int    k  = std::min((int)su, blades_ - 1);
+        const double f  = su - k;
+        const double a0 = vertexAngle(k);
+        if (radius_ == 0.)
+        {
+            // 直線: 原点と2頂点の三角形.
+            const double a1 = vertexAngle(k + 1);
+            const double s  = sqrt(f);
+            x               = s * ((1. - v) * cos(a0) + v * cos(a1));
+            y               = s * ((1. - v) * sin(a0) + v * sin(a1));
+            return;
+        }
+
+        // 円弧: 表から扇形内の角度を引き, 半径は境界までの sqrt 分布.
+        const double *hi  = std::upper_bound(cdf_, cdf_ + TABLE + 1, f);
+        const int     j   = std::min(std::max((int)(hi - cdf_) - 1, 0), TABLE - 1);
+        const double  den = cdf_[j + 1] - cdf_[j];
+        const double  t   = (j + ((den > 0.) ? (f - cdf_[j]) / den : 0.)) * (2. * M_PI / blades_) / TABLE;
+        const double  r   = boundary(t) * sqrt(v);
+        x                 = r * cos(a0 + t);
+        y                 = r * sin(a0 + t);
+    }
+
+  private:
+    double vertexAngle(int i) const { return rotation_ * (M_PI / 180.) + 2. * M_PI * i / std::max(blades_, 3); }
+    double edgeAngle(int i) const { return vertexAngle(i) + M_PI / std::max(blades_, 3); }
+
+    // 扇形0の中, 頂点0から角度tの方向の境界までの距離.
+    double boundary(double t) const
+    {
+        const double c = cos(t - M_PI / std::max(blades_, 3)); // 辺0の法線との角.
+        if (radius_ == 0.)
+            return apothem_ / c;
+        const double uc = offset_ * c;
+        return uc + sqrt(std::max(0., uc * uc - offset_ * offset_ + radius_ * radius_));
+    }
+
+    double quad_;
+    double bx_[MAX_BLADES], by_[MAX_BLADES], c_[MAX_BLADES];
+    double apothem_, radius_, offset_;
+    double area_;
+    double cdf_[TABLE + 1];
+};
+} // namespace Lens
+
+#endif
@@ -1,43 +1,69 @@
 ﻿// copyright(c) 2018 Hajime UCHIMURA / nikq
+#ifndef __LENS_H
+#define __LENS_H
 
 #define _USE_MATH_DEFINES
 #include <math.h>
 #undef _USE_MATH_DEFINES
 
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <wchar.h>
 
+#include <algorithm>
+#include <charconv>
+#include <memory>
+#include <string>
+#include <string_view>
 #include <vector>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <coating.hpp>
 #include <floatcanvas.hpp>
+#include <iris.hpp>
+#include <tracestats.hpp>
 #include <vectormath.hpp>
 
 namespace Lens
 {
 typedef VECTORMATH::Vector3<double> Vector;
 
-inline Vector reflect(const Vector &I, const Vector &N)
+// スカラー型の値部分. Dual側はDUAL::primal.
+inline double primal(double v) { return v; }
+
+template <typename T>
+inline VECTORMATH::Vector3<T> reflect(const VECTORMATH::Vector3<T> &I, const VECTORMATH::Vector3<T> &N)
 {
     return I - N * 2. * N.dot(I);
 }
 
-bool refract(const Vector &I, Vector &N, double eta, Vector &result)
+template <typename T>
+inline bool refract(const VECTORMATH::Vector3<T> &I, VECTORMATH::Vector3<T> &N, T eta, VECTORMATH::Vector3<T> &result)
 {
     if (I.dot(N) > 0.)
         N = N * -1.;
-    double cosi  = -I.dot(N); // dot(-i, n);
-    double cost2 = 1.0 - eta * eta * (1.0 - cosi * cosi);
+    T cosi  = -I.dot(N); // dot(-i, n);
+    T cost2 = 1.0 - eta * eta * (1.0 - cosi * cosi);
     if (cost2 < 0.)
+    {
+        DOMIPLAN_STATS(tir_++);
         return false; // 全反射.
+    }
     result = I * eta + (N * (eta * cosi - sqrt(cost2)));
     return true;
 }
 
 // coat_thickness must be in nm.
 // lambda is in nm.
-double single_coat_reflectance(double lambda, double ior_in, double coat_ior, double coat_thickness, const Vector &dir, const Vector &norm)
+inline double single_coat_reflectance(double lambda, double ior_in, double coat_ior, double coat_thickness, const Vector &dir, const Vector &norm)
 {
     double cosTheta1     = dir.dot(norm);
     double cosTheta2     = (ior_in / coat_ior) * sqrt((coat_ior * coat_ior) / (ior_in * ior_in) - (1. - cosTheta1 * cosTheta1));
@@ -46,7 +72,19 @@ double single_coat_reflectance(double lambda, double ior_in, double coat_ior, do
     return cos(m * M_PI);                                        // 0.5のとき0になるような値.
 }
 
-class Surface
+namespace Polarization
+{
+    // 偏光を追わない. ACTIVE=falseなので追跡ループからは何も呼ばれない.
+    struct None
+    {
+        static constexpr bool ACTIVE = false;
+
+        template <typename S, typename V>
+        void interact(const S &, double, double, double, const V &, const V &, const V &) { ; }
+    };
+} // namespace Polarization
+
+class SurfaceBase
 {
   public:
     typedef enum
@@ -54,41 +92,102 @@ class Surface
         NONE,       // 空間.
         STANDARD,   // 球面レンズ
         EVENASPH,   // 偶数次非球面,
-        CYLINDER_X, // シリンドリカルレンズX.
-        CYLINDER_Y, // シリンドリカルレンズY. anamo.
-        CYLINDER_Z, // シリンドリカルレンズZ.
+        CYLINDER_X, // シリンドリカルレンズX. 円柱の軸がX, 曲率はyだけ.
+        CYLINDER_Y, // シリンドリカルレンズY. anamo. 円柱の軸がY, 曲率はxだけ.
+        CYLINDER_Z, // シリンドリカルレンズZ. 軸が光軸と平行なので面としては平面扱い.
     } TYPE;
 
     static constexpr int N_Aspherical = 8;
+};
+
+// Tはdoubleの他, 自動微分用のDUAL::Dualでも使う.
+template <typename T>
+class BasicSurface : public SurfaceBase
+{
+  public:
+    typedef VECTORMATH::Vector3<T> Vec;
 
     TYPE   type_;
-    double center_;                   // 球の中心
-    double curve_;                    // 曲率
-    double curve2_;                   // 曲率^2
-    double radius_;                   // 球の半径
-    double radius2_;                  // 球の半径^2
-    double diameter_;                 // レンズ半径
-    double diam2_;                    // レンズ半径^2
-    double thickness_;                // 次の面までの距離.
+    T      center_;                   // 球の中心
+    T      curve_;                    // 曲率
+    T      curve2_;                   // 曲率^2
+    T      radius_;                   // 球の半径
+    T      radius2_;                  // 球の半径^2
+    T      diameter_;                 // レンズ半径
+    T      diam2_;                    // レンズ半径^2
+    T      thickness_;                // 次の面までの距離.
     double irisX_;                    //絞りサイズ
     double irisY_;                    // 円絞り楕円率.
-    double ior_;                      // 媒体屈折率
-    double abbeVd_;                   // d線あっべすう
+    Iris   iris_;                     // 絞り羽根の形. 既定は円.
+    T      ior_;                      // 媒体屈折率
+    T      abbeVd_;                   // d線あっべすう
     double reflection_;               // 反射率.
-    double conic_;                    // コーニック係数
-    double aspherical_[N_Aspherical]; // 非球面パラメータ
+    T      conic_;                    // コーニック係数
+    T      aspherical_[N_Aspherical]; // 非球面パラメータ
 
     bool   isCoated_;
     bool   isStop_;
-    double coatThickness_; // 275nm = 550nmの半波長.
+    double coatThickness_; // 物理膜厚[nm]. 既定は550nmの1/4波長膜.
     double coatIor_;       // MgF2で1.38
     double roughness_;
 
-    Surface()
+    Coating                               coating_;      // 多層膜. 空でisCoated_なら coatIor_/coatThickness_ の単層.
+    std::shared_ptr<const Coating::Table> coatingTable_; // (入射角, 波長)の反射率表. Body::setup()で作る.
+
+    // 面の姿勢. 頂点まわりに偏心してから X->Y->Z の順に傾ける.
+    double decenterX_, decenterY_; // [mm]
+    double tiltX_, tiltY_, tiltZ_; // [度]
+    bool   hasPose_;               // 偏心/傾きがあるときだけ座標変換する.
+    double rotation_[9];           // ローカル->ワールドの回転. setup()で作る.
+
+    double sagMin_, sagMax_; // 有効径内のsagの範囲. setup()で作る.
+
+    BasicSurface()
     {
         init();
     }
 
+    // 別のスカラー型の面から作る. 自動微分用に double -> Dual で使う.
+    template <typename U>
+    explicit BasicSurface(const BasicSurface<U> &s)
+    {
+        type_       = s.type_;
+        center_     = T(s.center_);
+        curve_      = T(s.curve_);
+        curve2_     = T(s.curve2_);
+        radius_     = T(s.radius_);
+        radius2_    = T(s.radius2_);
+        diameter_   = T(s.diameter_);
+        diam2_      = T(s.diam2_);
+        thickness_  = T(s.thickness_);
+        irisX_      = s.irisX_;
+        irisY_      = s.irisY_;
+        iris_       = s.iris_;
+        ior_        = T(s.ior_);
+        abbeVd_     = T(s.abbeVd_);
+        reflection_ = s.reflection_;
+        conic_      = T(s.conic_);
+        for (int i = 0; i < N_Aspherical; i++)
+            aspherical_[i] = T(s.aspherical_[i]);
+        isCoated_      = s.isCoated_;
+        isStop_        = s.isStop_;
+        coatThickness_ = s.coatThickness_;
+        coatIor_       = s.coatIor_;
+        roughness_     = s.roughness_;
+        coating_       = s.coating_;
+        coatingTable_  = s.coatingTable_;
+        decenterX_     = s.decenterX_;
+        decenterY_     = s.decenterY_;
+        tiltX_         = s.tiltX_;
+        tiltY_         = s.tiltY_;
+        tiltZ_         = s.tiltZ_;
+        hasPose_       = s.hasPose_;
+        for (int i = 0; i < 9; i++)
+            rotation_[i] = s.rotation_[i];
+        sagMin_ = s.sagMin_;
+        sagMax_ = s.sagMax_;
+    }
+
     void init()
     {
         type_       = NONE;
@@ -99,13 +198,33 @@ class Surface
         diam2_      = 0.;
         irisX_      = 1.;
         irisY_      = 1.;
+        iris_       = Iris();
         thickness_  = 0.;
         roughness_  = 0.; // 面の荒れ.
         ior_        = 1.; // at D light.
         abbeVd_     = 1.; // at D light.
         reflection_ = 0.1;
         isCoated_   = false;
+        isStop_     = false;
         conic_      = 0.;
+        curve_      = 0.;
+        curve2_     = 0.;
+        for (int i = 0; i < N_Aspherical; i++)
+            aspherical_[i] = 0.;
+        coatThickness_ = 550. / (4. * 1.38);
+        coatIor_       = 1.38;
+        coating_.layers_.clear();
+        coatingTable_.reset();
+        decenterX_ = 0.;
+        decenterY_ = 0.;
+        tiltX_     = 0.;
+        tiltY_     = 0.;
+        tiltZ_     = 0.;
+        hasPose_   = false;
+        for (int i = 0; i < 9; i++)
+            rotation_[i] = (i % 4 == 0) ? 1. : 0.;
+        sagMin_ = 0.;
+        sagMax_ = 0.;
     }
 
     void setup()
@@ -113,54 +232,245 @@ class Surface
         radius2_ = radius_ * radius_;
         diam2_   = diameter_ * diameter_;
         curve2_  = curve_ * curve_;
+        iris_.setup();
+        setupPose();
+        setupBounds();
+    }
+
+    // 有効径内のsagの範囲を半径方向のサンプルで求める. 非球面は単調とは限らないので端点だけでは足りない.
+    void setupBounds()
+    {
+        constexpr int N = 64;
+        const double  d = primal(diameter_);
+        sagMin_         = 0.;
+        sagMax_         = 0.;
+        for (int i = 1; i <= N; i++)
+        {
+            const double r = d * (double)i / (double)N;
+            for (const double z : {sag(r, 0.), sag(0., r)})
+            {
+                if (z != z)
+                    continue;
+                sagMin_ = std::min(sagMin_, z);
+                sagMax_ = std::max(sagMax_, z);
+            }
+        }
+        // サンプル間の取りこぼし分の余裕.
+        const double margin = (sagMax_ - sagMin_) * 0.02 + 1e-6;
+        sagMin_ -= margin;
+        sagMax_ += margin;
+    }
+
+    // 頂点平面上の点localから方向dirの光線が, 有効径の円柱とsagのスラブの共通部分を通りうるか.
+    bool mayHit(const Vec &local, const Vec &dir) const
+    {
+        const double ox = primal(local.x), oy = primal(local.y);
+        const double dx = primal(dir.x), dy = primal(dir.y), dz = primal(dir.z);
+        const double t0 = sagMin_ / dz, t1 = sagMax_ / dz;
+        const double dd = dx * dx + dy * dy;
+        double       t  = (dd > 0.) ? -(ox * dx + oy * dy) / dd : t0;
+        t               = std::min(std::max(t, t0), t1);
+        const double x  = ox + dx * t;
+        const double y  = oy + dy * t;
+        return x * x + y * y <= primal(diam2_);
+    }
+
+    // Rx * Ry * Rz を作っておく.
+    void setupPose()
+    {
+        hasPose_ = decenterX_ != 0. || decenterY_ != 0. || tiltX_ != 0. || tiltY_ != 0. || tiltZ_ != 0.;
+
+        const double d2r = M_PI / 180.;
+        const double cx  = cos(tiltX_ * d2r), sx = sin(tiltX_ * d2r);
+        const double cy  = cos(tiltY_ * d2r), sy = sin(tiltY_ * d2r);
+        const double cz  = cos(tiltZ_ * d2r), sz = sin(tiltZ_ * d2r);
+
+        rotation_[0] = cy * cz;
+        rotation_[1] = -cy * sz;
+        rotation_[2] = sy;
+        rotation_[3] = sx * sy * cz + cx * sz;
+        rotation_[4] = -sx * sy * sz + cx * cz;
+        rotation_[5] = -sx * cy;
+        rotation_[6] = -cx * sy * cz + sx * sz;
+        rotation_[7] = cx * sy * sz + sx * cz;
+        rotation_[8] = cx * cy;
     }
 
-    double ior(double lambda) const
+    // ワールドの点をローカルへ. ローカルは頂点を(0,0,vertex())に置いたまま回転だけ外した座標.
+    Vec toLocal(const Vec &v) const
+    {
+        const T   vz = vertex();
+        const Vec p  = Vec(v.x - decenterX_, v.y - decenterY_, v.z - vz);
+        return Vec(
+            p.x * rotation_[0] + p.y * rotation_[3] + p.z * rotation_[6],
+            p.x * rotation_[1] + p.y * rotation_[4] + p.z * rotation_[7],
+            p.x * rotation_[2] + p.y * rotation_[5] + p.z * rotation_[8] + vz);
+    }
+    Vec toWorld(const Vec &v) const
+    {
+        const T   vz = vertex();
+        const Vec p  = Vec(v.x, v.y, v.z - vz);
+        return Vec(
+            p.x * rotation_[0] + p.y * rotation_[1] + p.z * rotation_[2] + decenterX_,
+            p.x * rotation_[3] + p.y * rotation_[4] + p.z * rotation_[5] + decenterY_,
+            p.x * rotation_[6] + p.y * rotation_[7] + p.z * rotation_[8] + vz);
+    }
+    Vec directionToLocal(const Vec &d) const
+    {
+        return Vec(
+            d.x * rotation_[0] + d.y * rotation_[3] + d.z * rotation_[6],
+            d.x * rotation_[1] + d.y * rotation_[4] + d.z * rotation_[7],
+            d.x * rotation_[2] + d.y * rotation_[5] + d.z * rotation_[8]);
+    }
+    Vec directionToWorld(const Vec &d) const
+    {
+        return Vec(
+            d.x * rotation_[0] + d.y * rotation_[1] + d.z * rotation_[2],
+            d.x * rotation_[3] + d.y * rotation_[4] + d.z * rotation_[5],
+            d.x * rotation_[6] + d.y * rotation_[7] + d.z * rotation_[8]);
+    }
+
+    // 面頂点のz位置.
+    T vertex() const { return center_ - radius_; }
+
+    // 頂点位置を保ったまま曲率を変える.
+    void setCurve(T curve)
+    {
+        const T v = vertex();
+        curve_    = curve;
+        radius_   = (curve != 0.) ? T(1. / curve) : T(0.);
+        center_   = v + radius_;
+        setup();
+    }
+
+    // 絞りの内側か. (x,y)は光軸からの位置.
+    bool insideStop(double x, double y, double irisScale) const
+    {
+        if (!isStop_)
+            return true;
+        const double sx = x / irisX_;
+        const double sy = y / irisY_;
+        const double r  = primal(diameter_) * irisScale;
+        if (iris_.blades_ == 0 || r <= 0.)
+            return sx * sx + sy * sy <= r * r;
+        return iris_.inside(sx / r, sy / r);
+    }
+
+    // 光線束の(x[i], y[i])を絞りで切る. alive を落とし, 落とした数を返す.
+    size_t clipStop(const double *x, const double *y, size_t n, double irisScale, uint8_t *alive) const
+    {
+        if (!isStop_)
+            return 0;
+        const double r = primal(diameter_) * irisScale;
+        if (iris_.blades_ && r > 0.)
+            return iris_.clip(x, y, n, 1. / (irisX_ * r), 1. / (irisY_ * r), alive);
+        size_t clipped = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            if (alive[i] && !insideStop(x[i], y[i], irisScale))
+            {
+                clipped++;
+                alive[i] = 0;
+            }
+        }
+        return clipped;
+    }
+
+    T ior(double lambda) const
     {
         // コーシーの式.
-        double B   = (ior_ - 1.) / abbeVd_ * 0.52345;
-        double A   = ior_ - B / 0.34522792;
+        T      B   = (ior_ - 1.) / abbeVd_ * 0.52345;
+        T      A   = ior_ - B / 0.34522792;
         double C   = lambda / 1000.;
-        double ret = A + B / (C * C);
+        T      ret = A + B / (C * C);
         assert(ret == ret);
         return ret;
     }
 
-    double reflection(double lambda, double ior_now, double ior_next, const Vector &dir, const Vector &norm, double &Re, double &Tr)
+    // 実際に使う膜構成.
+    Coating coating() const
+    {
+        if (!coating_.layers_.empty() || !isCoated_)
+            return coating_;
+        Coating single;
+        single.layers_.push_back(Coating::Layer(coatIor_, coatThickness_)); // シングルコート.
+        return single;
+    }
+
+    // 手前の面beforeとの間の媒質から反射率表を作る. 条件が変わっていなければ今の表を使い続ける.
+    void setupCoating(const BasicSurface *before)
+    {
+        const Coating       c   = coating();
+        std::vector<double> key = {before ? primal(before->ior_) : 1., before ? primal(before->abbeVd_) : 0., primal(ior_), primal(abbeVd_)};
+        for (const Coating::Layer &l : c.layers_)
+        {
+            key.push_back(l.ior_);
+            key.push_back(l.thickness_);
+        }
+        if (coatingTable_ && coatingTable_->key_ == key)
+            return;
+
+        std::shared_ptr<Coating::Table> table = std::make_shared<Coating::Table>();
+        table->key_                           = key;
+        table->build(c, [before](double lambda) { return before ? primal(before->ior(lambda)) : 1.; }, [this](double lambda) { return primal(ior(lambda)); });
+        coatingTable_ = table;
+    }
+
+    // s/p偏光の反射率. front: 面の手前からの入射. 表が無ければその場で計算する.
+    void reflectance(double lambda, double ior_now, double ior_next, double cosTheta, bool front, double &rs, double &rp) const
     {
-        if (isCoated_) // シングルコート.
-            return single_coat_reflectance(lambda, ior_now, coatIor_, coatThickness_, dir, norm);
+        if (coatingTable_)
+        {
+            coatingTable_->lookup(front, cosTheta, lambda, rs, rp);
+            return;
+        }
+        const Coating::Fresnel f = coating().evaluate(ior_now, ior_next, cosTheta, lambda, !front);
+        rs                       = f.rs_;
+        rp                       = f.rp_;
+    }
 
-        // コーティング無し
-        double a  = ior_now - ior_next;
-        double b  = ior_now + ior_next;
-        double R0 = (a * a) / (b * b);
-        double t  = dir.dot(norm);
-        double c  = (t < 0.) ? 1.0 + t : 1.0 - t;
-        //assert( 0. <= c && c <= 1. );
-        Re          = R0 + (1.0 - R0) * pow(c, 5.); // 反射からの寄与.
+    // 偏光を平均した反射率Reと透過率Trを返す. dir.z > 0 なら面の手前から, そうでなければ奥からの入射.
+    double reflection(double lambda, double ior_now, double ior_next, const Vector &dir, const Vector &norm, double &Re, double &Tr) const
+    {
+        double rs, rp;
+        reflectance(lambda, ior_now, ior_next, fabs(dir.dot(norm)), dir.z >= 0., rs, rp);
+        Re          = (rs + rp) * 0.5; // 反射からの寄与.
         double nnt2 = (ior_now / ior_next) * (ior_now / ior_next);
         Tr          = (1. - Re) * nnt2; // 屈折からの寄与.
         return Re;
     }
 
+    bool isCylinder() const { return type_ == CYLINDER_X || type_ == CYLINDER_Y || type_ == CYLINDER_Z; }
+
     // norm : d/dx, d/dy, d/dz
-    const double sag(double x, double y, Vector &norm) const
+    const T sag(T x, T y, Vec &norm) const
     {
-        const double r2 = x * x + y * y;
-        if (r2 > diam2_)
-            return 0.f;
+        const T r2 = x * x + y * y;
+        if (r2 > diam2_ || type_ == CYLINDER_Z)
+        {
+            norm = Vec(0., 0., -1.);
+            return T(0.);
+        }
+        if (type_ == CYLINDER_X || type_ == CYLINDER_Y)
+        {
+            // 一方向だけの二次曲線.
+            const T u = (type_ == CYLINDER_X) ? y : x;
+            const T s = sqrt(1. - (conic_ + 1.) * curve2_ * u * u);
+            const T n = curve_ * u / s;
+            norm      = (type_ == CYLINDER_X) ? Vec(0., n, -1.).normal() : Vec(n, 0., -1.).normal();
+            return (curve_ * u * u) / (1. + s);
+        }
 
         //https://forum.zemax.com/12954/Zemax
         //https://www.desmos.com/calculator/wftkimsvv4 :: normal
 
-        const double     r   = sqrt(r2);
+        const T          r   = sqrt(r2);
         constexpr double eps = 1e-6;
 
-        double rr  = r;
-        double rr2 = r2;
-        double z   = (curve_ * r2) / (1. + sqrt(1. - (conic_ + 1.) * curve2_ * r2));
-        double n   = curve_ * r / sqrt(1. - curve2_ * (1. + conic_) * r2);
+        T rr  = r;
+        T rr2 = r2;
+        T z   = (curve_ * r2) / (1. + sqrt(1. - (conic_ + 1.) * curve2_ * r2));
+        T n   = curve_ * r / sqrt(1. - curve2_ * (1. + conic_) * r2);
         if (type_ == EVENASPH)
         {
             //非球面のときだけ高次もevalする.
@@ -171,42 +481,92 @@ class Surface
                 rr2 *= r2;
             }
         }
-        const double nx = (r < eps) ? 0. : (n * x / r);
-        const double ny = (r < eps) ? 0. : (n * y / r);
+        const T nx = (r < eps) ? T(0.) : T(n * x / r);
+        const T ny = (r < eps) ? T(0.) : T(n * y / r);
 
-        norm = Vector(nx, ny, -1.).normal();
+        norm = Vec(nx, ny, -1.).normal();
         return z;
     }
 
-    const double sag(const Vector &v, Vector &norm) const
+    const T sag(const Vec &v, Vec &norm) const
     {
         return sag(v.x, v.y, norm);
     }
 
+    // 法線不要な場合の高速版. 交差判定のループ用. 値のみで計算する.
+    const double sag(double x, double y) const
+    {
+        const double r2 = x * x + y * y;
+        if (r2 > primal(diam2_) || type_ == CYLINDER_Z)
+            return 0.;
+        if (type_ == CYLINDER_X || type_ == CYLINDER_Y)
+        {
+            const double u = (type_ == CYLINDER_X) ? y : x;
+            const double c = primal(curve_);
+            return (c * u * u) / (1. + sqrt(1. - (primal(conic_) + 1.) * c * c * u * u));
+        }
+
+        const double c = primal(curve_);
+        double       z = (c * r2) / (1. + sqrt(1. - (primal(conic_) + 1.) * primal(curve2_) * r2));
+        if (type_ == EVENASPH)
+        {
+            double rr2 = r2;
+            for (int i = 0; i < N_Aspherical; i++)
+            {
+                z += primal(aspherical_[i]) * rr2;
+                rr2 *= r2;
+            }
+        }
+        return z;
+    }
+
     // 原点はレンズの中心. x=y=sag=0
-    const bool intersect(const Vector &orig, const Vector &dir, double &t, Vector &point, Vector &norm) const
+    // 根の探索は値だけで行い, 最後に T のままニュートン法を1段かけて交点を仕上げる.
+    const bool intersect(const Vec &orig, const Vec &dir, T &t, Vec &point, Vec &norm) const
     {
         constexpr double eps = 1e-6;
 
+        const double ox = primal(orig.x), oy = primal(orig.y), oz = primal(orig.z);
+        const double dx = primal(dir.x), dy = primal(dir.y), dz = primal(dir.z);
+
+        if (isCylinder())
+        {
+            // 円柱面は c(u^2 + (1+k)z^2) - 2z = 0 の二次式なので分岐なしで解ける.
+            // 頂点側の解は c->0 で平面の解 -oz/dz に連続な C/q の方.
+            const bool   useY = type_ == CYLINDER_X;
+            const double c    = (type_ == CYLINDER_Z) ? 0. : primal(curve_);
+            const double k1   = primal(conic_) + 1.;
+            const double ou   = useY ? oy : ox;
+            const double du   = useY ? dy : dx;
+            const double A    = c * (du * du + k1 * dz * dz);
+            const double B    = 2. * (c * (ou * du + k1 * oz * dz) - dz);
+            const double C    = c * (ou * ou + k1 * oz * oz) - 2. * oz;
+            const double D    = B * B - 4. * A * C;
+            const double q    = -0.5 * (B + copysign(sqrt(std::max(D, 0.)), B));
+            if (D < 0. || q == 0.)
+                return false;
+            return hit(orig, dir, C / q, t, point, norm);
+        }
+
         // solve equation:
         // orig.z + dir.z * dist == sag( orig.x + dir.x * dist, orig.y + dir.y * dist) for dist.
+        constexpr int ITERATIONS = 256;
+
         double t0   = 0.;
-        double t1   = radius_;
-        int    iter = 256;
+        double t1   = primal(radius_);
+        int    iter = ITERATIONS;
 
         // initial range
-        Vector n0, n1;
-        double z0 = sag(orig + dir * t0, n0) - (orig.z + dir.z * t0);
-        double z1 = sag(orig + dir * t1, n1) - (orig.z + dir.z * t1);
+        double z0 = sag(ox + dx * t0, oy + dy * t0) - (oz + dz * t0);
+        double z1 = sag(ox + dx * t1, oy + dy * t1) - (oz + dz * t1);
         bool   s0 = signbit(z0);
         bool   s1 = signbit(z1);
 
         if (fabs(z0) < eps)
         {
             // converged.
-            t     = t0;
-            point = Vector(orig.x + dir.x * t, orig.y + dir.y * t, center_ - radius_ + sag(orig + dir * t, norm));
-            return true;
+            DOMIPLAN_STATS(solved(0, true));
+            return hit(orig, dir, t0, t, point, norm);
         }
 
         if (s0 == s1)
@@ -219,15 +579,13 @@ class Surface
         {
             double tm = (t0 + t1) / 2.;
 
-            Vector       nm;
-            const double zm = sag(orig + dir * tm, nm) - (orig.z + dir.z * tm);
+            const double zm = sag(ox + dx * tm, oy + dy * tm) - (oz + dz * tm);
 
             if (fabs(t1 - t0) < eps)
             {
                 // converged.
-                t     = tm;
-                point = Vector(orig.x + dir.x * tm, orig.y + dir.y * tm, center_ - radius_ + sag(orig + dir * tm, norm));
-                return true;
+                DOMIPLAN_STATS(solved(ITERATIONS - iter, true));
+                return hit(orig, dir, tm, t, point, norm);
             }
 
             const bool sm = signbit(zm);
@@ -245,45 +603,293 @@ class Surface
             }
         }
         // not converged.
+        DOMIPLAN_STATS(solved(ITERATIONS, false));
         return false;
     }
+
+    // 収束したtcで交点と法線を求める.
+    // f(t) = sag - z の根をニュートン法で1段進めると, T=Dual のとき t に面パラメータの微分が乗る.
+    const bool hit(const Vec &orig, const Vec &dir, double tc, T &t, Vec &point, Vec &norm) const
+    {
+        t     = T(tc);
+        Vec p = orig + dir * t;
+        T   z = sag(p.x, p.y, norm);
+        T   f = z - p.z;
+        if (fabs(primal(f)) < 1e-4 && fabs(primal(norm.z)) > 1e-12)
+        {
+            const T dfdt = -norm.dot(dir) / norm.z;
+            if (fabs(primal(dfdt)) > 1e-12)
+            {
+                t = t - f / dfdt;
+                p = orig + dir * t;
+                z = sag(p.x, p.y, norm);
+            }
+        }
+        point = Vec(p.x, p.y, center_ - radius_ + z);
+        return true;
+    }
 };
 
+typedef BasicSurface<double> Surface;
 typedef std::vector<Surface> SurfaceSet;
 
-class Body
+template <typename T>
+class BasicBody
 {
   public:
-    SurfaceSet surfaces_;
-    double     imageSurfaceZ_;
-    double     imageSurfaceR_; // 像面高さ.
-    double     irisScale_;
-    double     maxDiameter_; //最大レンズ半径
+    typedef VECTORMATH::Vector3<T> Vec;
+
+    std::vector<BasicSurface<T>> surfaces_;
+    T                            imageSurfaceZ_;
+    double                       imageSurfaceR_; // 像面高さ.
+    double                       irisScale_;
+    T                            maxDiameter_; //最大レンズ半径
+
+    // 変更の通し番号. 反転光学系や近軸行列などのキャッシュが古いかを見る.
+    // revision_ は変更のたび, setupRevision_ は setup() で面そのものが作り直されたときに進む.
+    // 間隔だけが変わったなら revision_ だけが進むので, キャッシュは面の位置だけ直せばよい.
+    uint64_t revision_;
+    uint64_t setupRevision_;
 
-    Body()
+    BasicBody()
     {
         surfaces_.clear();
         imageSurfaceZ_ = 100.;
         imageSurfaceR_ = 100.;
         irisScale_     = 1.;
-        maxDiameter_   = 0.f;
+        maxDiameter_   = 0.;
+        revision_      = 0;
+        setupRevision_ = 0;
     }
 
+    template <typename U>
+    explicit BasicBody(const BasicBody<U> &b)
+    {
+        for (const auto &surf : b.surfaces_)
+            surfaces_.push_back(BasicSurface<T>(surf));
+        imageSurfaceZ_ = T(b.imageSurfaceZ_);
+        imageSurfaceR_ = b.imageSurfaceR_;
+        irisScale_     = b.irisScale_;
+        maxDiameter_   = T(b.maxDiameter_);
+        revision_      = b.revision_;
+        setupRevision_ = b.setupRevision_;
+    }
+
+    // 面を直接書き換えたら呼ぶ.
     void setup(void)
     {
-        for (auto &surf : surfaces_)
+        for (size_t i = 0; i < surfaces_.size(); i++)
         {
+            BasicSurface<T> &surf = surfaces_[i];
             surf.setup();
+            surf.setupCoating(i ? &surfaces_[i - 1] : NULL);
             maxDiameter_ = std::max(maxDiameter_, surf.diameter_);
         }
+        setupRevision_ = ++revision_;
+    }
+
+    // 光軸を反転したBody. 像面側から物体側へ逆向きに追跡するのに使う.
+    // 座標は z' = imageSurfaceZ_ - z で, 元の像面が z'=0 に, 元の第一面頂点が新しい像面になる.
+    // 像空間は空気とみなす.
+    BasicBody reversed(void) const
+    {
+        BasicBody    r;
+        const T      zRef = imageSurfaceZ_;
+        const size_t n    = surfaces_.size();
+        for (size_t k = 0; k < n; k++)
+        {
+            const size_t    i    = n - 1 - k;
+            BasicSurface<T> surf = surfaces_[i];
+            const T         v    = zRef - surfaces_[i].vertex();
+            surf.curve_          = -surf.curve_;
+            surf.radius_         = -surf.radius_;
+            surf.center_         = v + surf.radius_;
+            for (int a = 0; a < BasicSurface<T>::N_Aspherical; a++)
+                surf.aspherical_[a] = -surf.aspherical_[a];
+            // 面の後ろの媒質は元の手前の媒質.
+            surf.ior_       = i ? surfaces_[i - 1].ior_ : T(1.);
+            surf.abbeVd_    = i ? surfaces_[i - 1].abbeVd_ : T(1.);
+            surf.thickness_ = i ? T(surfaces_[i].vertex() - surfaces_[i - 1].vertex()) : T(0.);
+            // z反転で x,y軸まわりの回転は向きが逆になる.
+            surf.tiltX_ = -surf.tiltX_;
+            surf.tiltY_ = -surf.tiltY_;
+            std::reverse(surf.coating_.layers_.begin(), surf.coating_.layers_.end());
+            surf.coatingTable_.reset();
+            r.surfaces_.push_back(surf);
+        }
+        r.imageSurfaceZ_ = n ? T(zRef - surfaces_[0].vertex()) : zRef;
+        r.imageSurfaceR_ = imageSurfaceR_;
+        r.irisScale_     = irisScale_;
+        r.setup();
+        return r;
+    }
+
+    // thickness_から各面の位置を並べ直す. 第一面の頂点と, 最終面から像面までの距離は保つ.
+    void layout(void)
+    {
+        if (surfaces_.empty())
+            return;
+        const T back = imageSurfaceZ_ - surfaces_.back().vertex();
+        T       z    = surfaces_[0].vertex();
+        for (auto &surf : surfaces_)
+        {
+            surf.center_ = z + surf.radius_;
+            z += surf.thickness_;
+        }
+        imageSurfaceZ_ = surfaces_.back().vertex() + back;
+        revision_++;
+    }
+
+    // 面iの頂点から次の面(最終面なら像面)までの距離.
+    T gap(size_t i) const
+    {
+        return ((i + 1 < surfaces_.size()) ? surfaces_[i + 1].vertex() : imageSurfaceZ_) - surfaces_[i].vertex();
+    }
+
+    // 面iの後ろの間隔(最終面なら像面まで)を変える. 後ろの面と像面を平行移動するだけで, 面のsetup()はやり直さない.
+    // 面の形, 有効径, 姿勢, sagの範囲, 反射率表はどれも位置によらない.
+    // 値が変わらなくても足し込む. Dual は値だけで比べるので, 飛ばすと微分が落ちる.
+    void setGap(size_t i, T thickness)
+    {
+        const T delta           = thickness - gap(i);
+        surfaces_[i].thickness_ = thickness;
+        for (size_t k = i + 1; k < surfaces_.size(); k++)
+            surfaces_[k].center_ += delta;
+        imageSurfaceZ_ += delta;
+        if (delta != 0.)
+            revision_++;
+    }
+
+    // 面[begin,end)を順に追跡する. pos,dirはワールド座標で更新される.
+    // 開口/絞りでケラれた, 全反射した, 交差しなかった場合はfalse.
+    // oplを渡すと光路長(屈折率x距離)を加算する.
+    bool traceSurfaces(Vec &pos, Vec &dir, double lambda, size_t begin, size_t end, T *opl = NULL) const
+    {
+        Polarization::None none;
+        return traceSurfaces(pos, dir, lambda, begin, end, opl, none);
+    }
+
+    // 偏光状態policyを運びながら追跡する.
+    // 各面の屈折ごとに policy.interact(面, 波長, 入射側/出射側の屈折率, 入射方向, 法線, 屈折方向) をワールド座標で呼ぶ.
+    template <typename Policy>
+    bool traceSurfaces(Vec &pos, Vec &dir, double lambda, size_t begin, size_t end, T *opl, Policy &policy) const
+    {
+        T iorNow = (begin == 0) ? T(1.) : surfaces_[begin - 1].ior(lambda);
+        for (size_t i = begin; i < end; i++)
+        {
+            const BasicSurface<T> &surf  = surfaces_[i];
+            const Vec              dirIn = dir;
+            if (surf.hasPose_)
+            {
+                pos = surf.toLocal(pos);
+                dir = surf.directionToLocal(dir);
+            }
+            if (dir.z <= 0.)
+                return false;
+
+            // 面頂点平面まで進めてローカル座標にする.
+            const T   vz    = surf.vertex();
+            const T   tp    = (vz - pos.z) / dir.z;
+            const Vec local = Vec(pos.x + dir.x * tp, pos.y + dir.y * tp, 0.);
+
+            DOMIPLAN_STATS(attempt(i));
+            if (!surf.mayHit(local, dir))
+            {
+                DOMIPLAN_STATS(reject(i));
+                return false; // ケラれ. 交点を解くまでもない.
+            }
+
+            T   t;
+            Vec point, norm;
+            if (!surf.intersect(local, dir, t, point, norm))
+            {
+                DOMIPLAN_STATS(surface(i).misses_++);
+                return false;
+            }
+            if (point.x * point.x + point.y * point.y > surf.diam2_ || !surf.insideStop(primal(point.x), primal(point.y), irisScale_))
+            {
+                DOMIPLAN_STATS(clip(i));
+                return false; // ケラれ.
+            }
+
+            const T iorNext = surf.ior(lambda);
+            Vec     refracted;
+            if (!refract(dir, norm, iorNow / iorNext, refracted))
+            {
+                DOMIPLAN_STATS(surface(i).tir_++);
+                return false;
+            }
+
+            if (opl)
+                *opl += iorNow * (tp + t);
+
+            pos = point;
+            dir = refracted;
+            if (surf.hasPose_)
+            {
+                pos = surf.toWorld(pos);
+                dir = surf.directionToWorld(dir);
+            }
+            if (Policy::ACTIVE)
+                policy.interact(surf, lambda, primal(iorNow), primal(iorNext), dirIn, surf.hasPose_ ? surf.directionToWorld(norm) : norm, dir);
+            iorNow = iorNext;
+        }
+        return true;
+    }
+
+    // 物体側の光線を像面まで追跡する.
+    bool trace(const Vec &orig, const Vec &dir, double lambda, Vec &hit, Vec &hitDir, T *opl = NULL) const
+    {
+        Polarization::None none;
+        return trace(orig, dir, lambda, hit, hitDir, opl, none);
     }
 
-    double maxDiameter() const { return maxDiameter_; }
+    template <typename Policy>
+    bool trace(const Vec &orig, const Vec &dir, double lambda, Vec &hit, Vec &hitDir, T *opl, Policy &policy) const
+    {
+        Vec pos = orig;
+        Vec d   = dir;
+        if (!traceSurfaces(pos, d, lambda, 0, surfaces_.size(), opl, policy))
+            return false;
+        if (d.z <= 0.)
+            return false;
+        const T t = (imageSurfaceZ_ - pos.z) / d.z;
+        hit       = pos + d * t;
+        hitDir    = d;
+        if (opl)
+            *opl += imageIor(lambda) * t;
+        return true;
+    }
+
+    // 最終面の後ろ(像空間)の屈折率.
+    T imageIor(double lambda) const
+    {
+        return surfaces_.empty() ? T(1.) : surfaces_.back().ior(lambda);
+    }
+
+    // 絞り面のindex. 無ければ-1.
+    int stopIndex() const
+    {
+        for (size_t i = 0; i < surfaces_.size(); i++)
+            if (surfaces_[i].isStop_)
+                return (int)i;
+        return -1;
+    }
+
+    double maxDiameter() const { return primal(maxDiameter_); }
     double getImageSurfaceR(void) const { return imageSurfaceR_; }
     void   setImageSurfaceR(double r) { imageSurfaceR_ = r; }
-    double getImageSurfaceZ(void) const { return imageSurfaceZ_; }
-    void   setImageSurfaceZ(double z) { imageSurfaceZ_ = z; }
-    void   setIrisScale(double i) { irisScale_ = i; }
+    T      getImageSurfaceZ(void) const { return imageSurfaceZ_; }
+    void   setImageSurfaceZ(T z)
+    {
+        imageSurfaceZ_ = z;
+        revision_++;
+    }
+    void   setIrisScale(double i)
+    {
+        irisScale_ = i;
+        revision_++;
+    }
 
     void dump(void)
     {
@@ -297,10 +903,10 @@ class Body
                 surfaces_[i].roughness_,
                 surfaces_[i].reflection_,
                 surfaces_[i].irisX_, surfaces_[i].irisY_);
-            if (surfaces_[i].type_ == Surface::EVENASPH)
+            if (surfaces_[i].type_ == SurfaceBase::EVENASPH)
             {
                 printf(" coni %f, ", surfaces_[i].conic_);
-                for (int t = 0; t < Surface::N_Aspherical; t++)
+                for (int t = 0; t < SurfaceBase::N_Aspherical; t++)
                 {
                     printf(" %e ", surfaces_[i].aspherical_[t]);
                 }
@@ -310,157 +916,327 @@ class Body
     }
 };
 
+typedef BasicBody<double> Body;
+
 namespace Loader
 {
-    namespace ZEMAX
+    // 読み込み専用にファイルを割り付ける. mmapの無い環境では全部読む.
+    class MappedFile
     {
-        char *tokenize(char *s, char *token)
+      public:
+        MappedFile(const char *filename) : data_(NULL), size_(0), map_(NULL)
         {
-            char *p = (char *)s;
-            while (*p && (*p == ' ' || *p == '\t'))
-                p++;
-            if (*p == 0)
-                return NULL;
-            while (*p != ' ' && *p != '\t' && *p != '\r' && *p != '\n' && *p)
+#ifndef _WIN32
+            const int fd = open(filename, O_RDONLY);
+            if (fd < 0)
+                return;
+            struct stat st;
+            void       *p = MAP_FAILED;
+            if (fstat(fd, &st) == 0 && st.st_size > 0)
+                p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (p != MAP_FAILED)
+            {
+                map_  = p;
+                data_ = (const char *)p;
+                size_ = (size_t)st.st_size;
+            }
+#else
+            FILE *fp = fopen(filename, "rb");
+            if (!fp)
+                return;
+            fseek(fp, 0, SEEK_END);
+            const long size = ftell(fp);
+            fseek(fp, 0, SEEK_SET);
+            storage_.resize(size > 0 ? (size_t)size : 0);
+            if (!storage_.empty() && fread(&storage_[0], 1, storage_.size(), fp) == storage_.size())
             {
-                //printf("%c\n",*p);
-                *token = *p;
-                token++;
-                p++;
+                data_ = storage_.data();
+                size_ = storage_.size();
             }
-            *token = 0;
-            if (*p == '\r' || *p == '\n' || *p == 0)
-                return NULL;
-            return p;
+            fclose(fp);
+#endif
+        }
+        ~MappedFile()
+        {
+#ifndef _WIN32
+            if (map_)
+                munmap(map_, size_);
+#endif
         }
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+
+        bool        ok(void) const { return data_ != NULL; }
+        const char *data(void) const { return data_; }
+        size_t      size(void) const { return size_; }
 
-        Body load(const char *filename)
+      private:
+        const char *data_;
+        size_t      size_;
+        void       *map_;
+        std::string storage_;
+    };
+
+    namespace ZEMAX
+    {
+        // 行頭のキーワードは全て4文字なので, 4バイトを詰めた整数がそのまま衝突の無いハッシュになる.
+        constexpr uint32_t keyword(const char *k)
         {
-            Body  lens;
-            FILE *fp;
+            return (uint32_t)(uint8_t)k[0] | ((uint32_t)(uint8_t)k[1] << 8) | ((uint32_t)(uint8_t)k[2] << 16) | ((uint32_t)(uint8_t)k[3] << 24);
+        }
 
-            fopen_s(&fp, filename, "rb");
-            if (!fp)
+        // バッファを行ごとに, 行の中を空白区切りで前から読む. トークンは元のバッファを指し, コピーしない.
+        class Scanner
+        {
+          public:
+            Scanner(const char *begin, const char *end) : p_(begin), end_(end), cursor_(begin), eol_(begin) { ; }
+
+            // 次の行へ. 行末は memchr でまとめて探す.
+            bool next(void)
             {
-                printf("lens %s open fail\n", filename);
-                return lens;
+                if (p_ >= end_)
+                    return false;
+                cursor_         = p_;
+                const void *eol = memchr(p_, '\n', (size_t)(end_ - p_));
+                eol_            = eol ? (const char *)eol : end_;
+                p_              = (eol_ < end_) ? eol_ + 1 : end_;
+                return true;
+            }
+
+            // 行の中の次のトークン. 無ければ空.
+            std::string_view token(void)
+            {
+                while (cursor_ < eol_ && (*cursor_ == ' ' || *cursor_ == '\t' || *cursor_ == '\r'))
+                    cursor_++;
+                const char *begin = cursor_;
+                while (cursor_ < eol_ && *cursor_ != ' ' && *cursor_ != '\t' && *cursor_ != '\r')
+                    cursor_++;
+                return std::string_view(begin, (size_t)(cursor_ - begin));
+            }
+
+            // 数値のトークン. 全体が数値で, 有限で桁外れに大きくないときだけ成功する. 桁外れに小さい値は0にする.
+            // 壊れた値を通すと Surface::ior() などで NaN になるので, 読めない行は無視する.
+            bool number(double &value) { return toNumber(token(), value); }
+
+            static bool toNumber(std::string_view t, double &value)
+            {
+                if (!t.empty() && t[0] == '+')
+                    t.remove_prefix(1);
+                double                       v = 0.;
+                const std::from_chars_result r = std::from_chars(t.data(), t.data() + t.size(), v);
+                if (t.empty() || r.ec != std::errc() || r.ptr != t.data() + t.size() || !(fabs(v) < 1e30))
+                    return false;
+                value = (fabs(v) < 1e-30) ? 0. : v;
+                return true;
+            }
+
+            bool integer(int &value)
+            {
+                const std::string_view       t = token();
+                const std::from_chars_result r = std::from_chars(t.data(), t.data() + t.size(), value);
+                return !t.empty() && r.ec == std::errc() && r.ptr == t.data() + t.size();
+            }
+
+          private:
+            const char *p_, *end_;
+            const char *cursor_, *eol_;
+        };
+
+        // UTF-16 で保存された .zmx を1バイト文字に詰め直す. キーワードも数値もASCIIなので, それ以外は '?' にする.
+        inline bool transcode(const char *data, size_t size, std::string &out)
+        {
+            if (size < 2)
+                return false;
+            const uint8_t *u = (const uint8_t *)data;
+            int            hi;
+            if (u[0] == 0xFF && u[1] == 0xFE)
+                hi = 1; // little endian.
+            else if (u[0] == 0xFE && u[1] == 0xFF)
+                hi = 0;
+            else
+                return false;
+            out.resize((size - 2) / 2);
+            for (size_t i = 0; i < out.size(); i++)
+            {
+                const uint8_t *c = u + 2 + i * 2;
+                out[i]           = (c[hi] == 0 && c[1 - hi] < 0x80) ? (char)c[1 - hi] : '?';
+            }
+            return true;
+        }
+
+        // 面の並びだけを読む. setup() はしない. 知らない面の種類は log に出す(NULLで黙る).
+        inline Body parse(const char *data, size_t size, FILE *log = stdout)
+        {
+            Body        lens;
+            std::string utf16;
+            if (transcode(data, size, utf16))
+            {
+                data = utf16.data();
+                size = utf16.size();
+            }
+            else if (size >= 3 && memcmp(data, "\xEF\xBB\xBF", 3) == 0)
+            {
+                data += 3;
+                size -= 3;
             }
 
             int     surfaceIndex = -1;
             Surface surface;
 
-            bool   isAperture = false;
-            double sumz       = 0.;
+            bool   isAperture   = false;
+            bool   isCoordBrk   = false;
+            double sumz         = 0.;
+            double breakPose[5] = {0., 0., 0., 0., 0.}; // COORDBRKの累積. decenter x/y, tilt x/y/z.
 
-            while (!feof(fp))
-            {
-                char line[1024], *p, token[256];
+            // 面の数だけ先に確保しておく. Surface は大きいので伸ばしながらのコピーが読み込みより高くつく.
+            size_t surfaces = 0;
+            for (const char *p = data, *end = data + size; (p = (const char *)memchr(p, 'S', (size_t)(end - p))) != NULL; p++)
+                surfaces += (end - p >= 4 && memcmp(p, "SURF", 4) == 0);
+            lens.surfaces_.reserve(surfaces);
 
-                fgets(line, 1024, fp);
-                p = line;
-                p = tokenize(p, token);
+            Scanner scanner(data, data + size);
+            while (scanner.next())
+            {
+                const std::string_view key = scanner.token();
+                if (key.size() != 4)
+                    continue;
 
-                if (strcmp(token, "SURF") == 0)
+                switch (keyword(key.data()))
+                {
+                case keyword("SURF"):
                 {
                     if (surfaceIndex >= 0)
                     {
-                        if (surface.diameter_ > 0.)
+                        if (isCoordBrk)
+                        {
+                            // 座標ブレーク. 以降の面に足し込む. 光軸そのものは曲げず, 各面を頂点まわりに動かす近似.
+                            for (int i = 0; i < 5; i++)
+                                breakPose[i] += surface.aspherical_[i];
+                            if (!lens.surfaces_.empty())
+                                lens.surfaces_.back().thickness_ += surface.thickness_;
+                        }
+                        else if (surface.diameter_ > 0.)
                         {
-                            surface.center_ = surface.center_ + surface.radius_; // 中心位置を調整しておく.
-                            surface.isStop_ = isAperture;
+                            surface.center_    = surface.center_ + surface.radius_; // 中心位置を調整しておく.
+                            surface.isStop_    = isAperture;
+                            surface.decenterX_ = breakPose[0];
+                            surface.decenterY_ = breakPose[1];
+                            surface.tiltX_     = breakPose[2];
+                            surface.tiltY_     = breakPose[3];
+                            surface.tiltZ_     = breakPose[4];
                             lens.surfaces_.push_back(surface); // レンズフラッシュ
                         }
+                        else if (!lens.surfaces_.empty())
+                        {
+                            lens.surfaces_.back().thickness_ += surface.thickness_; // 読み飛ばした面の間隔を詰める.
+                        }
                     }
-                    p            = tokenize(p, token);
-                    surfaceIndex = atoi(token);
+                    int index = 0;
+                    scanner.integer(index);
+                    surfaceIndex = std::max(index, 0);
                     surface.init();
                     isAperture = false;
+                    isCoordBrk = false;
+                    break;
                 }
-
-                if (strcmp(token, "TYPE") == 0)
+                case keyword("TYPE"):
                 {
-                    p = tokenize(p, token);
-                    if (strcmp(token, "STANDARD") == 0)
+                    const std::string_view type = scanner.token();
+                    if (type == "STANDARD")
                         surface.type_ = Surface::STANDARD;
-                    else if (strcmp(token, "EVENASPH") == 0)
+                    else if (type == "EVENASPH")
                         surface.type_ = Surface::EVENASPH;
-                    else
-                    {
-                        printf("unknown surface: %s\n", token);
-                    }
+                    else if (type == "TOROIDAL")
+                        surface.type_ = Surface::CYLINDER_X; // 回転半径は無限大とみなす. CURVはy-z面の曲率.
+                    else if (type == "COORDBRK")
+                        isCoordBrk = true; // PARM 1-5 = decenter x/y, tilt x/y/z.
+                    else if (log)
+                        fprintf(log, "unknown surface: %.*s\n", (int)type.size(), type.data());
+                    break;
                 }
-                if (strcmp(token, "STOP") == 0)
+                case keyword("STOP"):
                     isAperture = true;
-
-                if (strcmp(token, "CURV") == 0)
-                {
-                    p              = tokenize(p, token);
-                    double curve   = atof(token);
-                    surface.curve_ = curve;
-                    if (curve != 0.)
-                        surface.radius_ = 1. / curve;
-                    else
-                        surface.radius_ = 0.;
-                }
-
-                if (strcmp(token, "DISZ") == 0)
+                    break;
+                case keyword("CURV"):
                 {
-                    p           = tokenize(p, token);
-                    double disz = atof(token);
-                    if (strcmp(token, "INFINITY") == 0)
-                        disz = 0.;
-                    surface.thickness_ = disz;
-                    surface.center_    = sumz / 2.;
-                    sumz += disz;
+                    double curve;
+                    if (scanner.number(curve))
+                    {
+                        surface.curve_  = curve;
+                        surface.radius_ = (curve != 0.) ? 1. / curve : 0.;
+                    }
+                    break;
                 }
-                if (strcmp(token, "DIAM") == 0)
+                case keyword("DISZ"):
                 {
-                    p                 = tokenize(p, token);
-                    double d          = strtod(token, NULL);
-                    surface.diameter_ = d;
+                    // 物体面の INFINITY は0とみなす.
+                    const std::string_view t    = scanner.token();
+                    double                 disz = 0.;
+                    if (t == "INFINITY" || Scanner::toNumber(t, disz))
+                    {
+                        surface.thickness_ = disz;
+                        surface.center_    = sumz;
+                        sumz += disz;
+                    }
+                    break;
                 }
-
-                if (strcmp(token, "PARM") == 0)
+                case keyword("DIAM"):
+                    scanner.number(surface.diameter_);
+                    break;
+                case keyword("PARM"):
                 {
-                    // evenasph param.
-                    p            = tokenize(p, token);
-                    int index    = atoi(token);
-                    p            = tokenize(p, token);
-                    double value = strtod(token, NULL); //atof(token);
-                    assert(index >= 1 && index <= 8);
-                    //assert(surface.type_ == Surface::EVENASPH);
-                    surface.aspherical_[index - 1] = value;
+                    // evenasph param. 範囲外の番号は読み飛ばす.
+                    int    index;
+                    double value;
+                    if (scanner.integer(index) && scanner.number(value) && index >= 1 && index <= 8)
+                        surface.aspherical_[index - 1] = value;
+                    break;
                 }
-                if (strcmp(token, "CONI") == 0)
+                case keyword("CONI"):
+                    scanner.number(surface.conic_); // evenasph conic
+                    break;
+                case keyword("GLAS"):
                 {
-                    // evenasph conic
-                    p            = tokenize(p, token);
-                    double value = atoi(token);
-                    //assert(surface.type_ == Surface::EVENASPH);
-                    surface.conic_ = value;
+                    scanner.token(); // name
+                    scanner.token(); // nazo1
+                    scanner.token(); // nazo2
+                    double ior, abbe = 0.;
+                    if (scanner.number(ior))
+                    {
+                        surface.ior_ = ior;
+                        scanner.number(abbe);
+                        surface.abbeVd_ = (abbe > 0.) ? abbe : 1.; // fitting was done in inverted.
+                    }
+                    break;
                 }
-
-                if (strcmp(token, "GLAS") == 0)
-                {
-                    p = tokenize(p, token); // name
-                    p = tokenize(p, token); // nazo1
-                    p = tokenize(p, token); // nazo2
-
-                    p               = tokenize(p, token); // ior
-                    surface.ior_    = atof(token);
-                    p               = tokenize(p, token); // abbe
-                    surface.abbeVd_ = atof(token);        // fitting was done in inverted.
-                    if (surface.abbeVd_ <= 0.)
-                        surface.abbeVd_ = 1.;
+                default:
+                    break;
                 }
             }
             // lens.surfaces_.push_back( surface ); // レンズフラッシュ
             lens.imageSurfaceZ_ = surface.center_;
-            fclose(fp);
+            return lens;
+        }
+
+        inline Body loadFromMemory(const char *data, size_t size, FILE *log = stdout)
+        {
+            Body lens = parse(data, size, log);
             lens.setup();
             return lens;
         }
 
+        inline Body load(const char *filename)
+        {
+            const MappedFile file(filename);
+            if (!file.ok())
+            {
+                printf("lens %s open fail\n", filename);
+                return Body();
+            }
+            return loadFromMemory(file.data(), file.size());
+        }
+
     } // namespace ZEMAX
 } // namespace Loader
 
@@ -546,4 +1322,6 @@ class Plotter
     }
 };
 
-} // namespace Lens
\ No newline at end of file
+} // namespace Lens
+
+#endif
\ No newline at end of file
@@ -0,0 +1,316 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+#ifndef __LENSMAPS_H
+#define __LENSMAPS_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <lens.hpp>
+#include <parallel.hpp>
+#include <paraxial.hpp>
+#include <pupil.hpp>
+
+namespace Lens
+{
+// 像高に対する周辺光量/歪曲のテーブル.
+// 像高は imageSurfaceR_ で正規化した 0..1 の等間隔サンプル.
+class ImageMaps
+{
+  public:
+    static constexpr uint32_t MAGIC   = 0x4d505044; // "DPPM"
+    static constexpr uint32_t VERSION = 2;
+
+    double              irisScale_;
+    double              imageSurfaceR_;
+    double              focalLength_;
+    double              coverage_; // 主波長の主光線が像面まで届いた正規化像高. これより外は coverage_ での値で止めてある.
+    std::vector<double> lambdas_;
+    size_t              samples_;
+    std::vector<float>  vignetting_;   // [samples_] 軸上の透過光線数に対する比.
+    std::vector<float>  illumination_; // [samples_] vignetting x cos^4(像側主光線角).
+    std::vector<float>  distortion_;   // [lambdas_ x samples_] (実像高 - 理想像高) / 理想像高.
+
+    ImageMaps() : irisScale_(1.), imageSurfaceR_(0.), focalLength_(0.), coverage_(0.), samples_(0) { ; }
+
+    // 正規化像高rでの線形補間.
+    static float lookup(const float *table, size_t n, double r)
+    {
+        if (n == 0)
+            return 0.f;
+        const double x = std::min(std::max(r, 0.), 1.) * (double)(n - 1);
+        const size_t i = std::min((size_t)x, n - 1);
+        const size_t j = std::min(i + 1, n - 1);
+        const float  f = (float)(x - (double)i);
+        return table[i] * (1.f - f) + table[j] * f;
+    }
+
+    float vignetting(double r) const { return lookup(vignetting_.data(), vignetting_.size(), r); }
+    float illumination(double r) const { return lookup(illumination_.data(), illumination_.size(), r); }
+    float distortion(double r, size_t lambda = 0) const { return lookup(distortion_.data() + lambda * samples_, samples_, r); }
+
+    // 視野を掃引してテーブルを作る. 主光線で歪曲, 瞳サンプルの透過率で周辺減光.
+    void build(const Body &body, const std::vector<double> &lambdas, size_t samples = 64, size_t pupilRays = 1024, size_t threads = 0)
+    {
+        DOMIPLAN_STATS_SCOPE(LENSMAP);
+        irisScale_     = body.irisScale_;
+        imageSurfaceR_ = body.imageSurfaceR_;
+        lambdas_       = lambdas;
+        coverage_      = 0.;
+        vignetting_.clear();
+        illumination_.clear();
+        distortion_.clear();
+        if (lambdas_.empty())
+        {
+            samples_ = 0;
+            return;
+        }
+        samples_     = std::max<size_t>(2, samples);
+        focalLength_ = Paraxial::focalLength(body, lambdas_[0]);
+
+        // 掃引は画角で等間隔に行い, あとで像高の等間隔に直す.
+        const size_t              sweep    = samples_ * 2;
+        const double              maxAngle = atan(imageSurfaceR_ / fabs(focalLength_)) * 1.05;
+        std::vector<double>       angle(sweep), transmit(sweep, 0.), cos4(sweep, 0.);
+        std::vector<double>       height(sweep * lambdas_.size(), 0.);
+        std::vector<uint8_t>      valid(sweep * lambdas_.size(), 0);
+        const auto                pupil = Pupil::hexGrid(pupilRays);
+        std::vector<Pupil::Entrance> entrance(lambdas_.size());
+        for (size_t l = 0; l < lambdas_.size(); l++)
+            entrance[l].setup(body, lambdas_[l]);
+
+        PARALLEL::parallelFor(sweep, [&](size_t k) {
+            angle[k]          = maxAngle * (double)k / (double)(sweep - 1);
+            const Field field = Field(0., angle[k] * 180. / M_PI);
+            const Vector dir  = field.direction();
+
+            for (size_t l = 0; l < lambdas_.size(); l++)
+            {
+                const Vector chief = entrance[l].chief(body, field, lambdas_[l]);
+                Vector       hit, hitDir;
+                if (body.trace(chief, dir, lambdas_[l], hit, hitDir))
+                {
+                    height[l * sweep + k] = hit.y;
+                    valid[l * sweep + k]  = 1;
+                    if (l == 0)
+                    {
+                        const double c = hitDir.z;
+                        cos4[k]        = c * c * c * c;
+                    }
+                }
+            }
+
+            const Vector chief = entrance[0].chief(body, field, lambdas_[0]);
+            size_t       pass  = 0;
+            for (const auto &p : pupil)
+            {
+                Vector hit, hitDir;
+                const Vector orig = Vector(chief.x + p.x_ * entrance[0].radius_, chief.y + p.y_ * entrance[0].radius_, chief.z);
+                if (body.trace(orig, dir, lambdas_[0], hit, hitDir))
+                    pass++;
+            }
+            transmit[k] = (double)pass;
+        },
+            threads);
+
+        const double axial = std::max(transmit[0], 1.);
+        vignetting_.assign(samples_, 0.f);
+        illumination_.assign(samples_, 0.f);
+        distortion_.assign(samples_ * lambdas_.size(), 0.f);
+
+        // 主波長で主光線が像面まで届いた掃引点だけを使う. 届かなかった点の像高は無い.
+        std::vector<size_t> traced;
+        for (size_t k = 0; k < sweep; k++)
+            if (valid[k])
+                traced.push_back(k);
+        if (traced.empty())
+            return;
+        coverage_ = (imageSurfaceR_ > 0.) ? std::min(std::max(height[traced.back()] / imageSurfaceR_, 0.), 1.) : 1.;
+
+        // 角度aでの波長lの歪曲. 主光線の通った両隣で補間し, 外側は端の値で止める.
+        const auto distortion = [&](size_t l, double a) {
+            const double *hl = &height[l * sweep];
+            const double  x  = a / maxAngle * (double)(sweep - 1);
+            long          j0 = -1, j1 = -1;
+            for (size_t j = 0; j < sweep; j++)
+            {
+                if (!valid[l * sweep + j])
+                    continue;
+                if ((double)j <= x)
+                    j0 = (long)j;
+                else if (j1 < 0)
+                    j1 = (long)j;
+            }
+            if (j0 < 0 && j1 < 0)
+                return 0.;
+            double hr;
+            if (j0 >= 0 && j1 >= 0)
+                hr = hl[j0] + (hl[j1] - hl[j0]) * (a - angle[j0]) / (angle[j1] - angle[j0]);
+            else
+            {
+                a  = angle[(j0 >= 0) ? j0 : j1];
+                hr = hl[(j0 >= 0) ? j0 : j1];
+            }
+            // 同じ画角の理想像高 f tan(a) と比べる.
+            const double ideal = fabs(focalLength_) * tan(a);
+            return (ideal > 0.) ? (hr - ideal) / ideal : 0.;
+        };
+
+        // 主波長の実像高で等間隔に並べ直す.
+        for (size_t i = 0; i < samples_; i++)
+        {
+            const double h  = imageSurfaceR_ * (double)i / (double)(samples_ - 1);
+            size_t       t  = std::min<size_t>(1, traced.size() - 1);
+            while (t < traced.size() - 1 && height[traced[t]] < h)
+                t++;
+            const size_t k0 = traced[t ? t - 1 : 0], k1 = traced[t];
+            const double h0 = height[k0], h1 = height[k1];
+            const double f  = (h1 > h0) ? std::min(std::max((h - h0) / (h1 - h0), 0.), 1.) : 0.;
+            const double a  = angle[k0] + (angle[k1] - angle[k0]) * f;
+            const double v  = (transmit[k0] + (transmit[k1] - transmit[k0]) * f) / axial;
+            vignetting_[i]   = (float)v;
+            illumination_[i] = (float)(v * (cos4[k0] + (cos4[k1] - cos4[k0]) * f));
+
+            for (size_t l = 0; l < lambdas_.size(); l++)
+                distortion_[l * samples_ + i] = (float)distortion(l, a);
+        }
+        if (samples_ > 1)
+            for (size_t l = 0; l < lambdas_.size(); l++)
+                distortion_[l * samples_] = distortion_[l * samples_ + 1]; // 像高0は極限値.
+    }
+
+    bool save(const char *filename) const
+    {
+        FILE *fp = fopen(filename, "wb");
+        if (!fp)
+        {
+            printf("maps %s open fail\n", filename);
+            return false;
+        }
+        const uint32_t header[4] = {MAGIC, VERSION, (uint32_t)samples_, (uint32_t)lambdas_.size()};
+        const double   params[4] = {irisScale_, imageSurfaceR_, focalLength_, coverage_};
+        bool           ok        = fwrite(header, sizeof(header), 1, fp) == 1;
+        ok                       = ok && fwrite(params, sizeof(params), 1, fp) == 1;
+        ok                       = ok && fwrite(lambdas_.data(), sizeof(double), lambdas_.size(), fp) == lambdas_.size();
+        ok                       = ok && fwrite(vignetting_.data(), sizeof(float), samples_, fp) == samples_;
+        ok                       = ok && fwrite(illumination_.data(), sizeof(float), samples_, fp) == samples_;
+        ok                       = ok && fwrite(distortion_.data(), sizeof(float), distortion_.size(), fp) == distortion_.size();
+        fclose(fp);
+        return ok;
+    }
+
+    bool load(const char *filename)
+    {
+        FILE *fp = fopen(filename, "rb");
+        if (!fp)
+            return false;
+        uint32_t header[4];
+        double   params[4];
+        bool     ok = fread(header, sizeof(header), 1, fp) == 1 && header[0] == MAGIC && header[1] == VERSION;
+        ok          = ok && fread(params, sizeof(params), 1, fp) == 1;
+        if (ok)
+        {
+            samples_       = header[2];
+            irisScale_     = params[0];
+            imageSurfaceR_ = params[1];
+            focalLength_   = params[2];
+            coverage_      = params[3];
+            lambdas_.resize(header[3]);
+            vignetting_.resize(samples_);
+            illumination_.resize(samples_);
+            distortion_.resize(samples_ * lambdas_.size());
+            ok = fread(lambdas_.data(), sizeof(double), lambdas_.size(), fp) == lambdas_.size();
+            ok = ok && fread(vignetting_.data(), sizeof(float), samples_, fp) == samples_;
+            ok = ok && fread(illumination_.data(), sizeof(float), samples_, fp) == samples_;
+            ok = ok && fread(distortion_.data(), sizeof(float), distortion_.size(), fp) == distortion_.size();
+        }
+        fclose(fp);
+        return ok;
+    }
+};
+
+// レンズ1本ぶんのテーブルを絞り設定ごとに持つ.
+// prefix_を設定するとレンズファイルの隣に保存/読み込みする.
+class ImageMapCache
+{
+  public:
+    std::string         prefix_; // 例: "lens.zmx" -> "lens.zmx.iris0.500000.z1234abcd.dpmap"
+    std::vector<double> lambdas_;
+    size_t              samples_;
+    size_t              pupilRays_;
+
+    ImageMapCache() : lambdas_(1, 587.56), samples_(64), pupilRays_(1024) { ; }
+
+    // 絞りと面間隔(ピント/ズームの設定), 絞り羽根の形ごとに別のテーブル.
+    static std::vector<double> key(const Body &body)
+    {
+        std::vector<double> k(1, body.irisScale_);
+        for (size_t i = 0; i < body.surfaces_.size(); i++)
+            k.push_back(body.gap(i));
+        for (const Surface &s : body.surfaces_)
+        {
+            k.push_back((double)s.iris_.blades_);
+            k.push_back(s.iris_.curvature_);
+            k.push_back(s.iris_.rotation_);
+        }
+        return k;
+    }
+
+    // 間隔と羽根は FNV-1a で短くする.
+    std::string filename(const Body &body) const
+    {
+        const std::vector<double> k    = key(body);
+        uint32_t                  hash = 2166136261u;
+        for (size_t i = 1; i < k.size(); i++)
+        {
+            uint8_t bytes[sizeof(double)];
+            memcpy(bytes, &k[i], sizeof(double));
+            for (uint8_t b : bytes)
+                hash = (hash ^ b) * 16777619u;
+        }
+        char buf[64];
+        snprintf(buf, sizeof(buf), ".iris%f.z%08x.dpmap", body.irisScale_, hash);
+        return prefix_ + buf;
+    }
+
+    std::shared_ptr<const ImageMaps> get(const Body &body)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const std::vector<double>   k  = key(body);
+        auto                        it = maps_.find(k);
+        if (it != maps_.end())
+            return it->second;
+
+        std::shared_ptr<ImageMaps> maps = std::make_shared<ImageMaps>();
+        const std::string          file = filename(body);
+        if (prefix_.empty() || !maps->load(file.c_str()) || maps->lambdas_ != lambdas_ || maps->samples_ != samples_)
+        {
+            maps->build(body, lambdas_, samples_, pupilRays_);
+            if (!prefix_.empty())
+                maps->save(file.c_str());
+        }
+        maps_[k] = maps;
+        return maps;
+    }
+
+    void clear(void)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        maps_.clear();
+    }
+
+  private:
+    std::mutex                                         mutex_;
+    std::map<std::vector<double>, std::shared_ptr<const ImageMaps>> maps_;
+};
+} // namespace Lens
+
+#endif
@@ -0,0 +1,420 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+#ifndef __LIGHTFIELD_H
+#define __LIGHTFIELD_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <lens.hpp>
+#include <parallel.hpp>
+#include <pupil.hpp>
+
+namespace Lens
+{
+// センサー上の点 + 射出瞳上の点 -> 物体側の光線 の4次元テーブル.
+// ピントと絞りを決めたレンズで一度作っておけば, レンダリング時はガラスを追わずに補間で光線が得られる.
+// 座標の取り方は Renderer と同じで, センサーは反転座標系の z'=0 (倒立を戻した向き), 瞳は各センサー点の主光線を中心に
+// 射出瞳半径 x overscan の正方形 [-1,1]^2. 光線は物体側の基準面 zPlane_ 上の位置(x, y)と方向(dx, dy)で持つ.
+// 各成分は範囲で正規化した16bitで, ファイルはヘッダの後ろにそのまま並べるので mmap して使える.
+// 光線の値は有効径と絞りを外した光学系で追っておき, ケラれたかどうかは別のビット列で持つ.
+// ケラれの境界でも補間する値が滑らかにつながり, 境界そのものは通過ビットの補間で決まる.
+class LightField
+{
+  public:
+    static constexpr uint32_t MAGIC       = 0x464c5044; // "DPLF"
+    static constexpr uint32_t VERSION     = 3;
+    static constexpr uint16_t INVALID     = 0xffff; // 有効径を外しても追えなかった光線.
+    static constexpr int      N_COMPONENT = 4;      // x, y, dx, dy
+
+    size_t              ns_, nt_, nu_, nv_; // センサーx, y, 瞳u, v の格子数.
+    double              sensorWidth_, sensorHeight_;
+    double              overscan_;
+    double              zPlane_;        // 光線の基準面(ワールド). 第1面の頂点.
+    double              imageSurfaceZ_; // 作ったときのピント.
+    double              irisScale_;
+    std::vector<double> gaps_;          // 作ったときの面間隔. ImageMapCache::key の間隔の部分.
+    uint32_t            shape_;         // 面の形と材質のハッシュ. shapeHash().
+    std::vector<double> lambdas_;       // チャンネルごとの波長.
+    std::vector<float>  ranges_;        // [チャンネル x 成分] の (最小値, 幅).
+
+    LightField()
+        : ns_(0), nt_(0), nu_(0), nv_(0), sensorWidth_(0.), sensorHeight_(0.), overscan_(1.25), zPlane_(0.), imageSurfaceZ_(0.), irisScale_(1.), shape_(0), data_(NULL), map_(NULL), mapSize_(0) { ; }
+    ~LightField() { unmap(); }
+
+    LightField(const LightField &) = delete;
+    LightField &operator=(const LightField &) = delete;
+
+    size_t   channels(void) const { return lambdas_.size(); }
+    size_t   entries(void) const { return ns_ * nt_ * nu_ * nv_ * channels(); }
+    bool     empty(void) const { return data_ == NULL; }
+    bool     mapped(void) const { return map_ != NULL; }
+    uint64_t bytes(void) const { return (uint64_t)(entries() * N_COMPONENT + maskWords()) * sizeof(uint16_t); }
+
+    // ピントも絞りもbodyのまま. 格子の端はセンサーの端と瞳の正方形の端に一致する.
+    void build(const Body &body, double sensorWidth, double sensorHeight, const std::vector<double> &lambdas,
+        size_t ns = 48, size_t nt = 32, size_t nu = 24, size_t nv = 24, double overscan = 1.25, size_t threads = 0)
+    {
+        unmap();
+        ns_            = std::max<size_t>(2, ns);
+        nt_            = std::max<size_t>(2, nt);
+        nu_            = std::max<size_t>(2, nu);
+        nv_            = std::max<size_t>(2, nv);
+        sensorWidth_   = sensorWidth;
+        sensorHeight_  = sensorHeight;
+        overscan_      = overscan;
+        lambdas_       = lambdas;
+        imageSurfaceZ_ = body.imageSurfaceZ_;
+        irisScale_     = body.irisScale_;
+        shape_         = shapeHash(body);
+        gaps_.clear();
+        for (size_t i = 0; i < body.surfaces_.size(); i++)
+            gaps_.push_back(body.gap(i));
+        zPlane_        = body.surfaces_.empty() ? 0. : body.surfaces_[0].vertex();
+
+        const Body rev = body.reversed();
+        Body       open = rev;
+        for (Surface &surf : open.surfaces_)
+        {
+            // 有効径を広げる. 球/二次曲面が折り返す手前まで.
+            double d = surf.diameter_ * 2.;
+            if (surf.curve_ != 0. && surf.type_ != SurfaceBase::CYLINDER_Z)
+                d = std::max(surf.diameter_, std::min(d, 0.98 / (fabs(surf.curve_) * sqrt(std::max(surf.conic_ + 1., 1e-6)))));
+            surf.diameter_ = d;
+            surf.isStop_   = false;
+            surf.setup();
+        }
+        Pupil::Entrance exit;
+        exit.setup(rev, lambdas_[lambdas_.size() / 2]);
+        const double zRef   = body.imageSurfaceZ_;
+        const double spread = exit.radius_ * overscan_;
+
+        // まず double で追って, 範囲を決めてから量子化する.
+        const size_t         n = entries();
+        std::vector<double>  rays(n * N_COMPONENT, 0.);
+        std::vector<uint8_t> valid(n, 0), pass(n, 0);
+        PARALLEL::parallelFor(ns_ * nt_, [&](size_t st) {
+            const size_t s      = st % ns_, t = st / ns_;
+            const Vector origin = Vector(sensorX((double)s), sensorY((double)t), 0.);
+            const Vector chief  = exit.chiefFrom(rev, origin, lambdas_[lambdas_.size() / 2]);
+            for (size_t c = 0; c < channels(); c++)
+                for (size_t v = 0; v < nv_; v++)
+                    for (size_t u = 0; u < nu_; u++)
+                    {
+                        const Vector aim = Vector(chief.x + pupil(u, nu_) * spread, chief.y + pupil(v, nv_) * spread, chief.z);
+                        const size_t i   = index(c, s, t, u, v);
+                        Vector       pos = origin;
+                        Vector       dir = (aim - origin).normal();
+                        pass[i]          = rev.traceSurfaces(pos, dir, lambdas_[c], 0, rev.surfaces_.size());
+                        pos              = origin;
+                        dir              = (aim - origin).normal();
+                        if (!open.traceSurfaces(pos, dir, lambdas_[c], 0, open.surfaces_.size()) || dir.z <= 0.)
+                            continue;
+                        // ワールドへ戻して基準面まで延ばす.
+                        const double wz = zRef - pos.z;
+                        const double k  = (zPlane_ - wz) / -dir.z;
+                        rays[i * N_COMPONENT + 0] = pos.x + dir.x * k;
+                        rays[i * N_COMPONENT + 1] = pos.y + dir.y * k;
+                        rays[i * N_COMPONENT + 2] = dir.x;
+                        rays[i * N_COMPONENT + 3] = dir.y;
+                        valid[i]                  = 1;
+                    }
+        },
+            threads);
+
+        ranges_.assign(channels() * N_COMPONENT * 2, 0.f);
+        for (size_t c = 0; c < channels(); c++)
+            for (int k = 0; k < N_COMPONENT; k++)
+            {
+                double lo = INFINITY, hi = -INFINITY;
+                for (size_t i = c * n / channels(); i < (c + 1) * n / channels(); i++)
+                    if (valid[i])
+                    {
+                        lo = std::min(lo, rays[i * N_COMPONENT + k]);
+                        hi = std::max(hi, rays[i * N_COMPONENT + k]);
+                    }
+                if (lo > hi)
+                    lo = hi = 0.;
+                ranges_[(c * N_COMPONENT + k) * 2 + 0] = (float)lo;
+                ranges_[(c * N_COMPONENT + k) * 2 + 1] = std::max((float)(hi - lo), 1e-20f);
+            }
+
+        storage_.assign(n * N_COMPONENT + maskWords(), uint16_t(INVALID));
+        uint16_t *mask = &storage_[n * N_COMPONENT];
+        std::fill(mask, mask + maskWords(), 0);
+        for (size_t i = 0; i < n; i++)
+        {
+            if (pass[i] && valid[i])
+                mask[i / 16] |= (uint16_t)(1u << (i % 16));
+            if (!valid[i])
+                continue;
+            const size_t c = i / (n / channels());
+            for (int k = 0; k < N_COMPONENT; k++)
+            {
+                const float *r = &ranges_[(c * N_COMPONENT + k) * 2];
+                const double q = (rays[i * N_COMPONENT + k] - r[0]) / r[1] * (double)(INVALID - 1);
+                storage_[i * N_COMPONENT + k] = (uint16_t)std::min(std::max(floor(q + 0.5), 0.), (double)(INVALID - 1));
+            }
+        }
+        data_ = storage_.data();
+    }
+
+    // センサー上の点(反転座標系[mm]), 瞳座標(u, v in [-1,1]), チャンネルcの物体側光線.
+    // 周りの16点で4重線形補間する. 通過ビットの補間が0.5未満ならケラれ.
+    bool ray(double sx, double sy, double u, double v, size_t c, Vector &pos, Vector &dir) const
+    {
+        const double gs = clampGrid((sx / sensorWidth_ + 0.5) * (double)(ns_ - 1), ns_);
+        const double gt = clampGrid((sy / sensorHeight_ + 0.5) * (double)(nt_ - 1), nt_);
+        const double gu = clampGrid((u * 0.5 + 0.5) * (double)(nu_ - 1), nu_);
+        const double gv = clampGrid((v * 0.5 + 0.5) * (double)(nv_ - 1), nv_);
+        const size_t s0 = std::min((size_t)gs, ns_ - 2), t0 = std::min((size_t)gt, nt_ - 2);
+        const size_t u0 = std::min((size_t)gu, nu_ - 2), v0 = std::min((size_t)gv, nv_ - 2);
+        const double fs = gs - (double)s0, ft = gt - (double)t0, fu = gu - (double)u0, fv = gv - (double)v0;
+
+        const uint16_t *mask             = data_ + entries() * N_COMPONENT;
+        double          acc[N_COMPONENT] = {0., 0., 0., 0.};
+        double          wsum = 0., through = 0.;
+        for (int corner = 0; corner < 16; corner++)
+        {
+            const int    bs = corner & 1, bt = (corner >> 1) & 1, bu = (corner >> 2) & 1, bv = (corner >> 3) & 1;
+            const size_t i  = index(c, s0 + bs, t0 + bt, u0 + bu, v0 + bv);
+            const double w  = (bs ? fs : 1. - fs) * (bt ? ft : 1. - ft) * (bu ? fu : 1. - fu) * (bv ? fv : 1. - fv);
+            if ((mask[i / 16] >> (i % 16)) & 1)
+                through += w;
+            const uint16_t *e = data_ + i * N_COMPONENT;
+            if (e[0] == INVALID)
+                continue;
+            for (int k = 0; k < N_COMPONENT; k++)
+                acc[k] += w * (double)e[k];
+            wsum += w;
+        }
+        if (through < 0.5 || wsum <= 0.)
+            return false;
+
+        double r[N_COMPONENT];
+        for (int k = 0; k < N_COMPONENT; k++)
+        {
+            const float *range = &ranges_[(c * N_COMPONENT + k) * 2];
+            r[k]               = range[0] + acc[k] / wsum / (double)(INVALID - 1) * range[1];
+        }
+        pos = Vector(r[0], r[1], zPlane_);
+        dir = Vector(r[2], r[3], -sqrt(std::max(0., 1. - r[2] * r[2] - r[3] * r[3])));
+        return true;
+    }
+
+    // 同じレンズで, ピントと絞りと面間隔(インナーフォーカス/ズーム)が作ったときのままか.
+    bool matches(const Body &body) const
+    {
+        if (empty() || fabs(body.imageSurfaceZ_ - imageSurfaceZ_) >= 1e-9 || body.irisScale_ != irisScale_)
+            return false;
+        if (body.surfaces_.size() != gaps_.size() || shapeHash(body) != shape_)
+            return false;
+        for (size_t i = 0; i < gaps_.size(); i++)
+            if (fabs(body.gap(i) - gaps_[i]) >= 1e-9)
+                return false;
+        return true;
+    }
+
+    // 面の種類, 曲率, 非球面, 有効径, 材質, 偏心, 絞り羽根の FNV-1a. 面間隔は入れない.
+    static uint32_t shapeHash(const Body &body)
+    {
+        uint32_t hash = 2166136261u;
+        auto     feed = [&](double x) {
+            uint8_t bytes[sizeof(double)];
+            memcpy(bytes, &x, sizeof(double));
+            for (uint8_t b : bytes)
+                hash = (hash ^ b) * 16777619u;
+        };
+        for (const Surface &s : body.surfaces_)
+        {
+            feed((double)s.type_);
+            feed(s.isStop_ ? 1. : 0.);
+            feed(s.curve_);
+            feed(s.conic_);
+            for (int k = 0; k < Surface::N_Aspherical; k++)
+                feed(s.aspherical_[k]);
+            feed(s.diameter_);
+            feed(s.ior_);
+            feed(s.abbeVd_);
+            feed(s.decenterX_);
+            feed(s.decenterY_);
+            feed(s.tiltX_);
+            feed(s.tiltY_);
+            feed(s.tiltZ_);
+            feed((double)s.iris_.blades_);
+            feed(s.iris_.curvature_);
+            feed(s.iris_.rotation_);
+        }
+        return hash;
+    }
+
+    bool save(const char *filename) const
+    {
+        FILE *fp = fopen(filename, "wb");
+        if (!fp)
+        {
+            printf("lightfield %s open fail\n", filename);
+            return false;
+        }
+        std::vector<uint8_t> head(headerSize(channels(), gaps_.size()), 0);
+        writeHeader(head.data());
+        bool ok = fwrite(head.data(), 1, head.size(), fp) == head.size();
+        ok      = ok && fwrite(data_, 1, bytes(), fp) == bytes();
+        ok      = (fclose(fp) == 0) && ok;
+        return ok;
+    }
+
+    // ファイルを割り付けて, テーブル本体はコピーせずに使う. mmapの無い環境では読み込む.
+    bool map(const char *filename)
+    {
+        storage_.clear();
+        unmap();
+#ifndef _WIN32
+        const int fd = open(filename, O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        void       *p = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+            p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED)
+            return false;
+        map_     = p;
+        mapSize_ = (size_t)st.st_size;
+        if (!readHeader((const uint8_t *)map_, mapSize_))
+        {
+            unmap();
+            return false;
+        }
+        data_ = (const uint16_t *)((const uint8_t *)map_ + headerSize(channels(), gaps_.size()));
+        return true;
+#else
+        return load(filename);
+#endif
+    }
+
+    // ファイルを全部メモリに読む.
+    bool load(const char *filename)
+    {
+        storage_.clear();
+        unmap();
+        FILE *fp = fopen(filename, "rb");
+        if (!fp)
+            return false;
+        fseek(fp, 0, SEEK_END);
+        const long size = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+        std::vector<uint8_t> file(size > 0 ? (size_t)size : 0);
+        const bool           ok = !file.empty() && fread(file.data(), 1, file.size(), fp) == file.size() && readHeader(file.data(), file.size());
+        fclose(fp);
+        if (!ok)
+            return false;
+        storage_.resize(bytes() / sizeof(uint16_t));
+        memcpy(storage_.data(), file.data() + headerSize(channels(), gaps_.size()), bytes());
+        data_ = storage_.data();
+        return true;
+    }
+
+    void unmap(void)
+    {
+#ifndef _WIN32
+        if (map_)
+            munmap(map_, mapSize_);
+#endif
+        map_     = NULL;
+        mapSize_ = 0;
+        data_    = storage_.empty() ? NULL : storage_.data();
+    }
+
+  private:
+    const uint16_t       *data_;
+    std::vector<uint16_t> storage_;
+    void                 *map_;
+    size_t                mapSize_;
+
+    size_t maskWords(void) const { return (entries() + 15) / 16; }
+
+    // ヘッダ: uint32[10], double[6], lambdas, gaps, ranges. 本体(光線, 通過ビット)が64バイト境界から始まるように詰める.
+    static size_t headerSize(size_t channels, size_t surfaces)
+    {
+        const size_t raw = sizeof(uint32_t) * 10 + sizeof(double) * (6 + channels + surfaces) + sizeof(float) * channels * N_COMPONENT * 2;
+        return (raw + 63) / 64 * 64;
+    }
+
+    void writeHeader(uint8_t *p) const
+    {
+        const uint32_t header[10] = {MAGIC, VERSION, (uint32_t)ns_, (uint32_t)nt_, (uint32_t)nu_, (uint32_t)nv_, (uint32_t)channels(), (uint32_t)headerSize(channels(), gaps_.size()),
+            (uint32_t)gaps_.size(), shape_};
+        const double   params[6]  = {sensorWidth_, sensorHeight_, overscan_, zPlane_, imageSurfaceZ_, irisScale_};
+        memcpy(p, header, sizeof(header));
+        p += sizeof(header);
+        memcpy(p, params, sizeof(params));
+        p += sizeof(params);
+        memcpy(p, lambdas_.data(), sizeof(double) * lambdas_.size());
+        p += sizeof(double) * lambdas_.size();
+        memcpy(p, gaps_.data(), sizeof(double) * gaps_.size());
+        p += sizeof(double) * gaps_.size();
+        memcpy(p, ranges_.data(), sizeof(float) * ranges_.size());
+    }
+
+    bool readHeader(const uint8_t *p, size_t size)
+    {
+        uint32_t header[10];
+        double   params[6];
+        if (size < sizeof(header) + sizeof(params))
+            return false;
+        memcpy(header, p, sizeof(header));
+        if (header[0] != MAGIC || header[1] != VERSION || header[6] == 0 || header[7] != headerSize(header[6], header[8]))
+            return false;
+        ns_ = header[2];
+        nt_ = header[3];
+        nu_ = header[4];
+        nv_ = header[5];
+        lambdas_.resize(header[6]);
+        gaps_.resize(header[8]);
+        shape_ = header[9];
+        ranges_.resize(header[6] * N_COMPONENT * 2);
+        if (ns_ < 2 || nt_ < 2 || nu_ < 2 || nv_ < 2 || size != header[7] + bytes())
+            return false;
+        p += sizeof(header);
+        memcpy(params, p, sizeof(params));
+        p += sizeof(params);
+        sensorWidth_   = params[0];
+        sensorHeight_  = params[1];
+        overscan_      = params[2];
+        zPlane_        = params[3];
+        imageSurfaceZ_ = params[4];
+        irisScale_     = params[5];
+        memcpy(lambdas_.data(), p, sizeof(double) * lambdas_.size());
+        p += sizeof(double) * lambdas_.size();
+        memcpy(gaps_.data(), p, sizeof(double) * gaps_.size());
+        p += sizeof(double) * gaps_.size();
+        memcpy(ranges_.data(), p, sizeof(float) * ranges_.size());
+        return true;
+    }
+
+    size_t index(size_t c, size_t s, size_t t, size_t u, size_t v) const
+    {
+        return (((c * nt_ + t) * ns_ + s) * nv_ + v) * nu_ + u;
+    }
+
+    double sensorX(double s) const { return (s / (double)(ns_ - 1) - 0.5) * sensorWidth_; }
+    double sensorY(double t) const { return (t / (double)(nt_ - 1) - 0.5) * sensorHeight_; }
+    static double pupil(size_t i, size_t n) { return 2. * (double)i / (double)(n - 1) - 1.; }
+    static double clampGrid(double g, size_t n) { return std::min(std::max(g, 0.), (double)(n - 1)); }
+};
+} // namespace Lens
+
+#endif
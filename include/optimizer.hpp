@@ -0,0 +1,384 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+#ifndef __OPTIMIZER_H
+#define __OPTIMIZER_H
+
+#include <math.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <autodiff.hpp>
+#include <lens.hpp>
+#include <parallel.hpp>
+#include <paraxial.hpp>
+#include <pupil.hpp>
+
+namespace Lens
+{
+// 減衰最小二乗(Levenberg-Marquardt)によるレンズ最適化.
+// メリット関数はスポット(重心まわりの横収差)と焦点距離の重み付き二乗和.
+// ヤコビアンは前進差分か, 追跡そのものの自動微分(autoDiff_)で求める.
+class Optimizer
+{
+  public:
+    struct Variable
+    {
+        typedef enum
+        {
+            CURVE,
+            THICKNESS,
+            CONIC,
+            ASPHERICAL,
+            IMAGE, // 最終面から像面までの間隔. surface_は使わない. 最終面の THICKNESS と同じもの.
+        } KIND;
+
+        KIND   kind_;
+        size_t surface_;
+        int    index_; // ASPHERICALの次数index.
+        double step_;  // 数値微分の刻み. 自動微分では使わない.
+
+        Variable(KIND kind = CURVE, size_t surface = 0, int index = 0, double step = 0.)
+            : kind_(kind), surface_(surface), index_(index), step_(step) { ; }
+    };
+
+    struct Result
+    {
+        double              initial_; // 最初のメリット値.
+        double              final_;   // 最後のメリット値.
+        size_t              iterations_;
+        size_t              evaluations_;
+        std::vector<double> values_; // 最適化後の変数.
+    };
+
+    std::vector<Variable> variables_;
+    std::vector<Field>    fields_;
+    std::vector<double>   lambdas_;
+    size_t                pupilRays_;     // 1画角あたりの瞳サンプル数(六方格子).
+    double                spotWeight_;    // スポット残差の重み.
+    double                targetFocal_;   // 0なら焦点距離を拘束しない.
+    double                focalWeight_;   // 焦点距離残差の重み.
+    double                penalty_;       // ケラれた光線の残差[mm].
+    size_t                maxIterations_;
+    double                tolerance_;     // メリット値の相対改善がこれ以下で終了.
+    size_t                threads_;
+    bool                  autoDiff_;      // ヤコビアンを自動微分で求める.
+
+    Optimizer()
+        : fields_(1, Field(0., 0.)), lambdas_(1, 587.56), pupilRays_(37), spotWeight_(1.), targetFocal_(0.), focalWeight_(1.), penalty_(1.), maxIterations_(50), tolerance_(1e-6), threads_(0), autoDiff_(false) { ; }
+
+    template <typename T>
+    static T get(const BasicBody<T> &body, const Variable &v)
+    {
+        // 間隔で持つので, THICKNESS で前の面が動いても像面との間隔は変わらない.
+        if (v.kind_ == Variable::IMAGE)
+            return body.surfaces_.empty() ? body.imageSurfaceZ_ : body.gap(body.surfaces_.size() - 1);
+        const BasicSurface<T> &s = body.surfaces_[v.surface_];
+        switch (v.kind_)
+        {
+        case Variable::CURVE:
+            return s.curve_;
+        case Variable::THICKNESS:
+            return body.gap(v.surface_);
+        case Variable::CONIC:
+            return s.conic_;
+        case Variable::ASPHERICAL:
+            return s.aspherical_[v.index_];
+        default:
+            break;
+        }
+        return T(0.);
+    }
+
+    template <typename T>
+    static void set(BasicBody<T> &body, const Variable &v, T value)
+    {
+        if (v.kind_ == Variable::IMAGE)
+        {
+            if (body.surfaces_.empty())
+                body.imageSurfaceZ_ = value;
+            else
+                body.setGap(body.surfaces_.size() - 1, value);
+            return;
+        }
+        BasicSurface<T> &s = body.surfaces_[v.surface_];
+        switch (v.kind_)
+        {
+        case Variable::CURVE:
+            s.setCurve(value);
+            break;
+        case Variable::THICKNESS:
+            body.setGap(v.surface_, value); // 後ろの面だけ動かす.
+            break;
+        case Variable::CONIC:
+            s.conic_ = value;
+            break;
+        case Variable::ASPHERICAL:
+            s.aspherical_[v.index_] = value;
+            break;
+        default:
+            break;
+        }
+    }
+
+    // 数値微分の刻み. 指定がなければ値の大きさから決める.
+    static double step(const Variable &v, double value)
+    {
+        if (v.step_ > 0.)
+            return v.step_;
+        switch (v.kind_)
+        {
+        case Variable::CURVE:
+            return std::max(1e-7, fabs(value) * 1e-5);
+        case Variable::THICKNESS:
+        case Variable::IMAGE:
+            return std::max(1e-5, fabs(value) * 1e-5);
+        case Variable::CONIC:
+            return 1e-5;
+        case Variable::ASPHERICAL:
+            return std::max(1e-14, fabs(value) * 1e-5);
+        }
+        return 1e-6;
+    }
+
+    size_t residualCount(void) const
+    {
+        return fields_.size() * lambdas_.size() * Pupil::hexGrid(pupilRays_).size() * 2 + ((targetFocal_ != 0.) ? 1 : 0);
+    }
+
+    // 残差ベクトル. 1回の評価で全画角/波長/瞳サンプルをまとめて追跡する.
+    void residuals(const Body &body, const std::vector<Pupil::Sample> &pupil, std::vector<double> &r) const
+    {
+        residuals(body, body, pupil, r);
+    }
+
+    // 瞳の位置合わせ(主光線, 入射瞳半径)はaimで行い, bodyはそれを固定したまま追跡する.
+    // 自動微分ではaimに値だけのBodyを渡すので, 瞳の移動による微分は含まれない.
+    template <typename T>
+    void residuals(const BasicBody<T> &body, const Body &aim, const std::vector<Pupil::Sample> &pupil, std::vector<T> &r) const
+    {
+        typedef VECTORMATH::Vector3<T> Vec;
+        r.assign(residualCount(), T(0.));
+        Pupil::Entrance entrance;
+        entrance.setup(aim, lambdas_[0]);
+
+        const size_t      perField = lambdas_.size() * pupil.size();
+        const double      norm     = spotWeight_ / sqrt((double)(perField * fields_.size()));
+        std::vector<Vec>  hits(perField);
+        std::vector<bool> ok(perField);
+        size_t            k = 0;
+        for (const Field &field : fields_)
+        {
+            const Vector chief = entrance.chief(aim, field, lambdas_[0]);
+            const Vector dir   = field.direction();
+            T            cx = 0., cy = 0.;
+            size_t       count = 0;
+            for (size_t l = 0; l < lambdas_.size(); l++)
+                for (size_t i = 0; i < pupil.size(); i++)
+                {
+                    const size_t j    = l * pupil.size() + i;
+                    const Vec    orig = Vec(chief.x + pupil[i].x_ * entrance.radius_, chief.y + pupil[i].y_ * entrance.radius_, chief.z);
+                    Vec          hitDir;
+                    ok[j] = body.trace(orig, Vec(dir.x, dir.y, dir.z), lambdas_[l], hits[j], hitDir);
+                    if (ok[j])
+                    {
+                        cx += hits[j].x;
+                        cy += hits[j].y;
+                        count++;
+                    }
+                }
+            if (count)
+            {
+                cx /= (double)count;
+                cy /= (double)count;
+            }
+            for (size_t j = 0; j < perField; j++)
+            {
+                r[k++] = ok[j] ? T((hits[j].x - cx) * norm) : T(penalty_ * norm);
+                r[k++] = ok[j] ? T((hits[j].y - cy) * norm) : T(penalty_ * norm);
+            }
+        }
+        if (targetFocal_ != 0.)
+            r[k++] = focalWeight_ * (Paraxial::focalLength(body, lambdas_[0]) - targetFocal_);
+    }
+
+    // ヤコビアン J[変数][残差]. rはbodyでの残差. 戻り値は残差の評価回数.
+    size_t jacobian(const Body &body, const std::vector<Pupil::Sample> &pupil, const std::vector<double> &x, const std::vector<double> &r, std::vector<std::vector<double>> &J) const
+    {
+        const size_t n = variables_.size();
+        const size_t m = r.size();
+        J.assign(n, std::vector<double>(m, 0.));
+
+        if (autoDiff_)
+        {
+            // LANES個ずつの変数を1回の追跡で微分する.
+            const size_t chunks = (n + AutoDiff::LANES - 1) / AutoDiff::LANES;
+            PARALLEL::parallelFor(chunks, [&](size_t c) {
+                AutoDiff::Body ad    = AutoDiff::lift(body);
+                const size_t   begin = c * AutoDiff::LANES;
+                const size_t   end   = std::min(n, begin + AutoDiff::LANES);
+                // 値を上書きせずにレーンを足す. 先に設定した変数の影響(厚み->像面位置など)を残すため.
+                for (size_t j = begin; j < end; j++)
+                    set(ad, variables_[j], get(ad, variables_[j]) + AutoDiff::variable(0., (int)(j - begin)));
+                std::vector<AutoDiff::Number> rd;
+                residuals(ad, body, pupil, rd);
+                for (size_t j = begin; j < end; j++)
+                    for (size_t i = 0; i < m; i++)
+                        J[j][i] = AutoDiff::derivative(rd[i], (int)(j - begin));
+            },
+                threads_);
+            return chunks;
+        }
+
+        // 列ごとに別スレッド, 別コピーのBodyで前進差分.
+        PARALLEL::parallelFor(n, [&](size_t j) {
+            Body         copy = body;
+            const double h    = step(variables_[j], x[j]);
+            set(copy, variables_[j], x[j] + h);
+            std::vector<double> rj;
+            residuals(copy, pupil, rj);
+            for (size_t i = 0; i < m; i++)
+                J[j][i] = (rj[i] - r[i]) / h;
+        },
+            threads_);
+        return n;
+    }
+
+    static double cost(const std::vector<double> &r)
+    {
+        double c = 0.;
+        for (double v : r)
+            c += v * v;
+        return c;
+    }
+
+    Result optimize(Body &body) const
+    {
+        DOMIPLAN_STATS_SCOPE(OPTIMIZE);
+        const size_t                     n     = variables_.size();
+        const std::vector<Pupil::Sample> pupil = Pupil::hexGrid(pupilRays_);
+
+        Result res;
+        res.iterations_  = 0;
+        res.evaluations_ = 0;
+
+        std::vector<double> x(n);
+        for (size_t j = 0; j < n; j++)
+            x[j] = get(body, variables_[j]);
+
+        std::vector<double> r;
+        residuals(body, pupil, r);
+        res.evaluations_++;
+        double current = cost(r);
+        res.initial_   = current;
+
+        const size_t                     m = r.size();
+        std::vector<std::vector<double>> J(n, std::vector<double>(m));
+        std::vector<double>              A(n * n), g(n), delta(n);
+        double                           lambda = 1e-3;
+
+        for (size_t iter = 0; iter < maxIterations_ && n > 0; iter++)
+        {
+            res.iterations_++;
+            res.evaluations_ += jacobian(body, pupil, x, r, J);
+
+            for (size_t a = 0; a < n; a++)
+            {
+                double ga = 0.;
+                for (size_t i = 0; i < m; i++)
+                    ga += J[a][i] * r[i];
+                g[a] = ga;
+                for (size_t b = 0; b <= a; b++)
+                {
+                    double s = 0.;
+                    for (size_t i = 0; i < m; i++)
+                        s += J[a][i] * J[b][i];
+                    A[a * n + b] = A[b * n + a] = s;
+                }
+            }
+
+            bool improved = false;
+            for (int retry = 0; retry < 10; retry++)
+            {
+                if (!solve(A, g, lambda, delta))
+                {
+                    lambda *= 10.;
+                    continue;
+                }
+
+                Body trial = body;
+                for (size_t j = 0; j < n; j++)
+                    set(trial, variables_[j], x[j] - delta[j]);
+                std::vector<double> rt;
+                residuals(trial, pupil, rt);
+                res.evaluations_++;
+                const double c = cost(rt);
+                if (c < current)
+                {
+                    const double gain = (current - c) / std::max(current, 1e-300);
+                    body              = trial;
+                    for (size_t j = 0; j < n; j++)
+                        x[j] = get(body, variables_[j]); // 同じ間隔を2つの変数で持っていても実際の値に揃える.
+                    r.swap(rt);
+                    current  = c;
+                    lambda   = std::max(lambda / 3., 1e-12);
+                    improved = gain > tolerance_;
+                    break;
+                }
+                lambda *= 4.;
+            }
+            if (!improved)
+                break;
+        }
+
+        res.final_  = current;
+        res.values_ = x;
+        return res;
+    }
+
+  private:
+    // (A + lambda diag(A)) delta = g をコレスキー分解で解く.
+    static bool solve(const std::vector<double> &A, const std::vector<double> &g, double lambda, std::vector<double> &delta)
+    {
+        const size_t        n = g.size();
+        std::vector<double> L(n * n, 0.);
+        for (size_t i = 0; i < n; i++)
+        {
+            for (size_t j = 0; j <= i; j++)
+            {
+                double s = A[i * n + j];
+                if (i == j)
+                    s += lambda * std::max(A[i * n + i], 1e-30);
+                for (size_t k = 0; k < j; k++)
+                    s -= L[i * n + k] * L[j * n + k];
+                if (i == j)
+                {
+                    if (s <= 0.)
+                        return false;
+                    L[i * n + i] = sqrt(s);
+                }
+                else
+                    L[i * n + j] = s / L[j * n + j];
+            }
+        }
+        std::vector<double> y(n);
+        for (size_t i = 0; i < n; i++)
+        {
+            double s = g[i];
+            for (size_t k = 0; k < i; k++)
+                s -= L[i * n + k] * y[k];
+            y[i] = s / L[i * n + i];
+        }
+        delta.resize(n);
+        for (size_t i = n; i-- > 0;)
+        {
+            double s = y[i];
+            for (size_t k = i + 1; k < n; k++)
+                s -= L[k * n + i] * delta[k];
+            delta[i] = s / L[i * n + i];
+        }
+        return true;
+    }
+};
+} // namespace Lens
+
+#endif
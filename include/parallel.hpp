@@ -0,0 +1,56 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+#ifndef __PARALLEL_H
+#define __PARALLEL_H
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace PARALLEL
+{
+inline size_t concurrency(void)
+{
+    const unsigned int n = std::thread::hardware_concurrency();
+    return n ? n : 1;
+}
+
+// func(index) for index in [0,count). jobs are handed out dynamically,
+// so callers should keep any per-job state indexed by the job, not by the thread.
+template <typename F>
+void parallelFor(size_t count, const F &func, size_t threads = 0)
+{
+    if (threads == 0)
+        threads = concurrency();
+    threads = std::min(threads, count);
+    if (threads <= 1)
+    {
+        for (size_t i = 0; i < count; i++)
+            func(i);
+        return;
+    }
+
+    std::atomic<size_t> next(0);
+    const auto          worker = [&]() {
+        for (;;)
+        {
+            const size_t i = next.fetch_add(1);
+            if (i >= count)
+                return;
+            func(i);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    pool.reserve(threads - 1);
+    for (size_t t = 1; t < threads; t++)
+        pool.emplace_back(worker);
+    worker();
+    for (auto &th : pool)
+        th.join();
+}
+} // namespace PARALLEL
+
+#endif
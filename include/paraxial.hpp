@@ -0,0 +1,161 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+#ifndef __PARAXIAL_H
+#define __PARAXIAL_H
+
+#include <math.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include <lens.hpp>
+
+namespace Lens
+{
+namespace Paraxial
+{
+    // 光軸近傍の平行光線で焦点距離を求める.
+    template <typename T>
+    inline T focalLength(const BasicBody<T> &body, double lambda = 587.56)
+    {
+        typedef VECTORMATH::Vector3<T> Vec;
+        const double h   = body.maxDiameter() * 1e-4;
+        Vec          pos = Vec(0., h, body.surfaces_.empty() ? T(0.) : body.surfaces_[0].vertex());
+        Vec          dir = Vec(0., 0., 1.);
+        if (!body.traceSurfaces(pos, dir, lambda, 0, body.surfaces_.size()) || dir.y == 0.)
+            return T(0.);
+        return -h / (dir.y / dir.z);
+    }
+
+    // 無限遠物体の近軸焦点(ワールドz).
+    inline double focus(const Body &body, double lambda = 587.56)
+    {
+        const double h   = body.maxDiameter() * 1e-4;
+        Vector       pos = Vector(0., h, body.surfaces_.empty() ? 0. : body.surfaces_[0].vertex());
+        Vector       dir = Vector(0., 0., 1.);
+        if (!body.traceSurfaces(pos, dir, lambda, 0, body.surfaces_.size()) || dir.y == 0.)
+            return body.imageSurfaceZ_;
+        return pos.z - pos.y * dir.z / dir.y;
+    }
+
+    // 近軸の(y, n*u)に掛ける2x2行列.
+    struct Matrix
+    {
+        double a_, b_, c_, d_;
+        Matrix(double a = 1., double b = 0., double c = 0., double d = 1.) : a_(a), b_(b), c_(c), d_(d) { ; }
+
+        Matrix operator*(const Matrix &m) const
+        {
+            return Matrix(a_ * m.a_ + b_ * m.c_, a_ * m.b_ + b_ * m.d_, c_ * m.a_ + d_ * m.c_, c_ * m.b_ + d_ * m.d_);
+        }
+
+        static Matrix refraction(double power) { return Matrix(1., 0., -power, 1.); }
+        static Matrix transfer(double reduced) { return Matrix(1., reduced, 0., 1.); }
+    };
+
+    // 第一面から各面までの行列の積を持つ. 面の屈折力は setup() で, 間隔は update() で入れ直す.
+    // 間隔が変わったら, 変わった最初の間隔より後ろの積だけ掛け直す.
+    // 偏心/傾き/非球面の高次項は無視する(頂点曲率だけ).
+    class System
+    {
+      public:
+        System() : lambda_(587.56), setupRevision_(0), revision_(0) { ; }
+
+        void setup(const Body &body, double lambda = 587.56)
+        {
+            lambda_ = lambda;
+            const size_t n = body.surfaces_.size();
+            power_.resize(n);
+            ior_.resize(n);
+            gap_.assign(n, 0.);
+            prefix_.resize(n);
+            double iorNow = 1.;
+            for (size_t i = 0; i < n; i++)
+            {
+                ior_[i]   = body.surfaces_[i].ior(lambda);
+                power_[i] = (ior_[i] - iorNow) * body.surfaces_[i].curve_;
+                iorNow    = ior_[i];
+            }
+            setupRevision_ = body.setupRevision_;
+            multiply(body, 0);
+        }
+
+        // Bodyに合わせる. 掛け直した最初の面のindexを返す. 何も変わっていなければ面の数.
+        size_t update(const Body &body)
+        {
+            if (body.setupRevision_ != setupRevision_ || body.surfaces_.size() != power_.size())
+            {
+                setup(body, lambda_);
+                return 0;
+            }
+            if (body.revision_ == revision_)
+                return power_.size();
+            // 最終面の後ろの間隔は行列に入らない.
+            size_t first = power_.size();
+            for (size_t i = 0; i + 1 < power_.size(); i++)
+                if (body.gap(i) != gap_[i])
+                {
+                    first = i + 1;
+                    break;
+                }
+            multiply(body, first);
+            return first;
+        }
+
+        // 第一面から最終面まで.
+        Matrix matrix(void) const { return prefix_.empty() ? Matrix() : prefix_.back(); }
+        const Matrix &matrix(size_t i) const { return prefix_[i]; }
+
+        // 像空間の焦点距離. 光軸平行の光線が最終面から出る傾きから.
+        double focalLength(void) const
+        {
+            const Matrix m = matrix();
+            return (m.c_ != 0.) ? -imageIor() / m.c_ : 0.;
+        }
+
+        // 最終面頂点から近軸焦点までの距離.
+        double backFocus(void) const
+        {
+            const Matrix m = matrix();
+            return (m.c_ != 0.) ? -m.a_ * imageIor() / m.c_ : 0.;
+        }
+
+        // 物体が第一面頂点の手前distance[mm]にあるときの, 最終面頂点から像までの距離. 0以下は無限遠.
+        double conjugate(double distance) const
+        {
+            if (distance <= 0.)
+                return backFocus();
+            const Matrix m = matrix();
+            const double d = m.c_ * distance + m.d_;
+            return (d != 0.) ? -imageIor() * (m.a_ * distance + m.b_) / d : 0.;
+        }
+
+        double imageIor(void) const { return ior_.empty() ? 1. : ior_.back(); }
+
+      private:
+        // 面 first から先の積を掛け直す.
+        void multiply(const Body &body, size_t first)
+        {
+            for (size_t i = first; i < power_.size(); i++)
+            {
+                Matrix m = Matrix::refraction(power_[i]);
+                if (i)
+                {
+                    gap_[i - 1] = body.gap(i - 1);
+                    m           = m * Matrix::transfer(gap_[i - 1] / ior_[i - 1]) * prefix_[i - 1];
+                }
+                prefix_[i] = m;
+            }
+            if (!power_.empty())
+                gap_.back() = body.gap(power_.size() - 1);
+            revision_ = body.revision_;
+        }
+
+        double              lambda_;
+        uint64_t            setupRevision_, revision_;
+        std::vector<double> power_, ior_, gap_;
+        std::vector<Matrix> prefix_;
+    };
+} // namespace Paraxial
+} // namespace Lens
+
+#endif
@@ -0,0 +1,88 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+#ifndef __POLARIZATION_H
+#define __POLARIZATION_H
+
+#include <math.h>
+
+#include <lens.hpp>
+
+namespace Lens
+{
+namespace Polarization
+{
+    // ストークスベクトルで偏光を運ぶ. Body::trace/traceSurfacesのpolicyに渡す.
+    // 参照軸ref_は光線に垂直で, S1 = I(ref_) - I(dir x ref_).
+    // 面ではs/pの強度透過率による二色性だけを扱い, 位相差(リターダンス)は扱わない.
+    struct Stokes
+    {
+        static constexpr bool ACTIVE = true;
+
+        double s_[4];
+        Vector ref_;
+
+        Stokes() { ; }
+        Stokes(const Vector &dir, double s0 = 1., double s1 = 0., double s2 = 0., double s3 = 0.)
+        {
+            s_[0] = s0;
+            s_[1] = s1;
+            s_[2] = s2;
+            s_[3] = s3;
+            // 光線に垂直な適当な軸. x軸に近いものを選ぶ.
+            const Vector axis = (fabs(dir.x) < 0.9) ? Vector(1., 0., 0.) : Vector(0., 1., 0.);
+            ref_              = (axis - dir * axis.dot(dir)).normal();
+        }
+
+        double intensity(void) const { return s_[0]; }
+        double degree(void) const { return (s_[0] > 0.) ? sqrt(s_[1] * s_[1] + s_[2] * s_[2] + s_[3] * s_[3]) / s_[0] : 0.; }
+
+        // 参照軸を光線まわりに回して to に合わせる.
+        void rotate(const Vector &dir, const Vector &to)
+        {
+            Vector       perp = dir;
+            const double c    = ref_.dot(to);
+            const double s    = perp.cross(ref_).dot(to);
+            const double c2   = c * c - s * s;
+            const double s2   = 2. * s * c;
+            const double s1   = c2 * s_[1] + s2 * s_[2];
+            s_[2]             = -s2 * s_[1] + c2 * s_[2];
+            s_[1]             = s1;
+            ref_              = to;
+        }
+
+        template <typename S, typename V>
+        void interact(const S &surf, double lambda, double iorNow, double iorNext, const V &in, const V &norm, const V &out)
+        {
+            const Vector i = Vector(primal(in.x), primal(in.y), primal(in.z));
+            const Vector n = Vector(primal(norm.x), primal(norm.y), primal(norm.z));
+            const Vector o = Vector(primal(out.x), primal(out.y), primal(out.z));
+
+            // s方向は入射面に垂直. 垂直入射ではs/pの区別がないので今の軸をそのまま使う.
+            Vector       sv  = i;
+            sv               = sv.cross(n);
+            const double len = sv.length();
+            if (len > 1e-12)
+                rotate(i, sv * (1. / len));
+
+            double rs, rp;
+            surf.reflectance(lambda, iorNow, iorNext, fabs(i.dot(n)), i.z >= 0., rs, rp);
+            const double ts = 1. - rs, tp = 1. - rp;
+
+            // 軸がsに揃った状態での二色性のミュラー行列.
+            const double a  = (ts + tp) * 0.5;
+            const double b  = (ts - tp) * 0.5;
+            const double c  = sqrt(ts * tp);
+            const double s0 = a * s_[0] + b * s_[1];
+            const double s1 = b * s_[0] + a * s_[1];
+            s_[0]           = s0;
+            s_[1]           = s1;
+            s_[2] *= c;
+            s_[3] *= c;
+
+            // s方向は屈折しても変わらないが, 数値誤差を落とすため出射方向に直交化しておく.
+            ref_ = (ref_ - o * ref_.dot(o)).normal();
+        }
+    };
+} // namespace Polarization
+} // namespace Lens
+
+#endif
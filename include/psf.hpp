@@ -0,0 +1,189 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+#ifndef __PSF_H
+#define __PSF_H
+
+#include <math.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <fft.hpp>
+#include <lens.hpp>
+#include <parallel.hpp>
+#include <pupil.hpp>
+
+namespace Lens
+{
+// 射出瞳の波面収差(OPD)からFFTで回折PSF/MTFを求める.
+class Diffraction
+{
+  public:
+    size_t pupilN_;  // 瞳グリッド(N x N).
+    size_t padding_; // FFTサイズ = pupilN_ * padding_.
+    size_t threads_;
+
+    struct Result
+    {
+        double lambda_;
+        size_t pupilN_;
+        size_t n_;                 // PSF/MTFのサイズ(n x n).
+        std::vector<double>  opd_; // 瞳上のOPD[waves]. 主光線基準.
+        std::vector<uint8_t> mask_; // 光線が通った瞳サンプル.
+        std::vector<double>  psf_; // 合計1に正規化, 中心がピーク位置.
+        std::vector<double>  mtf_; // 直流=1に正規化, 中心が直流.
+        double rmsWaves_, pvWaves_;
+        double strehl_;
+        double psfPitch_; // 像面でのPSF 1サンプルの間隔[mm].
+        double mtfPitch_; // MTF 1サンプルの空間周波数[cycles/mm].
+
+        // 中心からx方向(sagittal)/y方向(tangential)のMTF.
+        std::vector<double> mtfSlice(bool tangential) const
+        {
+            std::vector<double> slice(n_ / 2);
+            const size_t        c = n_ / 2;
+            for (size_t i = 0; i < slice.size(); i++)
+                slice[i] = tangential ? mtf_[(c + i) * n_ + c] : mtf_[c * n_ + c + i];
+            return slice;
+        }
+    };
+
+    Diffraction() : pupilN_(128), padding_(4), threads_(0) { ; }
+
+    Result evaluate(const Body &body, const Field &field, double lambda) const
+    {
+        DOMIPLAN_STATS_SCOPE(PSF);
+        Result res;
+        res.lambda_ = lambda;
+        res.pupilN_ = pupilN_;
+        res.n_      = FFT::nextPowerOf2(pupilN_ * padding_);
+        res.opd_.assign(pupilN_ * pupilN_, 0.);
+        res.mask_.assign(pupilN_ * pupilN_, 0);
+        res.rmsWaves_ = res.pvWaves_ = res.strehl_ = 0.;
+        res.psfPitch_ = res.mtfPitch_ = 0.;
+
+        if (body.surfaces_.empty())
+            return res;
+
+        Pupil::Entrance entrance;
+        entrance.setup(body, lambda);
+        const Vector chief    = entrance.chief(body, field, lambda);
+        const Vector dir      = field.direction();
+        const double waveLen  = lambda * 1e-6; // nm -> mm.
+        const double imageIor = body.imageIor(lambda);
+        const size_t last     = body.surfaces_.size();
+
+        // 主光線: 参照球の中心と半径.
+        Vector cPos = chief, cDir = dir;
+        double cOpl = 0.;
+        if (!body.traceSurfaces(cPos, cDir, lambda, 0, last, &cOpl) || cDir.z <= 0.)
+            return res;
+        const Vector center = cPos + cDir * ((body.imageSurfaceZ_ - cPos.z) / cDir.z);
+        const double radius = center.distance(cPos);
+
+        // 瞳グリッドを追跡してOPDを求める.
+        const size_t        N = pupilN_;
+        std::vector<double> sinU(N, 0.);
+        PARALLEL::parallelFor(N, [&](size_t j) {
+            for (size_t i = 0; i < N; i++)
+            {
+                const double u = (2. * (i + 0.5) / N - 1.);
+                const double v = (2. * (j + 0.5) / N - 1.);
+                if (u * u + v * v > 1.)
+                    continue;
+                Vector pos = Vector(chief.x + u * entrance.radius_, chief.y + v * entrance.radius_, chief.z);
+                Vector d   = dir;
+                double opl = 0.;
+                if (!body.traceSurfaces(pos, d, lambda, 0, last, &opl) || d.z <= 0.)
+                    continue;
+
+                // 参照球との交点まで進める. |pos + s d - center| = radius.
+                const Vector pc   = pos - center;
+                const double b    = d.dot(pc);
+                const double c    = pc.length2() - radius * radius;
+                const double disc = b * b - c;
+                if (disc < 0.)
+                    continue;
+                const double s0 = -b - sqrt(disc);
+                const double s1 = -b + sqrt(disc);
+                const double s  = (fabs(s0) < fabs(s1)) ? s0 : s1;
+
+                res.opd_[j * N + i]  = (opl + imageIor * s - cOpl) / waveLen;
+                res.mask_[j * N + i] = 1;
+
+                // 像空間の開口数(主光線に対する角度).
+                const double sn = sqrt(std::max(0., 1. - d.dot(cDir) * d.dot(cDir)));
+                sinU[j]         = std::max(sinU[j], sn * imageIor);
+            }
+        },
+            threads_);
+
+        // 平均を引いたRMS, PV.
+        double sum = 0., sum2 = 0., lo = 0., hi = 0.;
+        size_t count = 0;
+        for (size_t k = 0; k < N * N; k++)
+        {
+            if (!res.mask_[k])
+                continue;
+            const double w = res.opd_[k];
+            lo             = count ? std::min(lo, w) : w;
+            hi             = count ? std::max(hi, w) : w;
+            sum += w;
+            sum2 += w * w;
+            count++;
+        }
+        if (count == 0)
+            return res;
+        const double mean = sum / count;
+        res.rmsWaves_     = sqrt(std::max(0., sum2 / count - mean * mean));
+        res.pvWaves_      = hi - lo;
+
+        // 瞳関数 -> PSF.
+        const size_t              n = res.n_;
+        std::vector<FFT::Complex> field2(n * n, FFT::Complex(0., 0.));
+        const size_t              o = (n - N) / 2;
+        for (size_t j = 0; j < N; j++)
+            for (size_t i = 0; i < N; i++)
+                if (res.mask_[j * N + i])
+                    field2[(o + j) * n + (o + i)] = std::polar(1., 2. * M_PI * res.opd_[j * N + i]);
+
+        FFT::transform2D(field2, n, n, false, threads_);
+
+        res.psf_.resize(n * n);
+        double total = 0., peak = 0.;
+        for (size_t k = 0; k < n * n; k++)
+        {
+            res.psf_[k] = std::norm(field2[k]);
+            total += res.psf_[k];
+            peak = std::max(peak, res.psf_[k]);
+        }
+        // 無収差なら直流成分 = (開口サンプル数)^2.
+        res.strehl_ = peak / ((double)count * (double)count);
+        for (auto &p : res.psf_)
+            p /= total;
+
+        // PSF -> MTF.
+        for (size_t k = 0; k < n * n; k++)
+            field2[k] = FFT::Complex(res.psf_[k], 0.);
+        FFT::transform2D(field2, n, n, false, threads_);
+        res.mtf_.resize(n * n);
+        const double dc = std::abs(field2[0]);
+        for (size_t k = 0; k < n * n; k++)
+            res.mtf_[k] = std::abs(field2[k]) / dc;
+
+        FFT::shift2D(res.psf_, n, n);
+        FFT::shift2D(res.mtf_, n, n);
+
+        // 瞳グリッド1サンプル = 2NA/N (方向余弦), PSFの間隔 = lambda / (n * 2NA/N).
+        const double na = *std::max_element(sinU.begin(), sinU.end());
+        if (na > 0.)
+        {
+            res.psfPitch_ = waveLen * (double)N / (2. * na * (double)n);
+            res.mtfPitch_ = 1. / ((double)n * res.psfPitch_);
+        }
+        return res;
+    }
+};
+} // namespace Lens
+
+#endif
@@ -0,0 +1,196 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+#ifndef __PUPIL_H
+#define __PUPIL_H
+
+#include <math.h>
+
+#include <vector>
+
+#include <lens.hpp>
+
+namespace Lens
+{
+// 画角(度). 無限遠物体のみ.
+struct Field
+{
+    double x_, y_;
+    Field(double x = 0., double y = 0.) : x_(x), y_(y) { ; }
+
+    Vector direction(void) const
+    {
+        return Vector(tan(x_ * M_PI / 180.), tan(y_ * M_PI / 180.), 1.).normal();
+    }
+};
+
+namespace Pupil
+{
+    // 単位円内の瞳座標.
+    struct Sample
+    {
+        double x_, y_;
+        Sample(double x = 0., double y = 0.) : x_(x), y_(y) { ; }
+    };
+
+    // 単位円内に約count点の六方格子.
+    inline std::vector<Sample> hexGrid(size_t count)
+    {
+        std::vector<Sample> samples;
+        if (count <= 1)
+        {
+            samples.push_back(Sample(0., 0.));
+            return samples;
+        }
+        const double d    = sqrt(2. * M_PI / (sqrt(3.) * (double)count));
+        const double dy   = d * sqrt(3.) / 2.;
+        const int    rows = (int)(1. / dy);
+        samples.reserve(count + count / 8);
+        for (int j = -rows; j <= rows; j++)
+        {
+            const double y    = j * dy;
+            const double ox   = (j & 1) ? d * 0.5 : 0.;
+            const int    cols = (int)(1. / d) + 1;
+            for (int i = -cols; i <= cols; i++)
+            {
+                const double x = i * d + ox;
+                if (x * x + y * y <= 1.)
+                    samples.push_back(Sample(x, y));
+            }
+        }
+        return samples;
+    }
+
+    // [0,1)^2 -> 単位円. Shirley-Chiu concentric mapping.
+    inline Sample concentric(double u, double v)
+    {
+        const double a = 2. * u - 1.;
+        const double b = 2. * v - 1.;
+        if (a == 0. && b == 0.)
+            return Sample(0., 0.);
+        double r, phi;
+        if (a * a > b * b)
+        {
+            r   = a;
+            phi = (M_PI / 4.) * (b / a);
+        }
+        else
+        {
+            r   = b;
+            phi = (M_PI / 2.) - (M_PI / 4.) * (a / b);
+        }
+        return Sample(r * cos(phi), r * sin(phi));
+    }
+
+    // R2列(Roberts)による準乱数. offsetから続きを生成できる.
+    inline Sample r2(size_t index)
+    {
+        constexpr double g  = 1.32471795724474602596;
+        constexpr double a1 = 1. / g;
+        constexpr double a2 = 1. / (g * g);
+        const double     u  = fmod(0.5 + a1 * (double)index, 1.);
+        const double     v  = fmod(0.5 + a2 * (double)index, 1.);
+        return concentric(u, v);
+    }
+
+    inline std::vector<Sample> qmc(size_t count, size_t offset = 0)
+    {
+        std::vector<Sample> samples(count);
+        for (size_t i = 0; i < count; i++)
+            samples[i] = r2(offset + i);
+        return samples;
+    }
+
+    // 入射瞳. 第一面の頂点平面上で, 絞りを満たす光束の位置と半径.
+    class Entrance
+    {
+      public:
+        double z_;      // 第一面頂点.
+        double radius_; // 入射瞳半径.
+        double mag_;    // 第一面->絞りの横倍率(近軸).
+        int    stop_;
+
+        Entrance() : z_(0.), radius_(0.), mag_(1.), stop_(-1) { ; }
+
+        // 頂点平面上の点posから方向dirの光線が絞り平面を通る位置.
+        bool atStop(const Body &body, Vector pos, Vector dir, double lambda, Vector &hit) const
+        {
+            if (!body.traceSurfaces(pos, dir, lambda, 0, stop_))
+                return false;
+            const double t = (body.surfaces_[stop_].vertex() - pos.z) / dir.z;
+            hit            = pos + dir * t;
+            return true;
+        }
+
+        void setup(const Body &body, double lambda = 587.56)
+        {
+            z_      = body.surfaces_.empty() ? 0. : body.surfaces_[0].vertex();
+            stop_   = body.stopIndex();
+            radius_ = body.surfaces_.empty() ? 0. : body.surfaces_[0].diameter_;
+            mag_    = 1.;
+            if (stop_ < 0)
+                return;
+
+            const Surface &stop      = body.surfaces_[stop_];
+            const double   stopR     = stop.diameter_ * body.irisScale_ * std::max(stop.irisX_, stop.irisY_);
+            const double   h         = body.maxDiameter() * 1e-3;
+            const Vector   axis      = Vector(0., 0., 1.);
+            Vector         hit;
+            if (!atStop(body, Vector(0., h, z_), axis, lambda, hit) || hit.y == 0.)
+                return;
+            mag_    = hit.y / h;
+            radius_ = fabs(stopR / mag_);
+
+            // 実光線で周辺を合わせ込む.
+            for (int i = 0; i < 4; i++)
+            {
+                if (!atStop(body, Vector(0., radius_, z_), axis, lambda, hit))
+                    break;
+                const double err = fabs(hit.y) - stopR;
+                if (fabs(err) < 1e-9 * stopR)
+                    break;
+                radius_ -= err / fabs(mag_);
+            }
+        }
+
+        // 主光線が絞り中心を通るような頂点平面上の入射位置.
+        Vector chief(const Body &body, const Field &field, double lambda = 587.56) const
+        {
+            Vector pos = Vector(0., 0., z_);
+            if (stop_ < 0 || (field.x_ == 0. && field.y_ == 0.))
+                return pos;
+            const Vector dir = field.direction();
+            for (int i = 0; i < 8; i++)
+            {
+                Vector hit;
+                if (!atStop(body, pos, dir, lambda, hit))
+                    break;
+                if (hit.x * hit.x + hit.y * hit.y < 1e-18)
+                    break;
+                pos.x -= hit.x / mag_;
+                pos.y -= hit.y / mag_;
+            }
+            return pos;
+        }
+
+        // 有限距離の物点objectからの主光線が通る頂点平面上の位置.
+        Vector chiefFrom(const Body &body, const Vector &object, double lambda = 587.56) const
+        {
+            Vector pos = Vector(0., 0., z_);
+            if (stop_ < 0)
+                return pos;
+            for (int i = 0; i < 8; i++)
+            {
+                Vector hit;
+                if (!atStop(body, pos, (pos - object).normal(), lambda, hit))
+                    break;
+                if (hit.x * hit.x + hit.y * hit.y < 1e-18)
+                    break;
+                pos.x -= hit.x / mag_;
+                pos.y -= hit.y / mag_;
+            }
+            return pos;
+        }
+    };
+} // namespace Pupil
+} // namespace Lens
+
+#endif
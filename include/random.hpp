@@ -7,6 +7,7 @@
 #define __RANDOM_H
 
 #include <algorithm>
+#include <limits.h>
 #include <stdint.h>
 
 namespace RANDOM
@@ -72,6 +73,18 @@ class xoshiro256aa
 
     virtual ~xoshiro256aa() { ; }
 
+    // 状態の退避/復元. 途中から同じ列を再開するのに使う.
+    void state(uint64_t out[4]) const
+    {
+        for (int i = 0; i < 4; i++)
+            out[i] = s[i];
+    }
+    void setState(const uint64_t in[4])
+    {
+        for (int i = 0; i < 4; i++)
+            s[i] = in[i];
+    }
+
     inline uint64_t next(void)
     {
         const uint64_t result_starstar = rotl(s[1] * 5, 7) * 9;
@@ -0,0 +1,529 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+#ifndef __RENDERER_H
+#define __RENDERER_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <floatcanvas.hpp>
+#include <lens.hpp>
+#include <lightfield.hpp>
+#include <parallel.hpp>
+#include <pupil.hpp>
+#include <random.hpp>
+
+namespace Lens
+{
+// 像面の各画素から射出瞳へ光線を出し, 反転したBodyで物体側へ追って光源を拾うモンテカルロレンダラ.
+// 画素ごとの和とサンプル数を積み増していくので, パスを重ねるほど収束する.
+// 画素ごとに輝度の二乗和も持ち, タイルごとの誤差を見て目標に届かない所へサンプルを寄せる適応パスも回せる.
+// 乱数はタイルごとの独立な列で, 途中状態(和, サンプル数, 乱数の状態)をチェックポイントに保存して
+// 再開すると, 止めずに回した場合とビット単位で同じ結果になる.
+// 反転光学系の代わりに LightField のテーブルを持たせると, ガラスを追わずに補間した光線で描く.
+// 複数プロセスに分けるときは shard_ ごとに long_jump() した独立な乱数列で回し, 保存した途中状態を merge() で足す.
+class Renderer
+{
+  public:
+    static constexpr uint32_t MAGIC   = 0x4b435044; // "DPCK"
+    static constexpr uint32_t VERSION = 4;
+
+    // 物体側の球光源.
+    struct Light
+    {
+        Vector             position_; // ワールド座標[mm].
+        double             radius_;
+        FloatCanvas::Pixel color_; // 放射輝度.
+
+        Light(const Vector &position = Vector(0., 0., 0.), double radius = 1., const FloatCanvas::Pixel &color = FloatCanvas::Pixel(1.f, 1.f, 1.f))
+            : position_(position), radius_(radius), color_(color) { ; }
+    };
+
+    struct Scene
+    {
+        std::vector<Light> lights_;
+        FloatCanvas::Pixel background_; // どの光源にも当たらずレンズを抜けた光線.
+
+        Scene() : background_(0.f, 0.f, 0.f) { ; }
+    };
+
+    size_t   width_, height_;
+    double   sensorWidth_; // 画像の幅に対応するセンサー幅[mm].
+    size_t   tile_;        // [px]. 乱数列はタイルごと.
+    size_t   samples_;     // 1パスで1画素あたりのサンプル数.
+    double   overscan_;    // 射出瞳半径に対するサンプル範囲. ケラレで歪んだ瞳を拾う.
+    uint64_t seed_;
+    size_t   threads_;
+    double   lambdas_[3];   // R, G, B チャンネルを追う波長.
+    double   minLuminance_; // 相対誤差の分母の下限. 暗いタイルで誤差が発散しないように.
+    size_t   maxSamples_;   // 適応パスで1画素に足すサンプル数の上限.
+    uint32_t shard_;        // 分散レンダリングでの分担番号. 乱数列を shard_ 回 long_jump() した所から始める.
+
+    FloatCanvas::Canvas               sum_;    // 放射輝度の和.
+    std::vector<double>               sumSq_;  // 輝度(RGBの平均)の二乗和.
+    std::vector<uint32_t>             count_;  // 画素ごとのサンプル数. タイル内では同じ.
+    std::vector<RANDOM::xoshiro256aa> rngs_;   // タイルごとの乱数列.
+    uint32_t                          passes_; // 済んだパス数.
+
+    Renderer()
+        : width_(0), height_(0), sensorWidth_(36.), tile_(32), samples_(4), overscan_(1.25), seed_(1), threads_(0), minLuminance_(0.01), maxSamples_(64), shard_(0), passes_(0)
+    {
+        lambdas_[0] = 656.27;
+        lambdas_[1] = 587.56;
+        lambdas_[2] = 486.13;
+    }
+
+    // 反転したBodyとその射出瞳. Bodyと lambdas_[1] が変わらなければ使い回せる.
+    // table_ があれば光線はそこから引く. センサー寸法, lambdas_, overscan_ を揃えて作っておくこと.
+    struct Optics
+    {
+        Body                              reversed_;
+        Pupil::Entrance                   exit_;
+        double                            zRef_;     // 元のBodyの像面位置.
+        uint64_t                          revision_; // 元のBodyの revision_ / setupRevision_.
+        uint64_t                          setupRevision_;
+        std::shared_ptr<const LightField> table_;
+
+        Optics() : zRef_(0.), revision_(0), setupRevision_(0) { ; }
+    };
+
+    Optics prepare(const Body &body) const
+    {
+        Optics optics;
+        optics.reversed_ = body.reversed();
+        optics.exit_.setup(optics.reversed_, lambdas_[1]);
+        optics.zRef_          = body.imageSurfaceZ_;
+        optics.revision_      = body.revision_;
+        optics.setupRevision_ = body.setupRevision_;
+        return optics;
+    }
+
+    // prepare()したBodyが変わっていたら追従する. 変わっていなければfalse.
+    // 間隔/絞りだけなら反転Bodyの面を平行移動して瞳を探し直すだけで, 面のsetup()や反射率表は作り直さない.
+    // table_ は作ったときの間隔でしか使えないので外す.
+    bool update(Optics &optics, const Body &body) const
+    {
+        if (optics.revision_ == body.revision_ && optics.setupRevision_ == body.setupRevision_)
+            return false;
+        const size_t n = body.surfaces_.size();
+        if (optics.setupRevision_ != body.setupRevision_ || optics.reversed_.surfaces_.size() != n)
+        {
+            optics = prepare(body);
+            return true;
+        }
+
+        // reversed() と同じ z' = imageSurfaceZ_ - z.
+        Body        &rev  = optics.reversed_;
+        const double zRef = body.imageSurfaceZ_;
+        for (size_t k = 0; k < n; k++)
+        {
+            const size_t i = n - 1 - k;
+            Surface     &s = rev.surfaces_[k];
+            s.center_      = zRef - body.surfaces_[i].vertex() + s.radius_;
+            s.thickness_   = i ? body.surfaces_[i].vertex() - body.surfaces_[i - 1].vertex() : 0.;
+        }
+        rev.imageSurfaceZ_ = n ? zRef - body.surfaces_[0].vertex() : zRef;
+        rev.irisScale_     = body.irisScale_;
+        rev.revision_++;
+        optics.exit_.setup(rev, lambdas_[1]);
+        optics.zRef_     = zRef;
+        optics.revision_ = body.revision_;
+        optics.table_.reset();
+        return true;
+    }
+
+    size_t tilesX(void) const { return (width_ + tile_ - 1) / tile_; }
+    size_t tilesY(void) const { return (height_ + tile_ - 1) / tile_; }
+
+    // 蓄積を空にする. タイルtの乱数はseed_から shard_ 回 long_jump(), t回jump()した位置.
+    void setup(size_t width, size_t height)
+    {
+        width_  = width;
+        height_ = height;
+        sum_.setup(width_, height_);
+        sum_.fill(FloatCanvas::Pixel(0.f, 0.f, 0.f));
+        sumSq_.assign(width_ * height_, 0.);
+        count_.assign(width_ * height_, 0);
+        rngs_.clear();
+        RANDOM::xoshiro256aa stream(seed_);
+        for (uint32_t k = 0; k < shard_; k++)
+            stream.long_jump();
+        for (size_t t = 0; t < tilesX() * tilesY(); t++)
+        {
+            rngs_.push_back(stream);
+            stream.jump();
+        }
+        passes_ = 0;
+    }
+
+    // 全画素に samples_ ずつ足す.
+    void pass(const Optics &optics, const Scene &scene)
+    {
+        trace(optics, scene, std::vector<uint32_t>(tilesX() * tilesY(), (uint32_t)samples_));
+    }
+    void pass(const Body &body, const Scene &scene) { pass(prepare(body), scene); }
+
+    // タイルtの各画素に samples[t] ずつ足す. 各タイルは自分の画素と乱数列しか触らないので
+    // スレッド数によらず同じ結果になる.
+    void trace(const Optics &optics, const Scene &scene, const std::vector<uint32_t> &samples)
+    {
+        DOMIPLAN_STATS_SCOPE(RENDER);
+        const Body            &rev   = optics.reversed_;
+        const Pupil::Entrance &exit  = optics.exit_;
+        const double           zRef  = optics.zRef_;
+        const LightField      *table = optics.table_.get();
+
+        // 羽根のある絞りは瞳を円でなく羽根の形で引く. 瞳は絞りの像なので, 近軸倍率が負なら180度回す.
+        const int      stop  = rev.stopIndex();
+        const Surface *blade = (stop >= 0 && rev.surfaces_[stop].iris_.blades_) ? &rev.surfaces_[stop] : NULL;
+        const double   flip  = (exit.mag_ < 0.) ? -1. : 1.;
+        const double   irisX = blade ? flip * blade->irisX_ / std::max(blade->irisX_, blade->irisY_) : 1.;
+        const double   irisY = blade ? flip * blade->irisY_ / std::max(blade->irisX_, blade->irisY_) : 1.;
+        const double   open  = blade ? blade->iris_.area() * fabs(irisX * irisY) / M_PI : 1.;
+
+        PARALLEL::parallelFor(tilesX() * tilesY(), [&](size_t tile) {
+            const uint32_t n = samples[tile];
+            if (n == 0)
+                return;
+            const size_t x0 = (tile % tilesX()) * tile_, x1 = std::min(width_, x0 + tile_);
+            const size_t y0 = (tile / tilesX()) * tile_, y1 = std::min(height_, y0 + tile_);
+            RANDOM::xoshiro256aa &rng = rngs_[tile];
+
+            // タイル中心の主光線を中心に瞳をサンプルする.
+            const Vector chief  = table ? Vector(0., 0., 0.) : exit.chiefFrom(rev, sensor((x0 + x1) * 0.5, (y0 + y1) * 0.5), lambdas_[1]);
+            const double spread = exit.radius_ * overscan_;
+            const double weight = overscan_ * overscan_ * open;
+
+            for (size_t y = y0; y < y1; y++)
+                for (size_t x = x0; x < x1; x++)
+                {
+                    double acc[3] = {0., 0., 0.};
+                    double acc2   = 0.;
+                    for (uint32_t s = 0; s < n; s++)
+                    {
+                        // 引数の評価順はコンパイラ次第なので, 乱数は先に順に引く.
+                        const double        u      = rng.rand01();
+                        const double        v      = rng.rand01();
+                        const double        pu     = rng.rand01();
+                        const double        pv     = rng.rand01();
+                        Pupil::Sample       p;
+                        if (blade)
+                        {
+                            blade->iris_.sample(pu, pv, p.x_, p.y_);
+                            p.x_ *= irisX;
+                            p.y_ *= irisY;
+                        }
+                        else
+                            p = Pupil::concentric(pu, pv);
+                        const Vector        origin = sensor((double)x + u, (double)y + v);
+                        const Vector        aim    = Vector(chief.x + p.x_ * spread, chief.y + p.y_ * spread, chief.z);
+                        const Vector        dir    = (aim - origin).normal();
+                        double              l[3];
+                        for (int c = 0; c < 3; c++)
+                        {
+                            Vector     wp, wd;
+                            const bool ok = table ? table->ray(origin.x, origin.y, p.x_, p.y_, c, wp, wd) : sceneRay(rev, zRef, origin, dir, c, wp, wd);
+                            l[c]          = ok ? radiance(scene, wp, wd, c) * weight : 0.;
+                            acc[c] += l[c];
+                        }
+                        const double lum = (l[0] + l[1] + l[2]) / 3.;
+                        acc2 += lum * lum;
+                    }
+                    const size_t        i   = y * width_ + x;
+                    FloatCanvas::Pixel &dst = sum_.pixel_[i];
+                    dst                     = FloatCanvas::Pixel(dst[0] + (float)acc[0], dst[1] + (float)acc[1], dst[2] + (float)acc[2]);
+                    sumSq_[i] += acc2;
+                    count_[i] += n;
+                }
+        },
+            threads_);
+        passes_++;
+    }
+
+    // タイルの誤差. 画素平均の標準誤差のRMSを, タイルの平均輝度で割った相対値.
+    double tileError(size_t tile) const
+    {
+        const size_t x0 = (tile % tilesX()) * tile_, x1 = std::min(width_, x0 + tile_);
+        const size_t y0 = (tile / tilesX()) * tile_, y1 = std::min(height_, y0 + tile_);
+        double       se2 = 0., mean = 0.;
+        for (size_t y = y0; y < y1; y++)
+            for (size_t x = x0; x < x1; x++)
+            {
+                const size_t i = y * width_ + x;
+                const double n = (double)count_[i];
+                if (n < 2.)
+                    return INFINITY;
+                const FloatCanvas::Pixel &p = sum_.pixel_[i];
+                const double              m = (p[0] + p[1] + p[2]) / (3. * n);
+                se2 += std::max(0., sumSq_[i] / n - m * m) / (n - 1.);
+                mean += m;
+            }
+        const double pixels = (double)((x1 - x0) * (y1 - y0));
+        return sqrt(se2 / pixels) / std::max(mean / pixels, minLuminance_);
+    }
+
+    // 最悪タイルの誤差.
+    double error(void) const
+    {
+        double e = 0.;
+        for (size_t t = 0; t < tilesX() * tilesY(); t++)
+            e = std::max(e, tileError(t));
+        return e;
+    }
+
+    // 目標誤差に届かないタイルへ, 一様パス1回ぶん(samples_ x 画素数)の予算を配る.
+    // 誤差はサンプル数の平方根に反比例するので, 届くまでに要る数は n((e/target)^2 - 1).
+    // 全タイルが届いていれば全て0.
+    std::vector<uint32_t> allocate(double target) const
+    {
+        const size_t          tiles = tilesX() * tilesY();
+        std::vector<double>   need(tiles, 0.);
+        std::vector<uint32_t> samples(tiles, 0);
+        double                total = 0.;
+        for (size_t t = 0; t < tiles; t++)
+        {
+            const double e = tileError(t);
+            if (e <= target)
+                continue;
+            const size_t x0 = (t % tilesX()) * tile_, y0 = (t / tilesX()) * tile_;
+            const double n  = (double)count_[y0 * width_ + x0];
+            need[t]         = std::isinf(e) ? (double)samples_ : n * (e * e / (target * target) - 1.);
+            total += need[t] * (double)((std::min(width_, x0 + tile_) - x0) * (std::min(height_, y0 + tile_) - y0));
+        }
+        const double budget = (double)(samples_ * width_ * height_);
+        const double scale  = (total > budget) ? budget / total : 1.;
+        for (size_t t = 0; t < tiles; t++)
+            if (need[t] > 0.)
+                samples[t] = (uint32_t)std::min<double>(std::max(ceil(need[t] * scale), 1.), (double)maxSamples_);
+        return samples;
+    }
+
+    // 一様パスで下地を作った後, 全タイルが target 以下になるか passes に達するまで適応パスを回す.
+    // 目標に届いたらtrue.
+    bool renderAdaptive(const Optics &optics, const Scene &scene, double target, size_t passes, const char *checkpoint = NULL, size_t every = 1)
+    {
+        if (passes_ == 0)
+        {
+            pass(optics, scene);
+            if (!save(checkpoint, every, passes))
+                return false;
+        }
+        while (passes_ < passes)
+        {
+            const std::vector<uint32_t> samples = allocate(target);
+            if (std::find_if(samples.begin(), samples.end(), [](uint32_t n) { return n > 0; }) == samples.end())
+                break;
+            trace(optics, scene, samples);
+            if (!save(checkpoint, every, passes))
+                return false;
+        }
+        if (checkpoint && !save(checkpoint))
+            return false;
+        return error() <= target;
+    }
+    bool renderAdaptive(const Body &body, const Scene &scene, double target, size_t passes, const char *checkpoint = NULL, size_t every = 1)
+    {
+        return renderAdaptive(prepare(body), scene, target, passes, checkpoint, every);
+    }
+
+    // これまでに追った光線の数. 1サンプルあたりRGBの3本.
+    uint64_t rays(void) const
+    {
+        uint64_t n = 0;
+        for (uint32_t c : count_)
+            n += c;
+        return n * 3;
+    }
+
+    // passes_ が passes に達するまで回す. checkpointを渡すと every パスごとと最後に保存する.
+    // 既存のチェックポイントから再開するときは先に load() する.
+    bool render(const Optics &optics, const Scene &scene, size_t passes, const char *checkpoint = NULL, size_t every = 1)
+    {
+        while (passes_ < passes)
+        {
+            pass(optics, scene);
+            if (!save(checkpoint, every, passes))
+                return false;
+        }
+        return true;
+    }
+    bool render(const Body &body, const Scene &scene, size_t passes, const char *checkpoint = NULL, size_t every = 1)
+    {
+        return render(prepare(body), scene, passes, checkpoint, every);
+    }
+
+    // 平均した画像.
+    FloatCanvas::Canvas image(void) const
+    {
+        FloatCanvas::Canvas out(width_, height_);
+        for (size_t i = 0; i < width_ * height_; i++)
+        {
+            const float               w = count_[i] ? 1.f / (float)count_[i] : 0.f;
+            const FloatCanvas::Pixel &p = sum_.pixel_[i];
+            out.pixel_[i]               = FloatCanvas::Pixel(p[0] * w, p[1] * w, p[2] * w);
+        }
+        return out;
+    }
+
+    // 一時ファイルに書いてから置き換えるので, 書き込み中に止まっても前回の状態は残る.
+    bool save(const char *filename) const
+    {
+        const std::string tmp = std::string(filename) + ".tmp";
+        FILE             *fp  = fopen(tmp.c_str(), "wb");
+        if (!fp)
+        {
+            printf("checkpoint %s open fail\n", tmp.c_str());
+            return false;
+        }
+        const uint32_t header[9] = {MAGIC, VERSION, (uint32_t)width_, (uint32_t)height_, (uint32_t)tile_, (uint32_t)samples_, passes_, (uint32_t)rngs_.size(), shard_};
+        const double   params[7] = {sensorWidth_, overscan_, lambdas_[0], lambdas_[1], lambdas_[2], minLuminance_, (double)maxSamples_};
+        bool           ok        = fwrite(header, sizeof(header), 1, fp) == 1;
+        ok                       = ok && fwrite(&seed_, sizeof(seed_), 1, fp) == 1;
+        ok                       = ok && fwrite(params, sizeof(params), 1, fp) == 1;
+        std::vector<float> sum(width_ * height_ * 3);
+        for (size_t i = 0; i < width_ * height_; i++)
+            for (int c = 0; c < 3; c++)
+                sum[i * 3 + c] = sum_.pixel_[i][c];
+        ok = ok && fwrite(sum.data(), sizeof(float), sum.size(), fp) == sum.size();
+        ok = ok && fwrite(sumSq_.data(), sizeof(double), sumSq_.size(), fp) == sumSq_.size();
+        ok = ok && fwrite(count_.data(), sizeof(uint32_t), count_.size(), fp) == count_.size();
+        for (const RANDOM::xoshiro256aa &rng : rngs_)
+        {
+            uint64_t state[4];
+            rng.state(state);
+            ok = ok && fwrite(state, sizeof(state), 1, fp) == 1;
+        }
+        ok = (fclose(fp) == 0) && ok;
+        if (!ok)
+            return false;
+#ifdef _WIN32
+        remove(filename);
+#endif
+        return rename(tmp.c_str(), filename) == 0;
+    }
+
+    // 設定ごと復元する.
+    bool load(const char *filename)
+    {
+        FILE *fp = fopen(filename, "rb");
+        if (!fp)
+            return false;
+        uint32_t header[9];
+        double   params[7];
+        uint64_t seed;
+        bool     ok = fread(header, sizeof(header), 1, fp) == 1 && header[0] == MAGIC && header[1] == VERSION;
+        ok          = ok && fread(&seed, sizeof(seed), 1, fp) == 1;
+        ok          = ok && fread(params, sizeof(params), 1, fp) == 1;
+        if (ok)
+        {
+            tile_        = header[4];
+            samples_     = header[5];
+            shard_       = header[8];
+            seed_        = seed;
+            sensorWidth_ = params[0];
+            overscan_    = params[1];
+            for (int c = 0; c < 3; c++)
+                lambdas_[c] = params[2 + c];
+            minLuminance_ = params[5];
+            maxSamples_   = (size_t)params[6];
+            setup(header[2], header[3]);
+            passes_ = header[6];
+            ok      = tile_ > 0 && header[7] == rngs_.size();
+        }
+        if (ok)
+        {
+            std::vector<float> sum(width_ * height_ * 3);
+            ok = fread(sum.data(), sizeof(float), sum.size(), fp) == sum.size();
+            ok = ok && fread(sumSq_.data(), sizeof(double), sumSq_.size(), fp) == sumSq_.size();
+            ok = ok && fread(count_.data(), sizeof(uint32_t), count_.size(), fp) == count_.size();
+            for (size_t i = 0; ok && i < width_ * height_; i++)
+                sum_.pixel_[i] = FloatCanvas::Pixel(sum[i * 3 + 0], sum[i * 3 + 1], sum[i * 3 + 2]);
+            for (size_t t = 0; ok && t < rngs_.size(); t++)
+            {
+                uint64_t state[4];
+                ok = fread(state, sizeof(state), 1, fp) == 1;
+                rngs_[t].setState(state);
+            }
+        }
+        fclose(fp);
+        return ok;
+    }
+
+    // 同じ設定で別の shard_ を回した途中状態を足し込む. パス数とサンプル数も合算する.
+    // 浮動小数点の和なので, 同じ結果が欲しければ常に同じ順(例えば shard_ 順)で足すこと.
+    // 乱数の状態は自分のものが残るので, 足した後に続きを回すのには使えない.
+    bool merge(const Renderer &other)
+    {
+        const bool same = width_ == other.width_ && height_ == other.height_ && tile_ == other.tile_ && seed_ == other.seed_
+            && sensorWidth_ == other.sensorWidth_ && overscan_ == other.overscan_ && minLuminance_ == other.minLuminance_ && maxSamples_ == other.maxSamples_
+            && std::equal(lambdas_, lambdas_ + 3, other.lambdas_);
+        if (!same)
+            return false;
+        for (size_t i = 0; i < width_ * height_; i++)
+        {
+            FloatCanvas::Pixel       &dst = sum_.pixel_[i];
+            const FloatCanvas::Pixel &src = other.sum_.pixel_[i];
+            dst                           = FloatCanvas::Pixel(dst[0] + src[0], dst[1] + src[1], dst[2] + src[2]);
+            sumSq_[i] += other.sumSq_[i];
+            count_[i] += other.count_[i];
+        }
+        passes_ += other.passes_;
+        return true;
+    }
+
+  private:
+    // every パスごとと最後のパスで保存する. checkpointがNULLなら何もしない.
+    bool save(const char *checkpoint, size_t every, size_t passes) const
+    {
+        if (!checkpoint || (passes_ % std::max<size_t>(every, 1) != 0 && passes_ < passes))
+            return true;
+        return save(checkpoint);
+    }
+
+    // 画素座標 -> 反転座標系のセンサー上の点(z'=0). Bokehと同じく倒立像を正立させる向き.
+    Vector sensor(double px, double py) const
+    {
+        const double pitch = sensorWidth_ / (double)width_;
+        return Vector(-(px - width_ * 0.5) * pitch, -(py - height_ * 0.5) * pitch, 0.);
+    }
+
+    // 反転したBodyを抜けた光線をワールド座標で返す.
+    bool sceneRay(const Body &rev, double zRef, Vector pos, Vector dir, int c, Vector &p, Vector &d) const
+    {
+        if (!rev.traceSurfaces(pos, dir, lambdas_[c], 0, rev.surfaces_.size()))
+            return false;
+        p = Vector(pos.x, pos.y, zRef - pos.z);
+        d = Vector(dir.x, dir.y, -dir.z);
+        return true;
+    }
+
+    // 物体側の光線で一番手前の光源を探す.
+    double radiance(const Scene &scene, const Vector &p, const Vector &d, int c) const
+    {
+        double       best = INFINITY;
+        double       l    = scene.background_[c];
+        for (const Light &light : scene.lights_)
+        {
+            const Vector oc = light.position_ - p;
+            const double b  = oc.dot(d);
+            const double h  = b * b - (oc.dot(oc) - light.radius_ * light.radius_);
+            if (h < 0.)
+                continue;
+            const double t = b - sqrt(h);
+            if (t > 0. && t < best)
+            {
+                best = t;
+                l    = light.color_[c];
+            }
+        }
+        return l;
+    }
+};
+} // namespace Lens
+
+#endif
@@ -0,0 +1,456 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+#ifndef __RENDERSERVICE_H
+#define __RENDERSERVICE_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <lens.hpp>
+#include <lightfield.hpp>
+#include <parallel.hpp>
+#include <renderer.hpp>
+
+namespace Lens
+{
+// 常駐してレンダリングジョブをさばくサービス.
+// 読み込んだBodyと反転光学系(Renderer::Optics)をレンズファイルごとにLRUで持ち, ジョブを優先度順にワーカーへ配る.
+// ジョブに LightField のファイルがあれば割り付けてキャッシュに一緒に持ち, ガラスを追わずに描く.
+// 通信はしない. ソケットなどの受け口は daemon/ 側で作る.
+class RenderService
+{
+  public:
+    typedef enum
+    {
+        UNKNOWN,
+        QUEUED,
+        RUNNING,
+        DONE,
+        FAILED,
+    } STATE;
+
+    struct Job
+    {
+        uint64_t        id_;       // submitで振る.
+        int             priority_; // 大きいほど先. 同じなら投入順.
+        std::string     lens_;     // レンズファイル. キャッシュのキー.
+        std::string     table_;    // LightField のファイル. 空なら追跡する.
+        std::string     output_;   // 出力先. 書き方はsinkに任せる.
+        Renderer::Scene scene_;
+        size_t          width_, height_;
+        double          sensorWidth_;
+        size_t          samples_; // 1パスあたり.
+        size_t          passes_;  // 適応時は上限.
+        double          target_;  // >0なら renderAdaptive の目標誤差.
+        uint64_t        seed_;
+        size_t          threads_; // 1ジョブの中の並列数.
+
+        Job()
+            : id_(0), priority_(0), width_(640), height_(480), sensorWidth_(36.), samples_(4), passes_(16), target_(0.), seed_(1), threads_(1) { ; }
+    };
+
+    // 読み込み済みのレンズ.
+    struct Optics
+    {
+        Body             body_;
+        Renderer::Optics optics_;
+    };
+
+    typedef std::function<Body(const std::string &)>              Reader;
+    typedef std::function<bool(const Job &, const Renderer &)>     Sink;
+    typedef std::shared_ptr<const Optics>                          OpticsPtr;
+    typedef std::list<std::pair<std::string, OpticsPtr>>::iterator LruIterator;
+
+    // 最近使った順に capacity 個まで持つ. 使用中のものは shared_ptr で生き残るので, 追い出しても安全.
+    class Cache
+    {
+      public:
+        explicit Cache(size_t capacity = 8) : capacity_(capacity), hits_(0), misses_(0) { ; }
+
+        // 無ければ reader で読んで入れる. 面が無ければ読み込み失敗としてNULL.
+        // table を渡すとそれも割り付ける. レンズのピント/絞りと合わなければNULL.
+        OpticsPtr get(const std::string &lens, const Reader &reader, const std::string &table = std::string())
+        {
+            const std::string key = table.empty() ? lens : lens + "\n" + table;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto                        it = index_.find(key);
+                if (it != index_.end())
+                {
+                    lru_.splice(lru_.begin(), lru_, it->second);
+                    hits_++;
+                    return it->second->second;
+                }
+                misses_++;
+            }
+            // 読み込みはロックの外で. 同じキーを同時に読むと二度読むが, 後から入れた方が残るだけ.
+            std::shared_ptr<Optics> optics = std::make_shared<Optics>();
+            optics->body_                  = reader(lens);
+            if (optics->body_.surfaces_.empty())
+                return OpticsPtr();
+            optics->optics_ = Renderer().prepare(optics->body_);
+            if (!table.empty())
+            {
+                std::shared_ptr<LightField> field = std::make_shared<LightField>();
+                if (!field->map(table.c_str()) || !field->matches(optics->body_))
+                {
+                    printf("lightfield %s does not fit %s\n", table.c_str(), lens.c_str());
+                    return OpticsPtr();
+                }
+                optics->optics_.table_ = field;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto                        it = index_.find(key);
+            if (it != index_.end())
+                lru_.erase(it->second);
+            lru_.push_front(std::make_pair(key, OpticsPtr(optics)));
+            index_[key] = lru_.begin();
+            while (lru_.size() > capacity_)
+            {
+                index_.erase(lru_.back().first);
+                lru_.pop_back();
+            }
+            return optics;
+        }
+
+        bool contains(const std::string &key) const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return index_.count(key) != 0;
+        }
+
+        // レンズファイルを書き換えたときに.
+        void clear(void)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            lru_.clear();
+            index_.clear();
+        }
+
+        size_t size(void) const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return lru_.size();
+        }
+        uint64_t hits(void) const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return hits_;
+        }
+        uint64_t misses(void) const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return misses_;
+        }
+
+      private:
+        size_t                                       capacity_;
+        uint64_t                                     hits_, misses_;
+        std::list<std::pair<std::string, OpticsPtr>> lru_; // 先頭が最近.
+        std::unordered_map<std::string, LruIterator> index_;
+        mutable std::mutex                           mutex_;
+    };
+
+    Reader reader_;  // レンズファイルの読み込み. 既定はZEMAX.
+    Sink   sink_;    // 仕上がったジョブの書き出し. 失敗ならFAILED.
+    size_t history_; // 終わったジョブの状態を覚えておく数. 古いものから忘れて UNKNOWN になる.
+
+    explicit RenderService(size_t cacheSize = 8)
+        : reader_([](const std::string &file) { return Lens::Loader::ZEMAX::load(file.c_str()); }), history_(1024), cache_(cacheSize), nextId_(1), stop_(false), running_(0), alive_(0)
+    {
+        ;
+    }
+    ~RenderService() { shutdown(); }
+
+    RenderService(const RenderService &) = delete;
+    RenderService &operator=(const RenderService &) = delete;
+
+    // workers 本のワーカーを起こす. 0ならハードウェアスレッド数. 起こす前に積んだジョブも優先度順に流れる.
+    void start(size_t workers = 0)
+    {
+        if (workers == 0)
+            workers = std::max<unsigned>(1, std::thread::hardware_concurrency());
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = false;
+        alive_ += workers;
+        for (size_t i = 0; i < workers; i++)
+            workers_.push_back(std::thread([this]() { work(); }));
+    }
+
+    // 積まれているジョブは捨てずに流し切ってから止める. 以降の submit() は断る.
+    void shutdown(void)
+    {
+        std::vector<std::thread> workers;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+            workers.swap(workers_);
+        }
+        wake_.notify_all();
+        done_.notify_all();
+        for (std::thread &t : workers)
+            t.join();
+    }
+
+    // 止めている最中/止めた後は積まずに0を返す. 流すワーカーが居ないので wait() が返らなくなる.
+    uint64_t submit(Job job)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stop_)
+            return 0;
+        job.id_          = nextId_++;
+        states_[job.id_] = QUEUED;
+        queue_.push(job);
+        wake_.notify_one();
+        return job.id_;
+    }
+
+    STATE state(uint64_t id) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto                        it = states_.find(id);
+        return (it == states_.end()) ? UNKNOWN : it->second;
+    }
+
+    // 終わるまで待つ. 止めていてワーカーが残っていなければ, その時点の状態で返る.
+    // 止めずにワーカーを起こしていないと返らない.
+    STATE wait(uint64_t id)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [&]() {
+            auto it = states_.find(id);
+            return it == states_.end() || it->second == DONE || it->second == FAILED || (stop_ && alive_ == 0);
+        });
+        auto it = states_.find(id);
+        return (it == states_.end()) ? UNKNOWN : it->second;
+    }
+
+    size_t queued(void) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return queue_.size();
+    }
+    size_t running(void) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return running_;
+    }
+
+    Cache       &cache(void) { return cache_; }
+    const Cache &cache(void) const { return cache_; }
+
+    static const char *name(STATE s)
+    {
+        static const char *names[] = {"unknown", "queued", "running", "done", "failed"};
+        return names[s];
+    }
+
+    // "key=value" を空白区切りで並べた1行をジョブにする. 光源は複数並べてよい.
+    //   lens=<file> out=<file> table=<file> width=640 height=480 sensor=36 samples=4 passes=16 target=0.05
+    //   seed=1 threads=1 priority=0 background=r,g,b light=x,y,z,radius,r,g,b
+    // 読めないときはfalseでerrorに理由.
+    static bool parse(const std::string &line, Job &job, std::string &error)
+    {
+        std::istringstream in(line);
+        std::string        item;
+        while (in >> item)
+        {
+            const size_t eq = item.find('=');
+            if (eq == std::string::npos)
+            {
+                error = "expected key=value: " + item;
+                return false;
+            }
+            const std::string   key   = item.substr(0, eq);
+            const std::string   value = item.substr(eq + 1);
+            std::vector<double> v;
+            if (!numbers(value, v))
+            {
+                if (key != "lens" && key != "out" && key != "table")
+                {
+                    error = "bad value: " + item;
+                    return false;
+                }
+            }
+
+            if (key == "lens")
+                job.lens_ = value;
+            else if (key == "out")
+                job.output_ = value;
+            else if (key == "table")
+                job.table_ = value;
+            else if (key == "width" && integer(v, 1., MAX_SIZE))
+                job.width_ = (size_t)v[0];
+            else if (key == "height" && integer(v, 1., MAX_SIZE))
+                job.height_ = (size_t)v[0];
+            else if (v.size() == 1 && key == "sensor" && v[0] > 0.)
+                job.sensorWidth_ = v[0];
+            else if (key == "samples" && integer(v, 1., MAX_COUNT))
+                job.samples_ = (size_t)v[0];
+            else if (key == "passes" && integer(v, 1., MAX_COUNT))
+                job.passes_ = (size_t)v[0];
+            else if (v.size() == 1 && key == "target" && v[0] >= 0.)
+                job.target_ = v[0];
+            else if (key == "seed" && integer(v, 0., 9007199254740992.)) // doubleで正確に持てる範囲.
+                job.seed_ = (uint64_t)v[0];
+            else if (key == "threads" && integer(v, 0., MAX_COUNT)) // 0は全コア. 多すぎる指定はコア数に抑える.
+                job.threads_ = std::min((size_t)v[0], PARALLEL::concurrency());
+            else if (key == "priority" && integer(v, -MAX_PRIORITY, MAX_PRIORITY))
+                job.priority_ = (int)v[0];
+            else if (v.size() == 3 && key == "background")
+                job.scene_.background_ = FloatCanvas::Pixel((float)v[0], (float)v[1], (float)v[2]);
+            else if (v.size() == 7 && key == "light" && v[3] > 0.)
+                job.scene_.lights_.push_back(Renderer::Light(Vector(v[0], v[1], v[2]), v[3], FloatCanvas::Pixel((float)v[4], (float)v[5], (float)v[6])));
+            else
+            {
+                error = "bad parameter: " + item;
+                return false;
+            }
+        }
+        if (job.lens_.empty())
+        {
+            error = "lens= is required";
+            return false;
+        }
+        return true;
+    }
+
+  private:
+    struct Later
+    {
+        bool operator()(const Job &a, const Job &b) const
+        {
+            return (a.priority_ != b.priority_) ? a.priority_ < b.priority_ : a.id_ > b.id_;
+        }
+    };
+
+    Cache                                             cache_;
+    std::priority_queue<Job, std::vector<Job>, Later> queue_;
+    std::map<uint64_t, STATE>                         states_;
+    std::deque<uint64_t>                              finished_; // 終わった順.
+    std::vector<std::thread>                          workers_;
+    uint64_t                                          nextId_;
+    bool                                              stop_;
+    size_t                                            running_;
+    size_t                                            alive_; // まだ抜けていないワーカー.
+    mutable std::mutex                                mutex_;
+    std::condition_variable                           wake_, done_;
+
+    // ソケットから来る値の上限. 範囲外はキャストせずに断る.
+    static constexpr double MAX_SIZE     = 16384.;
+    static constexpr double MAX_COUNT    = 65536.;
+    static constexpr double MAX_PRIORITY = 1e9;
+
+    // 1つだけの, [lo, hi] に入る整数.
+    static bool integer(const std::vector<double> &v, double lo, double hi)
+    {
+        return v.size() == 1 && v[0] >= lo && v[0] <= hi && floor(v[0]) == v[0];
+    }
+
+    // カンマ区切りの有限な数値. 全部読めたときだけtrue.
+    static bool numbers(const std::string &s, std::vector<double> &out)
+    {
+        out.clear();
+        const char *p = s.c_str();
+        while (*p)
+        {
+            char        *end;
+            const double d = strtod(p, &end);
+            if (end == p || !std::isfinite(d))
+                return false;
+            out.push_back(d);
+            p = end;
+            if (*p == ',')
+                p++;
+            else if (*p)
+                return false;
+        }
+        return !out.empty();
+    }
+
+    void work(void)
+    {
+        for (;;)
+        {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [&]() { return stop_ || !queue_.empty(); });
+                if (queue_.empty())
+                {
+                    alive_--;
+                    done_.notify_all();
+                    return;
+                }
+                job = queue_.top();
+                queue_.pop();
+                states_[job.id_] = RUNNING;
+                running_++;
+            }
+
+            const bool ok = run(job);
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                states_[job.id_] = ok ? DONE : FAILED;
+                running_--;
+                finished_.push_back(job.id_);
+                while (finished_.size() > history_)
+                {
+                    states_.erase(finished_.front());
+                    finished_.pop_front();
+                }
+            }
+            done_.notify_all();
+        }
+    }
+
+    bool run(const Job &job)
+    {
+        const OpticsPtr optics = cache_.get(job.lens_, reader_, job.table_);
+        if (!optics)
+            return false;
+
+        Renderer renderer;
+        renderer.sensorWidth_ = job.sensorWidth_;
+        if (const LightField *table = optics->optics_.table_.get())
+        {
+            // センサー寸法はテーブルに合わせる. 縦横比が違えばテーブルの外を引くので断る.
+            renderer.sensorWidth_ = table->sensorWidth_;
+            renderer.overscan_    = table->overscan_;
+            if (table->channels() != 3)
+                return false;
+            for (int c = 0; c < 3; c++)
+                renderer.lambdas_[c] = table->lambdas_[c];
+            if (fabs(table->sensorHeight_ - table->sensorWidth_ * (double)job.height_ / (double)job.width_) > 1e-3 * table->sensorHeight_)
+                return false;
+        }
+        renderer.samples_     = job.samples_;
+        renderer.seed_        = job.seed_;
+        renderer.threads_     = job.threads_;
+        renderer.setup(job.width_, job.height_);
+        if (job.target_ > 0.)
+            renderer.renderAdaptive(optics->optics_, job.scene_, job.target_, job.passes_);
+        else
+            renderer.render(optics->optics_, job.scene_, job.passes_);
+        return sink_ ? sink_(job, renderer) : true;
+    }
+};
+} // namespace Lens
+
+#endif
@@ -0,0 +1,196 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+#ifndef __SPOT_H
+#define __SPOT_H
+
+#include <math.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <lens.hpp>
+#include <parallel.hpp>
+#include <pupil.hpp>
+#include <wavefront.hpp>
+
+namespace Lens
+{
+// スポットダイアグラム. 各画角について瞳全体を像面まで追跡し, 重心/RMS/幾何半径を求める.
+class SpotDiagram
+{
+  public:
+    typedef enum
+    {
+        HEX, // 六方格子
+        QMC, // R2準乱数
+    } PATTERN;
+
+    struct Point
+    {
+        double x_, y_;
+        int    lambda_; // 波長のindex.
+    };
+
+    struct Result
+    {
+        Field              field_;
+        double             centroidX_, centroidY_;
+        double             rms_; // 重心まわりのRMS半径.
+        double             geo_; // 重心まわりの最大半径.
+        size_t             rays_;
+        size_t             hits_;
+        std::vector<Point> points_; // keepPoints_のときのみ.
+    };
+
+    PATTERN pattern_;
+    size_t  rays_;       // 1画角1波長あたりの瞳サンプル数.
+    size_t  chunk_;      // 1ジョブあたりの瞳サンプル数.
+    size_t  threads_;    // 0ならハードウェアスレッド数.
+    bool    keepPoints_; // 結果に各光線の到達点を残す.
+    bool    wavefront_;  // チャンクを光線束として1面ずつ追跡する. falseなら1本ずつ Body::trace.
+
+    SpotDiagram() : pattern_(HEX), rays_(4096), chunk_(8192), threads_(0), keepPoints_(false), wavefront_(true) { ; }
+
+    std::vector<Result> evaluate(const Body &body, const std::vector<Field> &fields, const std::vector<double> &lambdas) const
+    {
+        DOMIPLAN_STATS_SCOPE(SPOT);
+        std::vector<Result> results(fields.size());
+        if (fields.empty() || lambdas.empty())
+            return results;
+
+        const std::vector<Pupil::Sample> samples = (pattern_ == HEX) ? Pupil::hexGrid(rays_) : Pupil::qmc(rays_);
+
+        Pupil::Entrance entrance;
+        entrance.setup(body, lambdas[0]);
+
+        std::vector<Vector> chiefs(fields.size());
+        std::vector<Vector> dirs(fields.size());
+        for (size_t f = 0; f < fields.size(); f++)
+        {
+            chiefs[f] = entrance.chief(body, fields[f], lambdas[0]);
+            dirs[f]   = fields[f].direction();
+        }
+
+        // 画角 x 瞳チャンクをジョブにする.
+        const size_t chunk     = std::max<size_t>(1, chunk_);
+        const size_t perField  = (samples.size() + chunk - 1) / chunk;
+        const size_t jobCount  = fields.size() * perField;
+        const double pupilSize = entrance.radius_;
+
+        struct Partial
+        {
+            double             sx, sy;
+            size_t             hits;
+            std::vector<Point> points;
+        };
+        std::vector<Partial> partials(jobCount);
+
+        PARALLEL::parallelFor(jobCount, [&](size_t job) {
+            const size_t  f     = job / perField;
+            const size_t  begin = (job % perField) * chunk;
+            const size_t  end   = std::min(samples.size(), begin + chunk);
+            const Vector &chief = chiefs[f];
+            const Vector &dir   = dirs[f];
+
+            Partial &part = partials[job];
+            part.sx = part.sy = 0.;
+            part.hits         = 0;
+            part.points.reserve((end - begin) * lambdas.size());
+
+            if (wavefront_)
+            {
+                // 波長ごとにチャンク全体を束にする. 到達点は波長順に並ぶ.
+                Wavefront::Batch batch;
+                batch.reserve(end - begin);
+                for (size_t l = 0; l < lambdas.size(); l++)
+                {
+                    batch.clear();
+                    for (size_t i = begin; i < end; i++)
+                        batch.push(Vector(chief.x + samples[i].x_ * pupilSize, chief.y + samples[i].y_ * pupilSize, chief.z), dir, (uint32_t)i);
+                    Wavefront::trace(body, lambdas[l], batch);
+                    for (size_t k = 0; k < batch.size(); k++)
+                    {
+                        part.sx += batch.px_[k];
+                        part.sy += batch.py_[k];
+                        part.hits++;
+                        Point p;
+                        p.x_      = batch.px_[k];
+                        p.y_      = batch.py_[k];
+                        p.lambda_ = (int)l;
+                        part.points.push_back(p);
+                    }
+                }
+                return;
+            }
+
+            for (size_t i = begin; i < end; i++)
+            {
+                const Vector orig = Vector(chief.x + samples[i].x_ * pupilSize, chief.y + samples[i].y_ * pupilSize, chief.z);
+                for (size_t l = 0; l < lambdas.size(); l++)
+                {
+                    Vector hit, hitDir;
+                    if (!body.trace(orig, dir, lambdas[l], hit, hitDir))
+                        continue;
+                    part.sx += hit.x;
+                    part.sy += hit.y;
+                    part.hits++;
+                    Point p;
+                    p.x_      = hit.x;
+                    p.y_      = hit.y;
+                    p.lambda_ = (int)l;
+                    part.points.push_back(p);
+                }
+            }
+        },
+            threads_);
+
+        // 画角ごとに固定順で集計する.
+        PARALLEL::parallelFor(fields.size(), [&](size_t f) {
+            Result &res = results[f];
+            res.field_  = fields[f];
+            res.rays_   = samples.size() * lambdas.size();
+            res.hits_   = 0;
+
+            double sx = 0., sy = 0.;
+            for (size_t j = 0; j < perField; j++)
+            {
+                const Partial &part = partials[f * perField + j];
+                sx += part.sx;
+                sy += part.sy;
+                res.hits_ += part.hits;
+            }
+            res.centroidX_ = res.hits_ ? sx / res.hits_ : 0.;
+            res.centroidY_ = res.hits_ ? sy / res.hits_ : 0.;
+
+            double r2sum = 0., r2max = 0.;
+            for (size_t j = 0; j < perField; j++)
+            {
+                for (const Point &p : partials[f * perField + j].points)
+                {
+                    const double dx = p.x_ - res.centroidX_;
+                    const double dy = p.y_ - res.centroidY_;
+                    const double r2 = dx * dx + dy * dy;
+                    r2sum += r2;
+                    r2max = std::max(r2max, r2);
+                }
+            }
+            res.rms_ = res.hits_ ? sqrt(r2sum / res.hits_) : 0.;
+            res.geo_ = sqrt(r2max);
+
+            if (keepPoints_)
+            {
+                res.points_.reserve(res.hits_);
+                for (size_t j = 0; j < perField; j++)
+                {
+                    const std::vector<Point> &pts = partials[f * perField + j].points;
+                    res.points_.insert(res.points_.end(), pts.begin(), pts.end());
+                }
+            }
+        },
+            threads_);
+
+        return results;
+    }
+};
+} // namespace Lens
+
+#endif
@@ -0,0 +1,289 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+#ifndef __TOLERANCE_H
+#define __TOLERANCE_H
+
+#include <math.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <lens.hpp>
+#include <parallel.hpp>
+#include <psf.hpp>
+#include <pupil.hpp>
+#include <random.hpp>
+#include <spot.hpp>
+
+namespace Lens
+{
+// モンテカルロ公差解析.
+// 各試行で公差範囲内の乱数でBodyを崩し, スポット(とMTF)を評価して統計だけを積算する.
+class Tolerance
+{
+  public:
+    struct Spec
+    {
+        typedef enum
+        {
+            RADIUS,     // 曲率半径[mm]. 平面は対象外.
+            THICKNESS,  // 次の面までの距離[mm].
+            INDEX,      // d線屈折率.
+            ABBE,       // アッベ数.
+            DECENTER_X, // 面の偏心[mm].
+            DECENTER_Y,
+            TILT_X,     // 面の傾き[度]. 頂点まわり.
+            TILT_Y,
+        } KIND;
+
+        typedef enum
+        {
+            UNIFORM,  // [-range_, range_]の一様分布.
+            GAUSSIAN, // sigma = range_/2 の正規分布を±range_で打ち切る.
+        } DISTRIBUTION;
+
+        KIND         kind_;
+        size_t       surface_;
+        double       range_;
+        DISTRIBUTION distribution_;
+
+        Spec(KIND kind = RADIUS, size_t surface = 0, double range = 0., DISTRIBUTION distribution = UNIFORM)
+            : kind_(kind), surface_(surface), range_(range), distribution_(distribution) { ; }
+    };
+
+    // 平均/分散は逐次更新, パーセンタイルは固定幅ヒストグラムから求める.
+    class Statistics
+    {
+      public:
+        size_t              count_;
+        double              mean_;
+        double              m2_; // 偏差二乗和.
+        double              min_, max_;
+        double              lo_, hi_; // ヒストグラムの範囲.
+        std::vector<size_t> histogram_;
+        size_t              under_, over_; // 範囲外の個数.
+
+        Statistics(double lo = 0., double hi = 1., size_t bins = 256) { reset(lo, hi, bins); }
+
+        void reset(double lo, double hi, size_t bins)
+        {
+            count_ = 0;
+            mean_  = 0.;
+            m2_    = 0.;
+            min_   = INFINITY;
+            max_   = -INFINITY;
+            lo_    = lo;
+            hi_    = std::max(hi, lo + 1e-300);
+            histogram_.assign(std::max<size_t>(1, bins), 0);
+            under_ = 0;
+            over_  = 0;
+        }
+
+        void add(double v)
+        {
+            count_++;
+            const double d = v - mean_;
+            mean_ += d / (double)count_;
+            m2_ += d * (v - mean_);
+            min_ = std::min(min_, v);
+            max_ = std::max(max_, v);
+            if (v < lo_)
+                under_++;
+            else if (v >= hi_)
+                over_++;
+            else
+                histogram_[std::min(histogram_.size() - 1, (size_t)((v - lo_) / (hi_ - lo_) * histogram_.size()))]++;
+        }
+
+        double variance(void) const { return (count_ > 1) ? m2_ / (double)(count_ - 1) : 0.; }
+        double stddev(void) const { return sqrt(variance()); }
+
+        // p in [0,1]. ビン内は一様とみなして補間する. 範囲外に落ちる場合はmin/maxを返す.
+        double percentile(double p) const
+        {
+            if (count_ == 0)
+                return 0.;
+            const double target = std::min(std::max(p, 0.), 1.) * (double)count_;
+            double       seen   = (double)under_;
+            if (target <= seen)
+                return min_;
+            const double width = (hi_ - lo_) / (double)histogram_.size();
+            for (size_t i = 0; i < histogram_.size(); i++)
+            {
+                const double c = (double)histogram_[i];
+                if (c > 0. && target <= seen + c)
+                    return lo_ + width * ((double)i + (target - seen) / c);
+                seen += c;
+            }
+            return max_;
+        }
+    };
+
+    struct Result
+    {
+        double     nominalRms_; // 崩す前の最悪画角RMSスポット半径[mm].
+        double     nominalMtf_;
+        Statistics rms_;        // 各試行の最悪画角RMSスポット半径.
+        Statistics mtf_;        // 軸上の接線方向MTF. mtfFrequency_ > 0 のときのみ.
+        size_t     trials_;
+        size_t     failed_;     // 主光線が通らず評価できなかった試行.
+    };
+
+    std::vector<Spec>   specs_;
+    std::vector<Field>  fields_;
+    std::vector<double> lambdas_;
+    size_t              trials_;
+    uint64_t            seed_;
+    size_t              rays_;         // 1画角1波長あたりのスポット光線数.
+    double              mtfFrequency_; // [cycles/mm]. 0ならMTFは評価しない.
+    size_t              pupilN_;       // MTF評価の瞳グリッド.
+    size_t              bins_;
+    double              rmsRange_;     // ヒストグラム上限 = 公称RMS x rmsRange_.
+    size_t              batch_;        // 一度に保持する試行数. 0ならスレッド数x4.
+    size_t              threads_;
+
+    Tolerance()
+        : fields_(1, Field(0., 0.)), lambdas_(1, 587.56), trials_(1000), seed_(1), rays_(256), mtfFrequency_(0.), pupilN_(32), bins_(256), rmsRange_(8.), batch_(0), threads_(0) { ; }
+
+    // 公差1つぶんを適用する.
+    static void apply(Body &body, const Spec &spec, double delta)
+    {
+        if (spec.surface_ >= body.surfaces_.size())
+            return;
+        Surface &s = body.surfaces_[spec.surface_];
+        switch (spec.kind_)
+        {
+        case Spec::RADIUS:
+            if (s.curve_ != 0.)
+                s.setCurve(1. / (s.radius_ + delta));
+            break;
+        case Spec::THICKNESS:
+            body.setGap(spec.surface_, body.gap(spec.surface_) + delta); // 後ろの面だけ動かす.
+            break;
+        case Spec::INDEX:
+            s.ior_ += delta;
+            break;
+        case Spec::ABBE:
+            s.abbeVd_ += delta;
+            break;
+        case Spec::DECENTER_X:
+            s.decenterX_ += delta;
+            break;
+        case Spec::DECENTER_Y:
+            s.decenterY_ += delta;
+            break;
+        case Spec::TILT_X:
+            s.tiltX_ += delta;
+            break;
+        case Spec::TILT_Y:
+            s.tiltY_ += delta;
+            break;
+        }
+    }
+
+    static double sample(const Spec &spec, RANDOM::xoshiro256aa &rng)
+    {
+        if (spec.distribution_ == Spec::UNIFORM)
+            return (rng.rand01() * 2. - 1.) * spec.range_;
+        // Box-Muller. 範囲外は引き直す.
+        for (;;)
+        {
+            const double u = 1. - rng.rand01();
+            const double v = rng.rand01();
+            const double g = sqrt(-2. * log(u)) * cos(2. * M_PI * v) * spec.range_ * 0.5;
+            if (fabs(g) <= spec.range_)
+                return g;
+        }
+    }
+
+    // 公差をすべて乱数で適用したBodyを作る. 姿勢はsetup()で行列になる.
+    Body perturb(const Body &nominal, RANDOM::xoshiro256aa &rng) const
+    {
+        Body body = nominal;
+        for (const Spec &spec : specs_)
+            apply(body, spec, sample(spec, rng));
+        body.setup();
+        return body;
+    }
+
+    Result run(const Body &nominal) const
+    {
+        DOMIPLAN_STATS_SCOPE(TOLERANCE);
+        Result res;
+        res.trials_ = trials_;
+        res.failed_ = 0;
+
+        double mtf;
+        res.nominalRms_ = evaluate(nominal, mtf);
+        res.nominalMtf_ = mtf;
+        res.rms_.reset(0., std::max(res.nominalRms_, 1e-6) * rmsRange_, bins_);
+        res.mtf_.reset(0., 1., bins_);
+
+        // 試行iの乱数列はseed_からi回jump()した位置. 試行順に配って結果は試行順に積算するので,
+        // スレッド数によらず同じ統計になる.
+        RANDOM::xoshiro256aa              stream(seed_);
+        const size_t                      batch = batch_ ? batch_ : PARALLEL::concurrency() * 4;
+        std::vector<RANDOM::xoshiro256aa> rngs;
+        std::vector<double>               rms(batch), mtfs(batch);
+        for (size_t begin = 0; begin < trials_; begin += batch)
+        {
+            const size_t count = std::min(batch, trials_ - begin);
+            rngs.clear();
+            for (size_t i = 0; i < count; i++)
+            {
+                rngs.push_back(stream);
+                stream.jump();
+            }
+            PARALLEL::parallelFor(count, [&](size_t i) {
+                const Body body = perturb(nominal, rngs[i]);
+                rms[i]          = evaluate(body, mtfs[i]);
+            },
+                threads_);
+            for (size_t i = 0; i < count; i++)
+            {
+                if (rms[i] < 0.)
+                {
+                    res.failed_++;
+                    continue;
+                }
+                res.rms_.add(rms[i]);
+                if (mtfFrequency_ > 0.)
+                    res.mtf_.add(mtfs[i]);
+            }
+        }
+        return res;
+    }
+
+    // 最悪画角のRMSスポット半径. 評価できなければ負.
+    double evaluate(const Body &body, double &mtf) const
+    {
+        SpotDiagram spot;
+        spot.rays_    = rays_;
+        spot.threads_ = 1;
+        double worst  = 0.;
+        for (const SpotDiagram::Result &r : spot.evaluate(body, fields_, lambdas_))
+        {
+            if (r.hits_ == 0)
+                return -1.;
+            worst = std::max(worst, r.rms_);
+        }
+
+        mtf = 0.;
+        if (mtfFrequency_ > 0.)
+        {
+            Diffraction diff;
+            diff.pupilN_  = pupilN_;
+            diff.threads_ = 1;
+            const Diffraction::Result d     = diff.evaluate(body, Field(0., 0.), lambdas_[0]);
+            const std::vector<double> slice = d.mtfSlice(true);
+            const double              x     = (d.mtfPitch_ > 0.) ? mtfFrequency_ / d.mtfPitch_ : 0.;
+            const size_t              i     = (size_t)x;
+            if (i + 1 < slice.size())
+                mtf = slice[i] + (slice[i + 1] - slice[i]) * (x - (double)i);
+        }
+        return worst;
+    }
+};
+} // namespace Lens
+
+#endif
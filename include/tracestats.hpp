@@ -0,0 +1,254 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+#ifndef __TRACESTATS_H
+#define __TRACESTATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+// 追跡の統計を取るかどうか. 0ならDOMIPLAN_STATS*は何も生成しない.
+#ifndef DOMIPLAN_TRACE_STATS
+#define DOMIPLAN_TRACE_STATS 0
+#endif
+
+#if DOMIPLAN_TRACE_STATS
+#define DOMIPLAN_STATS(op) (::Lens::TraceStats::local().op)
+#define DOMIPLAN_STATS_SCOPE(phase) ::Lens::TraceStats::Scope traceStatsScope_(::Lens::TraceStats::phase)
+#else
+#define DOMIPLAN_STATS(op) ((void)0)
+#define DOMIPLAN_STATS_SCOPE(phase) ((void)0)
+#endif
+
+namespace Lens
+{
+// 追跡の統計. 各スレッドが自分のthread_localだけを数え, 集計のときだけ足し合わせる.
+// スレッドが終わるとその分は退避先に足し込まれるので, parallelForの後でも total() で拾える.
+struct TraceStats
+{
+    typedef enum
+    {
+        SPOT,      // SpotDiagram::evaluate
+        PSF,       // Diffraction::evaluate
+        BOKEH,     // Bokeh::render
+        LENSMAP,   // LensMaps::build
+        OPTIMIZE,  // Optimizer::optimize
+        TOLERANCE, // Tolerance::run
+        RENDER,    // Renderer::pass
+        N_PHASE,
+    } PHASE;
+
+    static constexpr size_t MAX_SURFACES = 64; // これ以降の面は最後の欄にまとめる.
+
+    struct Counter
+    {
+        uint64_t attempts_; // 交差判定.
+        uint64_t rejects_;  // 解く前に棄却.
+        uint64_t misses_;   // 交点なし/収束せず.
+        uint64_t clips_;    // 有効径/絞りでケラれ.
+        uint64_t tir_;      // 全反射.
+    };
+
+    size_t   surfaces_;     // 面との交差判定の回数.
+    size_t   earlyRejects_; // うち外接円柱/スラブで解く前に棄却した回数.
+    uint64_t solves_;       // intersectで根を探した回数.
+    uint64_t iterations_;   // その二分法の反復数の合計.
+    uint64_t nonConverged_; // 反復を使い切った回数.
+    uint64_t apertureClips_;
+    uint64_t tir_;
+    Counter  perSurface_[MAX_SURFACES];
+    uint64_t phaseNs_[N_PHASE];
+    uint64_t phaseCalls_[N_PHASE];
+
+    TraceStats() { reset(); }
+    void reset(void)
+    {
+        surfaces_      = 0;
+        earlyRejects_  = 0;
+        solves_        = 0;
+        iterations_    = 0;
+        nonConverged_  = 0;
+        apertureClips_ = 0;
+        tir_           = 0;
+        std::fill(perSurface_, perSurface_ + MAX_SURFACES, Counter());
+        std::fill(phaseNs_, phaseNs_ + N_PHASE, 0);
+        std::fill(phaseCalls_, phaseCalls_ + N_PHASE, 0);
+    }
+
+    double earlyRejectRatio(void) const { return surfaces_ ? (double)earlyRejects_ / (double)surfaces_ : 0.; }
+    double meanIterations(void) const { return solves_ ? (double)iterations_ / (double)solves_ : 0.; }
+
+    Counter &surface(size_t i) { return perSurface_[std::min(i, MAX_SURFACES - 1)]; }
+
+    // n は光線束でまとめて数えるとき用.
+    void attempt(size_t i, uint64_t n = 1)
+    {
+        surfaces_ += n;
+        surface(i).attempts_ += n;
+    }
+    void reject(size_t i, uint64_t n = 1)
+    {
+        earlyRejects_ += n;
+        surface(i).rejects_ += n;
+    }
+    void clip(size_t i, uint64_t n = 1)
+    {
+        apertureClips_ += n;
+        surface(i).clips_ += n;
+    }
+    void tir(size_t i, uint64_t n = 1)
+    {
+        tir_ += n;
+        surface(i).tir_ += n;
+    }
+    void solved(int iterations, bool converged)
+    {
+        solves_++;
+        iterations_ += (uint64_t)iterations;
+        if (!converged)
+            nonConverged_++;
+    }
+
+    void merge(const TraceStats &s)
+    {
+        surfaces_ += s.surfaces_;
+        earlyRejects_ += s.earlyRejects_;
+        solves_ += s.solves_;
+        iterations_ += s.iterations_;
+        nonConverged_ += s.nonConverged_;
+        apertureClips_ += s.apertureClips_;
+        tir_ += s.tir_;
+        for (size_t i = 0; i < MAX_SURFACES; i++)
+        {
+            perSurface_[i].attempts_ += s.perSurface_[i].attempts_;
+            perSurface_[i].rejects_ += s.perSurface_[i].rejects_;
+            perSurface_[i].misses_ += s.perSurface_[i].misses_;
+            perSurface_[i].clips_ += s.perSurface_[i].clips_;
+            perSurface_[i].tir_ += s.perSurface_[i].tir_;
+        }
+        for (int p = 0; p < N_PHASE; p++)
+        {
+            phaseNs_[p] += s.phaseNs_[p];
+            phaseCalls_[p] += s.phaseCalls_[p];
+        }
+    }
+
+    void report(FILE *fp = stdout) const
+    {
+        static const char *names[N_PHASE] = {"spot", "psf", "bokeh", "lensmap", "optimize", "tolerance", "render"};
+        fprintf(fp, "trace stats:\n");
+        fprintf(fp, "  surface tests   %llu (early reject %.1f%%)\n", (unsigned long long)surfaces_, earlyRejectRatio() * 100.);
+        fprintf(fp, "  root solves     %llu (%.1f iterations, %llu not converged)\n", (unsigned long long)solves_, meanIterations(), (unsigned long long)nonConverged_);
+        fprintf(fp, "  aperture clips  %llu\n", (unsigned long long)apertureClips_);
+        fprintf(fp, "  TIR             %llu\n", (unsigned long long)tir_);
+        fprintf(fp, "  %4s %12s %12s %12s %12s %12s\n", "surf", "attempts", "rejects", "misses", "clips", "tir");
+        for (size_t i = 0; i < MAX_SURFACES; i++)
+        {
+            const Counter &c = perSurface_[i];
+            if (c.attempts_ == 0)
+                continue;
+            fprintf(fp, "  %3zu%s %12llu %12llu %12llu %12llu %12llu\n", i, (i == MAX_SURFACES - 1) ? "+" : " ",
+                (unsigned long long)c.attempts_, (unsigned long long)c.rejects_, (unsigned long long)c.misses_,
+                (unsigned long long)c.clips_, (unsigned long long)c.tir_);
+        }
+        for (int p = 0; p < N_PHASE; p++)
+        {
+            if (phaseCalls_[p])
+                fprintf(fp, "  %-10s %6llu calls %12.3f ms\n", names[p], (unsigned long long)phaseCalls_[p], (double)phaseNs_[p] * 1e-6);
+        }
+    }
+
+    // 区間の経過時間を呼び出しスレッドの統計に足す.
+    class Scope
+    {
+      public:
+        explicit Scope(PHASE phase) : phase_(phase), begin_(std::chrono::steady_clock::now()) { ; }
+        ~Scope()
+        {
+            const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin_).count();
+            TraceStats &stats = local();
+            stats.phaseNs_[phase_] += (uint64_t)ns;
+            stats.phaseCalls_[phase_]++;
+        }
+
+      private:
+        PHASE                                 phase_;
+        std::chrono::steady_clock::time_point begin_;
+    };
+
+    static TraceStats &local(void);
+
+    // 全スレッドの合計. 追跡中のスレッドがあると途中の値になる.
+    static TraceStats total(void);
+
+    // 全スレッドの統計を消す. 追跡していないときに呼ぶこと.
+    static void resetAll(void);
+
+  private:
+    struct Registry;
+    struct Slot;
+    static Registry &registry(void);
+};
+
+struct TraceStats::Registry
+{
+    std::mutex                mutex_;
+    std::vector<TraceStats *> live_;
+    TraceStats                retired_; // 終了したスレッドの分.
+};
+
+// 登録/解除のときだけロックを取る. 数えるのは各スレッドの自分の領域だけ.
+struct TraceStats::Slot
+{
+    TraceStats stats_;
+    Slot()
+    {
+        Registry                   &r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex_);
+        r.live_.push_back(&stats_);
+    }
+    ~Slot()
+    {
+        Registry                   &r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex_);
+        r.retired_.merge(stats_);
+        r.live_.erase(std::remove(r.live_.begin(), r.live_.end(), &stats_), r.live_.end());
+    }
+};
+
+inline TraceStats::Registry &TraceStats::registry(void)
+{
+    static Registry r;
+    return r;
+}
+
+inline TraceStats &TraceStats::local(void)
+{
+    static thread_local Slot slot;
+    return slot.stats_;
+}
+
+inline TraceStats TraceStats::total(void)
+{
+    Registry                   &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex_);
+    TraceStats                  sum = r.retired_;
+    for (const TraceStats *s : r.live_)
+        sum.merge(*s);
+    return sum;
+}
+
+inline void TraceStats::resetAll(void)
+{
+    Registry                   &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex_);
+    r.retired_.reset();
+    for (TraceStats *s : r.live_)
+        s->reset();
+}
+} // namespace Lens
+
+#endif
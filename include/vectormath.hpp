@@ -12,11 +12,44 @@
 #include <math.h>
 #include <stdio.h>
 
+#include <type_traits>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define VECTORMATH_SSE 1
+#endif
+
 namespace VECTORMATH
 {
 #define MIN(A, B) ((A < B) ? A : B)
 #define MAX(A, B) ((A > B) ? A : B)
 
+// a * b + c. FMA命令のある環境(FP_FAST_FMA)だけ fma にする. 無いとライブラリ呼び出しになって遅い.
+template <typename T>
+inline T fmadd(const T &a, const T &b, const T &c) { return a * b + c; }
+#ifdef FP_FAST_FMA
+template <>
+inline double fmadd(const double &a, const double &b, const double &c) { return ::fma(a, b, c); }
+#endif
+#ifdef FP_FAST_FMAF
+template <>
+inline float fmadd(const float &a, const float &b, const float &c) { return ::fmaf(a, b, c); }
+#endif
+
+// 1 / sqrt(v).
+template <typename T>
+inline T rsqrt(const T &v) { return 1.0 / sqrt(v); }
+#if VECTORMATH_SSE
+// rsqrtss の12bitの近似からニュートン法1回. 内部の補助で, normal() は使わない.
+// 正規化は sqrt + 割り算の方が速く, double は3回詰めると更に遅くなるので特殊化しない.
+template <>
+inline float rsqrt(const float &v)
+{
+    const float r = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(v)));
+    return r * (1.5f - 0.5f * v * r * r);
+}
+#endif
+
 template <typename T>
 class Vector3
 {
@@ -30,12 +63,6 @@ class Vector3
 
     Vector3() { ; }
     Vector3(T x_, T y_, T z_) : x(x_), y(y_), z(z_) {}
-    Vector3(const self &self)
-    {
-        x = self.x;
-        y = self.y;
-        z = self.z;
-    }
 
     const size_t size() const { return 3; }
 
@@ -87,16 +114,17 @@ class Vector3
     inline Vector3 operator/(const Vector3 &b) const { return Vector3(x * b.x, y * b.y, z * b.z); }
     inline T       operator[](const int i) const { return get(i); }
     inline Vector3 mul(const Vector3 &b) const { return Vector3(x * b.x, y * b.y, z * b.z); }
-    inline T       dot(const Vector3 &b) const { return x * b.x + y * b.y + z * b.z; }
-    inline Vector3 operator%(Vector3 &b) const { return Vector3(y * b.z - z * b.y, z * b.x - x * b.z, x * b.y - y * b.x); }
+    // FMAが無ければ (x + y) + z の順で今までと同じ丸めになる.
+    inline T       dot(const Vector3 &b) const { return fmadd(z, b.z, fmadd(y, b.y, x * b.x)); }
+    inline Vector3 operator%(const Vector3 &b) const { return cross(b); }
 
-    inline Vector3 normal(void) const { return *this * (1.0 / sqrt(x * x + y * y + z * z)); }
-    inline void    normalize(void) { *this = *this * (1.0 / sqrt(x * x + y * y + z * z)); }
+    inline Vector3 normal(void) const { return *this * (1.0 / sqrt(length2())); }
+    inline void    normalize(void) { *this = normal(); }
 
     inline T distance2(const Vector3 &b) const { return (x - b.x) * (x - b.x) + (y - b.y) * (y - b.y) + (z - b.z) * (z - b.z); }
     inline T distance(const Vector3 &b) const { return sqrt(distance2(b)); }
 
-    inline T length2(void) const { return x * x + y * y + z * z; }
+    inline T length2(void) const { return dot(*this); }
     inline T length(void) const { return sqrt(length2()); }
 
     inline Vector3 min(const Vector3 &b) { return Vector3(MIN(x, b.x), MIN(y, b.y), MIN(z, b.z)); }
@@ -106,18 +134,23 @@ class Vector3
         return Vector3(static_cast<T>(::pow(x, b)), static_cast<T>(::pow(y, b)), static_cast<T>(::pow(z, b)));
     }
 
-    inline Vector3 cross(const Vector3 &b)
+    // 差の2項は片方をfmaに入れる. 打ち消しの丸めが1回で済む.
+    inline Vector3 cross(const Vector3 &b) const
     {
         return Vector3(
-            y * b.z - z * b.y,
-            z * b.x - x * b.z,
-            x * b.y - y * b.x);
+            fmadd(y, b.z, -(z * b.y)),
+            fmadd(z, b.x, -(x * b.z)),
+            fmadd(x, b.y, -(y * b.x)));
     }
 };
 
 template class Vector3<double>;
 typedef Vector3<double> Vector;
 
+// 光線束の配列を memcpy で扱えるように.
+static_assert(std::is_trivially_copyable<Vector3<double>>::value, "Vector3<double> must be trivially copyable");
+static_assert(std::is_trivially_copyable<Vector3<float>>::value, "Vector3<float> must be trivially copyable");
+
 #undef MIN
 #undef MAX
 
@@ -0,0 +1,314 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+#ifndef __WAVEFRONT_H
+#define __WAVEFRONT_H
+
+#include <math.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <lens.hpp>
+
+namespace Lens
+{
+// 光線の束を1面ずつ進める追跡.
+// 1本ずつ全面を通す Body::trace と違い, 1つの面のパラメータだけを触りながら束全体を処理し,
+// ケラれ/全反射で死んだ光線は面ごとに詰めて捨てる. 波長は束で1つ.
+namespace Wavefront
+{
+    // SoA の光線束. id_ は呼び出し側の通し番号で, 詰めたあとでも元の光線を辿れる.
+    struct Batch
+    {
+        std::vector<double>   px_, py_, pz_;
+        std::vector<double>   dx_, dy_, dz_;
+        std::vector<double>   opl_;
+        std::vector<uint32_t> id_;
+
+        // 面ごとの作業領域.
+        std::vector<double>  nx_, ny_, nz_;
+        std::vector<uint8_t> alive_;
+
+        size_t size(void) const { return id_.size(); }
+        bool   empty(void) const { return id_.empty(); }
+
+        void clear(void)
+        {
+            px_.clear();
+            py_.clear();
+            pz_.clear();
+            dx_.clear();
+            dy_.clear();
+            dz_.clear();
+            opl_.clear();
+            id_.clear();
+        }
+
+        void reserve(size_t n)
+        {
+            px_.reserve(n);
+            py_.reserve(n);
+            pz_.reserve(n);
+            dx_.reserve(n);
+            dy_.reserve(n);
+            dz_.reserve(n);
+            opl_.reserve(n);
+            id_.reserve(n);
+        }
+
+        void push(const Vector &pos, const Vector &dir, uint32_t id)
+        {
+            px_.push_back(pos.x);
+            py_.push_back(pos.y);
+            pz_.push_back(pos.z);
+            dx_.push_back(dir.x);
+            dy_.push_back(dir.y);
+            dz_.push_back(dir.z);
+            opl_.push_back(0.);
+            id_.push_back(id);
+        }
+
+        Vector position(size_t i) const { return Vector(px_[i], py_[i], pz_[i]); }
+        Vector direction(size_t i) const { return Vector(dx_[i], dy_[i], dz_[i]); }
+
+        // alive_ が立っている光線だけを前に詰める. 順序は保つ.
+        void compact(void)
+        {
+            const size_t n = size();
+            size_t       k = 0;
+            for (size_t i = 0; i < n; i++)
+            {
+                if (!alive_[i])
+                    continue;
+                if (k != i)
+                {
+                    px_[k]  = px_[i];
+                    py_[k]  = py_[i];
+                    pz_[k]  = pz_[i];
+                    dx_[k]  = dx_[i];
+                    dy_[k]  = dy_[i];
+                    dz_[k]  = dz_[i];
+                    opl_[k] = opl_[i];
+                    id_[k]  = id_[i];
+                }
+                k++;
+            }
+            px_.resize(k);
+            py_.resize(k);
+            pz_.resize(k);
+            dx_.resize(k);
+            dy_.resize(k);
+            dz_.resize(k);
+            opl_.resize(k);
+            id_.resize(k);
+        }
+    };
+
+    // 面 index を束全体に適用する. Body::traceSurfaces の1面分と同じ手順.
+    // 球面/平面(STANDARD, NONE)は二次式を直接解くので, 分岐のないループになる.
+    // 有効径の外で真の交点を持つ光線はここでケラれる(二分法はsagが0に切られる縁に止まって通すことがある).
+    // それ以外の面は Surface::intersect を1本ずつ呼ぶ.
+    inline void stage(const Body &body, size_t index, double iorNow, double iorNext, Batch &batch)
+    {
+        const Surface &surf = body.surfaces_[index];
+        const size_t   n    = batch.size();
+        batch.alive_.assign(n, 1);
+        batch.nx_.resize(n);
+        batch.ny_.resize(n);
+        batch.nz_.resize(n);
+
+        double  *px = batch.px_.data(), *py = batch.py_.data(), *pz = batch.pz_.data();
+        double  *dx = batch.dx_.data(), *dy = batch.dy_.data(), *dz = batch.dz_.data();
+        double  *nx = batch.nx_.data(), *ny = batch.ny_.data(), *nz = batch.nz_.data();
+        double  *opl   = batch.opl_.data();
+        uint8_t *alive = batch.alive_.data();
+
+        if (surf.hasPose_)
+        {
+            for (size_t i = 0; i < n; i++)
+            {
+                const Vector p = surf.toLocal(Vector(px[i], py[i], pz[i]));
+                const Vector d = surf.directionToLocal(Vector(dx[i], dy[i], dz[i]));
+                px[i]          = p.x;
+                py[i]          = p.y;
+                pz[i]          = p.z;
+                dx[i]          = d.x;
+                dy[i]          = d.y;
+                dz[i]          = d.z;
+            }
+        }
+
+        // 面頂点平面まで進めてローカル座標にする.
+        uint64_t     attempts = 0;
+        const double vz       = surf.vertex();
+        for (size_t i = 0; i < n; i++)
+        {
+            alive[i]        = dz[i] > 0.;
+            const double tp = (vz - pz[i]) / dz[i];
+            px[i] += dx[i] * tp;
+            py[i] += dy[i] * tp;
+            opl[i] += iorNow * tp;
+            attempts += alive[i];
+        }
+        DOMIPLAN_STATS(attempt(index, attempts));
+
+        uint64_t rejects = 0, misses = 0;
+        if (surf.type_ == SurfaceBase::STANDARD || surf.type_ == SurfaceBase::NONE)
+        {
+            // c(x^2 + y^2 + (1+k)z^2) - 2z = 0 の頂点側の解 C/q.
+            const double c  = surf.curve_;
+            const double k1 = surf.conic_ + 1.;
+            for (size_t i = 0; i < n; i++)
+            {
+                const double ox = px[i], oy = py[i];
+                const double ex = dx[i], ey = dy[i], ez = dz[i];
+                const double A  = c * (ex * ex + ey * ey + k1 * ez * ez);
+                const double B  = 2. * (c * (ox * ex + oy * ey) - ez);
+                const double C  = c * (ox * ox + oy * oy);
+                const double D  = B * B - 4. * A * C;
+                const double q  = -0.5 * (B + copysign(sqrt(std::max(D, 0.)), B));
+                const bool   ok = D >= 0. && q != 0.;
+                const double t  = ok ? C / q : 0.;
+                const double x  = ox + ex * t;
+                const double y  = oy + ey * t;
+                const double z  = ez * t;
+                px[i]           = x;
+                py[i]           = y;
+                pz[i]           = vz + z;
+                opl[i] += iorNow * t;
+                nx[i] = c * x;
+                ny[i] = c * y;
+                nz[i] = c * k1 * z - 1.;
+                misses += (alive[i] && !ok);
+                alive[i] = alive[i] && ok;
+            }
+        }
+        else
+        {
+            for (size_t i = 0; i < n; i++)
+            {
+                if (!alive[i])
+                    continue;
+                const Vector local = Vector(px[i], py[i], 0.);
+                const Vector dir   = Vector(dx[i], dy[i], dz[i]);
+                if (!surf.mayHit(local, dir))
+                {
+                    rejects++;
+                    alive[i] = 0;
+                    continue;
+                }
+                double t;
+                Vector point, norm;
+                if (!surf.intersect(local, dir, t, point, norm))
+                {
+                    misses++;
+                    alive[i] = 0;
+                    continue;
+                }
+                px[i] = point.x;
+                py[i] = point.y;
+                pz[i] = point.z;
+                opl[i] += iorNow * t;
+                nx[i] = norm.x;
+                ny[i] = norm.y;
+                nz[i] = norm.z;
+            }
+        }
+
+        // 有効径と絞り.
+        uint64_t     clips = 0;
+        const double diam2 = surf.diam2_;
+        for (size_t i = 0; i < n; i++)
+        {
+            const bool in = px[i] * px[i] + py[i] * py[i] <= diam2;
+            clips += (alive[i] && !in);
+            alive[i] = alive[i] && in;
+        }
+        clips += surf.clipStop(px, py, n, body.irisScale_, alive);
+
+        // 屈折. refract と同じ式.
+        uint64_t     tir = 0;
+        const double eta = iorNow / iorNext;
+        for (size_t i = 0; i < n; i++)
+        {
+            const double inv  = 1. / sqrt(nx[i] * nx[i] + ny[i] * ny[i] + nz[i] * nz[i]);
+            double       mx   = nx[i] * inv, my = ny[i] * inv, mz = nz[i] * inv;
+            const double side = (dx[i] * mx + dy[i] * my + dz[i] * mz > 0.) ? -1. : 1.;
+            mx *= side;
+            my *= side;
+            mz *= side;
+            const double cosi  = -(dx[i] * mx + dy[i] * my + dz[i] * mz);
+            const double cost2 = 1. - eta * eta * (1. - cosi * cosi);
+            const bool   ok    = cost2 >= 0.;
+            const double s     = eta * cosi - sqrt(std::max(cost2, 0.));
+            dx[i]              = dx[i] * eta + mx * s;
+            dy[i]              = dy[i] * eta + my * s;
+            dz[i]              = dz[i] * eta + mz * s;
+            tir += (alive[i] && !ok);
+            alive[i] = alive[i] && ok;
+        }
+
+        if (surf.hasPose_)
+        {
+            for (size_t i = 0; i < n; i++)
+            {
+                const Vector p = surf.toWorld(Vector(px[i], py[i], pz[i]));
+                const Vector d = surf.directionToWorld(Vector(dx[i], dy[i], dz[i]));
+                px[i]          = p.x;
+                py[i]          = p.y;
+                pz[i]          = p.z;
+                dx[i]          = d.x;
+                dy[i]          = d.y;
+                dz[i]          = d.z;
+            }
+        }
+
+        DOMIPLAN_STATS(reject(index, rejects));
+        DOMIPLAN_STATS(surface(index).misses_ += misses);
+        DOMIPLAN_STATS(clip(index, clips));
+        DOMIPLAN_STATS(tir(index, tir));
+        (void)attempts;
+        (void)rejects;
+        (void)misses;
+        (void)clips;
+        (void)tir;
+
+        batch.compact();
+    }
+
+    // 面[begin,end)を通す. 通り抜けた光線だけが束に残る.
+    inline void traceSurfaces(const Body &body, double lambda, Batch &batch, size_t begin, size_t end)
+    {
+        double iorNow = (begin == 0) ? 1. : body.surfaces_[begin - 1].ior(lambda);
+        for (size_t i = begin; i < end && !batch.empty(); i++)
+        {
+            const double iorNext = body.surfaces_[i].ior(lambda);
+            stage(body, i, iorNow, iorNext, batch);
+            iorNow = iorNext;
+        }
+    }
+
+    // 像面まで追跡する. 残った光線の位置は像面上の到達点, opl_ は像面までの光路長.
+    inline void trace(const Body &body, double lambda, Batch &batch)
+    {
+        traceSurfaces(body, lambda, batch, 0, body.surfaces_.size());
+
+        const size_t n = batch.size();
+        batch.alive_.resize(n);
+        const double zi  = body.imageSurfaceZ_;
+        const double ior = body.imageIor(lambda);
+        for (size_t i = 0; i < n; i++)
+        {
+            const double t = (zi - batch.pz_[i]) / batch.dz_[i];
+            batch.alive_[i] = batch.dz_[i] > 0.;
+            batch.px_[i] += batch.dx_[i] * t;
+            batch.py_[i] += batch.dy_[i] * t;
+            batch.pz_[i] = zi;
+            batch.opl_[i] += ior * t;
+        }
+        batch.compact();
+    }
+} // namespace Wavefront
+} // namespace Lens
+
+#endif
@@ -0,0 +1,157 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+
+// 1枚のレンダリングを複数プロセス/複数マシンに分ける.
+//   domiplan_shard render <shard> <out.dpck> lens=<file> [width= height= sensor= samples= passes= seed= threads= background= light=...]
+//     shard 番目の乱数列 (long_jump() を shard 回) で passes パス回し, 途中状態を書き出す.
+//     設定の書式は domiplan_daemon の render と同じ. 全シャードで同じ設定にすること.
+//   domiplan_shard merge <out.dpck|out.png> <in.dpck>...
+//     シャードを shard 番号順に足す. 引数の順や終わった順によらず同じ結果になる.
+//   domiplan_shard table <out.dplf> lens=<file> [width= height= sensor= threads=]
+//     レンズとセンサーの LightField を前計算する. render に table=<file> を渡すとガラスを追わずに描く.
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb_image_write.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <lightfield.hpp>
+#include <renderer.hpp>
+#include <renderservice.hpp>
+
+namespace
+{
+int usage(const char *name)
+{
+    printf("usage: %s render <shard> <out.dpck> lens=<file> [key=value...]\n", name);
+    printf("       %s merge <out.dpck|out.png> <in.dpck>...\n", name);
+    printf("       %s table <out.dplf> lens=<file> [key=value...]\n", name);
+    return 1;
+}
+
+bool parse(int argc, char *argv[], int first, Lens::RenderService::Job &job)
+{
+    std::string line;
+    for (int i = first; i < argc; i++)
+        line += std::string(argv[i]) + " ";
+    std::string error;
+    if (!Lens::RenderService::parse(line, job, error))
+    {
+        printf("%s\n", error.c_str());
+        return false;
+    }
+    return true;
+}
+
+int render(int argc, char *argv[])
+{
+    const uint32_t shard = (uint32_t)atoi(argv[2]);
+    const char    *out   = argv[3];
+
+    Lens::RenderService::Job job;
+    if (!parse(argc, argv, 4, job))
+        return 1;
+    const Lens::Body body = Lens::Loader::ZEMAX::load(job.lens_.c_str());
+    if (body.surfaces_.empty())
+        return 1;
+
+    Lens::Renderer renderer;
+    renderer.sensorWidth_ = job.sensorWidth_;
+    renderer.samples_     = job.samples_;
+    renderer.seed_        = job.seed_;
+    renderer.threads_     = job.threads_;
+    renderer.shard_       = shard;
+
+    Lens::Renderer::Optics optics = renderer.prepare(body);
+    if (!job.table_.empty())
+    {
+        std::shared_ptr<Lens::LightField> table = std::make_shared<Lens::LightField>();
+        if (!table->map(job.table_.c_str()) || !table->matches(body) || table->channels() != 3)
+        {
+            printf("lightfield %s does not fit %s\n", job.table_.c_str(), job.lens_.c_str());
+            return 1;
+        }
+        renderer.sensorWidth_ = table->sensorWidth_;
+        renderer.overscan_    = table->overscan_;
+        for (int c = 0; c < 3; c++)
+            renderer.lambdas_[c] = table->lambdas_[c];
+        optics        = renderer.prepare(body);
+        optics.table_ = table;
+    }
+    renderer.setup(job.width_, job.height_);
+    return renderer.render(optics, job.scene_, job.passes_, out, job.passes_) ? 0 : 1;
+}
+
+int table(int argc, char *argv[])
+{
+    const char *out = argv[2];
+
+    Lens::RenderService::Job job;
+    if (!parse(argc, argv, 3, job))
+        return 1;
+    const Lens::Body body = Lens::Loader::ZEMAX::load(job.lens_.c_str());
+    if (body.surfaces_.empty())
+        return 1;
+
+    const Lens::Renderer defaults;
+    const double         sensorHeight = job.sensorWidth_ * (double)job.height_ / (double)job.width_;
+    Lens::LightField     field;
+    field.build(body, job.sensorWidth_, sensorHeight, std::vector<double>(defaults.lambdas_, defaults.lambdas_ + 3),
+        48, 32, 24, 24, defaults.overscan_, job.threads_);
+    printf("%s: %llu bytes\n", out, (unsigned long long)field.bytes());
+    return field.save(out) ? 0 : 1;
+}
+
+int merge(int argc, char *argv[])
+{
+    const std::string out = argv[2];
+
+    std::vector<Lens::Renderer> shards(argc - 3);
+    for (int i = 3; i < argc; i++)
+    {
+        if (!shards[i - 3].load(argv[i]))
+        {
+            printf("shard %s load fail\n", argv[i]);
+            return 1;
+        }
+    }
+    std::sort(shards.begin(), shards.end(), [](const Lens::Renderer &a, const Lens::Renderer &b) { return a.shard_ < b.shard_; });
+    for (size_t i = 1; i < shards.size(); i++)
+    {
+        if (shards[i].shard_ == shards[i - 1].shard_)
+        {
+            printf("shard %u appears twice\n", shards[i].shard_);
+            return 1;
+        }
+        if (!shards[0].merge(shards[i]))
+        {
+            printf("shard %u was rendered with different settings\n", shards[i].shard_);
+            return 1;
+        }
+    }
+
+    const Lens::Renderer &merged = shards[0];
+    if (out.size() > 4 && out.compare(out.size() - 4, 4, ".png") == 0)
+    {
+        FloatCanvas::Canvas image = merged.image();
+        return stbi_write_png(out.c_str(), (int)image.width(), (int)image.height(), 3, image.getLDR8().data(), (int)image.width() * 3) ? 0 : 1;
+    }
+    return merged.save(out.c_str()) ? 0 : 1;
+}
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    if (argc >= 5 && strcmp(argv[1], "render") == 0)
+        return render(argc, argv);
+    if (argc >= 4 && strcmp(argv[1], "merge") == 0)
+        return merge(argc, argv);
+    if (argc >= 4 && strcmp(argv[1], "table") == 0)
+        return table(argc, argv);
+    return usage(argv[0]);
+}
@@ -0,0 +1,47 @@
+# domiplan_shard の分散レンダリングを1台で確かめる. ctest から -P で呼ぶ.
+#   SHARD: domiplan_shard, LENS: レンズファイル, WORK: 作業ディレクトリ.
+
+set (ARGS lens=${LENS} width=48 height=32 samples=2 passes=2 threads=1
+          background=0.05,0.05,0.05 light=0,0,-3000,200,4,2,1)
+
+file (REMOVE_RECURSE ${WORK})
+file (MAKE_DIRECTORY ${WORK})
+
+# 複数の COMMAND は同時に起動される.
+execute_process (COMMAND ${SHARD} render 0 ${WORK}/0.dpck ${ARGS}
+                 COMMAND ${SHARD} render 1 ${WORK}/1.dpck ${ARGS}
+                 COMMAND ${SHARD} render 2 ${WORK}/2.dpck ${ARGS}
+                 COMMAND ${SHARD} render 3 ${WORK}/3.dpck ${ARGS}
+                 RESULTS_VARIABLE results)
+foreach (r ${results})
+    if (NOT r EQUAL 0)
+        message (FATAL_ERROR "worker failed: ${results}")
+    endif ()
+endforeach ()
+
+# 引数の順によらず同じ結果.
+execute_process (COMMAND ${SHARD} merge ${WORK}/a.dpck ${WORK}/0.dpck ${WORK}/1.dpck ${WORK}/2.dpck ${WORK}/3.dpck RESULT_VARIABLE r)
+if (NOT r EQUAL 0)
+    message (FATAL_ERROR "merge failed")
+endif ()
+execute_process (COMMAND ${SHARD} merge ${WORK}/b.dpck ${WORK}/3.dpck ${WORK}/1.dpck ${WORK}/0.dpck ${WORK}/2.dpck RESULT_VARIABLE r)
+if (NOT r EQUAL 0)
+    message (FATAL_ERROR "merge failed")
+endif ()
+execute_process (COMMAND ${CMAKE_COMMAND} -E compare_files ${WORK}/a.dpck ${WORK}/b.dpck RESULT_VARIABLE r)
+if (NOT r EQUAL 0)
+    message (FATAL_ERROR "merge depends on the shard order")
+endif ()
+
+# 1つだけ回し直しても同じシャードになる.
+execute_process (COMMAND ${SHARD} render 2 ${WORK}/2again.dpck ${ARGS} RESULT_VARIABLE r)
+execute_process (COMMAND ${CMAKE_COMMAND} -E compare_files ${WORK}/2.dpck ${WORK}/2again.dpck RESULT_VARIABLE r)
+if (NOT r EQUAL 0)
+    message (FATAL_ERROR "shard 2 is not reproducible")
+endif ()
+
+# 同じシャードを二度足すのは拒否する.
+execute_process (COMMAND ${SHARD} merge ${WORK}/c.dpck ${WORK}/2.dpck ${WORK}/2again.dpck RESULT_VARIABLE r OUTPUT_QUIET)
+if (r EQUAL 0)
+    message (FATAL_ERROR "duplicate shard was merged")
+endif ()
@@ -0,0 +1,36 @@
+#pragma once
+#ifndef TestLenses_hpp__5b0f1c2e8d7a4e6b9a3c1f0e2d4b6a8c
+#define TestLenses_hpp__5b0f1c2e8d7a4e6b9a3c1f0e2d4b6a8c
+
+#include <lens.hpp>
+
+namespace TestLenses
+{
+inline Lens::Surface standard(double z, double curve, double diameter, double ior, double abbe)
+{
+    Lens::Surface surface;
+    surface.type_     = Lens::Surface::STANDARD;
+    surface.curve_    = curve;
+    surface.radius_   = (curve != 0.) ? 1. / curve : 0.;
+    surface.center_   = z + surface.radius_;
+    surface.diameter_ = diameter;
+    surface.ior_      = ior;
+    surface.abbeVd_   = abbe;
+    return surface;
+}
+
+// N-BK7 plano-convex singlet, f ~ 96.7mm, stop on the front surface.
+inline Lens::Body singlet(void)
+{
+    Lens::Body body;
+    body.surfaces_.push_back(standard(0., 1. / 50., 10., 1.5168, 64.17));
+    body.surfaces_.push_back(standard(5., 0., 10., 1., 1.));
+    body.surfaces_[0].isStop_ = true;
+    body.surfaces_[0].thickness_ = 5.;
+    body.setImageSurfaceZ(5. + 50. / 0.5168 - 5. / 1.5168);
+    body.setup();
+    return body;
+}
+} // namespace TestLenses
+
+#endif
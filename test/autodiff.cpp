@@ -0,0 +1,90 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+
+#include "common.hpp"
+
+#include "TestLenses.hpp"
+#include "TestUtilities.hpp"
+
+#include <autodiff.hpp>
+#include <optimizer.hpp>
+#include <paraxial.hpp>
+
+TEST_CASE("autodiff", "")
+{
+    typedef DUAL::Dual<double, 2>     D;
+    typedef Lens::Optimizer::Variable Variable;
+
+    SECTION("dual arithmetic")
+    {
+        const D x(3., 0), y(2., 1);
+        const D f = x * x * y + sin(x) / y - sqrt(x * y);
+        const double s = sqrt(6.);
+        REQUIRE(f.v_ == Approx(18. + ::sin(3.) / 2. - s));
+        REQUIRE(f.d_[0] == Approx(12. + ::cos(3.) / 2. - 2. / (2. * s)));
+        REQUIRE(f.d_[1] == Approx(9. - ::sin(3.) / 4. - 3. / (2. * s)));
+    }
+
+    SECTION("focal length derivative")
+    {
+        const Lens::Body     body = TestLenses::singlet();
+        Lens::AutoDiff::Body ad   = Lens::AutoDiff::lift(body);
+        ad.surfaces_[0].setCurve(Lens::AutoDiff::variable(body.surfaces_[0].curve_, 0));
+
+        const Lens::AutoDiff::Number f = Lens::Paraxial::focalLength(ad);
+        REQUIRE(f.v_ == Approx(Lens::Paraxial::focalLength(body)));
+
+        // thin lens: f = 1 / ((n-1) c) -> df/dc = -f^2 (n-1). thickness shifts it a little.
+        const double n = body.surfaces_[0].ior(587.56);
+        REQUIRE(Lens::AutoDiff::derivative(f, 0) == Approx(-f.v_ * f.v_ * (n - 1.)).epsilon(0.05));
+    }
+
+    SECTION("jacobian matches finite differences")
+    {
+        const Lens::Body body = TestLenses::singlet();
+        Lens::Optimizer  opt;
+        opt.fields_.push_back(Lens::Field(0., 3.));
+        opt.variables_.push_back(Variable(Variable::CURVE, 0, 0, 1e-7));
+        opt.variables_.push_back(Variable(Variable::CURVE, 1, 0, 1e-7));
+        opt.variables_.push_back(Variable(Variable::THICKNESS, 0, 0, 1e-5));
+        opt.variables_.push_back(Variable(Variable::CONIC, 0, 0, 1e-5));
+        opt.variables_.push_back(Variable(Variable::IMAGE, 0, 0, 1e-5));
+        opt.targetFocal_ = 100.;
+
+        const std::vector<Lens::Pupil::Sample> pupil = Lens::Pupil::hexGrid(opt.pupilRays_);
+        std::vector<double>                    x, r;
+        for (const Variable &v : opt.variables_)
+            x.push_back(Lens::Optimizer::get(body, v));
+        opt.residuals(body, pupil, r);
+
+        std::vector<std::vector<double>> fd, ad;
+        REQUIRE(opt.jacobian(body, pupil, x, r, fd) == opt.variables_.size());
+        opt.autoDiff_ = true;
+        REQUIRE(opt.jacobian(body, pupil, x, r, ad) == 1);
+
+        for (size_t j = 0; j < x.size(); j++)
+        {
+            double scale = 0.;
+            for (size_t i = 0; i < r.size(); i++)
+                scale = std::max(scale, fabs(fd[j][i]));
+            REQUIRE(scale > 0.);
+            for (size_t i = 0; i < r.size(); i++)
+                REQUIRE(ad[j][i] == Approx(fd[j][i]).margin(scale * 1e-3));
+        }
+    }
+
+    SECTION("optimizer converges with autodiff")
+    {
+        Lens::Body      body = TestLenses::singlet();
+        Lens::Optimizer opt;
+        opt.autoDiff_ = true;
+        opt.variables_.push_back(Variable(Variable::CURVE, 0));
+        opt.variables_.push_back(Variable(Variable::CURVE, 1));
+        opt.variables_.push_back(Variable(Variable::IMAGE));
+        opt.targetFocal_ = 100.;
+        opt.focalWeight_ = 0.1;
+
+        const Lens::Optimizer::Result res = opt.optimize(body);
+        REQUIRE(res.final_ < res.initial_ * 0.5);
+        REQUIRE(Lens::Paraxial::focalLength(body) == Approx(100.).epsilon(0.01));
+    }
+}
@@ -0,0 +1,109 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+
+#include "common.hpp"
+
+#include "TestLenses.hpp"
+#include "TestUtilities.hpp"
+
+#include <autofocus.hpp>
+#include <lens.hpp>
+#include <paraxial.hpp>
+
+#include <math.h>
+
+#include <vector>
+
+namespace
+{
+// rms spot radius about the centroid at plane z, traced ray by ray.
+double traced(Lens::Body body, const Lens::Autofocus &focus, double distance, double z)
+{
+    Lens::Pupil::Entrance entrance;
+    entrance.setup(body);
+    const double radius = entrance.radius_ * ((distance > 0.) ? focus.overscan_ : 1.);
+    body.setImageSurfaceZ(z);
+
+    std::vector<Lens::Vector> hits;
+    for (size_t i = 0; i < focus.rays_; i++)
+    {
+        const Lens::Pupil::Sample s   = Lens::Pupil::r2(i);
+        const Lens::Vector        pos = Lens::Vector(s.x_ * radius, s.y_ * radius, entrance.z_);
+        const Lens::Vector        dir = (distance > 0.) ? (pos - Lens::Vector(0., 0., entrance.z_ - distance)).normal() : Lens::Vector(0., 0., 1.);
+        Lens::Vector              hit, hitDir;
+        if (body.trace(pos, dir, focus.lambdas_[0], hit, hitDir))
+            hits.push_back(hit);
+    }
+    double cx = 0., cy = 0.;
+    for (const Lens::Vector &h : hits)
+    {
+        cx += h.x / hits.size();
+        cy += h.y / hits.size();
+    }
+    double sum = 0.;
+    for (const Lens::Vector &h : hits)
+        sum += (h.x - cx) * (h.x - cx) + (h.y - cy) * (h.y - cy);
+    return sqrt(sum / hits.size());
+}
+} // namespace
+
+TEST_CASE("autofocus", "")
+{
+    Lens::Body body = TestLenses::singlet();
+    // keep rays off the rim, where the scalar intersection may disagree with the batch tracer.
+    body.irisScale_ = 0.9;
+
+    Lens::Autofocus focus;
+    focus.rays_ = 128;
+
+    SECTION("infinity")
+    {
+        const Lens::Autofocus::Result r = focus.solve(body, 0.);
+        REQUIRE(r.paraxial_ == Approx(Lens::Paraxial::focus(body)).epsilon(1e-6));
+        REQUIRE(r.hits_ > 100);
+        // under-corrected spherical aberration: best focus sits in front of the paraxial focus.
+        REQUIRE(r.z_ < r.paraxial_);
+        REQUIRE(r.z_ > r.paraxial_ - 1.);
+
+        // the closed form agrees with tracing to the plane, and it is a minimum.
+        const Lens::Autofocus::Bundle bundle = focus.trace(body, 0., r.paraxial_);
+        for (double z : {r.z_, r.z_ + 0.2, r.paraxial_})
+            REQUIRE(bundle.rms(z) == Approx(traced(body, focus, 0., z)).epsilon(1e-6));
+        REQUIRE(r.rms_ < traced(body, focus, 0., r.z_ - 0.01));
+        REQUIRE(r.rms_ < traced(body, focus, 0., r.z_ + 0.01));
+        REQUIRE(r.rms_ < bundle.rms(r.paraxial_) * 0.5);
+    }
+    SECTION("finite distance")
+    {
+        const double                  distance = 1000.;
+        const Lens::Autofocus::Result far      = focus.solve(body, 0.);
+        const Lens::Autofocus::Result near     = focus.solve(body, distance);
+
+        // paraxial image of the axial point, from a real ray at small height.
+        Lens::Vector pos = Lens::Vector(0., 0., -distance);
+        Lens::Vector dir = Lens::Vector(0., 1e-5, 1.).normal();
+        REQUIRE(body.traceSurfaces(pos, dir, 587.56, 0, body.surfaces_.size()));
+        REQUIRE(near.paraxial_ == Approx(pos.z - pos.y * dir.z / dir.y).epsilon(1e-5));
+
+        REQUIRE(near.z_ > far.z_ + 5.);
+        REQUIRE(fabs(near.z_ - near.paraxial_) < 1.);
+        REQUIRE(near.rms_ < traced(body, focus, distance, near.z_ + 0.02));
+        REQUIRE(near.rms_ < traced(body, focus, distance, near.z_ - 0.02));
+    }
+    SECTION("apply")
+    {
+        focus.lambdas_ = {486.13, 587.56, 656.27};
+        const Lens::Autofocus::Result r = focus.solve(body, 2000.);
+
+        Lens::Autofocus threaded = focus;
+        threaded.threads_        = 4;
+        const Lens::Autofocus::Result t = threaded.solve(body, 2000.);
+        REQUIRE(t.z_ == r.z_);
+        REQUIRE(t.rms_ == r.rms_);
+        REQUIRE(t.rays_ == 3 * 128);
+
+        const uint64_t setupRevision = body.setupRevision_;
+        focus.apply(body, 2000.);
+        REQUIRE(body.imageSurfaceZ_ == Approx(r.z_).margin(1e-12));
+        REQUIRE(body.setupRevision_ == setupRevision);
+    }
+}
@@ -0,0 +1,63 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+
+#include "common.hpp"
+
+#include "TestLenses.hpp"
+#include "TestUtilities.hpp"
+
+#include <bokeh.hpp>
+
+TEST_CASE("bokeh", "")
+{
+    const Lens::Body body = TestLenses::singlet();
+
+    Lens::Bokeh bokeh;
+    bokeh.sensorWidth_  = 8.;
+    bokeh.pupilRays_    = 1024;
+    bokeh.kernelRadius_ = 16;
+    bokeh.tile_         = 32;
+    bokeh.layers_       = 2;
+    bokeh.zones_        = 2;
+
+    Lens::Pupil::Entrance entrance;
+    entrance.setup(body);
+    const double pitch = 8. / 128.;
+
+    SECTION("kernel")
+    {
+        // focused at infinity: a far point stays compact, a near one spreads out.
+        const Lens::Bokeh::Kernel farK  = bokeh.kernel(body, entrance, Lens::Vector(0., 0., -1e6), pitch);
+        const Lens::Bokeh::Kernel nearK = bokeh.kernel(body, entrance, Lens::Vector(0., 0., -5000.), pitch);
+        double                    sumF = 0., sumN = 0.;
+        for (float w : farK.weight_)
+            sumF += w;
+        for (float w : nearK.weight_)
+            sumN += w;
+        REQUIRE(sumF == Approx(1.).epsilon(0.02));
+        REQUIRE(sumN == Approx(1.).epsilon(0.02));
+        REQUIRE(farK.at(0, 0) > nearK.at(0, 0) * 4.f);
+    }
+
+    SECTION("render")
+    {
+        const size_t        W = 128, H = 96;
+        FloatCanvas::Canvas in(W, H), out;
+        in.fill(FloatCanvas::Pixel(0.f, 0.f, 0.f));
+        std::vector<float> depth(W * H, 1e6f);
+        in.pixel(64, 48)      = FloatCanvas::Pixel(1.f, 0.5f, 0.25f);
+        depth[48 * W + 64]    = 5000.f;
+        bokeh.render(body, in, depth, out);
+
+        double r = 0., g = 0., b = 0.;
+        for (const auto &p : out.pixel_)
+        {
+            r += p[0];
+            g += p[1];
+            b += p[2];
+        }
+        REQUIRE(r == Approx(1.).epsilon(0.03));
+        REQUIRE(g == Approx(0.5).epsilon(0.03));
+        REQUIRE(b == Approx(0.25).epsilon(0.03));
+        REQUIRE(out.pixel_[48 * W + 64][0] < 0.5f);
+    }
+}
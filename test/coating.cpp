@@ -0,0 +1,99 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+
+#include "common.hpp"
+
+#include "TestLenses.hpp"
+#include "TestUtilities.hpp"
+
+#include <coating.hpp>
+#include <lens.hpp>
+
+#include <math.h>
+
+TEST_CASE("coating", "")
+{
+    const double n = 1.52;
+
+    SECTION("bare interface is fresnel")
+    {
+        const Lens::Coating          bare;
+        const Lens::Coating::Fresnel f0 = bare.evaluate(1., n, 1., 550.);
+        REQUIRE(f0.rs_ == Approx((n - 1.) * (n - 1.) / ((n + 1.) * (n + 1.))));
+        REQUIRE(f0.rp_ == Approx(f0.rs_));
+        REQUIRE(f0.rs_ + f0.ts_ == Approx(1.));
+
+        const double                 ci = cos(40. * M_PI / 180.);
+        const double                 ct = sqrt(1. - (1. - ci * ci) / (n * n));
+        const Lens::Coating::Fresnel f  = bare.evaluate(1., n, ci, 550.);
+        const double                 rs = (ci - n * ct) / (ci + n * ct);
+        const double                 rp = (n * ci - ct) / (n * ci + ct);
+        REQUIRE(f.rs_ == Approx(rs * rs));
+        REQUIRE(f.rp_ == Approx(rp * rp));
+        REQUIRE(f.rp_ + f.tp_ == Approx(1.));
+
+        // brewster angle.
+        REQUIRE(bare.evaluate(1., n, cos(atan(n)), 550.).rp_ == Approx(0.).margin(1e-12));
+        // total internal reflection from the glass side.
+        REQUIRE(bare.evaluate(n, 1., cos(60. * M_PI / 180.), 550.).rs_ == 1.);
+    }
+
+    SECTION("quarter wave layer")
+    {
+        const Lens::Coating mgf2 = Lens::Coating::quarterWave(1.38, 550.);
+        const double        r    = (n - 1.38 * 1.38) / (n + 1.38 * 1.38);
+        const auto          f    = mgf2.evaluate(1., n, 1., 550.);
+        REQUIRE(f.rs_ == Approx(r * r));
+        REQUIRE(f.rs_ + f.ts_ == Approx(1.));
+        // AR is worse away from the design wavelength, and better than bare glass.
+        REQUIRE(mgf2.evaluate(1., n, 1., 420.).rs_ > f.rs_);
+        REQUIRE(mgf2.evaluate(1., n, 1., 420.).rs_ < 0.04);
+        // reversing the stack from the glass side gives the same reflectance at normal incidence.
+        REQUIRE(mgf2.evaluate(n, 1., 1., 550., true).rs_ == Approx(f.rs_));
+    }
+
+    SECTION("table lookup")
+    {
+        Lens::Coating stack;
+        stack.layers_.push_back(Lens::Coating::Layer(2.1, 60.));
+        stack.layers_.push_back(Lens::Coating::Layer(1.38, 95.));
+        Lens::Coating::Table table;
+        table.build(stack, [](double) { return 1.; }, [n](double) { return n; });
+        for (double a : {0., 13.3, 47.5, 71.})
+            for (double lambda : {450., 537., 612.})
+            {
+                double rs, rp;
+                table.lookup(true, cos(a * M_PI / 180.), lambda, rs, rp);
+                const auto f = stack.evaluate(1., n, cos(a * M_PI / 180.), lambda);
+                REQUIRE(rs == Approx(f.rs_).margin(2e-3));
+                REQUIRE(rp == Approx(f.rp_).margin(2e-3));
+            }
+    }
+
+    SECTION("surface tables")
+    {
+        Lens::Body body            = TestLenses::singlet();
+        body.surfaces_[0].isCoated_ = true;
+        body.setup();
+        REQUIRE(body.surfaces_[0].coatingTable_);
+        REQUIRE(body.surfaces_[1].coatingTable_);
+
+        // unchanged surfaces keep their table.
+        const Lens::Coating::Table *table = body.surfaces_[1].coatingTable_.get();
+        body.surfaces_[0].setCurve(1. / 45.);
+        body.setup();
+        REQUIRE(body.surfaces_[1].coatingTable_.get() == table);
+        body.surfaces_[0].ior_ = 1.6;
+        body.setup();
+        REQUIRE(body.surfaces_[1].coatingTable_.get() != table);
+
+        double             Re = -1., Tr = -1.;
+        const Lens::Vector dir  = Lens::Vector(0., 0., 1.);
+        const Lens::Vector norm = Lens::Vector(0., 0., -1.);
+        body.surfaces_[0].reflection(550., 1., body.surfaces_[0].ior(550.), dir, norm, Re, Tr);
+        REQUIRE(Re > 0.);
+        REQUIRE(Re < 0.02);
+        REQUIRE(Tr > 0.);
+        body.surfaces_[1].reflection(550., body.surfaces_[0].ior(550.), 1., dir * -1., norm, Re, Tr);
+        REQUIRE(Re > 0.04);
+    }
+}
@@ -0,0 +1,161 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+
+#include "common.hpp"
+
+#include "TestLenses.hpp"
+#include "TestUtilities.hpp"
+
+#include <configuration.hpp>
+#include <lens.hpp>
+#include <paraxial.hpp>
+#include <renderer.hpp>
+
+#include <math.h>
+
+namespace
+{
+// two positive singlets; the rear one is the focus group.
+Lens::Body twoGroups(void)
+{
+    Lens::Body body;
+    body.surfaces_.push_back(TestLenses::standard(0., 1. / 50., 10., 1.5168, 64.17));
+    body.surfaces_.push_back(TestLenses::standard(5., 0., 10., 1., 1.));
+    body.surfaces_.push_back(TestLenses::standard(15., 1. / 80., 10., 1.5168, 64.17));
+    body.surfaces_.push_back(TestLenses::standard(19., 0., 10., 1., 1.));
+    body.surfaces_[0].isStop_ = true;
+    body.surfaces_[0].thickness_ = 5.;
+    body.surfaces_[1].thickness_ = 10.;
+    body.surfaces_[2].thickness_ = 4.;
+    body.setup();
+    body.setImageSurfaceZ(Lens::Paraxial::focus(body));
+    return body;
+}
+} // namespace
+
+TEST_CASE("configuration", "")
+{
+    Lens::Body body = twoGroups();
+
+    SECTION("gaps")
+    {
+        REQUIRE(body.gap(1) == Approx(10.));
+        REQUIRE(body.gap(3) == Approx(body.imageSurfaceZ_ - 19.));
+
+        // setGap moves what follows, like editing thickness_ and laying out again.
+        Lens::Body edited = body;
+        edited.surfaces_[1].thickness_ = 12.;
+        edited.layout();
+
+        const uint64_t setupRevision = body.setupRevision_;
+        const uint64_t revision      = body.revision_;
+        body.setGap(1, 12.);
+        REQUIRE(body.revision_ == revision + 1);
+        REQUIRE(body.setupRevision_ == setupRevision);
+        for (size_t i = 0; i < body.surfaces_.size(); i++)
+            REQUIRE(body.surfaces_[i].vertex() == Approx(edited.surfaces_[i].vertex()).margin(1e-12));
+        REQUIRE(body.imageSurfaceZ_ == Approx(edited.imageSurfaceZ_).margin(1e-12));
+
+        // the last gap is the distance to the image plane.
+        body.setGap(3, 50.);
+        REQUIRE(body.imageSurfaceZ_ == Approx(body.surfaces_[3].vertex() + 50.));
+        body.setGap(3, 50.);
+        REQUIRE(body.revision_ == revision + 2);
+    }
+    SECTION("configurations")
+    {
+        Lens::Configurations configs;
+        REQUIRE(configs.addGap(body, 1) == 0);
+        REQUIRE(configs.addGap(body, 3) == 1);
+        const double far = body.gap(3);
+        REQUIRE(configs.capture(body) == 0);
+        REQUIRE(configs.capture(body) == 1);
+        // focus closer: pull the rear group forward and push the image back.
+        REQUIRE(configs.moveGroup(1, 2, 4, -2.));
+        configs.values_[1][1] += 3.;
+        REQUIRE(configs.values_[1][0] == Approx(8.));
+        REQUIRE(configs.values_[1][1] == Approx(far + 5.));
+        REQUIRE_FALSE(configs.moveGroup(1, 1, 2, 1.));
+
+        REQUIRE(configs.apply(body, (size_t)1) == 2);
+        REQUIRE(body.gap(1) == Approx(8.));
+        REQUIRE(body.gap(3) == Approx(far + 5.));
+        REQUIRE(body.surfaces_[2].vertex() == Approx(13.));
+
+        // switching to the same configuration again costs nothing.
+        const uint64_t revision = body.revision_;
+        REQUIRE(configs.apply(body, (size_t)1) == 0);
+        REQUIRE(body.revision_ == revision);
+
+        REQUIRE(configs.apply(body, 0.5) == 2);
+        REQUIRE(body.gap(1) == Approx(9.));
+        REQUIRE(body.gap(3) == Approx(far + 2.5));
+        configs.apply(body, (size_t)0);
+        REQUIRE(body.surfaces_[2].vertex() == Approx(15.));
+        REQUIRE(body.imageSurfaceZ_ == Approx(19. + far));
+    }
+    SECTION("paraxial matrices")
+    {
+        Lens::Paraxial::System system;
+        system.setup(body);
+        REQUIRE(system.focalLength() == Approx(Lens::Paraxial::focalLength(body)).epsilon(1e-4));
+        REQUIRE(body.surfaces_[3].vertex() + system.backFocus() == Approx(Lens::Paraxial::focus(body)).epsilon(1e-5));
+        REQUIRE(system.update(body) == 4);
+
+        // only the products behind the changed gap are recomputed.
+        const Lens::Paraxial::Matrix front = system.matrix(1);
+        body.setGap(1, 6.);
+        REQUIRE(system.update(body) == 2);
+        REQUIRE(system.matrix(1).c_ == front.c_);
+
+        Lens::Paraxial::System fresh;
+        fresh.setup(body);
+        REQUIRE(system.matrix().a_ == Approx(fresh.matrix().a_).margin(1e-12));
+        REQUIRE(system.matrix().b_ == Approx(fresh.matrix().b_).margin(1e-12));
+        REQUIRE(system.matrix().c_ == Approx(fresh.matrix().c_).margin(1e-12));
+        REQUIRE(system.matrix().d_ == Approx(fresh.matrix().d_).margin(1e-12));
+        REQUIRE(system.focalLength() == Approx(Lens::Paraxial::focalLength(body)).epsilon(1e-4));
+
+        // the image distance is not part of the matrix.
+        body.setGap(3, body.gap(3) + 1.);
+        REQUIRE(system.update(body) == 4);
+
+        body.surfaces_[2].curve_ = 1. / 70.;
+        body.setup();
+        REQUIRE(system.update(body) == 0);
+    }
+    SECTION("renderer optics")
+    {
+        const Lens::Renderer   renderer;
+        Lens::Renderer::Optics optics = renderer.prepare(body);
+        REQUIRE_FALSE(renderer.update(optics, body));
+
+        const Lens::Surface *before = &optics.reversed_.surfaces_[0];
+        const auto           table  = optics.reversed_.surfaces_[2].coatingTable_;
+        body.setGap(1, 7.);
+        body.setGap(3, body.gap(3) + 1.5);
+        REQUIRE(renderer.update(optics, body));
+        REQUIRE_FALSE(renderer.update(optics, body));
+        // moved in place, the surfaces were not set up again.
+        REQUIRE(&optics.reversed_.surfaces_[0] == before);
+        REQUIRE(optics.reversed_.surfaces_[2].coatingTable_ == table);
+
+        const Lens::Renderer::Optics fresh = renderer.prepare(body);
+        for (size_t i = 0; i < body.surfaces_.size(); i++)
+            REQUIRE(optics.reversed_.surfaces_[i].center_ == Approx(fresh.reversed_.surfaces_[i].center_).margin(1e-9));
+        REQUIRE(optics.reversed_.imageSurfaceZ_ == Approx(fresh.reversed_.imageSurfaceZ_).margin(1e-9));
+        REQUIRE(optics.zRef_ == fresh.zRef_);
+        REQUIRE(optics.exit_.z_ == Approx(fresh.exit_.z_).margin(1e-9));
+        REQUIRE(optics.exit_.radius_ == Approx(fresh.exit_.radius_).margin(1e-9));
+
+        const Lens::Vector pos = Lens::Vector(0.5, 0.3, 0.), dir = Lens::Vector(0.01, -0.02, 1.).normal();
+        Lens::Vector       p0 = pos, d0 = dir, p1 = pos, d1 = dir;
+        REQUIRE(optics.reversed_.traceSurfaces(p0, d0, 587.56, 0, 4));
+        REQUIRE(fresh.reversed_.traceSurfaces(p1, d1, 587.56, 0, 4));
+        REQUIRE_THAT(p0, IsApproxEquals(p1, 1e-9));
+        REQUIRE_THAT(d0, IsApproxEquals(d1, 1e-9));
+
+        body.setup();
+        REQUIRE(renderer.update(optics, body));
+        REQUIRE(optics.setupRevision_ == body.setupRevision_);
+    }
+}
@@ -0,0 +1,92 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+
+#include "common.hpp"
+
+#include "TestLenses.hpp"
+#include "TestUtilities.hpp"
+
+#include <fft.hpp>
+#include <psf.hpp>
+#include <random.hpp>
+
+#include <math.h>
+
+namespace
+{
+std::vector<FFT::Complex> dft(const std::vector<FFT::Complex> &in)
+{
+    const size_t              n = in.size();
+    std::vector<FFT::Complex> out(n);
+    for (size_t k = 0; k < n; k++)
+        for (size_t j = 0; j < n; j++)
+            out[k] += in[j] * std::polar(1., -2. * M_PI * (double)(j * k % n) / (double)n);
+    return out;
+}
+} // namespace
+
+TEST_CASE("fft", "")
+{
+    RANDOM::xoshiro256aa rng(1234);
+    SECTION("matches naive DFT")
+    {
+        // 2^odd / 2^even sizes exercise the radix-2 and radix-4 paths.
+        for (size_t n : {1, 2, 4, 8, 32, 64, 128})
+        {
+            std::vector<FFT::Complex> data(n);
+            for (auto &c : data)
+                c = FFT::Complex(rng.rand01() - 0.5, rng.rand01() - 0.5);
+            const std::vector<FFT::Complex> expected = dft(data);
+
+            FFT::Plan(n).transform(data.data());
+            for (size_t k = 0; k < n; k++)
+            {
+                REQUIRE(data[k].real() == Approx(expected[k].real()).margin(1e-9));
+                REQUIRE(data[k].imag() == Approx(expected[k].imag()).margin(1e-9));
+            }
+        }
+    }
+    SECTION("2D round trip")
+    {
+        const size_t              w = 64, h = 32;
+        std::vector<FFT::Complex> data(w * h);
+        for (auto &c : data)
+            c = FFT::Complex(rng.rand01(), rng.rand01());
+        const std::vector<FFT::Complex> orig = data;
+        FFT::transform2D(data, w, h, false);
+        FFT::transform2D(data, w, h, true);
+        for (size_t k = 0; k < w * h; k++)
+            REQUIRE(std::abs(data[k] - orig[k]) < 1e-12);
+    }
+}
+
+TEST_CASE("psf", "")
+{
+    Lens::Body body = TestLenses::singlet();
+
+    Lens::Diffraction diffraction;
+    diffraction.pupilN_  = 64;
+    diffraction.padding_ = 4;
+
+    SECTION("diffraction limited when stopped down")
+    {
+        body.setIrisScale(0.1);
+        const Lens::Diffraction::Result res = diffraction.evaluate(body, Lens::Field(0., 0.), 587.56);
+        REQUIRE(res.n_ == 256);
+        REQUIRE(res.rmsWaves_ < 0.07);
+        REQUIRE(res.strehl_ > 0.8);
+        REQUIRE(res.mtf_[128 * 256 + 128] == Approx(1.));
+        REQUIRE(res.psfPitch_ > 0.);
+    }
+    SECTION("aberrated at full aperture")
+    {
+        const Lens::Diffraction::Result res = diffraction.evaluate(body, Lens::Field(0., 0.), 587.56);
+        double                          sum = 0.;
+        for (double p : res.psf_)
+            sum += p;
+        REQUIRE(sum == Approx(1.));
+        REQUIRE(res.strehl_ < 0.8);
+        const std::vector<double> t = res.mtfSlice(true);
+        REQUIRE(t[0] == Approx(1.));
+        REQUIRE(t[8] < t[0]);
+    }
+}
@@ -0,0 +1,178 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+
+#include "common.hpp"
+
+#include "TestLenses.hpp"
+#include "TestUtilities.hpp"
+
+#include <iris.hpp>
+#include <lens.hpp>
+#include <pupil.hpp>
+#include <random.hpp>
+#include <renderer.hpp>
+#include <wavefront.hpp>
+
+#include <math.h>
+
+#include <vector>
+
+namespace
+{
+Lens::Iris iris(int blades, double curvature, double rotation = 0.)
+{
+    Lens::Iris i;
+    i.blades_    = blades;
+    i.curvature_ = curvature;
+    i.rotation_  = rotation;
+    i.setup();
+    return i;
+}
+} // namespace
+
+TEST_CASE("iris", "")
+{
+    SECTION("inside")
+    {
+        const Lens::Iris hex    = iris(6, 0.);
+        const double     apo    = cos(M_PI / 6.);
+        const double     normal = M_PI / 6.; // first edge normal.
+        REQUIRE(hex.inside(0., 0.));
+        REQUIRE(hex.inside(0.99 * apo * cos(normal), 0.99 * apo * sin(normal)));
+        REQUIRE_FALSE(hex.inside(1.01 * apo * cos(normal), 1.01 * apo * sin(normal)));
+        REQUIRE(hex.inside(0.99, 0.));
+        REQUIRE_FALSE(hex.inside(1.01, 0.));
+
+        // rounded blades bulge past the straight edge but stay within the vertex circle.
+        const Lens::Iris round = iris(6, 0.5);
+        REQUIRE(round.inside(1.02 * apo * cos(normal), 1.02 * apo * sin(normal)));
+        REQUIRE_FALSE(round.inside(0.999 * cos(normal), 0.999 * sin(normal)));
+        REQUIRE(round.area() > hex.area());
+        REQUIRE(round.area() < M_PI);
+
+        // fully curved blades are the circle.
+        const Lens::Iris    circle = iris(5, 1.);
+        RANDOM::xoshiro256aa rng(1);
+        for (int i = 0; i < 1000; i++)
+        {
+            const double x = rng.rand01() * 2.2 - 1.1, y = rng.rand01() * 2.2 - 1.1;
+            if (fabs(x * x + y * y - 1.) > 1e-9)
+                REQUIRE(circle.inside(x, y) == (x * x + y * y <= 1.));
+        }
+        REQUIRE(circle.area() == Approx(M_PI));
+        REQUIRE(hex.area() == Approx(1.5 * sqrt(3.)));
+    }
+    SECTION("batch")
+    {
+        const Lens::Iris     pent = iris(5, 0.3, 10.);
+        RANDOM::xoshiro256aa rng(2);
+        std::vector<double>  x(257), y(257);
+        std::vector<uint8_t> alive(257, 1);
+        for (size_t i = 0; i < x.size(); i++)
+        {
+            x[i] = rng.rand01() * 4. - 2.;
+            y[i] = rng.rand01() * 4. - 2.;
+        }
+        alive[3]             = 0;
+        const size_t clipped = pent.clip(x.data(), y.data(), x.size(), 0.5, 0.5, alive.data());
+        size_t       expect  = 0;
+        for (size_t i = 0; i < x.size(); i++)
+        {
+            const bool in = pent.inside(x[i] * 0.5, y[i] * 0.5);
+            REQUIRE((alive[i] != 0) == (in && i != 3));
+            expect += (i != 3 && !in);
+        }
+        REQUIRE(clipped == expect);
+    }
+    SECTION("sampling")
+    {
+        // uniform: the share of samples in a sub-region equals its share of the area.
+        for (const Lens::Iris &shape : {iris(6, 0.), iris(7, 0.), iris(5, 0.4, 15.), iris(0, 0.)})
+        {
+            RANDOM::xoshiro256aa rng(3);
+            const size_t         N     = 20000;
+            size_t               core  = 0;
+            double               cx    = 0., cy = 0.;
+            bool                 valid = true;
+            for (size_t i = 0; i < N; i++)
+            {
+                const double u = rng.rand01(), v = rng.rand01();
+                double       x, y;
+                shape.sample(u, v, x, y);
+                valid = valid && shape.inside(x * (1. - 1e-9), y * (1. - 1e-9));
+                core += (x * x + y * y < 0.25);
+                cx += x / N;
+                cy += y / N;
+            }
+            REQUIRE(valid);
+            // the r < 0.5 disc lies inside every shape here.
+            REQUIRE((double)core / N == Approx(0.25 * M_PI / shape.area()).margin(0.01));
+            REQUIRE(fabs(cx) < 0.01);
+            REQUIRE(fabs(cy) < 0.01);
+        }
+    }
+    SECTION("stop")
+    {
+        Lens::Body body = TestLenses::singlet();
+        body.irisScale_ = 0.9;
+        Lens::Surface &stop = body.surfaces_[0];
+        stop.iris_.blades_  = 5;
+        body.setup();
+
+        // between the pentagon edge and its vertex circle: the circle passes, the blades clip.
+        const double       r   = stop.diameter_ * body.irisScale_;
+        const double       a   = M_PI / 5.;
+        const Lens::Vector pos = Lens::Vector(0.95 * r * cos(a), 0.95 * r * sin(a), -1.);
+        REQUIRE_FALSE(stop.insideStop(pos.x, pos.y, body.irisScale_));
+        Lens::Vector hit, hitDir;
+        REQUIRE_FALSE(body.trace(pos, Lens::Vector(0., 0., 1.), 587.56, hit, hitDir));
+        REQUIRE(body.trace(Lens::Vector(0.95 * r, 0., -1.), Lens::Vector(0., 0., 1.), 587.56, hit, hitDir));
+
+        // the batch tracer agrees ray for ray.
+        Lens::Wavefront::Batch batch;
+        std::vector<bool>      traced;
+        for (size_t i = 0; i < 400; i++)
+        {
+            const Lens::Pupil::Sample s = Lens::Pupil::r2(i);
+            const Lens::Vector        o = Lens::Vector(s.x_ * r * 1.1, s.y_ * r * 1.1, -1.);
+            batch.push(o, Lens::Vector(0., 0., 1.), (uint32_t)i);
+            traced.push_back(body.trace(o, Lens::Vector(0., 0., 1.), 587.56, hit, hitDir));
+        }
+        Lens::Wavefront::trace(body, 587.56, batch);
+        size_t passed = 0;
+        for (bool t : traced)
+            passed += t;
+        REQUIRE(batch.size() == passed);
+        for (size_t i = 0; i < batch.size(); i++)
+            REQUIRE(traced[batch.id_[i]]);
+    }
+    SECTION("render")
+    {
+        // a defocused highlight through six blades carries the hexagon's share of the light.
+        Lens::Body body = TestLenses::singlet();
+
+        Lens::Renderer::Scene scene;
+        scene.background_ = FloatCanvas::Pixel(0.f, 0.f, 0.f);
+        scene.lights_.push_back(Lens::Renderer::Light(Lens::Vector(0., 0., -2000.), 20., FloatCanvas::Pixel(1.f, 1.f, 1.f)));
+
+        Lens::Renderer renderer;
+        renderer.sensorWidth_ = 8.;
+        renderer.tile_        = 8;
+        renderer.samples_     = 8;
+        renderer.threads_     = 1;
+
+        double total[2];
+        for (int k = 0; k < 2; k++)
+        {
+            body.surfaces_[0].iris_.blades_ = k ? 6 : 0;
+            body.setup();
+            renderer.setup(32, 24);
+            REQUIRE(renderer.render(body, scene, 2));
+            const FloatCanvas::Canvas image = renderer.image();
+            total[k]                        = 0.;
+            for (const FloatCanvas::Pixel &p : image.pixel_)
+                total[k] += p[1];
+        }
+        REQUIRE(total[0] > 0.);
+        REQUIRE(total[1] / total[0] == Approx(iris(6, 0.).area() / M_PI).epsilon(0.05));
+    }
+}
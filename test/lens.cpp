@@ -2,6 +2,7 @@
 
 #include "common.hpp"
 
+#include "TestLenses.hpp"
 #include "TestUtilities.hpp"
 
 #include <lens.hpp>
@@ -9,6 +10,7 @@
 #include <math.h>
 
 #include <floatcanvas.hpp>
+#include <parallel.hpp>
 
 TEST_CASE("lens", "")
 {
@@ -56,4 +58,126 @@ TEST_CASE("lens", "")
         Lens::Vector expected = Lens::Vector(0.f, 1.f, -1.f).normal();
         REQUIRE_THAT(normal, IsApproxEquals(expected, eps));
     }
+    SECTION("pose")
+    {
+        const Lens::Body body = TestLenses::singlet();
+        Lens::Vector     hit0, hit, dir;
+        REQUIRE(body.trace(Lens::Vector(0., 2., 0.), Lens::Vector(0., 0., 1.), 587.56, hit0, dir));
+
+        // identity pose takes the untransformed path.
+        Lens::Body moved = body;
+        moved.setup();
+        REQUIRE_FALSE(moved.surfaces_[0].hasPose_);
+
+        // decentering the whole lens shifts the image by the same amount.
+        for (auto &surface : moved.surfaces_)
+            surface.decenterX_ = 0.5;
+        moved.setup();
+        REQUIRE(moved.surfaces_[0].hasPose_);
+        REQUIRE(moved.trace(Lens::Vector(0.5, 2., 0.), Lens::Vector(0., 0., 1.), 587.56, hit, dir));
+        REQUIRE(hit.x == Approx(hit0.x + 0.5).margin(1e-9));
+        REQUIRE(hit.y == Approx(hit0.y).margin(1e-9));
+
+        // local <-> world round trip.
+        Lens::Surface surface = body.surfaces_[0];
+        surface.decenterY_    = 0.2;
+        surface.tiltX_        = 3.;
+        surface.tiltY_        = -2.;
+        surface.tiltZ_        = 10.;
+        surface.setup();
+        const Lens::Vector p = Lens::Vector(0.3, -1.2, 4.);
+        const Lens::Vector q = surface.toWorld(surface.toLocal(p));
+        REQUIRE_THAT(q, IsApproxEquals(p, eps));
+
+        // tilting the flat rear surface deviates the beam: a thin prism.
+        moved = body;
+        moved.surfaces_[1].tiltX_ = 1.;
+        moved.setup();
+        REQUIRE(moved.trace(Lens::Vector(0., 0., 0.), Lens::Vector(0., 0., 1.), 587.56, hit, dir));
+        const double n = body.surfaces_[0].ior(587.56);
+        REQUIRE(fabs(dir.y / dir.z) == Approx(tan((n - 1.) * M_PI / 180.)).epsilon(0.01));
+        REQUIRE(dir.x == Approx(0.).margin(1e-12));
+    }
+    SECTION("early rejection")
+    {
+        const Lens::Body body = TestLenses::singlet();
+        REQUIRE(body.surfaces_[0].sagMax_ > 1.);
+        REQUIRE(body.surfaces_[0].sagMin_ < 0.);
+
+        Lens::TraceStats &stats = Lens::TraceStats::local();
+        stats.reset();
+        Lens::Vector hit, dir;
+        REQUIRE(body.trace(Lens::Vector(0., 9.9, 0.), Lens::Vector(0., 0., 1.), 587.56, hit, dir));
+        REQUIRE(stats.earlyRejects_ == 0);
+        REQUIRE_FALSE(body.trace(Lens::Vector(0., 10.5, 0.), Lens::Vector(0., 0., 1.), 587.56, hit, dir));
+        REQUIRE(stats.earlyRejects_ == 1);
+        // steep ray that enters the slab inside the aperture is not rejected.
+        REQUIRE(body.trace(Lens::Vector(0., 9.5, 0.), Lens::Vector(0., -0.2, 1.).normal(), 587.56, hit, dir));
+        REQUIRE(stats.earlyRejects_ == 1);
+        REQUIRE(stats.earlyRejectRatio() > 0.);
+    }
+    SECTION("trace statistics")
+    {
+        Lens::Body body = TestLenses::singlet();
+        Lens::TraceStats::resetAll();
+        Lens::TraceStats &stats = Lens::TraceStats::local();
+
+        Lens::Vector hit, dir;
+        REQUIRE(body.trace(Lens::Vector(0., 5., 0.), Lens::Vector(0., 0., 1.), 587.56, hit, dir));
+        REQUIRE(stats.perSurface_[0].attempts_ == 1);
+        REQUIRE(stats.perSurface_[1].attempts_ == 1);
+        REQUIRE(stats.solves_ == 2);
+        REQUIRE(stats.iterations_ > 0);
+        REQUIRE(stats.nonConverged_ == 0);
+
+        // the stop is on the front surface.
+        body.irisScale_ = 0.5;
+        REQUIRE_FALSE(body.trace(Lens::Vector(0., 7., 0.), Lens::Vector(0., 0., 1.), 587.56, hit, dir));
+        REQUIRE(stats.apertureClips_ == 1);
+        REQUIRE(stats.perSurface_[0].clips_ == 1);
+        REQUIRE(stats.perSurface_[1].attempts_ == 1);
+
+        Lens::Vector norm = Lens::Vector(0., 0., -1.);
+        Lens::Vector out;
+        REQUIRE_FALSE(Lens::refract(Lens::Vector(0., sin(M_PI / 3.), cos(M_PI / 3.)), norm, 1.5, out));
+        REQUIRE(stats.tir_ == 1);
+
+        // worker threads fold their counters into the total when they exit.
+        body.irisScale_ = 1.;
+        PARALLEL::parallelFor(64, [&](size_t i) {
+            Lens::Vector h, d;
+            body.trace(Lens::Vector(0., (double)i * 0.1, 0.), Lens::Vector(0., 0., 1.), 587.56, h, d);
+        },
+            4);
+        const Lens::TraceStats total = Lens::TraceStats::total();
+        REQUIRE(total.surfaces_ == 3 + 64 * 2);
+        REQUIRE(total.perSurface_[1].attempts_ == 1 + 64);
+    }
+    SECTION("cylinder")
+    {
+        const Lens::Body sphere   = TestLenses::singlet();
+        Lens::Body       cylinder = sphere;
+        cylinder.surfaces_[0].type_ = Lens::Surface::CYLINDER_X;
+        cylinder.setup();
+
+        // in the y-z plane the cylinder matches the sphere.
+        Lens::Vector hit0, hit, dir0, dir;
+        const Lens::Vector slope = Lens::Vector(0., 0.05, 1.).normal();
+        REQUIRE(sphere.trace(Lens::Vector(0., 6., 0.), slope, 587.56, hit0, dir0));
+        REQUIRE(cylinder.trace(Lens::Vector(0., 6., 0.), slope, 587.56, hit, dir));
+        REQUIRE_THAT(hit, IsApproxEquals(hit0, 1e-9));
+        REQUIRE_THAT(dir, IsApproxEquals(dir0, 1e-9));
+
+        // no power along the cylinder axis.
+        REQUIRE(cylinder.trace(Lens::Vector(6., 0., 0.), Lens::Vector(0., 0., 1.), 587.56, hit, dir));
+        REQUIRE(hit.x == Approx(6.).margin(1e-9));
+        REQUIRE(dir.x == Approx(0.).margin(1e-12));
+
+        // CYLINDER_Y is the same surface rotated by 90 degrees.
+        cylinder.surfaces_[0].type_ = Lens::Surface::CYLINDER_Y;
+        cylinder.setup();
+        REQUIRE(cylinder.trace(Lens::Vector(6., 0., 0.), Lens::Vector(0.05, 0., 1.).normal(), 587.56, hit, dir));
+        REQUIRE(hit.x == Approx(hit0.y).margin(1e-9));
+        REQUIRE(cylinder.surfaces_[0].sagMax_ > 1.);
+    }
 }
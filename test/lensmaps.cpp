@@ -0,0 +1,93 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+
+#include "common.hpp"
+
+#include "TestLenses.hpp"
+#include "TestUtilities.hpp"
+
+#include <lensmaps.hpp>
+
+#include <stdio.h>
+
+TEST_CASE("lensmaps", "")
+{
+    Lens::Body body = TestLenses::singlet();
+    body.setImageSurfaceR(5.);
+
+    Lens::ImageMaps maps;
+    maps.build(body, {587.56, 486.13}, 32, 256);
+
+    SECTION("tables")
+    {
+        REQUIRE(maps.focalLength_ == Approx(96.75).epsilon(0.01));
+        REQUIRE(maps.vignetting(0.) == Approx(1.f));
+        REQUIRE(maps.illumination(1.) < maps.illumination(0.));
+        REQUIRE(fabs(maps.distortion(1.)) < 0.01);
+        // lateral color: blue is refracted more strongly.
+        REQUIRE(maps.distortion(1., 1) != maps.distortion(1., 0));
+    }
+    SECTION("beyond the traced field")
+    {
+        // the reference triplet's chief rays stop reaching the image well inside its default 100mm image circle.
+        const Lens::Body cooke = Lens::Loader::ZEMAX::load("../bench/data/cooke.zmx");
+        REQUIRE(cooke.imageSurfaceR_ == 100.);
+        Lens::ImageMaps wide;
+        wide.build(cooke, {587.56, 486.13}, 12, 256);
+        REQUIRE(wide.coverage_ > 0.1);
+        REQUIRE(wide.coverage_ < 0.5);
+        // past the last traced chief ray the tables hold their edge values instead of mapping onto the axis.
+        for (size_t l = 0; l < 2; l++)
+            for (size_t i = 0; i < wide.samples_; i++)
+            {
+                REQUIRE(fabs(wide.distortion_[l * wide.samples_ + i]) < 0.1);
+                if ((double)i / (wide.samples_ - 1) > wide.coverage_)
+                    REQUIRE(wide.distortion_[l * wide.samples_ + i] == wide.distortion_[l * wide.samples_ + wide.samples_ - 1]);
+            }
+        REQUIRE(wide.illumination(1.) > 0.f);
+        REQUIRE(wide.illumination(1.) == wide.illumination(wide.coverage_ + 0.1));
+
+        Lens::ImageMaps none;
+        none.build(body, {}, 8, 16);
+        REQUIRE(none.samples_ == 0);
+        REQUIRE(none.distortion(0.5) == 0.f);
+    }
+    SECTION("save/load")
+    {
+        const char *file = "lensmaps_test.dpmap";
+        REQUIRE(maps.save(file));
+        Lens::ImageMaps loaded;
+        REQUIRE(loaded.load(file));
+        remove(file);
+        REQUIRE(loaded.samples_ == maps.samples_);
+        REQUIRE(loaded.lambdas_ == maps.lambdas_);
+        REQUIRE(loaded.distortion_ == maps.distortion_);
+        REQUIRE(loaded.coverage_ == maps.coverage_);
+        REQUIRE(loaded.vignetting(0.5) == maps.vignetting(0.5));
+    }
+    SECTION("cache per iris")
+    {
+        Lens::ImageMapCache cache;
+        cache.samples_   = 16;
+        cache.pupilRays_ = 128;
+        const auto a     = cache.get(body);
+        REQUIRE(cache.get(body) == a);
+        body.setIrisScale(0.5);
+        REQUIRE(cache.get(body) != a);
+        REQUIRE(cache.get(body)->irisScale_ == 0.5);
+        // another focus is another table.
+        const auto        b    = cache.get(body);
+        const std::string name = cache.filename(body);
+        body.setGap(body.surfaces_.size() - 1, body.gap(body.surfaces_.size() - 1) + 1.);
+        REQUIRE(cache.get(body) != b);
+        REQUIRE(cache.filename(body) != name);
+        // so is another stop shape.
+        const auto        c     = cache.get(body);
+        const std::string round = cache.filename(body);
+        for (Lens::Surface &s : body.surfaces_)
+            if (s.isStop_)
+                s.iris_.blades_ = 6;
+        body.setup();
+        REQUIRE(cache.get(body) != c);
+        REQUIRE(cache.filename(body) != round);
+    }
+}
@@ -0,0 +1,182 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+
+#include "common.hpp"
+
+#include "TestLenses.hpp"
+#include "TestUtilities.hpp"
+
+#include <lightfield.hpp>
+#include <renderer.hpp>
+
+#include <math.h>
+#include <stdio.h>
+
+namespace
+{
+// the ray the table stands for, traced through the glass.
+bool traced(const Lens::Body &body, const Lens::LightField &field, double sx, double sy, double u, double v, size_t c, Lens::Vector &pos, Lens::Vector &dir)
+{
+    const Lens::Body      rev = body.reversed();
+    Lens::Pupil::Entrance exit;
+    exit.setup(rev, field.lambdas_[field.channels() / 2]);
+    const Lens::Vector origin = Lens::Vector(sx, sy, 0.);
+    const Lens::Vector chief  = exit.chiefFrom(rev, origin, field.lambdas_[field.channels() / 2]);
+    const double       spread = exit.radius_ * field.overscan_;
+    pos                       = origin;
+    dir                       = (Lens::Vector(chief.x + u * spread, chief.y + v * spread, chief.z) - origin).normal();
+    if (!rev.traceSurfaces(pos, dir, field.lambdas_[c], 0, rev.surfaces_.size()))
+        return false;
+    const double z = body.imageSurfaceZ_ - pos.z;
+    const double k = (field.zPlane_ - z) / -dir.z;
+    pos            = Lens::Vector(pos.x + dir.x * k, pos.y + dir.y * k, field.zPlane_);
+    dir            = Lens::Vector(dir.x, dir.y, -dir.z);
+    return true;
+}
+} // namespace
+
+TEST_CASE("lightfield", "")
+{
+    const Lens::Body          body    = TestLenses::singlet();
+    const std::vector<double> lambdas = {656.27, 587.56, 486.13};
+
+    Lens::LightField field;
+    field.build(body, 8., 6., lambdas, 9, 7, 9, 9, 1.25, 1);
+    REQUIRE(field.entries() == 9 * 7 * 9 * 9 * 3);
+    REQUIRE(field.matches(body));
+
+    SECTION("nodes and interpolation")
+    {
+        Lens::Vector p, d, q, e;
+        // on a grid node only the 16-bit quantization is left.
+        REQUIRE(field.ray(-1., 1., 0.5, -0.25, 1, p, d));
+        REQUIRE(traced(body, field, -1., 1., 0.5, -0.25, 1, q, e));
+        REQUIRE_THAT(p, IsApproxEquals(q, 1e-3));
+        REQUIRE_THAT(d, IsApproxEquals(e, 1e-4));
+
+        // between nodes the interpolation stays close to the traced ray.
+        double worstP = 0., worstD = 0.;
+        size_t count  = 0;
+        for (int i = 0; i < 200; i++)
+        {
+            const double sx = -3.9 + 7.8 * fmod(i * 0.618034, 1.);
+            const double sy = -2.9 + 5.8 * fmod(i * 0.754878, 1.);
+            const double a  = 2. * M_PI * fmod(i * 0.569840, 1.);
+            const double r  = 0.7 * sqrt(fmod(i * 0.323, 1.));
+            if (!traced(body, field, sx, sy, r * cos(a), r * sin(a), i % 3, q, e))
+                continue;
+            if (!field.ray(sx, sy, r * cos(a), r * sin(a), i % 3, p, d))
+                continue; // at the edge of the vignetted pupil.
+            worstP = std::max(worstP, (p - q).length());
+            worstD = std::max(worstD, (d - e).length());
+            count++;
+        }
+        REQUIRE(count > 150);
+        REQUIRE(worstP < 0.05);
+        REQUIRE(worstD < 1e-3);
+
+        // far outside the pupil nothing gets through.
+        REQUIRE_FALSE(field.ray(0., 0., 1., 1., 1, p, d));
+    }
+    SECTION("file")
+    {
+        const char *file = "lightfield_test.dplf";
+        REQUIRE(field.save(file));
+
+        Lens::LightField mapped;
+        REQUIRE(mapped.map(file));
+        REQUIRE(mapped.mapped());
+        Lens::LightField loaded;
+        REQUIRE(loaded.load(file));
+        REQUIRE_FALSE(loaded.mapped());
+
+        FILE *fp = fopen(file, "rb");
+        fseek(fp, 0, SEEK_END);
+        const long size = ftell(fp);
+        fclose(fp);
+        REQUIRE((uint64_t)size <= field.bytes() + 256);
+        // 16-bit entries and a pass bit instead of four doubles.
+        REQUIRE(field.bytes() * 3 < field.entries() * 4 * sizeof(double));
+
+        bool same = true;
+        for (int i = 0; i < 50; i++)
+        {
+            const double sx = -4. + 8. * i / 49., sy = 1.3, u = 0.3 - i * 0.01, v = -0.2;
+            Lens::Vector p, d, q, e, r, f;
+            const bool   a = field.ray(sx, sy, u, v, 0, p, d);
+            const bool   b = mapped.ray(sx, sy, u, v, 0, q, e);
+            const bool   c = loaded.ray(sx, sy, u, v, 0, r, f);
+            same           = same && a == b && a == c && (!a || (p.x == q.x && p.y == q.y && d.x == e.x && d.y == e.y && p.x == r.x && d.y == f.y));
+        }
+        REQUIRE(same);
+        mapped.unmap();
+        remove(file);
+
+        REQUIRE_FALSE(mapped.map("lightfield_test_missing.dplf"));
+        Lens::Body refocused = body;
+        refocused.setImageSurfaceZ(body.imageSurfaceZ_ + 1.);
+        REQUIRE_FALSE(field.matches(refocused));
+
+        // the layout and the shape come back from the file.
+        REQUIRE(loaded.matches(body));
+        REQUIRE(loaded.gaps_ == field.gaps_);
+        REQUIRE(loaded.shape_ == field.shape_);
+
+        // an inner focus move keeps the image plane but not the gaps.
+        Lens::Body moved = body;
+        moved.setGap(0, body.gap(0) + 0.5);
+        moved.setGap(1, body.gap(1) - 0.5);
+        REQUIRE(moved.imageSurfaceZ_ == Approx(body.imageSurfaceZ_));
+        REQUIRE_FALSE(loaded.matches(moved));
+
+        // another lens with the same image plane.
+        Lens::Body other = body;
+        other.surfaces_[0].curve_ *= 1.01;
+        other.setup();
+        REQUIRE(other.imageSurfaceZ_ == body.imageSurfaceZ_);
+        REQUIRE_FALSE(loaded.matches(other));
+
+        // the pass mask was traced through a round stop.
+        Lens::Body bladed = body;
+        for (Lens::Surface &s : bladed.surfaces_)
+            if (s.isStop_)
+                s.iris_.blades_ = 6;
+        bladed.setup();
+        REQUIRE_FALSE(loaded.matches(bladed));
+    }
+    SECTION("render")
+    {
+        Lens::Renderer::Scene scene;
+        scene.background_ = FloatCanvas::Pixel(0.1f, 0.1f, 0.1f);
+        scene.lights_.push_back(Lens::Renderer::Light(Lens::Vector(0., 0., -2000.), 20., FloatCanvas::Pixel(4.f, 2.f, 1.f)));
+
+        Lens::Renderer renderer;
+        renderer.sensorWidth_ = 8.;
+        renderer.tile_        = 8;
+        renderer.samples_     = 8;
+        renderer.threads_     = 1;
+        renderer.setup(32, 24);
+        Lens::Renderer tabled = renderer;
+
+        const Lens::Renderer::Optics traced = renderer.prepare(body);
+        Lens::Renderer::Optics       optics = traced;
+        std::shared_ptr<Lens::LightField> table = std::make_shared<Lens::LightField>();
+        table->build(body, 8., 6., lambdas, 17, 13, 17, 17, renderer.overscan_, 1);
+        optics.table_ = table;
+
+        REQUIRE(renderer.render(traced, scene, 2));
+        REQUIRE(tabled.render(optics, scene, 2));
+        const FloatCanvas::Canvas a = renderer.image();
+        const FloatCanvas::Canvas b = tabled.image();
+        // same estimator with the same random numbers: the interpolation and the vignetting edge differ.
+        double diff = 0., total = 0.;
+        for (size_t i = 0; i < a.pixel_.size(); i++)
+            for (int c = 0; c < 3; c++)
+            {
+                diff += fabs(a.pixel_[i][c] - b.pixel_[i][c]);
+                total += a.pixel_[i][c];
+            }
+        REQUIRE(diff / total < 0.05);
+        REQUIRE(b.pixel_[12 * 32 + 16][0] > 1.f);
+        REQUIRE(b.pixel_[12 * 32][0] == Approx(a.pixel_[12 * 32][0]).epsilon(0.05));
+    }
+}
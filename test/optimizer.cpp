@@ -0,0 +1,84 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+
+#include "common.hpp"
+
+#include "TestLenses.hpp"
+#include "TestUtilities.hpp"
+
+#include <optimizer.hpp>
+#include <paraxial.hpp>
+
+TEST_CASE("optimizer", "")
+{
+    typedef Lens::Optimizer::Variable Variable;
+
+    Lens::Body body = TestLenses::singlet();
+
+    SECTION("layout keeps the back distance")
+    {
+        const double back = body.imageSurfaceZ_ - body.surfaces_[1].vertex();
+        Lens::Optimizer::set(body, Variable(Variable::THICKNESS, 0), 7.);
+        REQUIRE(body.surfaces_[1].vertex() == Approx(7.));
+        REQUIRE(body.imageSurfaceZ_ - body.surfaces_[1].vertex() == Approx(back));
+        Lens::Optimizer::set(body, Variable(Variable::CURVE, 0), 1. / 40.);
+        REQUIRE(body.surfaces_[0].vertex() == Approx(0.).margin(1e-12));
+        REQUIRE(body.surfaces_[0].radius_ == Approx(40.));
+    }
+
+    SECTION("thickness is the vertex spacing")
+    {
+        // thickness_ left unset: only the surfaces behind the gap move.
+        Lens::Body loose;
+        loose.surfaces_.push_back(TestLenses::standard(0., 1. / 50., 10., 1.5168, 64.17));
+        loose.surfaces_.push_back(TestLenses::standard(5., 0., 10., 1., 1.));
+        loose.surfaces_.push_back(TestLenses::standard(9., 1. / 80., 10., 1.5168, 64.17));
+        loose.setImageSurfaceZ(60.);
+        loose.setup();
+        REQUIRE(Lens::Optimizer::get(loose, Variable(Variable::THICKNESS, 1)) == Approx(4.));
+        Lens::Optimizer::set(loose, Variable(Variable::THICKNESS, 1), 6.);
+        REQUIRE(loose.surfaces_[0].vertex() == Approx(0.).margin(1e-12));
+        REQUIRE(loose.surfaces_[1].vertex() == Approx(5.));
+        REQUIRE(loose.surfaces_[2].vertex() == Approx(11.));
+        REQUIRE(loose.imageSurfaceZ_ == Approx(62.));
+    }
+
+    SECTION("variable order does not matter")
+    {
+        // IMAGE is the back gap, so a THICKNESS listed after it does not undo the image move.
+        Lens::Optimizer opt;
+        opt.variables_.push_back(Variable(Variable::IMAGE));
+        opt.variables_.push_back(Variable(Variable::THICKNESS, 0));
+        opt.variables_.push_back(Variable(Variable::CURVE, 0));
+        opt.targetFocal_ = 100.;
+        opt.focalWeight_ = 0.1;
+
+        Lens::Optimizer reordered = opt;
+        std::rotate(reordered.variables_.begin(), reordered.variables_.begin() + 1, reordered.variables_.end());
+
+        Lens::Body                    first = body, last = body;
+        const Lens::Optimizer::Result a     = opt.optimize(first);
+        const Lens::Optimizer::Result b     = reordered.optimize(last);
+        for (size_t j = 0; j < opt.variables_.size(); j++)
+            REQUIRE(a.values_[j] == Approx(Lens::Optimizer::get(first, opt.variables_[j])));
+        REQUIRE(a.values_[0] == Approx(first.imageSurfaceZ_ - first.surfaces_[1].vertex()));
+        REQUIRE(a.final_ == Approx(b.final_).epsilon(1e-3));
+        REQUIRE(first.imageSurfaceZ_ == Approx(last.imageSurfaceZ_).epsilon(1e-6));
+    }
+
+    SECTION("bending reduces spherical aberration")
+    {
+        Lens::Optimizer opt;
+        opt.variables_.push_back(Variable(Variable::CURVE, 0));
+        opt.variables_.push_back(Variable(Variable::CURVE, 1));
+        opt.variables_.push_back(Variable(Variable::IMAGE));
+        opt.targetFocal_ = 100.;
+        opt.focalWeight_ = 0.1;
+
+        const Lens::Optimizer::Result res = opt.optimize(body);
+        REQUIRE(res.iterations_ > 0);
+        REQUIRE(res.final_ < res.initial_ * 0.5);
+        REQUIRE(Lens::Paraxial::focalLength(body) == Approx(100.).epsilon(0.01));
+        // best form for a BK7 singlet has a weakly convex rear surface.
+        REQUIRE(body.surfaces_[1].curve_ < 0.);
+    }
+}
@@ -0,0 +1,56 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+
+#include "common.hpp"
+
+#include "TestLenses.hpp"
+#include "TestUtilities.hpp"
+
+#include <polarization.hpp>
+
+#include <math.h>
+
+TEST_CASE("polarization", "")
+{
+    SECTION("stokes follows the plain trace")
+    {
+        const Lens::Body   body = TestLenses::singlet();
+        const Lens::Vector dir  = Lens::Vector(0., 0.1, 1.).normal();
+        Lens::Vector       hit0, hit, dir0, dir1;
+        REQUIRE(body.trace(Lens::Vector(0., 4., 0.), dir, 587.56, hit0, dir0));
+
+        Lens::Polarization::Stokes stokes(dir);
+        REQUIRE(body.trace(Lens::Vector(0., 4., 0.), dir, 587.56, hit, dir1, (double *)NULL, stokes));
+        REQUIRE_THAT(hit, IsApproxEquals(hit0, 1e-12));
+        REQUIRE(stokes.intensity() < 1.);
+        REQUIRE(stokes.intensity() > 0.9);
+        REQUIRE(stokes.degree() > 0.);
+        REQUIRE(fabs(stokes.ref_.dot(dir1)) < 1e-9);
+    }
+
+    SECTION("brewster plate")
+    {
+        // a plate at brewster incidence passes p fully and attenuates s twice.
+        const double n = 1.52;
+        Lens::Body   plate;
+        plate.surfaces_.push_back(TestLenses::standard(0., 0., 50., n, 1e9));
+        plate.surfaces_.push_back(TestLenses::standard(5., 0., 50., 1., 1e9));
+        plate.surfaces_[0].thickness_ = 5.;
+        plate.setImageSurfaceZ(20.);
+        plate.setup();
+
+        const double       theta = atan(n);
+        const Lens::Vector dir   = Lens::Vector(0., sin(theta), cos(theta));
+        Lens::Polarization::Stokes stokes(dir);
+        REQUIRE(stokes.ref_.x == Approx(1.));
+        Lens::Vector hit, out;
+        REQUIRE(plate.trace(Lens::Vector(0., -5., 0.), dir, 587.56, hit, out, (double *)NULL, stokes));
+
+        const double nl = plate.surfaces_[0].ior(587.56);
+        double       rs, rp;
+        plate.surfaces_[0].reflectance(587.56, 1., nl, cos(theta), true, rs, rp);
+        REQUIRE(rp == Approx(0.).margin(1e-3));
+        const double ts = (1. - rs) * (1. - rs);
+        REQUIRE(stokes.s_[0] == Approx((ts + 1.) * 0.5).epsilon(1e-3));
+        REQUIRE(stokes.s_[1] / stokes.s_[0] == Approx((ts - 1.) / (ts + 1.)).epsilon(1e-2));
+    }
+}
@@ -0,0 +1,170 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+
+#include "common.hpp"
+
+#include "TestLenses.hpp"
+#include "TestUtilities.hpp"
+
+#include <lens.hpp>
+#include <renderer.hpp>
+
+#include <math.h>
+#include <string.h>
+
+TEST_CASE("renderer", "")
+{
+    const Lens::Body body = TestLenses::singlet();
+
+    Lens::Renderer::Scene scene;
+    scene.background_ = FloatCanvas::Pixel(0.1f, 0.1f, 0.1f);
+    // out of focus highlight on axis.
+    scene.lights_.push_back(Lens::Renderer::Light(Lens::Vector(0., 0., -2000.), 20., FloatCanvas::Pixel(4.f, 2.f, 1.f)));
+
+    Lens::Renderer renderer;
+    renderer.sensorWidth_ = 8.;
+    renderer.tile_        = 8;
+    renderer.samples_     = 2;
+    renderer.threads_     = 1;
+
+    SECTION("reversed body")
+    {
+        const Lens::Body   rev  = body.reversed();
+        const Lens::Vector orig = Lens::Vector(0., 3., -10.);
+        const Lens::Vector dir  = Lens::Vector(0., -0.02, 1.).normal();
+        Lens::Vector       hit, hitDir;
+        REQUIRE(body.trace(orig, dir, 587.56, hit, hitDir));
+
+        // start from the image and go back: mirrored z, opposite direction.
+        Lens::Vector pos  = Lens::Vector(hit.x, hit.y, body.imageSurfaceZ_ - hit.z);
+        Lens::Vector back = Lens::Vector(-hitDir.x, -hitDir.y, hitDir.z);
+        REQUIRE(rev.traceSurfaces(pos, back, 587.56, 0, rev.surfaces_.size()));
+        const Lens::Vector out = Lens::Vector(-back.x, -back.y, back.z);
+        REQUIRE_THAT(out, IsApproxEquals(dir, 1e-9));
+        // the returning ray passes through the original origin.
+        const double       t = (orig.z - (body.imageSurfaceZ_ - pos.z)) / -back.z;
+        const Lens::Vector p = Lens::Vector(pos.x + back.x * t, pos.y + back.y * t, orig.z);
+        REQUIRE_THAT(p, IsApproxEquals(orig, 1e-6));
+    }
+    SECTION("image")
+    {
+        renderer.setup(32, 24);
+        REQUIRE(renderer.render(body, scene, 4));
+        REQUIRE(renderer.passes_ == 4);
+        REQUIRE(renderer.count_[0] == 8);
+
+        const FloatCanvas::Canvas image = renderer.image();
+        // the highlight blurs into a disc around the centre; the corners only see the background.
+        const FloatCanvas::Pixel &center = image.pixel_[12 * 32 + 16];
+        REQUIRE(center[0] > 1.f);
+        REQUIRE(center[0] > center[2]);
+        REQUIRE(image.pixel_[0][0] == Approx(0.1).epsilon(0.2));
+    }
+    SECTION("adaptive")
+    {
+        const double target = 0.25;
+
+        Lens::Renderer uniform = renderer;
+        uniform.setup(32, 24);
+        while (uniform.passes_ < 200 && uniform.error() > target)
+            uniform.pass(body, scene);
+        REQUIRE(uniform.error() <= target);
+
+        renderer.setup(32, 24);
+        REQUIRE(renderer.renderAdaptive(body, scene, target, 200));
+        REQUIRE(renderer.error() <= target);
+        // the highlight edges get the rays, the flat background does not.
+        REQUIRE(renderer.count_[12 * 32 + 12] > renderer.count_[0]);
+        REQUIRE(renderer.rays() * 3 < uniform.rays() * 2);
+    }
+    SECTION("checkpoint")
+    {
+        Lens::Renderer straight = renderer;
+        straight.setup(32, 24);
+        REQUIRE(straight.render(body, scene, 4));
+
+        // stop after two passes and resume from disk with a different thread count.
+        const char *file = "renderer_test.dpck";
+        renderer.setup(32, 24);
+        REQUIRE(renderer.render(body, scene, 2, file));
+
+        Lens::Renderer resumed;
+        resumed.threads_ = 4;
+        REQUIRE(resumed.load(file));
+        REQUIRE(resumed.passes_ == 2);
+        REQUIRE(resumed.render(body, scene, 4, file));
+        remove(file);
+
+        REQUIRE(resumed.count_ == straight.count_);
+        REQUIRE(resumed.sumSq_ == straight.sumSq_);
+        bool same = true;
+        for (size_t i = 0; i < straight.sum_.pixel_.size(); i++)
+            for (int c = 0; c < 3; c++)
+            {
+                const float a = straight.sum_.pixel_[i][c];
+                const float b = resumed.sum_.pixel_[i][c];
+                same          = same && memcmp(&a, &b, sizeof(float)) == 0;
+            }
+        REQUIRE(same);
+
+        // adaptive passes resume the same way, with their own limits.
+        renderer.minLuminance_ = 0.05;
+        renderer.maxSamples_   = 16;
+        renderer.setup(32, 24);
+        REQUIRE_FALSE(renderer.renderAdaptive(body, scene, 0.01, 3, file));
+        REQUIRE(resumed.load(file));
+        REQUIRE(resumed.minLuminance_ == 0.05);
+        REQUIRE(resumed.maxSamples_ == 16);
+        REQUIRE(resumed.renderAdaptive(body, scene, 0.01, 5) == renderer.renderAdaptive(body, scene, 0.01, 5));
+        remove(file);
+        REQUIRE(resumed.count_ == renderer.count_);
+        REQUIRE(resumed.sumSq_ == renderer.sumSq_);
+
+        Lens::Renderer bad;
+        REQUIRE_FALSE(bad.load("renderer_test_missing.dpck"));
+    }
+    SECTION("shards")
+    {
+        // three shards on disjoint streams, written and read back like separate processes would.
+        const char *files[3] = {"renderer_test_0.dpck", "renderer_test_1.dpck", "renderer_test_2.dpck"};
+        for (uint32_t k = 0; k < 3; k++)
+        {
+            Lens::Renderer shard = renderer;
+            shard.shard_         = k;
+            shard.setup(32, 24);
+            REQUIRE(shard.render(body, scene, 2, files[k]));
+        }
+
+        Lens::Renderer part[3];
+        for (int k = 0; k < 3; k++)
+        {
+            REQUIRE(part[k].load(files[k]));
+            REQUIRE(part[k].shard_ == (uint32_t)k);
+            remove(files[k]);
+        }
+        REQUIRE(part[0].sumSq_ != part[1].sumSq_);
+
+        Lens::Renderer a = part[0], b = part[0];
+        REQUIRE(a.merge(part[1]));
+        REQUIRE(a.merge(part[2]));
+        REQUIRE(b.merge(part[1]));
+        REQUIRE(b.merge(part[2]));
+        REQUIRE(a.passes_ == 6);
+        REQUIRE(a.count_[0] == 12);
+        REQUIRE(a.count_ == b.count_);
+        REQUIRE(a.sumSq_ == b.sumSq_);
+        bool same = true;
+        for (size_t i = 0; i < a.sum_.pixel_.size(); i++)
+            for (int c = 0; c < 3; c++)
+                same = same && a.sum_.pixel_[i][c] == b.sum_.pixel_[i][c];
+        REQUIRE(same);
+        REQUIRE(a.image().pixel_[12 * 32 + 16][0] > 1.f);
+
+        Lens::Renderer other = renderer;
+        other.seed_          = 2;
+        other.setup(32, 24);
+        REQUIRE_FALSE(a.merge(other));
+        Lens::Renderer capped = part[0];
+        capped.maxSamples_    = 8;
+        REQUIRE_FALSE(a.merge(capped));
+    }
+}
@@ -0,0 +1,153 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+
+#include "common.hpp"
+
+#include "TestLenses.hpp"
+
+#include <renderservice.hpp>
+
+#include <string.h>
+
+#include <atomic>
+#include <mutex>
+
+TEST_CASE("render service", "")
+{
+    Lens::RenderService service(2);
+    std::atomic<int>    reads(0);
+    service.reader_ = [&](const std::string &file) {
+        reads++;
+        return (file == "missing") ? Lens::Body() : TestLenses::singlet();
+    };
+
+    SECTION("parse")
+    {
+        Lens::RenderService::Job job;
+        std::string              error;
+        REQUIRE(Lens::RenderService::parse("lens=a.zmx out=a.png table=a.dplf width=64 height=32 passes=3 target=0.1 priority=5 "
+                                           "background=0.1,0.2,0.3 light=0,0,-2000,20,4,2,1 light=1,2,-500,5,1,1,1",
+            job, error));
+        REQUIRE(job.lens_ == "a.zmx");
+        REQUIRE(job.output_ == "a.png");
+        REQUIRE(job.table_ == "a.dplf");
+        REQUIRE(job.width_ == 64);
+        REQUIRE(job.height_ == 32);
+        REQUIRE(job.passes_ == 3);
+        REQUIRE(job.target_ == Approx(0.1));
+        REQUIRE(job.priority_ == 5);
+        REQUIRE(job.scene_.background_[2] == Approx(0.3f));
+        REQUIRE(job.scene_.lights_.size() == 2);
+        REQUIRE(job.scene_.lights_[0].position_.z == Approx(-2000.));
+        REQUIRE(job.scene_.lights_[1].radius_ == Approx(5.));
+
+        Lens::RenderService::Job bad;
+        REQUIRE_FALSE(Lens::RenderService::parse("width=64", bad, error));
+        REQUIRE_FALSE(Lens::RenderService::parse("lens=a.zmx width=abc", bad, error));
+        REQUIRE_FALSE(Lens::RenderService::parse("lens=a.zmx light=1,2,3", bad, error));
+        REQUIRE_FALSE(Lens::RenderService::parse("lens=a.zmx bogus=1", bad, error));
+        REQUIRE_FALSE(Lens::RenderService::parse("lens=a.zmx width", bad, error));
+
+        // counts must be in range and whole; nothing is cast from an arbitrary double.
+        const char *junk[] = {"seed=-1", "seed=1e30", "priority=1e12", "priority=-1e12", "width=0", "width=2.5", "height=1e9",
+            "samples=-3", "passes=1e300", "threads=-1", "threads=0.5", "sensor=inf", "light=0,0,nan,20,4,2,1"};
+        for (const char *j : junk)
+            REQUIRE_FALSE(Lens::RenderService::parse(std::string("lens=a.zmx ") + j, bad, error));
+        REQUIRE(Lens::RenderService::parse("lens=a.zmx threads=60000 seed=123456789 priority=-7", bad, error));
+        REQUIRE(bad.threads_ <= std::max<size_t>(1, std::thread::hardware_concurrency()));
+        REQUIRE(bad.seed_ == 123456789);
+        REQUIRE(bad.priority_ == -7);
+    }
+    SECTION("lru cache")
+    {
+        Lens::RenderService::Cache &cache = service.cache();
+        REQUIRE(cache.get("a", service.reader_));
+        REQUIRE(cache.get("b", service.reader_));
+        REQUIRE(cache.get("a", service.reader_));
+        REQUIRE(reads == 2);
+        REQUIRE(cache.hits() == 1);
+
+        // "b" is the least recently used and goes first.
+        REQUIRE(cache.get("c", service.reader_));
+        REQUIRE(cache.size() == 2);
+        REQUIRE(cache.contains("a"));
+        REQUIRE_FALSE(cache.contains("b"));
+        REQUIRE(reads == 3);
+
+        REQUIRE_FALSE(cache.get("missing", service.reader_));
+        REQUIRE_FALSE(cache.contains("missing"));
+        // a table that cannot be mapped fails the entry, not the lens.
+        REQUIRE_FALSE(cache.get("a", service.reader_, "renderservice_test_missing.dplf"));
+        REQUIRE(cache.contains("a"));
+    }
+    SECTION("priority and results")
+    {
+        std::mutex                         mutex;
+        std::vector<uint64_t>              order;
+        std::vector<FloatCanvas::Canvas>   images;
+        service.sink_ = [&](const Lens::RenderService::Job &job, const Lens::Renderer &renderer) {
+            std::lock_guard<std::mutex> lock(mutex);
+            order.push_back(job.id_);
+            images.push_back(renderer.image());
+            return true;
+        };
+
+        Lens::RenderService::Job job;
+        std::string              error;
+        REQUIRE(Lens::RenderService::parse("lens=singlet width=16 height=12 sensor=8 samples=2 passes=2 light=0,0,-2000,20,4,2,1 background=0.1,0.1,0.1", job, error));
+
+        // queued before the worker starts: priorities decide, ties keep submission order.
+        const uint64_t low  = service.submit(job);
+        job.priority_       = 10;
+        const uint64_t high = service.submit(job);
+        const uint64_t tie  = service.submit(job);
+        job.lens_           = "missing";
+        const uint64_t bad  = service.submit(job);
+        REQUIRE(service.state(low) == Lens::RenderService::QUEUED);
+        REQUIRE(service.queued() == 4);
+
+        service.start(1);
+        REQUIRE(service.wait(low) == Lens::RenderService::DONE);
+        REQUIRE(service.wait(bad) == Lens::RenderService::FAILED);
+        REQUIRE(service.state(12345) == Lens::RenderService::UNKNOWN);
+        service.shutdown();
+
+        REQUIRE(order.size() == 3);
+        REQUIRE(order[0] == high);
+        REQUIRE(order[1] == tie);
+        REQUIRE(order[2] == low);
+        // the lens is read once and the same job renders the same image.
+        REQUIRE(reads == 2);
+        REQUIRE(service.cache().hits() == 2);
+        bool same = true;
+        for (size_t i = 0; i < images[0].pixel_.size(); i++)
+            for (int c = 0; c < 3; c++)
+                same = same && images[0].pixel_[i][c] == images[2].pixel_[i][c];
+        REQUIRE(same);
+        REQUIRE(images[0].pixel_[6 * 16 + 8][0] > 1.f);
+    }
+    SECTION("shutdown and history")
+    {
+        service.sink_ = [](const Lens::RenderService::Job &, const Lens::Renderer &) { return true; };
+        Lens::RenderService::Job job;
+        std::string              error;
+        REQUIRE(Lens::RenderService::parse("lens=singlet width=4 height=4 sensor=8 samples=1 passes=1", job, error));
+
+        // stopping with nobody to run the queue: wait() returns instead of hanging, and new jobs are refused.
+        const uint64_t stranded = service.submit(job);
+        service.shutdown();
+        REQUIRE(service.wait(stranded) == Lens::RenderService::QUEUED);
+        REQUIRE(service.submit(job) == 0);
+
+        // restarted, only the latest finished states are kept.
+        service.history_ = 2;
+        service.start(1);
+        std::vector<uint64_t> ids;
+        for (int i = 0; i < 3; i++)
+            ids.push_back(service.submit(job));
+        for (uint64_t id : ids)
+            service.wait(id);
+        service.shutdown();
+        REQUIRE(service.state(ids[0]) == Lens::RenderService::UNKNOWN);
+        REQUIRE(service.state(ids[2]) == Lens::RenderService::DONE);
+    }
+}
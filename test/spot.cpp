@@ -0,0 +1,61 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+
+#include "common.hpp"
+
+#include "TestLenses.hpp"
+#include "TestUtilities.hpp"
+
+#include <spot.hpp>
+
+#include <math.h>
+
+TEST_CASE("spot", "")
+{
+    const Lens::Body          body    = TestLenses::singlet();
+    const std::vector<double> lambdas = {587.56};
+
+    SECTION("paraxial focus")
+    {
+        Lens::Vector hit, dir;
+        REQUIRE(body.trace(Lens::Vector(0., 0.01, 0.), Lens::Vector(0., 0., 1.), 587.56, hit, dir));
+        REQUIRE(hit.y == Approx(0.).margin(1e-4));
+        REQUIRE(dir.y < 0.);
+    }
+
+    SECTION("entrance pupil")
+    {
+        Lens::Pupil::Entrance entrance;
+        entrance.setup(body);
+        REQUIRE(entrance.radius_ == Approx(10.).margin(1e-6));
+    }
+
+    SECTION("on axis")
+    {
+        Lens::SpotDiagram spot;
+        spot.rays_                                        = 2000;
+        const std::vector<Lens::SpotDiagram::Result> res = spot.evaluate(body, {Lens::Field(0., 0.)}, lambdas);
+        REQUIRE(res.size() == 1);
+        REQUIRE(res[0].hits_ == res[0].rays_);
+        REQUIRE(res[0].centroidX_ == Approx(0.).margin(1e-9));
+        REQUIRE(res[0].centroidY_ == Approx(0.).margin(1e-9));
+        REQUIRE(res[0].rms_ > 0.);
+        REQUIRE(res[0].geo_ >= res[0].rms_);
+    }
+
+    SECTION("hex and qmc agree")
+    {
+        Lens::SpotDiagram hex, qmc;
+        hex.rays_ = qmc.rays_ = 20000;
+        qmc.pattern_          = Lens::SpotDiagram::QMC;
+        const std::vector<Lens::Field> fields = {Lens::Field(0., 0.), Lens::Field(0., 2.)};
+        const auto                     a      = hex.evaluate(body, fields, lambdas);
+        const auto                     b      = qmc.evaluate(body, fields, lambdas);
+        for (size_t f = 0; f < fields.size(); f++)
+        {
+            REQUIRE(a[f].rms_ == Approx(b[f].rms_).epsilon(0.05));
+            REQUIRE(a[f].centroidY_ == Approx(b[f].centroidY_).epsilon(0.01).margin(1e-4));
+        }
+        // image height ~ f tan(theta).
+        REQUIRE(a[1].centroidY_ == Approx(96.75 * tan(2. * M_PI / 180.)).epsilon(0.02));
+    }
+}
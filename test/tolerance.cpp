@@ -0,0 +1,104 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+
+#include "common.hpp"
+
+#include "TestLenses.hpp"
+#include "TestUtilities.hpp"
+
+#include <tolerance.hpp>
+
+TEST_CASE("tolerance", "")
+{
+    typedef Lens::Tolerance::Spec Spec;
+
+    const Lens::Body body = TestLenses::singlet();
+
+    SECTION("streaming statistics")
+    {
+        Lens::Tolerance::Statistics stats(0., 1., 100);
+        for (int i = 0; i < 1000; i++)
+            stats.add((i + 0.5) / 1000.);
+        REQUIRE(stats.count_ == 1000);
+        REQUIRE(stats.mean_ == Approx(0.5));
+        REQUIRE(stats.variance() == Approx(1. / 12.).epsilon(0.01));
+        REQUIRE(stats.percentile(0.5) == Approx(0.5).margin(0.01));
+        REQUIRE(stats.percentile(0.9) == Approx(0.9).margin(0.01));
+        REQUIRE(stats.percentile(1.) == Approx(1.).margin(0.01));
+        stats.add(5.);
+        REQUIRE(stats.over_ == 1);
+        REQUIRE(stats.percentile(1.) == 5.);
+    }
+
+    SECTION("thickness shifts only what follows")
+    {
+        // thickness_ left unset on the surfaces: the perturbation works on the vertex spacing.
+        Lens::Body loose;
+        loose.surfaces_.push_back(TestLenses::standard(0., 1. / 50., 10., 1.5168, 64.17));
+        loose.surfaces_.push_back(TestLenses::standard(5., 0., 10., 1., 1.));
+        loose.setImageSurfaceZ(90.);
+        loose.setup();
+        Lens::Tolerance::apply(loose, Spec(Spec::THICKNESS, 0, 0.1), 0.25);
+        REQUIRE(loose.surfaces_[0].vertex() == Approx(0.).margin(1e-12));
+        REQUIRE(loose.surfaces_[1].vertex() == Approx(5.25));
+        REQUIRE(loose.imageSurfaceZ_ == Approx(90.25));
+    }
+
+    SECTION("zero tolerance reproduces the nominal design")
+    {
+        Lens::Tolerance tol;
+        tol.trials_ = 16;
+        tol.specs_.push_back(Spec(Spec::RADIUS, 0, 0.));
+        const Lens::Tolerance::Result res = tol.run(body);
+        REQUIRE(res.failed_ == 0);
+        REQUIRE(res.rms_.count_ == 16);
+        REQUIRE(res.rms_.min_ == Approx(res.nominalRms_));
+        REQUIRE(res.rms_.max_ == Approx(res.nominalRms_));
+    }
+
+    SECTION("deterministic across thread counts")
+    {
+        Lens::Tolerance tol;
+        tol.trials_ = 40;
+        tol.rays_   = 64;
+        tol.fields_.push_back(Lens::Field(0., 3.));
+        tol.specs_.push_back(Spec(Spec::RADIUS, 0, 0.5, Spec::GAUSSIAN));
+        tol.specs_.push_back(Spec(Spec::THICKNESS, 0, 0.1));
+        tol.specs_.push_back(Spec(Spec::INDEX, 0, 0.001));
+
+        tol.threads_                   = 1;
+        const Lens::Tolerance::Result a = tol.run(body);
+        tol.threads_                   = 4;
+        tol.batch_                     = 7;
+        const Lens::Tolerance::Result b = tol.run(body);
+        REQUIRE(a.rms_.count_ == b.rms_.count_);
+        REQUIRE(a.rms_.mean_ == b.rms_.mean_);
+        REQUIRE(a.rms_.histogram_ == b.rms_.histogram_);
+        REQUIRE(a.rms_.max_ > a.rms_.min_);
+    }
+
+    SECTION("looser tolerances degrade the spot")
+    {
+        Lens::Tolerance tol;
+        tol.trials_ = 64;
+        tol.rays_   = 64;
+        tol.specs_.push_back(Spec(Spec::RADIUS, 0, 0.2));
+        const double tight = tol.run(body).rms_.percentile(0.9);
+        tol.specs_[0].range_ = 2.;
+        const double loose = tol.run(body).rms_.percentile(0.9);
+        REQUIRE(loose > tight);
+    }
+
+    SECTION("mtf statistics")
+    {
+        Lens::Tolerance tol;
+        tol.trials_       = 8;
+        tol.rays_         = 64;
+        tol.mtfFrequency_ = 10.;
+        tol.specs_.push_back(Spec(Spec::RADIUS, 0, 1.));
+        const Lens::Tolerance::Result res = tol.run(body);
+        REQUIRE(res.nominalMtf_ > 0.);
+        REQUIRE(res.nominalMtf_ <= 1.);
+        REQUIRE(res.mtf_.count_ == 8);
+        REQUIRE(res.mtf_.max_ <= 1. + 1e-9);
+    }
+}
@@ -0,0 +1,65 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+
+#include "common.hpp"
+
+#include <random.hpp>
+#include <vectormath.hpp>
+
+#include <math.h>
+#include <string.h>
+
+#include <type_traits>
+
+TEST_CASE("vectormath", "")
+{
+    typedef VECTORMATH::Vector3<double> Vec;
+
+    SECTION("trivially copyable")
+    {
+        REQUIRE(std::is_trivially_copyable<Vec>::value);
+        REQUIRE(sizeof(Vec) == 3 * sizeof(double));
+        const Vec a(1., 2., 3.);
+        Vec       b;
+        memcpy(&b, &a, sizeof(Vec));
+        REQUIRE(b.x == 1.);
+        REQUIRE(b.y == 2.);
+        REQUIRE(b.z == 3.);
+    }
+    SECTION("dot and cross")
+    {
+        const Vec a(1., 2., 3.), b(-4., 5., 0.5);
+        REQUIRE(a.dot(b) == 7.5);
+        REQUIRE(a.length2() == 14.);
+        const Vec c = a.cross(b);
+        REQUIRE(c.x == 2. * 0.5 - 3. * 5.);
+        REQUIRE(c.y == 3. * -4. - 1. * 0.5);
+        REQUIRE(c.z == 1. * 5. - 2. * -4.);
+        const Vec d = a % b;
+        REQUIRE(d.x == c.x);
+        REQUIRE(d.y == c.y);
+        REQUIRE(d.z == c.z);
+        REQUIRE(c.dot(a) == Approx(0.).margin(1e-12));
+        REQUIRE(c.dot(b) == Approx(0.).margin(1e-12));
+    }
+    SECTION("normal")
+    {
+        REQUIRE(VECTORMATH::rsqrt(4.) == 0.5);
+        REQUIRE(VECTORMATH::rsqrt(4.f) == Approx(0.5f).epsilon(1e-6));
+        REQUIRE(isinf(VECTORMATH::rsqrt(0.)));
+
+        // normal() is sqrt and division; the float rsqrt is the approximation with one Newton step.
+        RANDOM::xoshiro256aa rng(5);
+        double               err = 0., errf = 0.;
+        for (int i = 0; i < 10000; i++)
+        {
+            const double s = pow(10., rng.rand01() * 80. - 40.);
+            const Vec    v((rng.rand01() * 2. - 1.) * s, (rng.rand01() * 2. - 1.) * s, (rng.rand01() * 2. - 1.) * s);
+            err            = std::max(err, fabs(v.normal().length() - 1.));
+
+            const float f = (float)(rng.rand01() * 100. + 1e-3);
+            errf          = std::max(errf, (double)fabs(VECTORMATH::rsqrt(f) * sqrtf(f) - 1.f));
+        }
+        REQUIRE(err < 1e-15);
+        REQUIRE(errf < 1e-6);
+    }
+}
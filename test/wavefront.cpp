@@ -0,0 +1,119 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+
+#include "common.hpp"
+
+#include "TestLenses.hpp"
+#include "TestUtilities.hpp"
+
+#include <spot.hpp>
+#include <wavefront.hpp>
+
+#include <math.h>
+
+namespace
+{
+// trace the same rays one by one and as a batch; survivors and hits must agree.
+void compare(const Lens::Body &body, const std::vector<Lens::Vector> &origs, const std::vector<Lens::Vector> &dirs, size_t &hits)
+{
+    Lens::Wavefront::Batch batch;
+    for (size_t i = 0; i < origs.size(); i++)
+        batch.push(origs[i], dirs[i], (uint32_t)i);
+    Lens::Wavefront::trace(body, 587.56, batch);
+
+    size_t k = 0;
+    hits     = 0;
+    for (size_t i = 0; i < origs.size(); i++)
+    {
+        Lens::Vector hit, hitDir;
+        double       opl = 0.;
+        if (!body.trace(origs[i], dirs[i], 587.56, hit, hitDir, &opl))
+            continue;
+        hits++;
+        REQUIRE(k < batch.size());
+        REQUIRE(batch.id_[k] == i);
+        REQUIRE_THAT(batch.position(k), IsApproxEquals(hit, 1e-8));
+        REQUIRE_THAT(batch.direction(k), IsApproxEquals(hitDir, 1e-8));
+        REQUIRE(batch.opl_[k] == Approx(opl).margin(1e-8));
+        k++;
+    }
+    REQUIRE(k == batch.size());
+}
+} // namespace
+
+TEST_CASE("wavefront", "")
+{
+    // the per-ray bisection can settle on the rim of the front surface where the sag is clamped to zero,
+    // so keep the stop a little inside it to compare exactly.
+    Lens::Body body = TestLenses::singlet();
+    body.irisScale_ = 0.9;
+
+    // a fan that overfills the stop at an angle.
+    std::vector<Lens::Vector> origs, dirs;
+    for (int j = -12; j <= 12; j++)
+        for (int i = -12; i <= 12; i++)
+        {
+            origs.push_back(Lens::Vector(i * 1., j * 1., -5.));
+            dirs.push_back(Lens::Vector(0., 0.1, 1.).normal());
+        }
+
+    SECTION("matches per-ray trace")
+    {
+        size_t hits;
+        compare(body, origs, dirs, hits);
+        REQUIRE(hits > 100);
+        REQUIRE(hits < origs.size());
+
+        body.irisScale_ = 0.5;
+        compare(body, origs, dirs, hits);
+        REQUIRE(hits > 10);
+    }
+    SECTION("generic surfaces")
+    {
+        // aspheric and tilted surfaces take the per-ray intersect path.
+        body.surfaces_[0].type_          = Lens::Surface::EVENASPH;
+        body.surfaces_[0].aspherical_[1] = 1e-5;
+        body.surfaces_[1].tiltX_         = 1.;
+        body.setup();
+        size_t hits;
+        compare(body, origs, dirs, hits);
+        REQUIRE(hits > 100);
+    }
+    SECTION("compaction and statistics")
+    {
+        Lens::TraceStats::resetAll();
+        const Lens::TraceStats &stats = Lens::TraceStats::local();
+
+        Lens::Wavefront::Batch batch;
+        batch.push(Lens::Vector(0., 2., -1.), Lens::Vector(0., 0., 1.), 7);
+        batch.push(Lens::Vector(0., 9.5, -1.), Lens::Vector(0., 0., 1.), 8); // outside the stop.
+        batch.push(Lens::Vector(0., -3., -1.), Lens::Vector(0., 0., 1.), 9);
+        Lens::Wavefront::traceSurfaces(body, 587.56, batch, 0, 1);
+        REQUIRE(batch.size() == 2);
+        REQUIRE(stats.perSurface_[0].clips_ == 1);
+
+        // a steep ray inside the glass is totally reflected at the flat back.
+        batch.push(Lens::Vector(0., 0., 3.), Lens::Vector(0., 0.8, 0.6), 10);
+        Lens::Wavefront::traceSurfaces(body, 587.56, batch, 1, 2);
+        REQUIRE(batch.size() == 2);
+        REQUIRE(batch.id_[0] == 7);
+        REQUIRE(batch.id_[1] == 9);
+        REQUIRE(stats.perSurface_[1].tir_ == 1);
+        REQUIRE(stats.perSurface_[1].attempts_ == 3);
+    }
+    SECTION("spot diagram")
+    {
+        Lens::SpotDiagram wave, ray;
+        wave.rays_ = ray.rays_ = 2000;
+        ray.wavefront_         = false;
+        const std::vector<Lens::Field>  fields  = {Lens::Field(0., 0.), Lens::Field(0., 3.)};
+        const std::vector<double>       lambdas = {486.13, 587.56, 656.27};
+        const auto                      a       = wave.evaluate(body, fields, lambdas);
+        const auto                      b       = ray.evaluate(body, fields, lambdas);
+        for (size_t f = 0; f < fields.size(); f++)
+        {
+            REQUIRE(a[f].hits_ == b[f].hits_);
+            REQUIRE(a[f].rms_ == Approx(b[f].rms_).epsilon(1e-9));
+            REQUIRE(a[f].centroidY_ == Approx(b[f].centroidY_).epsilon(1e-9).margin(1e-12));
+        }
+    }
+}
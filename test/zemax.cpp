@@ -0,0 +1,225 @@
+// copyright(c) 2018 Hajime UCHIMURA / nikq
+
+#include "common.hpp"
+
+#include <lens.hpp>
+#include <random.hpp>
+
+#include <math.h>
+#include <stdio.h>
+
+#include <string>
+
+namespace
+{
+// object at infinity, a singlet, an even asphere stop, a coordinate break, a dummy surface and a flint.
+const char *sample =
+    "VERS 140404 299 39109\n"
+    "MODE SEQ\n"
+    "NAME test lens\n"
+    "SURF 0\n"
+    "  TYPE STANDARD\n"
+    "  CURV 0.0\n"
+    "  DISZ INFINITY\n"
+    "SURF 1\n"
+    "  TYPE STANDARD\n"
+    "  CURV 2.0E-002\n"
+    "  DISZ 5.0\n"
+    "  GLAS N-BK7 0 0 1.5168 64.17 0 0 0 0 0 0\n"
+    "  DIAM 10.0 1 0 0 1 \"\"\n"
+    "SURF 2\n"
+    "  TYPE EVENASPH\n"
+    "  STOP\n"
+    "  CURV -1.0E-002\n"
+    "  CONI -0.5\n"
+    "  PARM 1 0\n"
+    "  PARM 2 1.5E-005\n"
+    "  PARM 9 7\n"
+    "  DISZ 2.0\n"
+    "  DIAM 9.0 1 0 0 1 \"\"\n"
+    "SURF 3\n"
+    "  TYPE COORDBRK\n"
+    "  PARM 1 0.1\n"
+    "  PARM 4 2.5\n"
+    "  DISZ 1.0\n"
+    "SURF 4\n"
+    "  TYPE STANDARD\n"
+    "  CURV 0.0\n"
+    "  DISZ 3.0\n"
+    "  DIAM 0 0 0 0 1 \"\"\n"
+    "SURF 5\n"
+    "  TYPE STANDARD\n"
+    "  CURV -3.125E-002\n"
+    "  DISZ 2.0\n"
+    "  GLAS F2 0 0 1.62004 36.37 0 0 0 0 0 0\n"
+    "  DIAM 8.0 1 0 0 1 \"\"\n"
+    "SURF 6\n"
+    "  TYPE STANDARD\n"
+    "  CURV 0.0\n"
+    "  DISZ 40.0\n"
+    "  DIAM 8.0 1 0 0 1 \"\"\n"
+    "SURF 7\n"
+    "  TYPE STANDARD\n"
+    "  CURV 0.0\n"
+    "  DISZ 0\n";
+
+Lens::Body parse(const std::string &text)
+{
+    return Lens::Loader::ZEMAX::parse(text.data(), text.size());
+}
+
+bool same(const Lens::Body &a, const Lens::Body &b)
+{
+    if (a.surfaces_.size() != b.surfaces_.size() || a.imageSurfaceZ_ != b.imageSurfaceZ_)
+        return false;
+    for (size_t i = 0; i < a.surfaces_.size(); i++)
+    {
+        const Lens::Surface &s = a.surfaces_[i], &t = b.surfaces_[i];
+        bool                 eq = s.type_ == t.type_ && s.center_ == t.center_ && s.curve_ == t.curve_ && s.thickness_ == t.thickness_ && s.diameter_ == t.diameter_ &&
+                  s.ior_ == t.ior_ && s.abbeVd_ == t.abbeVd_ && s.conic_ == t.conic_ && s.isStop_ == t.isStop_ && s.decenterX_ == t.decenterX_ && s.tiltY_ == t.tiltY_;
+        for (int k = 0; k < Lens::Surface::N_Aspherical; k++)
+            eq = eq && s.aspherical_[k] == t.aspherical_[k];
+        if (!eq)
+            return false;
+    }
+    return true;
+}
+
+bool finite(const Lens::Body &body)
+{
+    bool ok = std::isfinite(body.imageSurfaceZ_);
+    for (const Lens::Surface &s : body.surfaces_)
+    {
+        ok = ok && std::isfinite(s.center_) && std::isfinite(s.radius_) && std::isfinite(s.thickness_) && std::isfinite(s.diameter_) && std::isfinite(s.ior_) &&
+             std::isfinite(s.abbeVd_) && s.abbeVd_ > 0. && std::isfinite(s.conic_);
+        for (int k = 0; k < Lens::Surface::N_Aspherical; k++)
+            ok = ok && std::isfinite(s.aspherical_[k]);
+    }
+    return ok;
+}
+} // namespace
+
+TEST_CASE("zemax", "")
+{
+    const Lens::Body reference = parse(sample);
+
+    SECTION("parse")
+    {
+        REQUIRE(reference.surfaces_.size() == 4);
+        const Lens::Surface &front = reference.surfaces_[0];
+        REQUIRE(front.vertex() == Approx(0.));
+        REQUIRE(front.radius_ == Approx(50.));
+        REQUIRE(front.thickness_ == 5.);
+        REQUIRE(front.diameter_ == 10.);
+        REQUIRE(front.ior_ == 1.5168);
+        REQUIRE(front.abbeVd_ == 64.17);
+        REQUIRE_FALSE(front.isStop_);
+
+        // CONI is a real number; PARM beyond 8 is ignored.
+        const Lens::Surface &stop = reference.surfaces_[1];
+        REQUIRE(stop.type_ == Lens::Surface::EVENASPH);
+        REQUIRE(stop.isStop_);
+        REQUIRE(stop.conic_ == -0.5);
+        REQUIRE(stop.aspherical_[1] == 1.5e-5);
+        REQUIRE(stop.vertex() == Approx(5.));
+        // the coordinate break and the zero-diameter dummy fold into this gap.
+        REQUIRE(stop.thickness_ == Approx(6.));
+        REQUIRE(stop.decenterX_ == 0.);
+
+        const Lens::Surface &flint = reference.surfaces_[2];
+        REQUIRE(flint.vertex() == Approx(11.));
+        REQUIRE(flint.radius_ == Approx(-32.));
+        REQUIRE(flint.decenterX_ == 0.1);
+        REQUIRE(flint.tiltY_ == 2.5);
+        REQUIRE(reference.surfaces_[3].decenterX_ == 0.1);
+        REQUIRE(reference.surfaces_[3].thickness_ == 40.);
+        REQUIRE(reference.imageSurfaceZ_ == Approx(53.));
+    }
+    SECTION("load")
+    {
+        const char *file = "zemax_test.zmx";
+        FILE       *fp   = fopen(file, "wb");
+        REQUIRE(fp);
+        fputs(sample, fp);
+        fclose(fp);
+
+        const Lens::Body loaded = Lens::Loader::ZEMAX::load(file);
+        remove(file);
+        REQUIRE(same(loaded, Lens::Loader::ZEMAX::loadFromMemory(sample, strlen(sample))));
+        REQUIRE(loaded.surfaces_[0].coatingTable_);
+        REQUIRE(loaded.setupRevision_ != 0);
+
+        REQUIRE(Lens::Loader::ZEMAX::load("zemax_test_missing.zmx").surfaces_.empty());
+    }
+    SECTION("encodings")
+    {
+        std::string crlf, utf16le = "\xFF\xFE", utf16be = "\xFE\xFF";
+        for (const char *p = sample; *p; p++)
+        {
+            if (*p == '\n')
+                crlf += '\r';
+            crlf += *p;
+            utf16le += *p;
+            utf16le += '\0';
+            utf16be += '\0';
+            utf16be += *p;
+        }
+        REQUIRE(same(parse(crlf), reference));
+        REQUIRE(same(parse("\xEF\xBB\xBF" + std::string(sample)), reference));
+        REQUIRE(same(parse(utf16le), reference));
+        REQUIRE(same(parse(utf16be), reference));
+        // no newline at the end.
+        REQUIRE(same(parse(std::string(sample, strlen(sample) - 1)), reference));
+    }
+    SECTION("malformed")
+    {
+        // keywords without their arguments, junk numbers, and things that only look like keywords.
+        const Lens::Body junk = parse("SURF\nCURV\nDISZ\nPARM\nPARM 3\nPARM x 1\nGLAS\nGLAS A 0\nCONI 1e999\nDIAM nan\nSURFACE 1\nSUR\n"
+                                      "SURF 1\nCURV 1e-320\nDIAM 5 \nGLAS A 0 0 inf -3\nDISZ 2.5e\nSURF 2\n");
+        REQUIRE(junk.surfaces_.size() == 1);
+        REQUIRE(junk.surfaces_[0].curve_ == 0.);
+        REQUIRE(junk.surfaces_[0].diameter_ == 5.);
+        REQUIRE(junk.surfaces_[0].ior_ == 1.);
+        REQUIRE(junk.surfaces_[0].thickness_ == 0.);
+        REQUIRE(finite(junk));
+
+        // every truncation of the sample.
+        const std::string text = sample;
+        for (size_t n = 0; n <= text.size(); n++)
+            REQUIRE(finite(Lens::Loader::ZEMAX::parse(text.data(), n, NULL)));
+
+        // random mutations. the loaded lens is set up too, which must not trip the assertions in Surface::ior().
+        const char           alphabet[] = "0123456789.-+eE \t\r\n\"xSURFCVDIZAMPGLONTY";
+        RANDOM::xoshiro256aa rng(7);
+        for (int i = 0; i < 1000; i++)
+        {
+            std::string  mutated = text;
+            const size_t edits   = 1 + rng.next() % 16;
+            for (size_t e = 0; e < edits; e++)
+            {
+                const size_t at = rng.next() % mutated.size();
+                switch (rng.next() % 4)
+                {
+                case 0:
+                    mutated[at] = alphabet[rng.next() % (sizeof(alphabet) - 1)];
+                    break;
+                case 1:
+                    mutated[at] = (char)(rng.next() & 0xFF);
+                    break;
+                case 2:
+                    mutated.erase(at, rng.next() % 8);
+                    break;
+                default:
+                    mutated.insert(at, 1, alphabet[rng.next() % (sizeof(alphabet) - 1)]);
+                    break;
+                }
+                if (mutated.empty())
+                    mutated = "\n";
+            }
+            const Lens::Body lens = Lens::Loader::ZEMAX::parse(mutated.data(), mutated.size(), NULL);
+            REQUIRE(finite(lens));
+            if (i % 20 == 0)
+                REQUIRE(finite(Lens::Loader::ZEMAX::loadFromMemory(mutated.data(), mutated.size(), NULL)));
+        }
+    }
+}